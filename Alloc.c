@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../Cute/String.h"
+#include "../Cute/Array.h"
+#include "../Cute/Buffer.h"
+#define ALLOC_IMPLEMENTATION
+#include "Alloc.h"
+
+typedef struct _PhaseCounters {
+	unsigned long long allocs;
+	unsigned long long reallocs;
+	unsigned long long bytes;
+} PhaseCounters;
+
+static void append_format(Buffer *out, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void append_format(Buffer *out, const char *format, ...) {
+	char line[256];
+	va_list args;
+
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (length > 0) {
+		bufferAppendBytes(out, line,
+			length < (int) sizeof(line) ? length : (int) sizeof(line) - 1);
+	}
+}
+
+#ifdef ALLOC_STATS
+
+static const char *phase_names[ALLOC_PHASE_COUNT] = {
+	"other", "begin", "request_header", "connect", "relay", "end"
+};
+
+__thread int allocPhase = ALLOC_PHASE_OTHER;
+
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static AllocSite *sites = NULL;
+static PhaseCounters phases[ALLOC_PHASE_COUNT];
+
+/*
+ * Sites are only ever added so that a report can walk the list while
+ * other threads allocate.
+ */
+static void register_site(AllocSite *site) {
+	pthread_mutex_lock(&sites_lock);
+	if (!site->registered) {
+		site->next = sites;
+		__atomic_store_n(&sites, site, __ATOMIC_RELEASE);
+		__atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&sites_lock);
+}
+
+static void record(AllocSite *site, int grown, unsigned long long bytes) {
+	PhaseCounters *phase = phases + allocPhase;
+
+	if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+		register_site(site);
+	}
+	if (grown) {
+		__atomic_fetch_add(&site->reallocs, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&phase->reallocs, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&site->allocs, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&phase->allocs, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&site->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&phase->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+//Appends only count when they grew the container
+static void record_growth(AllocSite *site, size_t before, size_t after,
+	size_t unit) {
+	if (after != before) {
+		record(site, 1, after > before ? (after - before) * unit : 0);
+	}
+}
+
+String *allocNewString(AllocSite *site) {
+	String *s = newString();
+
+	record(site, 0, sizeof(String) + s->capacity);
+
+	return s;
+}
+
+String *allocNewStringWithCapacity(AllocSite *site, size_t capacity) {
+	String *s = newStringWithCapacity(capacity);
+
+	record(site, 0, sizeof(String) + s->capacity);
+
+	return s;
+}
+
+Array *allocNewArray(AllocSite *site, size_t capacity) {
+	Array *a = newArray(capacity);
+
+	record(site, 0, sizeof(Array) + a->capacity * sizeof(void*));
+
+	return a;
+}
+
+Buffer *allocNewBufferWithCapacity(AllocSite *site, size_t capacity) {
+	Buffer *b = newBufferWithCapacity(capacity);
+
+	record(site, 0, sizeof(Buffer) + b->capacity);
+
+	return b;
+}
+
+void allocStringAppendChar(AllocSite *site, String *s, char ch) {
+	size_t before = s->capacity;
+
+	stringAppendChar(s, ch);
+	record_growth(site, before, s->capacity, 1);
+}
+
+void allocStringAppendBuffer(AllocSite *site, String *s, const char *b,
+	size_t length) {
+	size_t before = s->capacity;
+
+	stringAppendBuffer(s, b, length);
+	record_growth(site, before, s->capacity, 1);
+}
+
+void allocStringAppendCString(AllocSite *site, String *s, const char *c) {
+	size_t before = s->capacity;
+
+	stringAppendCString(s, c);
+	record_growth(site, before, s->capacity, 1);
+}
+
+const char *allocStringAsCString(AllocSite *site, String *s) {
+	size_t before = s->capacity;
+	const char *c = stringAsCString(s);
+
+	record_growth(site, before, s->capacity, 1);
+
+	return c;
+}
+
+void allocBufferAppendBytes(AllocSite *site, Buffer *b, const char *data,
+	size_t length) {
+	size_t before = b->capacity;
+
+	bufferAppendBytes(b, data, length);
+	record_growth(site, before, b->capacity, 1);
+}
+
+void allocArrayAdd(AllocSite *site, Array *a, void *value) {
+	size_t before = a->capacity;
+
+	arrayAdd(a, value);
+	record_growth(site, before, a->capacity, sizeof(void*));
+}
+
+static int compare_sites(const void *a, const void *b) {
+	const AllocSite *x = a, *y = b;
+
+	if (x->bytes != y->bytes) {
+		return x->bytes > y->bytes ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static int compare_keys(const void *a, const void *b) {
+	const AllocSite *x = a, *y = b;
+	int status = strcmp(x->file, y->file);
+
+	if (status == 0) {
+		status = x->line - y->line;
+	}
+
+	return status != 0 ? status : strcmp(x->call, y->call);
+}
+
+/*
+ * Adds up sites that report under the same file, line and call, as when
+ * a macro expands the same call twice on one line. Returns the number
+ * of sites left.
+ */
+static size_t merge_sites(AllocSite *sites, size_t length) {
+	size_t merged = 0;
+
+	qsort(sites, length, sizeof(AllocSite), compare_keys);
+	for (size_t i = 0; i < length; ++i) {
+		if (merged > 0 && compare_keys(sites + merged - 1, sites + i) == 0) {
+			sites[merged - 1].allocs += sites[i].allocs;
+			sites[merged - 1].reallocs += sites[i].reallocs;
+			sites[merged - 1].bytes += sites[i].bytes;
+		} else {
+			sites[merged++] = sites[i];
+		}
+	}
+
+	return merged;
+}
+
+/*
+ * Copies the sites that have been used, most bytes first. Counters
+ * being updated while this runs may be partly included.
+ */
+static AllocSite *copy_sites(size_t *count) {
+	AllocSite *first = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+	size_t length = 0;
+
+	for (AllocSite *site = first; site != NULL; site = site->next) {
+		++length;
+	}
+
+	AllocSite *copy = malloc((length + 1) * sizeof(AllocSite));
+	size_t i = 0;
+
+	for (AllocSite *site = first; site != NULL; site = site->next, ++i) {
+		copy[i] = *site;
+		copy[i].allocs = __atomic_load_n(&site->allocs, __ATOMIC_RELAXED);
+		copy[i].reallocs = __atomic_load_n(&site->reallocs, __ATOMIC_RELAXED);
+		copy[i].bytes = __atomic_load_n(&site->bytes, __ATOMIC_RELAXED);
+	}
+	length = merge_sites(copy, length);
+	qsort(copy, length, sizeof(AllocSite), compare_sites);
+	*count = length;
+
+	return copy;
+}
+
+static void copy_phases(PhaseCounters *out) {
+	for (int i = 0; i < ALLOC_PHASE_COUNT; ++i) {
+		out[i].allocs = __atomic_load_n(&phases[i].allocs, __ATOMIC_RELAXED);
+		out[i].reallocs = __atomic_load_n(&phases[i].reallocs,
+			__ATOMIC_RELAXED);
+		out[i].bytes = __atomic_load_n(&phases[i].bytes, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Writes a table of the counts by request phase, with averages over the
+ * given number of requests, followed by the call sites with the most
+ * bytes first. Returns -1 if not built with ALLOC_STATS.
+ */
+int allocFormatReport(Buffer *out, long long requests) {
+	PhaseCounters counters[ALLOC_PHASE_COUNT];
+	double perRequest = requests > 0 ? requests : 1;
+
+	copy_phases(counters);
+	append_format(out, "%-16s %12s %12s %14s %10s %12s\n", "phase", "allocs",
+		"reallocs", "bytes", "allocs/req", "bytes/req");
+	for (int i = 0; i < ALLOC_PHASE_COUNT; ++i) {
+		append_format(out, "%-16s %12llu %12llu %14llu %10.2f %12.1f\n",
+			phase_names[i], counters[i].allocs, counters[i].reallocs,
+			counters[i].bytes,
+			(counters[i].allocs + counters[i].reallocs) / perRequest,
+			counters[i].bytes / perRequest);
+	}
+
+	size_t count;
+	AllocSite *sorted = copy_sites(&count);
+
+	append_format(out, "\n%-28s %-22s %12s %12s %14s\n", "site", "call",
+		"allocs", "reallocs", "bytes");
+	for (size_t i = 0; i < count; ++i) {
+		const char *file = strrchr(sorted[i].file, '/');
+		char where[64];
+
+		snprintf(where, sizeof(where), "%s:%d",
+			file != NULL ? file + 1 : sorted[i].file, sorted[i].line);
+		append_format(out, "%-28s %-22s %12llu %12llu %14llu\n", where,
+			sorted[i].call, sorted[i].allocs, sorted[i].reallocs,
+			sorted[i].bytes);
+	}
+	free(sorted);
+
+	return 0;
+}
+
+/*
+ * Appends the counts in the Prometheus text format.
+ */
+void allocFormatMetrics(Buffer *out) {
+	PhaseCounters counters[ALLOC_PHASE_COUNT];
+	static const char *names[3] = {"pixie_alloc_total",
+		"pixie_alloc_growth_total", "pixie_alloc_bytes_total"};
+	static const char *help[3] = {"New Cute objects.",
+		"Appends that grew a Cute object.", "Bytes allocated through Cute."};
+
+	copy_phases(counters);
+	for (int m = 0; m < 3; ++m) {
+		append_format(out, "# HELP %s %s\n# TYPE %s counter\n", names[m],
+			help[m], names[m]);
+		for (int i = 0; i < ALLOC_PHASE_COUNT; ++i) {
+			unsigned long long value = m == 0 ? counters[i].allocs :
+				m == 1 ? counters[i].reallocs : counters[i].bytes;
+
+			append_format(out, "%s{phase=\"%s\"} %llu\n", names[m],
+				phase_names[i], value);
+		}
+	}
+
+	size_t count;
+	AllocSite *sorted = copy_sites(&count);
+
+	append_format(out, "# HELP pixie_alloc_site_bytes_total "
+		"Bytes allocated through Cute by call site.\n"
+		"# TYPE pixie_alloc_site_bytes_total counter\n");
+	for (size_t i = 0; i < count; ++i) {
+		const char *file = strrchr(sorted[i].file, '/');
+
+		append_format(out, "pixie_alloc_site_bytes_total{site=\"%s:%d\","
+			"call=\"%s\"} %llu\n", file != NULL ? file + 1 : sorted[i].file,
+			sorted[i].line, sorted[i].call, sorted[i].bytes);
+	}
+	free(sorted);
+}
+
+#else
+
+int allocFormatReport(Buffer *out, long long requests) {
+	append_format(out, "Allocation accounting needs a build with "
+		"ALLOC_STATS=1.\n");
+
+	return -1;
+}
+
+void allocFormatMetrics(Buffer *out) {
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Opt-in accounting of heap use through Cute. Build with ALLOC_STATS=1
+ * and the Cute constructors and appends called from files that include
+ * this header are counted per call site and per request phase. An
+ * append is counted as a reallocation when the container's capacity
+ * changed. Bytes are the struct and capacity of a new object or the
+ * capacity added by growth.
+ *
+ * Without ALLOC_STATS the Cute calls are left alone and ALLOC_PHASE()
+ * compiles to nothing.
+ */
+typedef enum _AllocPhase {
+	ALLOC_PHASE_OTHER, //Outside request processing
+	ALLOC_PHASE_BEGIN, //New connection or request
+	ALLOC_PHASE_REQUEST_HEADER,
+	ALLOC_PHASE_CONNECT,
+	ALLOC_PHASE_RELAY, //Request body and response
+	ALLOC_PHASE_END, //Meta data and commit
+	ALLOC_PHASE_COUNT
+} AllocPhase;
+
+typedef struct _AllocSite {
+	const char *file;
+	int line;
+	const char *call;
+	int registered;
+	unsigned long long allocs;
+	unsigned long long reallocs;
+	unsigned long long bytes;
+	struct _AllocSite *next;
+} AllocSite;
+
+int allocFormatReport(Buffer *out, long long requests);
+void allocFormatMetrics(Buffer *out);
+
+#ifdef ALLOC_STATS
+
+extern __thread int allocPhase;
+
+#define ALLOC_PHASE(phase) do { allocPhase = (phase); } while (0)
+//A site per expansion, registered the first time it is used
+#define ALLOC_SITE(name) \
+	({static AllocSite _site = {__FILE__, __LINE__, name}; &_site;})
+
+String *allocNewString(AllocSite *site);
+String *allocNewStringWithCapacity(AllocSite *site, size_t capacity);
+Array *allocNewArray(AllocSite *site, size_t capacity);
+Buffer *allocNewBufferWithCapacity(AllocSite *site, size_t capacity);
+void allocStringAppendChar(AllocSite *site, String *s, char ch);
+void allocStringAppendBuffer(AllocSite *site, String *s, const char *b,
+	size_t length);
+void allocStringAppendCString(AllocSite *site, String *s, const char *c);
+const char *allocStringAsCString(AllocSite *site, String *s);
+void allocBufferAppendBytes(AllocSite *site, Buffer *b, const char *data,
+	size_t length);
+void allocArrayAdd(AllocSite *site, Array *a, void *value);
+
+#ifndef ALLOC_IMPLEMENTATION
+#define newString() allocNewString(ALLOC_SITE("newString"))
+#define newStringWithCapacity(c) \
+	allocNewStringWithCapacity(ALLOC_SITE("newStringWithCapacity"), c)
+#define newArray(c) allocNewArray(ALLOC_SITE("newArray"), c)
+#define newBufferWithCapacity(c) \
+	allocNewBufferWithCapacity(ALLOC_SITE("newBufferWithCapacity"), c)
+#define stringAppendChar(s, ch) \
+	allocStringAppendChar(ALLOC_SITE("stringAppendChar"), s, ch)
+#define stringAppendBuffer(s, b, length) \
+	allocStringAppendBuffer(ALLOC_SITE("stringAppendBuffer"), s, b, length)
+#define stringAppendCString(s, c) \
+	allocStringAppendCString(ALLOC_SITE("stringAppendCString"), s, c)
+#define stringAsCString(s) \
+	allocStringAsCString(ALLOC_SITE("stringAsCString"), s)
+#define bufferAppendBytes(b, data, length) \
+	allocBufferAppendBytes(ALLOC_SITE("bufferAppendBytes"), b, data, length)
+#define arrayAdd(a, value) allocArrayAdd(ALLOC_SITE("arrayAdd"), a, value)
+#endif
+
+#else
+
+#define ALLOC_PHASE(phase) do {} while (0)
+
+#endif
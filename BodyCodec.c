@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#include "Proxy.h"
+#include "Persistence.h"
+#include "BodyCodec.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+#define MAX_CODINGS 8
+#define CACHE_BUCKETS 256
+//Decode at least this much when only a range is asked for
+#define MIN_DECODE (256 * 1024)
+//Stages before the last may decode to at most this. More is a bomb.
+#define MAX_STAGE_SIZE (64 * 1024 * 1024)
+
+enum {
+	DECODE_ERROR = -1,
+	DECODE_COMPLETE = 0,
+	DECODE_TRUNCATED = 1 //Stopped at the limit
+};
+
+typedef struct _CachedBody {
+	char uniqueId[64];
+	Buffer *body;
+	int isComplete;
+	struct _CachedBody *newer;
+	struct _CachedBody *older;
+	struct _CachedBody *bucketNext;
+} CachedBody;
+
+typedef struct _BodyCache {
+	pthread_mutex_t lock;
+	CachedBody *buckets[CACHE_BUCKETS];
+	CachedBody *newest;
+	CachedBody *oldest;
+	unsigned long entries;
+	unsigned long long bytes;
+	unsigned long hits;
+	unsigned long misses;
+} BodyCache;
+
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Appends to out without going past limit. Returns 1 if some of the data
+ * did not fit.
+ */
+static int append_limited(Buffer *out, const char *data, size_t length,
+	size_t limit) {
+	size_t room = out->length < limit ? limit - out->length : 0;
+
+	bufferAppendBytes(out, data, length < room ? length : room);
+
+	return length > room;
+}
+
+/*
+ * Removes chunked framing. Trailers are dropped. A body that was cut off
+ * decodes up to where it ends.
+ */
+static int dechunk(const char *data, size_t length, size_t limit,
+	Buffer *out) {
+	size_t pos = 0;
+
+	while (pos < length) {
+		size_t chunkSize = 0;
+		int digits = 0;
+
+		while (pos < length && isxdigit((unsigned char) data[pos])) {
+			char ch = tolower((unsigned char) data[pos++]);
+
+			chunkSize = chunkSize * 16 + (isdigit((unsigned char) ch) ?
+				ch - '0' : ch - 'a' + 10);
+			++digits;
+		}
+		if (digits == 0) {
+			return DECODE_ERROR;
+		}
+		//Skip extensions
+		while (pos < length && data[pos] != '\n') {
+			++pos;
+		}
+		++pos;
+
+		if (chunkSize == 0) {
+			break;
+		}
+		if (pos >= length) {
+			break;
+		}
+
+		size_t available = length - pos < chunkSize ? length - pos : chunkSize;
+
+		if (append_limited(out, data + pos, available, limit)) {
+			return DECODE_TRUNCATED;
+		}
+		pos += available + 2; //Data and CRLF
+	}
+
+	return DECODE_COMPLETE;
+}
+
+static int inflate_body(const char *data, size_t length, int windowBits,
+	size_t limit, Buffer *out) {
+	z_stream stream;
+	char chunk[16384];
+	size_t start = out->length;
+	int status;
+
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, windowBits) != Z_OK) {
+		return DECODE_ERROR;
+	}
+	stream.next_in = (Bytef*) data;
+
+	do {
+		//avail_in is 32 bits wide
+		if (stream.avail_in == 0) {
+			size_t left = length - (size_t) ((const char*) stream.next_in - data);
+
+			stream.avail_in = left < UINT32_MAX ? left : UINT32_MAX;
+		}
+		stream.next_out = (Bytef*) chunk;
+		stream.avail_out = sizeof(chunk);
+		status = inflate(&stream, Z_NO_FLUSH);
+		if (status == Z_NEED_DICT || status == Z_DATA_ERROR ||
+			status == Z_MEM_ERROR) {
+			inflateEnd(&stream);
+
+			//Some servers send raw deflate data for deflate
+			if (windowBits == MAX_WBITS && out->length == start) {
+				return inflate_body(data, length, -MAX_WBITS, limit, out);
+			}
+
+			return DECODE_ERROR;
+		}
+		if (append_limited(out, chunk, sizeof(chunk) - stream.avail_out,
+			limit)) {
+			inflateEnd(&stream);
+
+			return DECODE_TRUNCATED;
+		}
+		//Z_BUF_ERROR means the input ran out. Keep what was decoded.
+	} while (status == Z_OK);
+
+	inflateEnd(&stream);
+
+	return DECODE_COMPLETE;
+}
+
+#ifdef HAVE_BROTLI
+static int brotli_body(const char *data, size_t length, size_t limit,
+	Buffer *out) {
+	BrotliDecoderState *state = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+	const uint8_t *next_in = (const uint8_t*) data;
+	size_t avail_in = length;
+	uint8_t chunk[16384];
+	BrotliDecoderResult result;
+
+	if (state == NULL) {
+		return DECODE_ERROR;
+	}
+
+	do {
+		uint8_t *next_out = chunk;
+		size_t avail_out = sizeof(chunk);
+
+		result = BrotliDecoderDecompressStream(state, &avail_in, &next_in,
+			&avail_out, &next_out, NULL);
+		if (result == BROTLI_DECODER_RESULT_ERROR) {
+			BrotliDecoderDestroyInstance(state);
+
+			return DECODE_ERROR;
+		}
+		if (append_limited(out, (char*) chunk, sizeof(chunk) - avail_out,
+			limit)) {
+			BrotliDecoderDestroyInstance(state);
+
+			return DECODE_TRUNCATED;
+		}
+	} while (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+
+	BrotliDecoderDestroyInstance(state);
+
+	return DECODE_COMPLETE;
+}
+#endif
+
+static int slice_equals(Slice *s, const char *text) {
+	return s->length == strlen(text) &&
+		strncasecmp(s->buffer, text, s->length) == 0;
+}
+
+static int decode_one(Slice *coding, const char *data, size_t length,
+	size_t limit, Buffer *out) {
+	if (slice_equals(coding, "gzip") || slice_equals(coding, "x-gzip")) {
+		return inflate_body(data, length, 16 + MAX_WBITS, limit, out);
+	}
+	if (slice_equals(coding, "deflate")) {
+		return inflate_body(data, length, MAX_WBITS, limit, out);
+	}
+#ifdef HAVE_BROTLI
+	if (slice_equals(coding, "br")) {
+		return brotli_body(data, length, limit, out);
+	}
+#endif
+
+	return DECODE_ERROR;
+}
+
+/*
+ * Splits a comma separated header value. identity is left out.
+ */
+static int split_codings(Slice *value, Slice *codings, int count) {
+	const char *p = value->buffer, *end = value->buffer + value->length;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+			++p;
+		}
+
+		const char *start = p;
+
+		while (p < end && *p != ',' && *p != ' ' && *p != '\t' && *p != ';') {
+			++p;
+		}
+		//Skip parameters
+		while (p < end && *p != ',') {
+			++p;
+		}
+		if (p == start) {
+			continue;
+		}
+
+		Slice coding = {start, 0};
+
+		coding.length = 0;
+		while (start + coding.length < p && start[coding.length] != ' ' &&
+			start[coding.length] != '\t' && start[coding.length] != ';') {
+			++coding.length;
+		}
+		if (slice_equals(&coding, "identity")) {
+			continue;
+		}
+		if (count == MAX_CODINGS) {
+			return -1;
+		}
+		codings[count++] = coding;
+	}
+
+	return count;
+}
+
+/*
+ * Undoes the codings in the reverse order they were applied. Only the
+ * last step stops at the limit. The steps before it are refused if they
+ * decode to more than MAX_STAGE_SIZE.
+ */
+static int decode_body(Buffer *body, Slice *transferEncoding,
+	Slice *contentEncoding, size_t limit, Buffer *out) {
+	Slice codings[MAX_CODINGS];
+	int count = 0, chunked = 0, status = DECODE_COMPLETE;
+
+	if (contentEncoding != NULL &&
+		(count = split_codings(contentEncoding, codings, count)) < 0) {
+		return DECODE_ERROR;
+	}
+	if (transferEncoding != NULL &&
+		(count = split_codings(transferEncoding, codings, count)) < 0) {
+		return DECODE_ERROR;
+	}
+	//chunked is always applied last
+	if (count > 0 && slice_equals(codings + count - 1, "chunked")) {
+		chunked = 1;
+		--count;
+	}
+
+	if (!chunked && count == 0) {
+		return append_limited(out, body->buffer, body->length, limit) ?
+			DECODE_TRUNCATED : DECODE_COMPLETE;
+	}
+
+	Buffer *input = NULL, *output = NULL;
+	const char *data = body->buffer;
+	size_t length = body->length;
+
+	if (chunked) {
+		if (count == 0) {
+			return dechunk(data, length, limit, out);
+		}
+		input = newBufferWithCapacity(length);
+		if (dechunk(data, length, MAX_STAGE_SIZE, input) != DECODE_COMPLETE) {
+			deleteBuffer(input);
+
+			return DECODE_ERROR;
+		}
+		data = input->buffer;
+		length = input->length;
+	}
+
+	for (int i = count - 1; i >= 0 && status != DECODE_ERROR; --i) {
+		if (i == 0) {
+			status = decode_one(codings + i, data, length, limit, out);
+			break;
+		}
+
+		output = newBufferWithCapacity(length < MAX_STAGE_SIZE / 4 ?
+			length * 4 + 1024 : MAX_STAGE_SIZE);
+		status = decode_one(codings + i, data, length, MAX_STAGE_SIZE, output);
+		if (status == DECODE_TRUNCATED) {
+			status = DECODE_ERROR;
+		}
+		if (input != NULL) {
+			deleteBuffer(input);
+		}
+		input = output;
+		data = input->buffer;
+		length = input->length;
+	}
+
+	if (input != NULL) {
+		deleteBuffer(input);
+	}
+
+	return status;
+}
+
+/*
+ * Returns 1 if a body of this content type is text that is worth showing
+ * or indexing.
+ */
+int bodyIsText(Slice *contentType) {
+	const char *types[] = {"text/", "json", "xml", "javascript",
+		"x-www-form-urlencoded"};
+
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		size_t length = strlen(types[i]);
+
+		for (size_t j = 0; j + length <= contentType->length; ++j) {
+			if (strncasecmp(contentType->buffer + j, types[i], length) == 0) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Appends at most limit bytes of the decoded body to out. Returns 0 if
+ * the whole body was decoded, 1 if it stopped at the limit and -1 if the
+ * body could not be decoded.
+ */
+int requestRecordDecodeBody(RequestRecord *rec, size_t limit, Buffer *out) {
+	Slice transferEncoding, contentEncoding;
+	int hasTransfer = requestRecordFindHeaderId(rec, HEADER_TRANSFER_ENCODING,
+		&transferEncoding) == 0;
+	int hasContent = requestRecordFindHeaderId(rec, HEADER_CONTENT_ENCODING,
+		&contentEncoding) == 0;
+
+	return decode_body(&rec->bodyBuffer, hasTransfer ? &transferEncoding : NULL,
+		hasContent ? &contentEncoding : NULL, limit, out);
+}
+
+int responseRecordDecodeBody(ResponseRecord *rec, size_t limit, Buffer *out) {
+	Slice transferEncoding, contentEncoding;
+	int hasTransfer = responseRecordFindHeaderId(rec, HEADER_TRANSFER_ENCODING,
+		&transferEncoding) == 0;
+	int hasContent = responseRecordFindHeaderId(rec, HEADER_CONTENT_ENCODING,
+		&contentEncoding) == 0;
+
+	return decode_body(&rec->bodyBuffer, hasTransfer ? &transferEncoding : NULL,
+		hasContent ? &contentEncoding : NULL, limit, out);
+}
+
+static size_t bucket_of(const char *uniqueId) {
+	size_t h = 5381;
+
+	for (const char *c = uniqueId; *c != '\0'; ++c) {
+		h = h * 33 + (unsigned char) *c;
+	}
+
+	return h % CACHE_BUCKETS;
+}
+
+static CachedBody *find_entry(BodyCache *cache, const char *uniqueId) {
+	for (CachedBody *e = cache->buckets[bucket_of(uniqueId)]; e != NULL;
+		e = e->bucketNext) {
+		if (strcmp(e->uniqueId, uniqueId) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+static void unlink_entry(BodyCache *cache, CachedBody *e) {
+	if (e->newer != NULL) {
+		e->newer->older = e->older;
+	} else {
+		cache->newest = e->older;
+	}
+	if (e->older != NULL) {
+		e->older->newer = e->newer;
+	} else {
+		cache->oldest = e->newer;
+	}
+	e->newer = e->older = NULL;
+}
+
+static void push_newest(BodyCache *cache, CachedBody *e) {
+	e->older = cache->newest;
+	if (cache->newest != NULL) {
+		cache->newest->newer = e;
+	}
+	cache->newest = e;
+	if (cache->oldest == NULL) {
+		cache->oldest = e;
+	}
+}
+
+static void remove_entry(BodyCache *cache, CachedBody *e) {
+	CachedBody **link = cache->buckets + bucket_of(e->uniqueId);
+
+	while (*link != e) {
+		link = &(*link)->bucketNext;
+	}
+	*link = e->bucketNext;
+	unlink_entry(cache, e);
+
+	cache->bytes -= e->body->length;
+	--cache->entries;
+	deleteBuffer(e->body);
+	free(e);
+}
+
+static void insert_entry(BodyCache *cache, const char *uniqueId, Buffer *body,
+	int isComplete, unsigned long long capacity) {
+	CachedBody *old = find_entry(cache, uniqueId);
+
+	if (old != NULL) {
+		remove_entry(cache, old);
+	}
+	if (body->length > capacity) {
+		deleteBuffer(body);
+
+		return;
+	}
+	while (cache->oldest != NULL && cache->bytes + body->length > capacity) {
+		remove_entry(cache, cache->oldest);
+	}
+
+	CachedBody *e = calloc(1, sizeof(CachedBody));
+	size_t bucket = bucket_of(uniqueId);
+
+	snprintf(e->uniqueId, sizeof(e->uniqueId), "%s", uniqueId);
+	e->body = body;
+	e->isComplete = isComplete;
+	e->bucketNext = cache->buckets[bucket];
+	cache->buckets[bucket] = e;
+	push_newest(cache, e);
+	cache->bytes += body->length;
+	++cache->entries;
+}
+
+static BodyCache *open_cache(ProxyServer *p) {
+	pthread_mutex_lock(&sharedLock);
+	if (p->bodyCache == NULL) {
+		BodyCache *cache = calloc(1, sizeof(BodyCache));
+
+		pthread_mutex_init(&cache->lock, NULL);
+		p->bodyCache = cache;
+	}
+	pthread_mutex_unlock(&sharedLock);
+
+	return p->bodyCache;
+}
+
+static size_t copy_range(Buffer *body, size_t offset, size_t length,
+	Buffer *out) {
+	if (offset >= body->length) {
+		return 0;
+	}
+
+	size_t available = body->length - offset;
+
+	if (length > available) {
+		length = available;
+	}
+	bufferAppendBytes(out, body->buffer + offset, length);
+
+	return length;
+}
+
+/*
+ * Appends up to length bytes of the decoded response body starting at
+ * offset to out. Pass SIZE_MAX as length to read to the end. Returns the
+ * number of bytes appended or -1 if the record could not be loaded or
+ * decoded.
+ *
+ * Only as much of the body as is needed for the range is decoded and the
+ * decoded prefix is cached. A read past the cached prefix decodes the
+ * body again from the start, at least twice as far as before. Paging
+ * through a body therefore decodes it about twice in total.
+ */
+long proxyServerGetResponseBody(ProxyServer *p, const char *uniqueId,
+	size_t offset, size_t length, Buffer *out) {
+	BodyCache *cache = open_cache(p);
+	size_t end = length > SIZE_MAX - offset ? SIZE_MAX : offset + length;
+	size_t decodedBefore = 0;
+
+	pthread_mutex_lock(&cache->lock);
+
+	CachedBody *e = find_entry(cache, uniqueId);
+
+	if (e != NULL && (e->isComplete || e->body->length >= end)) {
+		size_t copied = copy_range(e->body, offset, length, out);
+
+		unlink_entry(cache, e);
+		push_newest(cache, e);
+		++cache->hits;
+		pthread_mutex_unlock(&cache->lock);
+
+		return copied;
+	}
+	if (e != NULL) {
+		decodedBefore = e->body->length;
+	}
+	++cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+
+	ResponseRecord *rec = newResponseRecord();
+	int status = proxyServerLoadResponse(p, uniqueId, rec);
+
+	if (status < 0) {
+		deleteResponseRecord(rec);
+
+		return -1;
+	}
+
+	//Decoding starts over, so grow geometrically to keep paging linear
+	size_t limit = end;
+
+	if (limit < MIN_DECODE) {
+		limit = MIN_DECODE;
+	}
+	if (decodedBefore > 0 && limit < decodedBefore * 2) {
+		limit = decodedBefore * 2;
+	}
+
+	Buffer *body = newBufferWithCapacity(rec->bodyBuffer.length + 1024);
+
+	status = responseRecordDecodeBody(rec, limit, body);
+	proxyServerResetRecords(p, NULL, rec);
+	deleteResponseRecord(rec);
+
+	if (status == DECODE_ERROR) {
+		deleteBuffer(body);
+		DIE(p, -1, "Failed to decode response body.");
+	}
+
+	size_t copied = copy_range(body, offset, length, out);
+	unsigned long long capacity = p->bodyCacheSize > 0 ?
+		p->bodyCacheSize : DEFAULT_BODY_CACHE_SIZE;
+
+	pthread_mutex_lock(&cache->lock);
+	insert_entry(cache, uniqueId, body, status == DECODE_COMPLETE, capacity);
+	pthread_mutex_unlock(&cache->lock);
+
+	return copied;
+}
+
+int proxyServerGetBodyCacheStats(ProxyServer *p, BodyCacheStats *stats) {
+	BodyCache *cache = open_cache(p);
+
+	pthread_mutex_lock(&cache->lock);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->entries = cache->entries;
+	stats->bytes = cache->bytes;
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+void deleteBodyCache(BodyCache *cache) {
+	while (cache->oldest != NULL) {
+		remove_entry(cache, cache->oldest);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
@@ -0,0 +1,26 @@
+/*
+ * Decoding of stored message bodies. The capture files hold the bytes
+ * exactly as they were sent. Chunked transfer encoding is undone and gzip
+ * and deflate content encodings are decompressed. The br encoding is
+ * supported when built with BROTLI=1.
+ *
+ * Decoded response bodies are kept in a per server LRU cache keyed by
+ * unique ID so that viewing the same record again does not decompress
+ * it again.
+ */
+#define DEFAULT_BODY_CACHE_SIZE (32 * 1024 * 1024)
+
+typedef struct _BodyCacheStats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long entries;
+	unsigned long long bytes;
+} BodyCacheStats;
+
+int bodyIsText(Slice *contentType);
+int requestRecordDecodeBody(RequestRecord *rec, size_t limit, Buffer *out);
+int responseRecordDecodeBody(ResponseRecord *rec, size_t limit, Buffer *out);
+long proxyServerGetResponseBody(ProxyServer *p, const char *uniqueId,
+	size_t offset, size_t length, Buffer *out);
+int proxyServerGetBodyCacheStats(ProxyServer *p, BodyCacheStats *stats);
+void deleteBodyCache(struct _BodyCache *cache);
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include "Proxy.h"
+#include "HeaderCodec.h"
+#include "Ring.h"
+#include "Committer.h"
+#include "Metrics.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+#define DEFAULT_COMMIT_INTERVAL 100
+
+typedef struct _PendingCommit {
+	FILE *requestFile;
+	FILE *responseFile;
+	char uniqueId[64];
+	Buffer *meta;
+	struct timeval queuedAt;
+	struct _PendingCommit *next;
+} PendingCommit;
+
+/*
+ * Files of a request that is still running. The descriptors are
+ * duplicates owned by the committer so that the proxy thread can close
+ * its files at any time.
+ */
+typedef struct _OpenRecord {
+	int requestFd;
+	int responseFd;
+	int dirty; //Written to since the last sync
+	struct _OpenRecord *prev;
+	struct _OpenRecord *next;
+} OpenRecord;
+
+typedef struct _Committer {
+	pthread_t threadId;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeUp;
+	int stopRequested;
+	PendingCommit *head;
+	PendingCommit *tail;
+	OpenRecord *open;
+	int openDirty; //Some open record is dirty
+	int dirFd;
+	uint64_t ringSynced; //Ring position up to which data is on disk
+	CommitStats stats;
+} Committer;
+
+static int sync_fd(ProxyServer *p, int fd) {
+	return p->commitFullSync ? fsync(fd) : fdatasync(fd);
+}
+
+static void sync_and_close(ProxyServer *p, FILE *file) {
+	if (file == NULL) {
+		return;
+	}
+
+	fflush(file);
+	sync_fd(p, fileno(file));
+	fclose(file);
+}
+
+static void sync_range(char *start, uint64_t length) {
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t from = (uintptr_t) start & ~((uintptr_t) page - 1);
+
+	msync((void*) from, (uintptr_t) start + length - from, MS_SYNC);
+}
+
+/*
+ * Flushes the part of the ring written since the last commit.
+ */
+static void sync_ring(Committer *c, Ring *ring) {
+	uint64_t head = ring->header->head;
+
+	if (head == c->ringSynced) {
+		return;
+	}
+
+	uint64_t length = head - c->ringSynced;
+
+	if (length >= ring->size || head < c->ringSynced) {
+		sync_range(ring->data, ring->size);
+	} else {
+		uint64_t from = c->ringSynced % ring->size;
+
+		if (from + length <= ring->size) {
+			sync_range(ring->data + from, length);
+		} else {
+			sync_range(ring->data + from, ring->size - from);
+			sync_range(ring->data, from + length - ring->size);
+		}
+	}
+	sync_range((char*) ring->header, sizeof(RingHeader));
+	c->ringSynced = head;
+}
+
+/*
+ * Meta data goes to a temporary file that is renamed into place once it is
+ * on disk. A reader either sees the whole meta file or none at all.
+ */
+static void commit_meta(ProxyServer *p, Committer *c, PendingCommit *item) {
+	char tmp_name[128], file_name[128];
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.meta.tmp", item->uniqueId);
+	snprintf(file_name, sizeof(file_name), "%s.meta", item->uniqueId);
+
+	int fd = openat(c->dirFd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	if (fd < 0) {
+		return;
+	}
+
+	ssize_t sz = write(fd, item->meta->buffer, item->meta->length);
+
+	sync_fd(p, fd);
+	close(fd);
+
+	if (sz == (ssize_t) item->meta->length) {
+		renameat(c->dirFd, tmp_name, c->dirFd, file_name);
+	} else {
+		unlinkat(c->dirFd, tmp_name, 0);
+	}
+}
+
+static double ms_between(struct timeval *from, struct timeval *to) {
+	return (to->tv_sec - from->tv_sec) * 1000.0 +
+		(to->tv_usec - from->tv_usec) / 1000.0;
+}
+
+/*
+ * Syncs the data written since the last sync by requests that are still
+ * running. The descriptors are duplicated under the lock so that a
+ * request can end while we sync.
+ */
+static void sync_open_records(ProxyServer *p, Committer *c) {
+	int *fds = NULL;
+	size_t length = 0, capacity = 0;
+
+	pthread_mutex_lock(&c->lock);
+	for (OpenRecord *r = c->open; r != NULL; r = r->next) {
+		if (!__atomic_exchange_n(&r->dirty, 0, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		if (length + 2 > capacity) {
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			fds = realloc(fds, capacity * sizeof(int));
+		}
+		fds[length++] = dup(r->requestFd);
+		fds[length++] = dup(r->responseFd);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	for (size_t i = 0; i < length; ++i) {
+		if (fds[i] >= 0) {
+			sync_fd(p, fds[i]);
+			close(fds[i]);
+		}
+	}
+	free(fds);
+}
+
+static void commit_batch(ProxyServer *p, Committer *c, PendingCommit *batch) {
+	unsigned long count = 0;
+
+	//Data first so that a meta file never points to missing data
+	for (PendingCommit *item = batch; item != NULL; item = item->next) {
+		sync_and_close(p, item->requestFile);
+		sync_and_close(p, item->responseFile);
+		++count;
+	}
+	if (p->durability == DURABILITY_GROUP) {
+		sync_open_records(p, c);
+	}
+	if (p->headerDictionary != NULL && p->headerDictionary->fd >= 0) {
+		sync_fd(p, p->headerDictionary->fd);
+	}
+	if (p->ring != NULL) {
+		sync_ring(c, p->ring);
+	}
+	for (PendingCommit *item = batch; item != NULL; item = item->next) {
+		if (item->meta != NULL) {
+			commit_meta(p, c, item);
+		}
+	}
+	if (c->dirFd >= 0) {
+		//Make the renames durable
+		fsync(c->dirFd);
+	}
+
+	if (count == 0) {
+		//Only open records were synced
+		return;
+	}
+
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&c->lock);
+	c->stats.batches += 1;
+	c->stats.records += count;
+	c->stats.lastBatchSize = count;
+	if (count > c->stats.maxBatchSize) {
+		c->stats.maxBatchSize = count;
+	}
+	for (PendingCommit *item = batch; item != NULL; item = item->next) {
+		double latency = ms_between(&item->queuedAt, &now);
+
+		c->stats.lastLatencyMs = latency;
+		c->stats.totalLatencyMs += latency;
+		if (latency > c->stats.maxLatencyMs) {
+			c->stats.maxLatencyMs = latency;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	metricsAdd(p, METRIC_COMMIT_BACKLOG, -(long long) count);
+
+	while (batch != NULL) {
+		PendingCommit *next = batch->next;
+
+		if (batch->meta != NULL) {
+			deleteBuffer(batch->meta);
+		}
+		free(batch);
+		batch = next;
+	}
+}
+
+static void *committer_loop(void *data) {
+	ProxyServer *p = data;
+	Committer *c = p->committer;
+	int interval = p->commitIntervalMs > 0 ?
+		p->commitIntervalMs : DEFAULT_COMMIT_INTERVAL;
+
+	pthread_mutex_lock(&c->lock);
+	while (c->stopRequested == 0 || c->head != NULL) {
+		if (c->stopRequested == 0 && p->durability == DURABILITY_GROUP) {
+			struct timespec deadline;
+
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += (long) (interval % 1000) * 1000000;
+			deadline.tv_sec += interval / 1000 + deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&c->wakeUp, &c->lock, &deadline);
+		} else if (c->stopRequested == 0 && c->head == NULL) {
+			pthread_cond_wait(&c->wakeUp, &c->lock);
+		}
+
+		//Nothing to do if no record ended and no data came in
+		PendingCommit *batch = c->head;
+		int openDirty = __atomic_exchange_n(&c->openDirty, 0, __ATOMIC_ACQUIRE);
+		int pending = batch != NULL || openDirty ||
+			(p->ring != NULL && p->ring->header->head != c->ringSynced);
+
+		c->head = c->tail = NULL;
+		pthread_mutex_unlock(&c->lock);
+
+		if (pending) {
+			commit_batch(p, c, batch);
+		}
+
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+int committerStart(ProxyServer *p) {
+	if (p->committer != NULL || p->durability == DURABILITY_NONE) {
+		return 0;
+	}
+
+	Committer *c = calloc(1, sizeof(Committer));
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->wakeUp, NULL);
+	c->dirFd = open(stringAsCString(p->persistenceFolder),
+		O_RDONLY | O_DIRECTORY);
+	if (p->ring != NULL) {
+		c->ringSynced = p->ring->header->head;
+	}
+	p->committer = c;
+
+	int status = pthread_create(&c->threadId, NULL, committer_loop, p);
+
+	if (status != 0) {
+		p->committer = NULL;
+		if (c->dirFd >= 0) {
+			close(c->dirFd);
+		}
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->wakeUp);
+		free(c);
+		DIE(p, -1, "Failed to create committer thread.");
+	}
+
+	return 0;
+}
+
+/*
+ * Commits whatever is still pending and stops the thread.
+ */
+void committerStop(ProxyServer *p) {
+	Committer *c = p->committer;
+
+	if (c == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->stopRequested = 1;
+	pthread_cond_signal(&c->wakeUp);
+	pthread_mutex_unlock(&c->lock);
+
+	pthread_join(c->threadId, NULL);
+
+	p->committer = NULL;
+	if (c->dirFd >= 0) {
+		close(c->dirFd);
+	}
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->wakeUp);
+	free(c);
+}
+
+/*
+ * Adds the files of a request that just started to the group commits.
+ * The files are made unbuffered so that a commit gets everything the
+ * proxy wrote so far.
+ */
+void committerTrack(ProxyServer *p, Request *req) {
+	Committer *c = p->committer;
+
+	if (c == NULL || p->durability != DURABILITY_GROUP ||
+		req->requestFile == NULL || req->responseFile == NULL) {
+		return;
+	}
+
+	OpenRecord *r = calloc(1, sizeof(OpenRecord));
+
+	setvbuf(req->requestFile, NULL, _IONBF, 0);
+	setvbuf(req->responseFile, NULL, _IONBF, 0);
+	r->requestFd = dup(fileno(req->requestFile));
+	r->responseFd = dup(fileno(req->responseFile));
+
+	pthread_mutex_lock(&c->lock);
+	r->next = c->open;
+	if (c->open != NULL) {
+		c->open->prev = r;
+	}
+	c->open = r;
+	pthread_mutex_unlock(&c->lock);
+
+	req->openRecord = r;
+}
+
+/*
+ * Marks the files of a running request as written to, so the next group
+ * commit syncs them. Called by the proxy thread after each write.
+ */
+void committerWritten(ProxyServer *p, Request *req) {
+	Committer *c = p->committer;
+	OpenRecord *r = req->openRecord;
+
+	if (c == NULL || r == NULL) {
+		return;
+	}
+	__atomic_store_n(&r->dirty, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&c->openDirty, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Takes a request out of the group commits when it ends or its capture
+ * is dropped.
+ */
+void committerUntrack(ProxyServer *p, Request *req) {
+	Committer *c = p->committer;
+	OpenRecord *r = req->openRecord;
+
+	if (c == NULL || r == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	if (r->prev != NULL) {
+		r->prev->next = r->next;
+	} else {
+		c->open = r->next;
+	}
+	if (r->next != NULL) {
+		r->next->prev = r->prev;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (r->requestFd >= 0) {
+		close(r->requestFd);
+	}
+	if (r->responseFd >= 0) {
+		close(r->responseFd);
+	}
+	free(r);
+	req->openRecord = NULL;
+}
+
+/*
+ * Hands the files and meta data of a finished request over to the
+ * committer. The request no longer owns its files after this.
+ */
+void committerSubmit(ProxyServer *p, Request *req) {
+	Committer *c = p->committer;
+	PendingCommit *item = calloc(1, sizeof(PendingCommit));
+
+	committerUntrack(p, req);
+
+	gettimeofday(&item->queuedAt, NULL);
+	item->requestFile = req->requestFile;
+	item->responseFile = req->responseFile;
+	req->requestFile = NULL;
+	req->responseFile = NULL;
+
+	//Ring records only need the ring to be synced
+	if (req->ringRecord == 0 &&
+		req->uniqueId->length < sizeof(item->uniqueId)) {
+		memcpy(item->uniqueId, req->uniqueId->buffer, req->uniqueId->length);
+		item->meta = newBufferWithCapacity(req->metaBuffer->length);
+		bufferAppendBytes(item->meta, req->metaBuffer->buffer,
+			req->metaBuffer->length);
+	}
+
+	metricsAdd(p, METRIC_COMMIT_BACKLOG, 1);
+
+	pthread_mutex_lock(&c->lock);
+	if (c->tail == NULL) {
+		c->head = c->tail = item;
+	} else {
+		c->tail->next = item;
+		c->tail = item;
+	}
+	if (p->durability == DURABILITY_RECORD) {
+		pthread_cond_signal(&c->wakeUp);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+int proxyServerGetCommitStats(ProxyServer *p, CommitStats *stats) {
+	Committer *c = p->committer;
+
+	if (c == NULL) {
+		memset(stats, 0, sizeof(CommitStats));
+
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
@@ -0,0 +1,10 @@
+/*
+ * Makes captured data durable on a background thread so that the
+ * proxy thread never waits for the disk.
+ */
+int committerStart(ProxyServer *p);
+void committerStop(ProxyServer *p);
+void committerTrack(ProxyServer *p, Request *req);
+void committerWritten(ProxyServer *p, Request *req);
+void committerUntrack(ProxyServer *p, Request *req);
+void committerSubmit(ProxyServer *p, Request *req);
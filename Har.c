@@ -0,0 +1,679 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "Proxy.h"
+#include "Persistence.h"
+#include "BodyCodec.h"
+#include "ResponseCache.h"
+#include "Har.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+//Small batches keep the memory used by decoded bodies down
+#define HAR_BATCH 32
+
+typedef struct _HarExport {
+	ProxyServer *p;
+	FILE *out;
+	const HarFilter *filter;
+	long written;
+	int failed;
+} HarExport;
+
+typedef struct _HarBatch {
+	Buffer *json;
+	long count;
+} HarBatch;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void append_cstring(Buffer *b, const char *s) {
+	bufferAppendBytes(b, s, strlen(s));
+}
+
+/*
+ * Returns the length of the UTF-8 sequence at s or 0 if it is not valid.
+ * Overlong forms, surrogates and code points past U+10FFFF are not valid.
+ */
+static size_t utf8_length(const unsigned char *s, size_t length) {
+	size_t need;
+	//Range of the second byte. Narrower than 80-BF after some lead bytes.
+	unsigned char low = 0x80, high = 0xbf;
+
+	if (s[0] < 0x80) {
+		return 1;
+	} else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		need = 2;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		need = 3;
+		if (s[0] == 0xe0) {
+			low = 0xa0;
+		} else if (s[0] == 0xed) {
+			high = 0x9f;
+		}
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		need = 4;
+		if (s[0] == 0xf0) {
+			low = 0x90;
+		} else if (s[0] == 0xf4) {
+			high = 0x8f;
+		}
+	} else {
+		return 0;
+	}
+	if (need > length || s[1] < low || s[1] > high) {
+		return 0;
+	}
+	for (size_t i = 2; i < need; ++i) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+	}
+
+	return need;
+}
+
+static int is_utf8(const char *s, size_t length) {
+	const unsigned char *in = (const unsigned char*) s;
+
+	for (size_t i = 0, n; i < length; i += n) {
+		n = utf8_length(in + i, length - i);
+		if (n == 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Writes a quoted JSON string. Bytes that are not valid UTF-8 are written
+ * as the code point of the same value.
+ */
+static void append_json_string(Buffer *b, const char *s, size_t length) {
+	const unsigned char *in = (const unsigned char*) s;
+	size_t run = 0, i = 0;
+
+	bufferAppendBytes(b, "\"", 1);
+	while (i < length) {
+		unsigned char ch = in[i];
+		size_t n = ch >= 0x20 && ch != '"' && ch != '\\' ?
+			utf8_length(in + i, length - i) : 0;
+
+		if (n > 0) {
+			i += n;
+			run += n;
+			continue;
+		}
+
+		//Flush the bytes that need no escaping
+		bufferAppendBytes(b, s + i - run, run);
+		run = 0;
+
+		char escape[6] = {'\\', 'u', '0', '0', hex_digits[ch >> 4],
+			hex_digits[ch & 15]};
+
+		switch (ch) {
+		case '"':
+			bufferAppendBytes(b, "\\\"", 2);
+			break;
+		case '\\':
+			bufferAppendBytes(b, "\\\\", 2);
+			break;
+		case '\n':
+			bufferAppendBytes(b, "\\n", 2);
+			break;
+		case '\r':
+			bufferAppendBytes(b, "\\r", 2);
+			break;
+		case '\t':
+			bufferAppendBytes(b, "\\t", 2);
+			break;
+		default:
+			bufferAppendBytes(b, escape, 6);
+			break;
+		}
+		++i;
+	}
+	bufferAppendBytes(b, s + i - run, run);
+	bufferAppendBytes(b, "\"", 1);
+}
+
+static void append_json_cstring(Buffer *b, const char *s) {
+	append_json_string(b, s, strlen(s));
+}
+
+static void append_base64(Buffer *b, const char *data, size_t length) {
+	static const char table[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char *in = (const unsigned char*) data;
+	char chunk[4];
+
+	bufferAppendBytes(b, "\"", 1);
+	for (size_t i = 0; i < length; i += 3) {
+		uint32_t v = in[i] << 16;
+
+		if (i + 1 < length) {
+			v |= in[i + 1] << 8;
+		}
+		if (i + 2 < length) {
+			v |= in[i + 2];
+		}
+		chunk[0] = table[(v >> 18) & 63];
+		chunk[1] = table[(v >> 12) & 63];
+		chunk[2] = i + 1 < length ? table[(v >> 6) & 63] : '=';
+		chunk[3] = i + 2 < length ? table[v & 63] : '=';
+		bufferAppendBytes(b, chunk, 4);
+	}
+	bufferAppendBytes(b, "\"", 1);
+}
+
+static void append_number(Buffer *b, long long value) {
+	char number[32];
+
+	bufferAppendBytes(b, number, snprintf(number, sizeof(number), "%lld", value));
+}
+
+static void append_name_value(Buffer *b, const char *name, size_t nameLength,
+	const char *value, size_t valueLength) {
+	append_cstring(b, "{\"name\":");
+	append_json_string(b, name, nameLength);
+	append_cstring(b, ",\"value\":");
+	append_json_string(b, value, valueLength);
+	append_cstring(b, "}");
+}
+
+static void append_query_string(Buffer *b, RequestRecord *req) {
+	size_t count = requestRecordQueryParameterCount(req);
+	int first = 1;
+	Slice name, value;
+
+	append_cstring(b, "[");
+	for (size_t i = 0; i < count &&
+		requestRecordParameterAt(req, i, &name, &value) == 0; ++i) {
+		//Left by && in the query string
+		if (name.length == 0 && value.length == 0) {
+			continue;
+		}
+		if (!first) {
+			append_cstring(b, ",");
+		}
+		first = 0;
+		append_name_value(b, name.buffer, name.length, value.buffer,
+			value.length);
+	}
+	append_cstring(b, "]");
+}
+
+/*
+ * Cookie headers hold name=value pairs split by ';'. A Set-Cookie header
+ * holds one pair followed by attributes.
+ */
+static int append_cookies(Buffer *b, Slice *value, int isSetCookie,
+	int first) {
+	const char *s = value->buffer, *end = value->buffer + value->length;
+
+	while (s < end) {
+		while (s < end && *s == ' ') {
+			++s;
+		}
+
+		const char *semi = memchr(s, ';', end - s);
+		const char *pairEnd = semi == NULL ? end : semi;
+		const char *eq = memchr(s, '=', pairEnd - s);
+
+		if (eq != NULL) {
+			if (!first) {
+				append_cstring(b, ",");
+			}
+			first = 0;
+			append_name_value(b, s, eq - s, eq + 1, pairEnd - eq - 1);
+		}
+		if (isSetCookie) {
+			break;
+		}
+		s = pairEnd + 1;
+	}
+
+	return first;
+}
+
+static void append_time(Buffer *b, struct timeval *tv) {
+	char text[64];
+	struct tm tm;
+	time_t seconds = tv->tv_sec;
+
+	gmtime_r(&seconds, &tm);
+
+	size_t length = strftime(text, sizeof(text), "\"%Y-%m-%dT%H:%M:%S", &tm);
+
+	length += snprintf(text + length, sizeof(text) - length, ".%03ldZ\"",
+		(long) tv->tv_usec / 1000);
+	bufferAppendBytes(b, text, length);
+}
+
+static void append_url(Buffer *b, RequestRecord *meta, RequestRecord *req) {
+	Buffer *url = newBufferWithCapacity(256);
+
+	//Already an absolute URL
+	if (req != NULL && req->path->length > 0 && req->path->buffer[0] != '/') {
+		bufferAppendBytes(url, req->path->buffer, req->path->length);
+		if (req->queryString->length > 0) {
+			bufferAppendBytes(url, "?", 1);
+			bufferAppendBytes(url, req->queryString->buffer,
+				req->queryString->length);
+		}
+		append_json_string(b, url->buffer, url->length);
+		deleteBuffer(url);
+
+		return;
+	}
+
+	const char *scheme = meta->protocol->length > 0 ?
+		stringAsCString(meta->protocol) : "http";
+	int port = atoi(stringAsCString(meta->port));
+
+	append_cstring(url, scheme);
+	append_cstring(url, "://");
+	bufferAppendBytes(url, meta->host->buffer, meta->host->length);
+	if (port > 0 && !(port == 80 && strcmp(scheme, "http") == 0) &&
+		!(port == 443 && strcmp(scheme, "https") == 0)) {
+		bufferAppendBytes(url, ":", 1);
+		bufferAppendBytes(url, meta->port->buffer, meta->port->length);
+	}
+	if (req != NULL) {
+		bufferAppendBytes(url, req->path->buffer, req->path->length);
+		if (req->queryString->length > 0) {
+			bufferAppendBytes(url, "?", 1);
+			bufferAppendBytes(url, req->queryString->buffer,
+				req->queryString->length);
+		}
+	}
+	append_json_string(b, url->buffer, url->length);
+	deleteBuffer(url);
+}
+
+static void append_request(Buffer *b, RequestRecord *meta,
+	RequestRecord *req, int hasRequest, Buffer *scratch) {
+	Slice name, value;
+	String *method = hasRequest && req->method->length > 0 ?
+		req->method : meta->method;
+
+	append_cstring(b, "\"request\":{\"method\":");
+	append_json_string(b, method->buffer, method->length);
+	append_cstring(b, ",\"url\":");
+	append_url(b, meta, hasRequest ? req : NULL);
+	//The version is the last word of the request line
+	const char *line = hasRequest ? req->headerBuffer.buffer : NULL;
+	const char *eol = line == NULL ? NULL :
+		memchr(line, '\n', req->headerBuffer.length);
+	const char *version = eol;
+
+	while (version != NULL && version > line && version[-1] != ' ') {
+		--version;
+	}
+	while (eol != NULL && eol > version && eol[-1] == '\r') {
+		--eol;
+	}
+	append_cstring(b, ",\"httpVersion\":");
+	if (version != NULL && eol > version) {
+		append_json_string(b, version, eol - version);
+	} else {
+		append_json_cstring(b, "HTTP/1.1");
+	}
+
+	append_cstring(b, ",\"cookies\":[");
+	int first = 1;
+
+	for (size_t i = 0; hasRequest &&
+		requestRecordHeaderAt(req, i, &name, &value) == 0; ++i) {
+		if (name.length == 6 && strncasecmp(name.buffer, "Cookie", 6) == 0) {
+			first = append_cookies(b, &value, 0, first);
+		}
+	}
+
+	append_cstring(b, "],\"headers\":[");
+	for (size_t i = 0; hasRequest &&
+		requestRecordHeaderAt(req, i, &name, &value) == 0; ++i) {
+		if (i > 0) {
+			append_cstring(b, ",");
+		}
+		append_name_value(b, name.buffer, name.length, value.buffer,
+			value.length);
+	}
+
+	append_cstring(b, "],\"queryString\":");
+	if (hasRequest) {
+		append_query_string(b, req);
+	} else {
+		append_cstring(b, "[]");
+	}
+
+	if (hasRequest && req->bodyBuffer.length > 0) {
+		Slice contentType = {"", 0};
+
+		requestRecordFindHeaderId(req, HEADER_CONTENT_TYPE, &contentType);
+		append_cstring(b, ",\"postData\":{\"mimeType\":");
+		append_json_string(b, contentType.buffer, contentType.length);
+		append_cstring(b, ",\"text\":");
+		scratch->length = 0;
+		if (requestRecordDecodeBody(req, SIZE_MAX, scratch) < 0) {
+			scratch->length = 0;
+			bufferAppendBytes(scratch, req->bodyBuffer.buffer,
+				req->bodyBuffer.length);
+		}
+		append_json_string(b, scratch->buffer, scratch->length);
+		append_cstring(b, "}");
+	}
+
+	append_cstring(b, ",\"headersSize\":");
+	append_number(b, hasRequest ? (long long) req->headerBuffer.length : -1);
+	append_cstring(b, ",\"bodySize\":");
+	append_number(b, hasRequest ? (long long) req->bodyBuffer.length : -1);
+	append_cstring(b, "}");
+}
+
+static void append_response(Buffer *b, ResponseRecord *metaResponse,
+	ResponseRecord *res, int hasResponse, Buffer *scratch) {
+	Slice name, value;
+	Slice contentType = {"", 0}, location = {"", 0};
+	String *status = hasResponse && res->statusCode->length > 0 ?
+		res->statusCode : metaResponse->statusCode;
+
+	append_cstring(b, "\"response\":{\"status\":");
+	append_number(b, atoi(stringAsCString(status)));
+	append_cstring(b, ",\"statusText\":");
+	if (hasResponse) {
+		append_json_string(b, res->statusMessage->buffer,
+			res->statusMessage->length);
+	} else {
+		append_json_cstring(b, "");
+	}
+
+	//The version is the first word of the status line
+	const char *line = hasResponse ? res->headerBuffer.buffer : NULL;
+	const char *space = line == NULL ? NULL :
+		memchr(line, ' ', res->headerBuffer.length);
+
+	append_cstring(b, ",\"httpVersion\":");
+	if (space != NULL) {
+		append_json_string(b, line, space - line);
+	} else {
+		append_json_cstring(b, "HTTP/1.1");
+	}
+
+	append_cstring(b, ",\"cookies\":[");
+	int first = 1;
+
+	for (size_t i = 0; hasResponse &&
+		responseRecordHeaderAt(res, i, &name, &value) == 0; ++i) {
+		if (name.length == 10 && strncasecmp(name.buffer, "Set-Cookie", 10) == 0) {
+			first = append_cookies(b, &value, 1, first);
+		}
+	}
+
+	append_cstring(b, "],\"headers\":[");
+	for (size_t i = 0; hasResponse &&
+		responseRecordHeaderAt(res, i, &name, &value) == 0; ++i) {
+		if (i > 0) {
+			append_cstring(b, ",");
+		}
+		append_name_value(b, name.buffer, name.length, value.buffer,
+			value.length);
+	}
+	append_cstring(b, "]");
+
+	if (hasResponse) {
+		responseRecordFindHeaderId(res, HEADER_CONTENT_TYPE, &contentType);
+		responseRecordFindHeaderId(res, HEADER_LOCATION, &location);
+	}
+
+	scratch->length = 0;
+	if (hasResponse &&
+		responseRecordDecodeBody(res, SIZE_MAX, scratch) < 0) {
+		//Unknown encoding. Export the bytes as they are.
+		scratch->length = 0;
+		bufferAppendBytes(scratch, res->bodyBuffer.buffer,
+			res->bodyBuffer.length);
+	}
+
+	long long bodySize = hasResponse ? (long long) res->bodyBuffer.length : -1;
+
+	append_cstring(b, ",\"content\":{\"size\":");
+	append_number(b, scratch->length);
+	if (bodySize > (long long) scratch->length) {
+		append_cstring(b, ",\"compression\":");
+		append_number(b, bodySize - scratch->length);
+	}
+	append_cstring(b, ",\"mimeType\":");
+	append_json_string(b, contentType.buffer, contentType.length);
+	if (scratch->length > 0) {
+		append_cstring(b, ",\"text\":");
+		//Text that is not valid UTF-8 would not survive as a JSON string
+		if (bodyIsText(&contentType) &&
+			is_utf8(scratch->buffer, scratch->length)) {
+			append_json_string(b, scratch->buffer, scratch->length);
+		} else {
+			append_base64(b, scratch->buffer, scratch->length);
+			append_cstring(b, ",\"encoding\":\"base64\"");
+		}
+	}
+	append_cstring(b, "},\"redirectURL\":");
+	append_json_string(b, location.buffer, location.length);
+	append_cstring(b, ",\"headersSize\":");
+	append_number(b, hasResponse ? (long long) res->headerBuffer.length : -1);
+	append_cstring(b, ",\"bodySize\":");
+	append_number(b, bodySize);
+	append_cstring(b, "}");
+}
+
+static long long to_micros(struct timeval *tv) {
+	return (long long) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void append_millis(Buffer *b, long long micros) {
+	char number[32];
+
+	if (micros < 0) {
+		bufferAppendBytes(b, "-1", 2);
+	} else {
+		bufferAppendBytes(b, number, snprintf(number, sizeof(number), "%.3f",
+			micros / 1000.0));
+	}
+}
+
+#define PHASE_COUNT 6
+
+static const char *phase_names[PHASE_COUNT] = {
+	"blocked", "dns", "connect", "send", "wait", "receive"
+};
+
+/*
+ * Splits the time taken by a request into HAR phases in microseconds.
+ * Each phase runs from the end of the one before so that they add up to
+ * the returned total. Phases that did not happen are -1. Blocked is the
+ * time taken by the client to send the request header.
+ */
+static long long split_phases(RequestRecord *meta, long long *phases) {
+	PhaseTimings *t = &meta->timings;
+	long long ends[PHASE_COUNT] = {t->headerComplete, t->dnsDone,
+		t->connectDone, t->requestSent, t->firstByte, t->responseComplete};
+	long long at = 0;
+
+	if (t->requestSent < 0 || t->firstByte < 0 || t->responseComplete < 0) {
+		//Recorded before phases were saved. Only the total is known.
+		long long total = to_micros(&meta->responseEndTime) -
+			to_micros(&meta->requestStartTime);
+
+		if (total < 0) {
+			total = 0;
+		}
+		for (int i = 0; i < PHASE_COUNT; ++i) {
+			phases[i] = i < 3 ? -1 : 0;
+		}
+		phases[4] = total;
+
+		return total;
+	}
+
+	for (int i = 0; i < PHASE_COUNT; ++i) {
+		if (ends[i] < 0) {
+			//Only DNS and connect may be missing
+			phases[i] = i == 0 ? 0 : -1;
+			continue;
+		}
+		phases[i] = ends[i] > at ? ends[i] - at : 0;
+		at += phases[i];
+	}
+
+	return at;
+}
+
+static int matches_filter(const HarFilter *filter, RequestRecord *meta) {
+	if (filter == NULL) {
+		return 1;
+	}
+
+	long long start = to_micros(&meta->requestStartTime);
+
+	if (filter->startTime > 0 && start < filter->startTime) {
+		return 0;
+	}
+	if (filter->endTime > 0 && start >= filter->endTime) {
+		return 0;
+	}
+	if (filter->host != NULL && filter->host[0] != '\0' &&
+		strcasecmp(stringAsCString(meta->host), filter->host) != 0) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Encodes a batch of entries. Runs on several threads at once.
+ */
+static void *prepare_batch(void *contextData, HistoryEntry *entries,
+	size_t count) {
+	HarExport *e = contextData;
+	HarBatch *batch = calloc(1, sizeof(HarBatch));
+	RequestRecord *req = newRequestRecord();
+	ResponseRecord *res = newResponseRecord();
+	Buffer *scratch = newBufferWithCapacity(4096);
+
+	batch->json = newBufferWithCapacity(4096);
+
+	for (size_t i = 0; i < count; ++i) {
+		RequestRecord *meta = entries[i].request;
+		Buffer *b = batch->json;
+
+		if (!matches_filter(e->filter, meta)) {
+			continue;
+		}
+
+		int hasRequest = proxyServerLoadRequest(e->p, entries[i].uniqueId,
+			req) == 0;
+		int hasResponse = proxyServerLoadResponse(e->p, entries[i].uniqueId,
+			res) == 0;
+		long long phases[PHASE_COUNT];
+		long long total = split_phases(meta, phases);
+
+		append_cstring(b, batch->count > 0 ? ",\n{" : "\n{");
+		append_cstring(b, "\"startedDateTime\":");
+		append_time(b, &meta->requestStartTime);
+		append_cstring(b, ",\"time\":");
+		append_millis(b, total);
+		append_cstring(b, ",");
+		append_request(b, meta, req, hasRequest, scratch);
+		append_cstring(b, ",");
+		append_response(b, entries[i].response, res, hasResponse, scratch);
+		append_cstring(b, ",\"cache\":{},\"timings\":{");
+		for (int j = 0; j < PHASE_COUNT; ++j) {
+			if (j > 0) {
+				append_cstring(b, ",");
+			}
+			append_json_cstring(b, phase_names[j]);
+			append_cstring(b, ":");
+			append_millis(b, phases[j]);
+		}
+		append_cstring(b, "},\"_id\":");
+		append_json_cstring(b, entries[i].uniqueId);
+		if (entries[i].response->cacheStatus != CACHE_NONE) {
+			append_cstring(b, ",\"_cache\":");
+			append_json_cstring(b,
+				cacheStatusName(entries[i].response->cacheStatus));
+		}
+		append_cstring(b, "}");
+		++batch->count;
+
+		proxyServerResetRecords(e->p, req, res);
+		//Don't hold on to a large body
+		if (scratch->capacity > 1024 * 1024) {
+			deleteBuffer(scratch);
+			scratch = newBufferWithCapacity(4096);
+		}
+	}
+
+	deleteRequestRecord(req);
+	deleteResponseRecord(res);
+	deleteBuffer(scratch);
+
+	return batch;
+}
+
+/*
+ * Writes batches out in order.
+ */
+static void deliver_batch(void *contextData, void *prepared) {
+	HarExport *e = contextData;
+	HarBatch *batch = prepared;
+
+	if (batch->count > 0 && !e->failed) {
+		if (e->written > 0 && fputc(',', e->out) == EOF) {
+			e->failed = 1;
+		}
+		if (fwrite(batch->json->buffer, 1, batch->json->length, e->out) !=
+			batch->json->length) {
+			e->failed = 1;
+		}
+		e->written += batch->count;
+	}
+
+	deleteBuffer(batch->json);
+	free(batch);
+}
+
+/*
+ * Writes the records that pass the filter to out as a HAR log, oldest
+ * first. filter may be NULL. If threadCount is 0 or less one thread per
+ * CPU encodes records. Returns the number of records written or -1.
+ */
+long proxyServerExportHar(ProxyServer *p, FILE *out, const HarFilter *filter,
+	int threadCount) {
+	HarExport e;
+
+	memset(&e, 0, sizeof(e));
+	e.p = p;
+	e.out = out;
+	e.filter = filter;
+
+	fputs("{\"log\":{\"version\":\"1.2\","
+		"\"creator\":{\"name\":\"Pixie\",\"version\":\"1.0\"},"
+		"\"pages\":[],\"entries\":[", out);
+
+	int status = proxyServerLoadHistoryPipelined(p, threadCount, HAR_BATCH, &e,
+		prepare_batch, deliver_batch);
+
+	DIE(p, status, "Failed to load history.");
+
+	fputs("\n]}}\n", out);
+	if (fflush(out) != 0 || e.failed) {
+		DIE(p, -1, "Failed to write HAR file.");
+	}
+
+	return e.written;
+}
@@ -0,0 +1,14 @@
+/*
+ * Export of captured traffic in the HTTP Archive (HAR) 1.2 format. Records
+ * are read from the persistence folder a batch at a time and encoded by
+ * several threads. JSON is written out as it is produced so memory use
+ * does not grow with the size of the capture.
+ */
+typedef struct _HarFilter {
+	long long startTime; //Microseconds since the epoch. 0 for no limit.
+	long long endTime; //Records that start before this. 0 for no limit.
+	const char *host; //Only records for this host. NULL for all.
+} HarFilter;
+
+long proxyServerExportHar(ProxyServer *p, FILE *out, const HarFilter *filter,
+	int threadCount);
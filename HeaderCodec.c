@@ -0,0 +1,837 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../Cute/String.h"
+#include "../Cute/Array.h"
+#include "../Cute/Buffer.h"
+#include "HeaderCodec.h"
+
+#define MAX_DICTIONARY_ENTRIES 16384
+#define MAX_INDEXED_VALUE 512
+#define MAX_HEADER_LINES 1024
+#define SEEN_FIELD_SLOTS 8192 //Power of 2
+
+#define REP_INDEXED 0x80
+#define REP_INDEXED_NAME 0x40
+#define REP_LITERAL 0x00
+#define REP_RAW_LINE 0x01
+
+typedef struct _StaticField {
+	const char *name;
+	const char *value;
+	//Values of these headers change with every message or carry
+	//credentials that must not be shared between records. Never add them
+	//to the dictionary.
+	int isVolatile;
+} StaticField;
+
+/*
+ * Most common header fields in HTTP/1.x traffic. The order must never
+ * change since the indices are stored in the capture files. New fields can
+ * only be added by bumping the magic version.
+ */
+static const StaticField staticTable[] = {
+	{"Host", "", 0},
+	{"User-Agent", "", 0},
+	{"Accept", "", 0},
+	{"Accept", "*/*", 0},
+	{"Accept-Language", "", 0},
+	{"Accept-Encoding", "", 0},
+	{"Accept-Encoding", "gzip, deflate", 0},
+	{"Accept-Encoding", "gzip, deflate, br", 0},
+	{"Accept-Charset", "", 0},
+	{"Accept-Ranges", "bytes", 0},
+	{"Connection", "keep-alive", 0},
+	{"Connection", "close", 0},
+	{"Proxy-Connection", "keep-alive", 0},
+	{"Keep-Alive", "", 0},
+	{"Cookie", "", 1},
+	{"Set-Cookie", "", 1},
+	{"Referer", "", 1},
+	{"Origin", "", 0},
+	{"Authorization", "", 1},
+	{"Cache-Control", "", 0},
+	{"Cache-Control", "no-cache", 0},
+	{"Cache-Control", "max-age=0", 0},
+	{"Pragma", "no-cache", 0},
+	{"Content-Type", "", 0},
+	{"Content-Type", "application/json", 0},
+	{"Content-Type", "application/x-www-form-urlencoded", 0},
+	{"Content-Type", "text/html", 0},
+	{"Content-Type", "text/html; charset=utf-8", 0},
+	{"Content-Type", "text/plain", 0},
+	{"Content-Type", "text/css", 0},
+	{"Content-Type", "application/javascript", 0},
+	{"Content-Type", "image/png", 0},
+	{"Content-Type", "image/jpeg", 0},
+	{"Content-Length", "", 1},
+	{"Content-Encoding", "gzip", 0},
+	{"Content-Encoding", "", 0},
+	{"Transfer-Encoding", "chunked", 0},
+	{"Date", "", 1},
+	{"Expires", "", 1},
+	{"Last-Modified", "", 1},
+	{"ETag", "", 1},
+	{"Age", "", 1},
+	{"If-None-Match", "", 1},
+	{"If-Modified-Since", "", 1},
+	{"Content-Range", "", 1},
+	{"Range", "", 1},
+	{"Location", "", 0},
+	{"Server", "", 0},
+	{"Vary", "Accept-Encoding", 0},
+	{"Vary", "", 0},
+	{"Upgrade-Insecure-Requests", "1", 0},
+	{"Access-Control-Allow-Origin", "*", 0},
+	{"Access-Control-Allow-Origin", "", 0},
+	{"Access-Control-Allow-Credentials", "true", 0},
+	{"Access-Control-Allow-Headers", "", 0},
+	{"Access-Control-Allow-Methods", "", 0},
+	{"Strict-Transport-Security", "", 0},
+	{"X-Content-Type-Options", "nosniff", 0},
+	{"X-Frame-Options", "SAMEORIGIN", 0},
+	{"X-Requested-With", "XMLHttpRequest", 0},
+	{"X-Request-Id", "", 1},
+	{"DNT", "1", 0},
+};
+
+#define STATIC_TABLE_LENGTH (sizeof(staticTable) / sizeof(staticTable[0]))
+
+//Credentials without a static entry. Volatile like the ones above.
+static const char *volatileNames[] = {"Proxy-Authorization"};
+
+//Headers named like these carry API keys and tokens. They are stored as
+//literals and neither the name nor the value enters the dictionary.
+static const char *secretSuffixes[] = {"-Token", "-Key", "-Secret"};
+
+static size_t hash_bytes(size_t h, const char *data, size_t length) {
+	//FNV-1a
+	for (size_t i = 0; i < length; ++i) {
+		h ^= (unsigned char) data[i];
+		h *= 1099511628211UL;
+	}
+
+	return h;
+}
+
+static size_t hash_field(const char *name, size_t nameLength,
+	const char *value, size_t valueLength) {
+	size_t h = hash_bytes(14695981039346656037UL, name, nameLength);
+
+	h = hash_bytes(h ^ 0xff, value, valueLength);
+
+	return h;
+}
+
+static size_t hash_name(const char *name, size_t nameLength) {
+	return hash_bytes(14695981039346656037UL, name, nameLength);
+}
+
+/*
+ * Table index is 1 based. Static entries come first followed by
+ * the dictionary.
+ */
+static void get_entry(HeaderDictionary *d, size_t index,
+	const char **name, size_t *nameLength,
+	const char **value, size_t *valueLength) {
+	if (index <= STATIC_TABLE_LENGTH) {
+		const StaticField *f = staticTable + index - 1;
+
+		*name = f->name;
+		*nameLength = strlen(f->name);
+		*value = f->value;
+		*valueLength = strlen(f->value);
+
+		return;
+	}
+
+	String *n = arrayGet(d->names, index - STATIC_TABLE_LENGTH - 1);
+	String *v = arrayGet(d->values, index - STATIC_TABLE_LENGTH - 1);
+
+	*name = n->buffer;
+	*nameLength = n->length;
+	*value = v->buffer;
+	*valueLength = v->length;
+}
+
+static size_t table_length(HeaderDictionary *d) {
+	return STATIC_TABLE_LENGTH + d->names->length;
+}
+
+static int is_volatile(const char *name, size_t nameLength) {
+	for (size_t i = 0; i < STATIC_TABLE_LENGTH; ++i) {
+		if (staticTable[i].isVolatile &&
+			strlen(staticTable[i].name) == nameLength &&
+			strncasecmp(staticTable[i].name, name, nameLength) == 0) {
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < sizeof(volatileNames) / sizeof(volatileNames[0]);
+		++i) {
+		if (strlen(volatileNames[i]) == nameLength &&
+			strncasecmp(volatileNames[i], name, nameLength) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int is_secret(const char *name, size_t nameLength) {
+	for (size_t i = 0; i < sizeof(secretSuffixes) / sizeof(secretSuffixes[0]);
+		++i) {
+		size_t suffixLength = strlen(secretSuffixes[i]);
+
+		if (nameLength > suffixLength &&
+			strncasecmp(secretSuffixes[i], name + nameLength - suffixLength,
+				suffixLength) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void index_entry(HeaderDictionary *d, size_t index) {
+	const char *name, *value;
+	size_t nameLength, valueLength;
+
+	get_entry(d, index, &name, &nameLength, &value, &valueLength);
+
+	size_t mask = d->slotCount - 1;
+	size_t slot = hash_field(name, nameLength, value, valueLength) & mask;
+
+	while (d->fieldSlots[slot] != 0) {
+		slot = (slot + 1) & mask;
+	}
+	d->fieldSlots[slot] = index;
+
+	//Only the first entry with a name is used for name lookup
+	slot = hash_name(name, nameLength) & mask;
+	while (d->nameSlots[slot] != 0) {
+		const char *n, *v;
+		size_t nl, vl;
+
+		get_entry(d, d->nameSlots[slot], &n, &nl, &v, &vl);
+		if (nl == nameLength && memcmp(n, name, nl) == 0) {
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+	d->nameSlots[slot] = index;
+}
+
+static size_t find_field(HeaderDictionary *d, const char *name, size_t nameLength,
+	const char *value, size_t valueLength) {
+	size_t mask = d->slotCount - 1;
+	size_t slot = hash_field(name, nameLength, value, valueLength) & mask;
+
+	while (d->fieldSlots[slot] != 0) {
+		const char *n, *v;
+		size_t nl, vl;
+
+		get_entry(d, d->fieldSlots[slot], &n, &nl, &v, &vl);
+		if (nl == nameLength && vl == valueLength &&
+			memcmp(n, name, nl) == 0 && memcmp(v, value, vl) == 0) {
+			return d->fieldSlots[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return 0;
+}
+
+static size_t find_name(HeaderDictionary *d, const char *name, size_t nameLength) {
+	size_t mask = d->slotCount - 1;
+	size_t slot = hash_name(name, nameLength) & mask;
+
+	while (d->nameSlots[slot] != 0) {
+		const char *n, *v;
+		size_t nl, vl;
+
+		get_entry(d, d->nameSlots[slot], &n, &nl, &v, &vl);
+		if (nl == nameLength && memcmp(n, name, nl) == 0) {
+			return d->nameSlots[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return 0;
+}
+
+static void encode_int(Buffer *out, int prefixBits, unsigned char flags, size_t value) {
+	size_t max = (1 << prefixBits) - 1;
+	unsigned char ch;
+
+	if (value < max) {
+		ch = flags | (unsigned char) value;
+		bufferAppendBytes(out, (char*) &ch, 1);
+
+		return;
+	}
+
+	ch = flags | (unsigned char) max;
+	bufferAppendBytes(out, (char*) &ch, 1);
+	value -= max;
+	while (value >= 128) {
+		ch = (unsigned char) ((value & 0x7f) | 0x80);
+		bufferAppendBytes(out, (char*) &ch, 1);
+		value >>= 7;
+	}
+	ch = (unsigned char) value;
+	bufferAppendBytes(out, (char*) &ch, 1);
+}
+
+/*
+ * Returns number of bytes consumed or 0 if the data is malformed.
+ */
+static size_t decode_int(const unsigned char *data, size_t length,
+	int prefixBits, size_t *value) {
+	if (length == 0) {
+		return 0;
+	}
+
+	size_t max = (1 << prefixBits) - 1;
+
+	*value = data[0] & max;
+	if (*value < max) {
+		return 1;
+	}
+
+	int shift = 0;
+
+	for (size_t i = 1; i < length && shift < 56; ++i) {
+		*value += (size_t) (data[i] & 0x7f) << shift;
+		if ((data[i] & 0x80) == 0) {
+			return i + 1;
+		}
+		shift += 7;
+	}
+
+	return 0;
+}
+
+static void append_byte(Buffer *out, unsigned char ch) {
+	bufferAppendBytes(out, (char*) &ch, 1);
+}
+
+static void encode_string(Buffer *out, const char *str, size_t length) {
+	encode_int(out, 8, 0, length);
+	bufferAppendBytes(out, str, length);
+}
+
+static size_t decode_string(const unsigned char *data, size_t length,
+	const char **str, size_t *strLength) {
+	size_t n = decode_int(data, length, 8, strLength);
+
+	if (n == 0 || *strLength > length - n) {
+		return 0;
+	}
+	*str = (const char*) data + n;
+
+	return n + *strLength;
+}
+
+/*
+ * Loads any entries appended to the dictionary file since the last time.
+ * A partially written entry at the end is ignored. If we own the file
+ * it is truncated so that the next append starts at a clean position.
+ */
+static void load_entries(HeaderDictionary *d) {
+	struct stat stat_buf;
+
+	if (d->fd < 0 || fstat(d->fd, &stat_buf) < 0) {
+		return;
+	}
+	if (stat_buf.st_size <= d->loadedLength) {
+		return;
+	}
+
+	size_t length = stat_buf.st_size - d->loadedLength;
+	unsigned char *data = malloc(length);
+	ssize_t sz = pread(d->fd, data, length, d->loadedLength);
+
+	if (sz != (ssize_t) length) {
+		free(data);
+
+		return;
+	}
+
+	size_t pos = 0;
+
+	while (pos < length) {
+		const char *name, *value;
+		size_t nameLength, valueLength;
+		size_t n = decode_string(data + pos, length - pos, &name, &nameLength);
+
+		if (n == 0) {
+			break;
+		}
+
+		size_t m = decode_string(data + pos + n, length - pos - n,
+			&value, &valueLength);
+
+		if (m == 0) {
+			break;
+		}
+
+		String *nameStr = newString();
+		String *valueStr = newString();
+
+		stringAppendBuffer(nameStr, name, nameLength);
+		stringAppendBuffer(valueStr, value, valueLength);
+		arrayAdd(d->names, nameStr);
+		arrayAdd(d->values, valueStr);
+		index_entry(d, table_length(d));
+
+		pos += n + m;
+	}
+
+	d->loadedLength += pos;
+	free(data);
+
+	if (d->writable == 1 && d->loadedLength < stat_buf.st_size) {
+		if (ftruncate(d->fd, d->loadedLength) < 0) {
+			d->writable = -1;
+		}
+	}
+}
+
+/*
+ * Only one process can add to a dictionary. The first time we need to add
+ * an entry we try to lock the file. If another process has it locked
+ * the encoder falls back to static table and literals.
+ */
+static int acquire_writer(HeaderDictionary *d) {
+	if (d->writable == 0) {
+		d->writable = -1;
+		if (d->fd >= 0 && flock(d->fd, LOCK_EX | LOCK_NB) == 0) {
+			d->writable = 1;
+			//Catch up with the last writer and drop a torn entry
+			load_entries(d);
+		}
+	}
+
+	return d->writable == 1;
+}
+
+/*
+ * Opens the dictionary in the persistence folder. Readers and the writer
+ * both use this. Entries are only appended by the process that holds
+ * the file lock.
+ */
+HeaderDictionary *newHeaderDictionary(const char *folder) {
+	HeaderDictionary *d = calloc(1, sizeof(HeaderDictionary));
+	char file_name[512];
+
+	snprintf(file_name, sizeof(file_name), "%s/%s", folder,
+		HEADER_DICTIONARY_FILE);
+
+	d->fd = open(file_name, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (d->fd < 0) {
+		//Read only folder perhaps
+		d->fd = open(file_name, O_RDONLY);
+		d->writable = -1;
+	}
+
+	d->names = newArray(64);
+	d->values = newArray(64);
+	//Keep load factor at or below 50%
+	d->slotCount = 1;
+	while (d->slotCount < 2 * (STATIC_TABLE_LENGTH + MAX_DICTIONARY_ENTRIES)) {
+		d->slotCount <<= 1;
+	}
+	d->fieldSlots = calloc(d->slotCount, sizeof(size_t));
+	d->nameSlots = calloc(d->slotCount, sizeof(size_t));
+	d->seenFields = calloc(SEEN_FIELD_SLOTS, sizeof(size_t));
+	pthread_mutex_init(&d->lock, NULL);
+
+	for (size_t i = 1; i <= STATIC_TABLE_LENGTH; ++i) {
+		index_entry(d, i);
+	}
+	load_entries(d);
+
+	return d;
+}
+
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The proxy and the persistence API share one dictionary per server.
+ * Whoever needs it first opens it.
+ */
+HeaderDictionary *headerDictionaryOpenOnce(HeaderDictionary **slot,
+	const char *folder) {
+	if (folder == NULL || folder[0] == '\0') {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&sharedLock);
+	if (*slot == NULL) {
+		*slot = newHeaderDictionary(folder);
+	}
+	pthread_mutex_unlock(&sharedLock);
+
+	return *slot;
+}
+
+void deleteHeaderDictionary(HeaderDictionary *d) {
+	for (size_t i = 0; i < d->names->length; ++i) {
+		deleteString(arrayGet(d->names, i));
+		deleteString(arrayGet(d->values, i));
+	}
+	deleteArray(d->names);
+	deleteArray(d->values);
+	free(d->fieldSlots);
+	free(d->nameSlots);
+	free(d->seenFields);
+	if (d->fd >= 0) {
+		close(d->fd);
+	}
+	pthread_mutex_destroy(&d->lock);
+
+	free(d);
+}
+
+/*
+ * Adds a new field to the dictionary. Returns the table index or 0
+ * if the field could not be added.
+ */
+static size_t add_entry(HeaderDictionary *d, const char *name, size_t nameLength,
+	const char *value, size_t valueLength) {
+	if (d->names->length >= MAX_DICTIONARY_ENTRIES ||
+		!acquire_writer(d)) {
+		return 0;
+	}
+
+	Buffer *entry = newBufferWithCapacity(nameLength + valueLength + 8);
+
+	encode_string(entry, name, nameLength);
+	encode_string(entry, value, valueLength);
+
+	//Single write so that a reader never sees a torn entry from us
+	ssize_t sz = write(d->fd, entry->buffer, entry->length);
+
+	if (sz != (ssize_t) entry->length) {
+		deleteBuffer(entry);
+		//Something is wrong with the file. Stop adding.
+		d->writable = -1;
+
+		return 0;
+	}
+
+	d->loadedLength += entry->length;
+	deleteBuffer(entry);
+
+	String *nameStr = newString();
+	String *valueStr = newString();
+
+	stringAppendBuffer(nameStr, name, nameLength);
+	stringAppendBuffer(valueStr, value, valueLength);
+	arrayAdd(d->names, nameStr);
+	arrayAdd(d->values, valueStr);
+	index_entry(d, table_length(d));
+
+	return table_length(d);
+}
+
+/*
+ * Returns 1 if the field was seen before. Otherwise remembers it and
+ * returns 0. Most values that are only ever sent once, like request IDs
+ * in headers we don't know, never make it into the dictionary. A slot
+ * holds one hash, so a field can be forgotten before it comes again.
+ */
+static int seen_before(HeaderDictionary *d, const char *name,
+	size_t nameLength, const char *value, size_t valueLength) {
+	size_t h = hash_field(name, nameLength, value, valueLength);
+	size_t *slot = d->seenFields + (h & (SEEN_FIELD_SLOTS - 1));
+
+	if (*slot == h) {
+		return 1;
+	}
+	*slot = h;
+
+	return 0;
+}
+
+static void encode_field(HeaderDictionary *d, Buffer *out,
+	const char *name, size_t nameLength,
+	const char *value, size_t valueLength) {
+	if (is_secret(name, nameLength)) {
+		append_byte(out, REP_LITERAL);
+		encode_string(out, name, nameLength);
+		encode_string(out, value, valueLength);
+
+		return;
+	}
+
+	size_t index = find_field(d, name, nameLength, value, valueLength);
+
+	if (index > 0) {
+		encode_int(out, 7, REP_INDEXED, index);
+
+		return;
+	}
+
+	int indexable = valueLength <= MAX_INDEXED_VALUE &&
+		!is_volatile(name, nameLength);
+
+	if (indexable && seen_before(d, name, nameLength, value, valueLength)) {
+		index = add_entry(d, name, nameLength, value, valueLength);
+		if (index > 0) {
+			encode_int(out, 7, REP_INDEXED, index);
+
+			return;
+		}
+	}
+
+	index = find_name(d, name, nameLength);
+	if (index == 0) {
+		//Store the name alone so that the next message can refer to it
+		index = add_entry(d, name, nameLength, "", 0);
+	}
+	if (index > 0) {
+		encode_int(out, 6, REP_INDEXED_NAME, index);
+		encode_string(out, value, valueLength);
+
+		return;
+	}
+
+	append_byte(out, REP_LITERAL);
+	encode_string(out, name, nameLength);
+	encode_string(out, value, valueLength);
+}
+
+int headerCodecIsEncoded(const char *data, size_t length) {
+	return length >= HEADER_CODEC_MAGIC_LENGTH &&
+		memcmp(data, HEADER_CODEC_MAGIC, HEADER_CODEC_MAGIC_LENGTH) == 0;
+}
+
+/*
+ * Encodes a complete header block (request or status line, header lines
+ * and the empty line) and appends the result to out. Returns -1 if the
+ * block can not be reproduced exactly from the encoded form. In that case
+ * nothing is appended and the caller should store the block as is.
+ */
+int headerCodecEncode(HeaderDictionary *d, const char *header, size_t length,
+	Buffer *out) {
+	//Every line must end with CRLF and the block with an empty line
+	if (length < 4 || memcmp(header + length - 4, "\r\n\r\n", 4) != 0) {
+		return -1;
+	}
+	for (size_t i = 0; i < length; ++i) {
+		if (header[i] == '\n' && (i == 0 || header[i - 1] != '\r')) {
+			return -1;
+		}
+		if (header[i] == '\r' && (i + 1 == length || header[i + 1] != '\n')) {
+			return -1;
+		}
+		if (header[i] == '\0') {
+			return -1;
+		}
+	}
+
+	const char *lineEnd = memchr(header, '\r', length);
+	size_t firstLineLength = lineEnd - header;
+	size_t headerCount = 0;
+
+	for (size_t i = firstLineLength + 2; i < length - 2; ++i) {
+		if (header[i] == '\n') {
+			++headerCount;
+		}
+	}
+	if (headerCount > MAX_HEADER_LINES) {
+		return -1;
+	}
+
+	size_t start = out->length;
+
+	bufferAppendBytes(out, HEADER_CODEC_MAGIC, HEADER_CODEC_MAGIC_LENGTH);
+	encode_string(out, header, firstLineLength);
+	encode_int(out, 8, 0, headerCount);
+
+	pthread_mutex_lock(&d->lock);
+
+	size_t pos = firstLineLength + 2;
+
+	while (pos < length - 2) {
+		const char *line = header + pos;
+		size_t lineLength = (const char*) memchr(line, '\r', length - pos) - line;
+		const char *colon = memchr(line, ':', lineLength);
+
+		pos += lineLength + 2;
+
+		/*
+		 * We store value after skipping exactly one space. Anything
+		 * else can not be reproduced so store the line raw.
+		 */
+		if (colon == NULL || colon == line ||
+			(size_t) (colon - line) + 1 >= lineLength ||
+			colon[1] != ' ') {
+			append_byte(out, REP_RAW_LINE);
+			encode_string(out, line, lineLength);
+
+			continue;
+		}
+
+		size_t nameLength = colon - line;
+		const char *value = colon + 2;
+		size_t valueLength = lineLength - nameLength - 2;
+
+		encode_field(d, out, line, nameLength, value, valueLength);
+	}
+
+	pthread_mutex_unlock(&d->lock);
+
+	if (out->length - start >= length) {
+		//No gain. Keep the original.
+		out->length = start;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Decodes an encoded header block. The header text is appended to text in
+ * the original wire format. If names and values are not NULL the parsed
+ * header fields are also added to them. On success consumed is set to
+ * the length of the encoded block so that the body follows at that offset.
+ */
+int headerCodecDecode(HeaderDictionary *d, const char *data, size_t length,
+	Buffer *text, Array *names, Array *values, size_t *consumed) {
+	if (!headerCodecIsEncoded(data, length)) {
+		return -1;
+	}
+
+	const unsigned char *in = (const unsigned char*) data;
+	size_t pos = HEADER_CODEC_MAGIC_LENGTH;
+	const char *str;
+	size_t strLength, count, n;
+
+	n = decode_string(in + pos, length - pos, &str, &strLength);
+	if (n == 0) {
+		return -1;
+	}
+	pos += n;
+	bufferAppendBytes(text, str, strLength);
+	bufferAppendBytes(text, "\r\n", 2);
+
+	n = decode_int(in + pos, length - pos, 8, &count);
+	if (n == 0) {
+		return -1;
+	}
+	pos += n;
+
+	pthread_mutex_lock(&d->lock);
+
+	int status = 0;
+
+	for (size_t i = 0; i < count && status == 0; ++i) {
+		const char *name = NULL, *value = NULL;
+		size_t nameLength = 0, valueLength = 0, index = 0;
+
+		if (pos >= length) {
+			status = -1;
+			break;
+		}
+
+		unsigned char rep = in[pos];
+
+		if (rep & REP_INDEXED) {
+			n = decode_int(in + pos, length - pos, 7, &index);
+		} else if (rep & REP_INDEXED_NAME) {
+			n = decode_int(in + pos, length - pos, 6, &index);
+		} else if (rep == REP_LITERAL || rep == REP_RAW_LINE) {
+			n = 1;
+		} else {
+			n = 0;
+		}
+		pos += n;
+
+		if ((rep & (REP_INDEXED | REP_INDEXED_NAME)) && index == 0) {
+			status = -1;
+			break;
+		}
+
+		if (index > table_length(d)) {
+			//Another process may have added to the dictionary
+			load_entries(d);
+		}
+		if (n == 0 || index > table_length(d)) {
+			status = -1;
+			break;
+		}
+
+		if (rep == REP_RAW_LINE) {
+			n = decode_string(in + pos, length - pos, &str, &strLength);
+			if (n == 0) {
+				status = -1;
+				break;
+			}
+			pos += n;
+			bufferAppendBytes(text, str, strLength);
+			bufferAppendBytes(text, "\r\n", 2);
+
+			continue;
+		}
+
+		if (rep & REP_INDEXED) {
+			get_entry(d, index, &name, &nameLength, &value, &valueLength);
+		} else {
+			if (rep & REP_INDEXED_NAME) {
+				get_entry(d, index, &name, &nameLength, &str, &strLength);
+			} else {
+				n = decode_string(in + pos, length - pos,
+					&name, &nameLength);
+				pos += n;
+				if (n == 0) {
+					status = -1;
+					break;
+				}
+			}
+			n = decode_string(in + pos, length - pos,
+				&value, &valueLength);
+			pos += n;
+			if (n == 0) {
+				status = -1;
+				break;
+			}
+		}
+
+		bufferAppendBytes(text, name, nameLength);
+		bufferAppendBytes(text, ": ", 2);
+		bufferAppendBytes(text, value, valueLength);
+		bufferAppendBytes(text, "\r\n", 2);
+
+		if (names != NULL && values != NULL) {
+			String *nameStr = newString();
+			String *valueStr = newString();
+
+			stringAppendBuffer(nameStr, name, nameLength);
+			stringAppendBuffer(valueStr, value, valueLength);
+			arrayAdd(names, nameStr);
+			arrayAdd(values, valueStr);
+		}
+	}
+
+	pthread_mutex_unlock(&d->lock);
+
+	if (status < 0) {
+		return status;
+	}
+
+	bufferAppendBytes(text, "\r\n", 2);
+	*consumed = pos;
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Compact storage of HTTP header blocks in the capture files.
+ *
+ * A header block is stored as a list of references into a table of
+ * header fields. The table starts with a fixed static part of very common
+ * fields followed by a dictionary that is shared by all records in the
+ * persistence folder. The dictionary lives in an append only file and
+ * an entry never changes its index once written.
+ *
+ * Encoded block layout:
+ *   magic (5 bytes) first-line-length first-line header-count header...
+ * Each header is one of:
+ *   1xxxxxxx                     Name and value from table at index x.
+ *   01xxxxxx length value        Name from table at index x, literal value.
+ *   00000000 length name length value  Literal name and value.
+ *   00000001 length line         Raw header line stored as is.
+ * All integers use HPACK style prefix encoding.
+ */
+#define HEADER_CODEC_MAGIC "\0PXH1"
+#define HEADER_CODEC_MAGIC_LENGTH 5
+#define HEADER_DICTIONARY_FILE "headers.dict"
+
+typedef struct _HeaderDictionary {
+	int fd;
+	int writable; //1 if we own the file, -1 if we can't write, 0 unknown
+	off_t loadedLength; //How much of the file has been loaded
+	Array *names;
+	Array *values;
+	//Open addressing hash tables of table indices. 0 means empty.
+	size_t *fieldSlots;
+	size_t *nameSlots;
+	size_t slotCount;
+	//Hashes of fields seen once but not added yet. A field is only added
+	//to the dictionary when it comes again.
+	size_t *seenFields;
+	pthread_mutex_t lock;
+} HeaderDictionary;
+
+HeaderDictionary *newHeaderDictionary(const char *folder);
+HeaderDictionary *headerDictionaryOpenOnce(HeaderDictionary **slot,
+	const char *folder);
+void deleteHeaderDictionary(HeaderDictionary *d);
+int headerCodecIsEncoded(const char *data, size_t length);
+int headerCodecEncode(HeaderDictionary *d, const char *header, size_t length,
+	Buffer *out);
+int headerCodecDecode(HeaderDictionary *d, const char *data, size_t length,
+	Buffer *text, Array *names, Array *values, size_t *consumed);
@@ -0,0 +1,160 @@
+/*
+ * Generated by genheadernames.py. Do not edit.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "HeaderNames.h"
+
+#define HASH_SEED 92u
+#define TABLE_SIZE 512
+
+static const char *names[HEADER_NAME_COUNT] = {
+	NULL,
+	"Accept",
+	"Accept-Charset",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Accept-Ranges",
+	"Access-Control-Allow-Credentials",
+	"Access-Control-Allow-Headers",
+	"Access-Control-Allow-Methods",
+	"Access-Control-Allow-Origin",
+	"Access-Control-Expose-Headers",
+	"Access-Control-Max-Age",
+	"Access-Control-Request-Headers",
+	"Access-Control-Request-Method",
+	"Age",
+	"Allow",
+	"Authorization",
+	"Cache-Control",
+	"Connection",
+	"Content-Disposition",
+	"Content-Encoding",
+	"Content-Language",
+	"Content-Length",
+	"Content-Location",
+	"Content-Range",
+	"Content-Security-Policy",
+	"Content-Type",
+	"Cookie",
+	"Date",
+	"DNT",
+	"ETag",
+	"Expect",
+	"Expires",
+	"Forwarded",
+	"From",
+	"Host",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Keep-Alive",
+	"Last-Modified",
+	"Link",
+	"Location",
+	"Max-Forwards",
+	"Origin",
+	"Pragma",
+	"Proxy-Authenticate",
+	"Proxy-Authorization",
+	"Proxy-Connection",
+	"Range",
+	"Referer",
+	"Referrer-Policy",
+	"Retry-After",
+	"Server",
+	"Set-Cookie",
+	"Strict-Transport-Security",
+	"TE",
+	"Trailer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"Upgrade-Insecure-Requests",
+	"User-Agent",
+	"Vary",
+	"Via",
+	"Warning",
+	"WWW-Authenticate",
+	"X-Content-Type-Options",
+	"X-Forwarded-For",
+	"X-Forwarded-Host",
+	"X-Forwarded-Proto",
+	"X-Frame-Options",
+	"X-Powered-By",
+	"X-Request-Id",
+	"X-Requested-With",
+	"X-XSS-Protection",
+};
+
+static const unsigned char lengths[HEADER_NAME_COUNT] = {
+	0, 6, 14, 15, 15, 13, 32, 28, 28, 27, 29, 22, 30, 29, 3, 5,
+	13, 13, 10, 19, 16, 16, 14, 16, 13, 23, 12, 6, 4, 3, 4, 6,
+	7, 9, 4, 4, 8, 17, 13, 8, 19, 10, 13, 4, 8, 12, 6, 6,
+	18, 19, 16, 5, 7, 15, 11, 6, 10, 25, 2, 7, 17, 7, 25, 10,
+	4, 3, 7, 16, 22, 15, 16, 17, 15, 12, 12, 16, 16,
+};
+
+//ID by hash slot
+static const unsigned char slots[TABLE_SIZE] = {
+	0, 0, 0, 43, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 67, 0, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 63, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 51, 24, 0, 64, 0, 53, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 58, 0, 0, 0, 13, 0, 0, 0, 0, 0, 20,
+	0, 0, 0, 0, 0, 0, 0, 44, 0, 0, 0, 0, 0, 0, 0, 54,
+	0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 73, 0, 0, 0, 0, 0,
+	0, 0, 68, 0, 0, 0, 60, 23, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 16, 0, 0, 9, 0, 0, 0, 22, 75, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 40, 1, 0, 0,
+	0, 0, 0, 0, 0, 0, 39, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	37, 0, 0, 0, 49, 0, 0, 0, 0, 0, 0, 0, 0, 0, 15, 0,
+	0, 0, 0, 0, 0, 50, 0, 0, 0, 0, 0, 0, 6, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 8, 0, 0, 30, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	70, 0, 66, 29, 0, 0, 0, 0, 17, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 45, 0, 76, 11, 48, 0, 0, 36, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 74, 0, 0, 0, 0, 0, 0, 27, 47, 35, 0, 0, 41, 0, 0,
+	0, 0, 0, 0, 52, 25, 0, 0, 0, 0, 0, 69, 0, 0, 0, 0,
+	62, 0, 0, 0, 0, 12, 0, 3, 4, 0, 14, 0, 0, 0, 0, 0,
+	0, 31, 0, 0, 0, 0, 28, 0, 32, 0, 0, 0, 0, 0, 0, 0,
+	46, 0, 0, 0, 0, 0, 0, 19, 0, 65, 0, 0, 0, 0, 0, 0,
+	26, 0, 0, 0, 0, 34, 0, 0, 0, 55, 0, 0, 0, 0, 0, 2,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 33, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 71, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 18, 0, 0, 0, 0, 0, 0, 56, 0, 0, 42, 0, 0, 0,
+	0, 38, 59, 0, 0, 0, 0, 0, 0, 5, 0, 0, 0, 21, 0, 0,
+	57, 0, 72, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 61, 0, 0,
+};
+
+/*
+ * Returns the ID of a header name or HEADER_UNKNOWN.
+ */
+int headerNameLookup(const char *name, size_t length) {
+	uint32_t h = HASH_SEED;
+
+	for (size_t i = 0; i < length; ++i) {
+		h = (h ^ ((unsigned char) name[i] | 0x20)) * 16777619u;
+	}
+	h ^= h >> 16;
+
+	int id = slots[h % TABLE_SIZE];
+
+	if (id != HEADER_UNKNOWN && lengths[id] == length &&
+		strncasecmp(names[id], name, length) == 0) {
+		return id;
+	}
+
+	return HEADER_UNKNOWN;
+}
+
+const char *headerNameString(int id) {
+	return id > HEADER_UNKNOWN && id < HEADER_NAME_COUNT ? names[id] : NULL;
+}
@@ -0,0 +1,90 @@
+/*
+ * Generated by genheadernames.py. Do not edit.
+ *
+ * Well known header names have a small ID. Names are looked up
+ * ignoring case with a perfect hash. Other names are
+ * HEADER_UNKNOWN and have to be compared by text.
+ */
+typedef enum _HeaderNameId {
+	HEADER_UNKNOWN = 0,
+	HEADER_ACCEPT,
+	HEADER_ACCEPT_CHARSET,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_ACCEPT_LANGUAGE,
+	HEADER_ACCEPT_RANGES,
+	HEADER_ACCESS_CONTROL_ALLOW_CREDENTIALS,
+	HEADER_ACCESS_CONTROL_ALLOW_HEADERS,
+	HEADER_ACCESS_CONTROL_ALLOW_METHODS,
+	HEADER_ACCESS_CONTROL_ALLOW_ORIGIN,
+	HEADER_ACCESS_CONTROL_EXPOSE_HEADERS,
+	HEADER_ACCESS_CONTROL_MAX_AGE,
+	HEADER_ACCESS_CONTROL_REQUEST_HEADERS,
+	HEADER_ACCESS_CONTROL_REQUEST_METHOD,
+	HEADER_AGE,
+	HEADER_ALLOW,
+	HEADER_AUTHORIZATION,
+	HEADER_CACHE_CONTROL,
+	HEADER_CONNECTION,
+	HEADER_CONTENT_DISPOSITION,
+	HEADER_CONTENT_ENCODING,
+	HEADER_CONTENT_LANGUAGE,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_LOCATION,
+	HEADER_CONTENT_RANGE,
+	HEADER_CONTENT_SECURITY_POLICY,
+	HEADER_CONTENT_TYPE,
+	HEADER_COOKIE,
+	HEADER_DATE,
+	HEADER_DNT,
+	HEADER_ETAG,
+	HEADER_EXPECT,
+	HEADER_EXPIRES,
+	HEADER_FORWARDED,
+	HEADER_FROM,
+	HEADER_HOST,
+	HEADER_IF_MATCH,
+	HEADER_IF_MODIFIED_SINCE,
+	HEADER_IF_NONE_MATCH,
+	HEADER_IF_RANGE,
+	HEADER_IF_UNMODIFIED_SINCE,
+	HEADER_KEEP_ALIVE,
+	HEADER_LAST_MODIFIED,
+	HEADER_LINK,
+	HEADER_LOCATION,
+	HEADER_MAX_FORWARDS,
+	HEADER_ORIGIN,
+	HEADER_PRAGMA,
+	HEADER_PROXY_AUTHENTICATE,
+	HEADER_PROXY_AUTHORIZATION,
+	HEADER_PROXY_CONNECTION,
+	HEADER_RANGE,
+	HEADER_REFERER,
+	HEADER_REFERRER_POLICY,
+	HEADER_RETRY_AFTER,
+	HEADER_SERVER,
+	HEADER_SET_COOKIE,
+	HEADER_STRICT_TRANSPORT_SECURITY,
+	HEADER_TE,
+	HEADER_TRAILER,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_UPGRADE,
+	HEADER_UPGRADE_INSECURE_REQUESTS,
+	HEADER_USER_AGENT,
+	HEADER_VARY,
+	HEADER_VIA,
+	HEADER_WARNING,
+	HEADER_WWW_AUTHENTICATE,
+	HEADER_X_CONTENT_TYPE_OPTIONS,
+	HEADER_X_FORWARDED_FOR,
+	HEADER_X_FORWARDED_HOST,
+	HEADER_X_FORWARDED_PROTO,
+	HEADER_X_FRAME_OPTIONS,
+	HEADER_X_POWERED_BY,
+	HEADER_X_REQUEST_ID,
+	HEADER_X_REQUESTED_WITH,
+	HEADER_X_XSS_PROTECTION,
+	HEADER_NAME_COUNT
+} HeaderNameId;
+
+int headerNameLookup(const char *name, size_t length);
+const char *headerNameString(int id);
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "Proxy.h"
+#include "Persistence.h"
+#include "Ring.h"
+#include "HistoryFeed.h"
+
+#define META_EXT ".meta"
+//How often the ring and, without inotify, the folder are checked
+#define POLL_INTERVAL 250
+
+typedef struct _FeedRecord {
+	char uniqueId[64];
+	long long metaTime;
+} FeedRecord;
+
+typedef struct _RingBegin {
+	uint64_t record;
+	uint64_t position;
+	char uniqueId[64];
+} RingBegin;
+
+struct _HistoryFeed {
+	ProxyServer *p;
+	HistoryCursor cursor;
+	int inotifyFd;
+	int needsScan;
+	//Records found by the last scan. Events for them may still be queued.
+	char (*scanned)[64];
+	size_t scannedCount;
+	Ring *ring;
+	int ownsRing;
+	uint64_t ringPosition;
+	uint64_t ringSequence;
+	//Records in the ring that have begun but not ended yet
+	RingBegin *begins;
+	size_t beginCount;
+	size_t beginCapacity;
+	RequestRecord *req;
+	ResponseRecord *res;
+};
+
+static long long meta_time(struct stat *stat_buf) {
+#ifdef __APPLE__
+	return stat_buf->st_mtimespec.tv_sec * 1000000000LL +
+		stat_buf->st_mtimespec.tv_nsec;
+#else
+	return stat_buf->st_mtim.tv_sec * 1000000000LL + stat_buf->st_mtim.tv_nsec;
+#endif
+}
+
+static int compare_feed_records(const void *a, const void *b) {
+	const FeedRecord *r1 = a, *r2 = b;
+
+	if (r1->metaTime != r2->metaTime) {
+		return r1->metaTime < r2->metaTime ? -1 : 1;
+	}
+
+	return strcmp(r1->uniqueId, r2->uniqueId);
+}
+
+static int compare_ids(const void *a, const void *b) {
+	return strcmp(a, b);
+}
+
+/*
+ * Is the record after the cursor?
+ */
+static int is_new(HistoryCursor *cursor, long long metaTime,
+	const char *uniqueId) {
+	if (metaTime != cursor->metaTime) {
+		return metaTime > cursor->metaTime;
+	}
+
+	return strcmp(uniqueId, cursor->uniqueId) > 0;
+}
+
+static void advance_cursor(HistoryCursor *cursor, long long metaTime,
+	const char *uniqueId) {
+	if (is_new(cursor, metaTime, uniqueId)) {
+		cursor->metaTime = metaTime;
+		snprintf(cursor->uniqueId, sizeof(cursor->uniqueId), "%s", uniqueId);
+	}
+}
+
+static int deliver_meta(HistoryFeed *feed, const char *uniqueId,
+	long long metaTime, void *contextData, HistoryFeedCallback callback) {
+	//Meta files are empty until the record is complete
+	if (proxyServerLoadMeta(feed->p, uniqueId, feed->req, feed->res) != 0) {
+		return 0;
+	}
+
+	callback(contextData, uniqueId, feed->req, feed->res);
+	advance_cursor(&feed->cursor, metaTime, uniqueId);
+
+	return 1;
+}
+
+/*
+ * Delivers records in the folder that are newer than the cursor, oldest
+ * first. Used to catch up when the feed starts and when inotify is not
+ * available.
+ */
+static int scan_folder(HistoryFeed *feed, void *contextData,
+	HistoryFeedCallback callback) {
+	const char *folder = stringAsCString(feed->p->persistenceFolder);
+	DIR *dir = opendir(folder);
+
+	if (dir == NULL) {
+		return 0;
+	}
+
+	size_t capacity = 64, length = 0;
+	size_t extLen = strlen(META_EXT);
+	FeedRecord *records = malloc(capacity * sizeof(FeedRecord));
+	struct dirent *ent;
+	struct stat stat_buf;
+
+	while ((ent = readdir(dir)) != NULL) {
+		size_t name_len = strlen(ent->d_name);
+
+		if (name_len <= extLen || name_len - extLen >= sizeof(records->uniqueId) ||
+			strcmp(ent->d_name + name_len - extLen, META_EXT) != 0) {
+			continue;
+		}
+		if (fstatat(dirfd(dir), ent->d_name, &stat_buf, 0) < 0 ||
+			stat_buf.st_size == 0) {
+			continue;
+		}
+
+		FeedRecord rec;
+
+		memset(&rec, 0, sizeof(rec));
+		memcpy(rec.uniqueId, ent->d_name, name_len - extLen);
+		rec.metaTime = meta_time(&stat_buf);
+		if (!is_new(&feed->cursor, rec.metaTime, rec.uniqueId)) {
+			continue;
+		}
+		if (length == capacity) {
+			capacity *= 2;
+			records = realloc(records, capacity * sizeof(FeedRecord));
+		}
+		records[length++] = rec;
+	}
+	closedir(dir);
+
+	qsort(records, length, sizeof(FeedRecord), compare_feed_records);
+
+	int count = 0;
+
+	for (size_t i = 0; i < length; ++i) {
+		count += deliver_meta(feed, records[i].uniqueId, records[i].metaTime,
+			contextData, callback);
+	}
+
+	//Remember what was delivered so that queued events can be ignored
+	if (feed->inotifyFd >= 0) {
+		free(feed->scanned);
+		feed->scanned = malloc((length + 1) * sizeof(*feed->scanned));
+		for (size_t i = 0; i < length; ++i) {
+			memcpy(feed->scanned[i], records[i].uniqueId,
+				sizeof(records[i].uniqueId));
+		}
+		feed->scannedCount = length;
+		qsort(feed->scanned, length, sizeof(*feed->scanned), compare_ids);
+	}
+
+	free(records);
+
+	return count;
+}
+
+#ifdef __linux__
+static int was_scanned(HistoryFeed *feed, const char *uniqueId) {
+	return feed->scannedCount > 0 &&
+		bsearch(uniqueId, feed->scanned, feed->scannedCount,
+			sizeof(*feed->scanned), compare_ids) != NULL;
+}
+
+/*
+ * Delivers the records whose meta file was written or moved into place.
+ * Events come in the order the meta files were completed.
+ */
+static int read_events(HistoryFeed *feed, void *contextData,
+	HistoryFeedCallback callback) {
+	char buffer[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const char *folder = stringAsCString(feed->p->persistenceFolder);
+	size_t extLen = strlen(META_EXT);
+	int count = 0;
+
+	while (1) {
+		ssize_t sz = read(feed->inotifyFd, buffer, sizeof(buffer));
+
+		if (sz <= 0) {
+			break;
+		}
+
+		for (char *ptr = buffer; ptr < buffer + sz; ) {
+			struct inotify_event *event = (struct inotify_event*) ptr;
+
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				//Lost events. Fall back to a scan.
+				feed->needsScan = 1;
+				continue;
+			}
+
+			size_t name_len = event->len > 0 ? strlen(event->name) : 0;
+			char uniqueId[64];
+
+			if (name_len <= extLen || name_len - extLen >= sizeof(uniqueId) ||
+				strcmp(event->name + name_len - extLen, META_EXT) != 0) {
+				continue;
+			}
+			memcpy(uniqueId, event->name, name_len - extLen);
+			uniqueId[name_len - extLen] = '\0';
+
+			if (was_scanned(feed, uniqueId)) {
+				continue;
+			}
+
+			char file_name[512];
+			struct stat stat_buf;
+
+			snprintf(file_name, sizeof(file_name), "%s/%s",
+				folder, event->name);
+			if (stat(file_name, &stat_buf) < 0) {
+				continue; //Already removed
+			}
+			count += deliver_meta(feed, uniqueId, meta_time(&stat_buf),
+				contextData, callback);
+		}
+	}
+
+	//Anything queued before the scan has been seen now
+	feed->scannedCount = 0;
+
+	return count;
+}
+#endif
+
+static void add_ring_begin(HistoryFeed *feed, uint64_t record,
+	uint64_t position, const char *uniqueId, size_t length) {
+	if (length >= sizeof(feed->begins->uniqueId)) {
+		return;
+	}
+	if (feed->beginCount == feed->beginCapacity) {
+		feed->beginCapacity = feed->beginCapacity == 0 ?
+			64 : feed->beginCapacity * 2;
+		feed->begins = realloc(feed->begins,
+			feed->beginCapacity * sizeof(RingBegin));
+	}
+
+	RingBegin *begin = feed->begins + feed->beginCount++;
+
+	begin->record = record;
+	begin->position = position;
+	memcpy(begin->uniqueId, uniqueId, length);
+	begin->uniqueId[length] = '\0';
+}
+
+static RingBegin *find_ring_begin(HistoryFeed *feed, uint64_t record) {
+	for (size_t i = feed->beginCount; i > 0; --i) {
+		if (feed->begins[i - 1].record == record) {
+			return feed->begins + i - 1;
+		}
+	}
+
+	return NULL;
+}
+
+typedef struct _RingFeed {
+	HistoryFeed *feed;
+	void *contextData;
+	HistoryFeedCallback callback;
+	int count;
+} RingFeed;
+
+static void remove_ring_begin(HistoryFeed *feed, RingBegin *begin) {
+	*begin = feed->begins[--feed->beginCount];
+}
+
+/*
+ * Meta fragments are written in the order records end. The cursor keeps
+ * the sequence of the last one delivered.
+ */
+static int ring_feed_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	RingFeed *rf = context;
+	HistoryFeed *feed = rf->feed;
+
+	if (f->kind == RING_BEGIN) {
+		add_ring_begin(feed, f->record, position, payload, f->length);
+
+		return 0;
+	}
+	if (f->kind != RING_META) {
+		return 0;
+	}
+
+	RingBegin *begin = find_ring_begin(feed, f->record);
+
+	if (begin == NULL) {
+		return 0; //Began before the feed could see it
+	}
+	if (f->sequence > feed->cursor.ringSequence &&
+		proxyServerLoadMetaBuffer(feed->p, payload, f->length,
+			feed->req, feed->res) == 0 &&
+		ringIsValid(feed->ring, begin->position)) {
+		rf->callback(rf->contextData, begin->uniqueId, feed->req, feed->res);
+		++rf->count;
+		feed->cursor.ringSequence = f->sequence;
+	}
+	remove_ring_begin(feed, begin);
+
+	return 0;
+}
+
+/*
+ * Delivers records that ended in the ring since the last call. Only the
+ * new part of the ring is walked.
+ */
+static int read_ring(HistoryFeed *feed, void *contextData,
+	HistoryFeedCallback callback) {
+	if (feed->ring == NULL) {
+		if (feed->p->ring != NULL) {
+			feed->ring = feed->p->ring;
+		} else {
+			char file_name[512];
+
+			snprintf(file_name, sizeof(file_name), "%s/%s",
+				stringAsCString(feed->p->persistenceFolder), RING_FILE);
+			feed->ring = openRing(file_name);
+			feed->ownsRing = feed->ring != NULL;
+		}
+		if (feed->ring == NULL) {
+			return 0;
+		}
+	}
+
+	RingFeed rf;
+
+	rf.feed = feed;
+	rf.contextData = contextData;
+	rf.callback = callback;
+	rf.count = 0;
+
+	ringWalkFrom(feed->ring, &feed->ringPosition, &feed->ringSequence,
+		&rf, ring_feed_callback);
+
+	//Forget records that were overwritten before they ended
+	for (size_t i = feed->beginCount; i > 0; --i) {
+		if (!ringIsValid(feed->ring, feed->begins[i - 1].position)) {
+			remove_ring_begin(feed, feed->begins + i - 1);
+		}
+	}
+
+	return rf.count;
+}
+
+/*
+ * Starts a feed for the persistence folder of the server. Pass NULL as
+ * the cursor to get every record already in the folder.
+ */
+HistoryFeed *newHistoryFeed(ProxyServer *p, const HistoryCursor *cursor) {
+	HistoryFeed *feed = calloc(1, sizeof(HistoryFeed));
+
+	feed->p = p;
+	feed->inotifyFd = -1;
+	feed->needsScan = 1;
+	if (cursor != NULL) {
+		feed->cursor = *cursor;
+	}
+	feed->req = newRequestRecord();
+	feed->res = newResponseRecord();
+
+#ifdef __linux__
+	feed->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (feed->inotifyFd >= 0 &&
+		inotify_add_watch(feed->inotifyFd,
+			stringAsCString(p->persistenceFolder),
+			IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(feed->inotifyFd);
+		feed->inotifyFd = -1;
+	}
+#endif
+
+	return feed;
+}
+
+void deleteHistoryFeed(HistoryFeed *feed) {
+	if (feed->inotifyFd >= 0) {
+		close(feed->inotifyFd);
+	}
+	if (feed->ring != NULL && feed->ownsRing) {
+		deleteRing(feed->ring);
+	}
+	free(feed->scanned);
+	free(feed->begins);
+	deleteRequestRecord(feed->req);
+	deleteResponseRecord(feed->res);
+
+	free(feed);
+}
+
+/*
+ * Returns a descriptor that becomes readable when new meta files show up
+ * so that a feed can be driven from an event loop. Returns -1 if the
+ * feed has to poll.
+ */
+int historyFeedGetFd(HistoryFeed *feed) {
+	return feed->inotifyFd;
+}
+
+/*
+ * Waits up to timeoutMs for new records and delivers them to the callback
+ * on the calling thread. Does not wait if there is anything to deliver
+ * right away. Returns the number of records delivered.
+ */
+int historyFeedWait(HistoryFeed *feed, int timeoutMs, void *contextData,
+	HistoryFeedCallback callback) {
+	int count = 0;
+
+	if (feed->needsScan) {
+		feed->needsScan = 0;
+		count += scan_folder(feed, contextData, callback);
+	}
+	count += read_ring(feed, contextData, callback);
+
+	if (count > 0) {
+		timeoutMs = 0;
+	}
+
+	//The ring is memory mapped and gives no events
+	int pollMs = timeoutMs;
+
+	if (pollMs < 0 || pollMs > POLL_INTERVAL) {
+		pollMs = feed->ring != NULL || feed->inotifyFd < 0 ?
+			POLL_INTERVAL : timeoutMs;
+	}
+
+	struct pollfd pfd;
+
+	pfd.fd = feed->inotifyFd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	poll(feed->inotifyFd >= 0 ? &pfd : NULL, feed->inotifyFd >= 0 ? 1 : 0,
+		pollMs);
+
+#ifdef __linux__
+	if (feed->inotifyFd >= 0) {
+		count += read_events(feed, contextData, callback);
+	}
+#endif
+	if (feed->inotifyFd < 0 || feed->needsScan) {
+		feed->needsScan = 0;
+		count += scan_folder(feed, contextData, callback);
+	}
+	count += read_ring(feed, contextData, callback);
+
+	return count;
+}
+
+void historyFeedGetCursor(HistoryFeed *feed, HistoryCursor *cursor) {
+	*cursor = feed->cursor;
+}
@@ -0,0 +1,25 @@
+/*
+ * Delivers records as they complete, from this or any other process that
+ * captures to the same folder. New meta files are found with inotify where
+ * available. Otherwise, and for the flight recorder ring, the feed polls.
+ *
+ * A cursor records how far a feed got. A reader can save it and start a
+ * new feed from it later to receive only what it has not seen yet.
+ */
+typedef struct _HistoryCursor {
+	long long metaTime; //Modification time of the last meta file in ns
+	char uniqueId[64]; //Of the last record from the folder
+	unsigned long long ringSequence; //Of the last meta fragment from the ring
+} HistoryCursor;
+
+typedef void (*HistoryFeedCallback)(void *contextData, const char *uniqueId,
+	RequestRecord *req, ResponseRecord *res);
+
+typedef struct _HistoryFeed HistoryFeed;
+
+HistoryFeed *newHistoryFeed(ProxyServer *p, const HistoryCursor *cursor);
+void deleteHistoryFeed(HistoryFeed *feed);
+int historyFeedGetFd(HistoryFeed *feed);
+int historyFeedWait(HistoryFeed *feed, int timeoutMs, void *contextData,
+	HistoryFeedCallback callback);
+void historyFeedGetCursor(HistoryFeed *feed, HistoryCursor *cursor);
@@ -0,0 +1,856 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include "Proxy.h"
+#include "Persistence.h"
+#include "HistoryFeed.h"
+#include "Index.h"
+#include "BodyCodec.h"
+#include "SavedState.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+#define INDEX_MAGIC "PXIDX1"
+#define LOCK_FILE "capture.index.lock"
+#define MAX_TOKEN 64
+#define MAX_QUERY_TERMS 32
+//Only the start of large decoded bodies is indexed
+#define MAX_INDEXED_BODY (1024 * 1024)
+//Save after this many changes
+#define SAVE_EVERY 4096
+#define FEED_WAIT 250
+
+/*
+ * A posting list holds the IDs of the documents that contain a term in
+ * increasing order. IDs are stored as varint encoded deltas.
+ */
+typedef struct _Term {
+	char *text; //NULL if the slot is empty
+	uint32_t length;
+	uint32_t count;
+	uint32_t lastDoc; //Document ID + 1 of the last posting
+	uint8_t *postings;
+	size_t postingLength;
+	size_t postingCapacity;
+} Term;
+
+typedef struct _Document {
+	char uniqueId[64];
+	int removed;
+} Document;
+
+typedef struct _Index {
+	pthread_t threadId;
+	pthread_rwlock_t lock;
+	int stopRequested;
+	HistoryCursor cursor;
+
+	Document *docs;
+	uint32_t docCount;
+	uint32_t docCapacity;
+	uint32_t *docSlots; //Document ID + 1 by unique ID hash
+	size_t docSlotCount;
+
+	Term *terms;
+	size_t termSlotCount;
+	size_t termCount;
+
+	unsigned long removedCount;
+	unsigned long long postingBytes;
+	SavedState saved;
+
+	RequestRecord *req;
+	ResponseRecord *res;
+	Buffer *reqBody; //Decoded bodies
+	Buffer *resBody;
+} Index;
+
+static void put_varint(Term *t, uint32_t value) {
+	if (t->postingLength + 5 > t->postingCapacity) {
+		t->postingCapacity = t->postingCapacity == 0 ?
+			8 : t->postingCapacity * 2;
+		t->postings = realloc(t->postings, t->postingCapacity);
+	}
+	while (value >= 0x80) {
+		t->postings[t->postingLength++] = (uint8_t) (value | 0x80);
+		value >>= 7;
+	}
+	t->postings[t->postingLength++] = (uint8_t) value;
+}
+
+static size_t get_varint(const uint8_t *data, size_t length, size_t pos,
+	uint32_t *value) {
+	uint32_t result = 0;
+	int shift = 0;
+
+	while (pos < length && shift < 35) {
+		uint8_t b = data[pos++];
+
+		result |= (uint32_t) (b & 0x7F) << shift;
+		if ((b & 0x80) == 0) {
+			break;
+		}
+		shift += 7;
+	}
+	*value = result;
+
+	return pos;
+}
+
+/*
+ * Decodes the posting list of a term into document IDs.
+ */
+static uint32_t *decode_postings(Term *t) {
+	uint32_t *docs = malloc((t->count + 1) * sizeof(uint32_t));
+	uint32_t current = 0, delta;
+	size_t pos = 0;
+
+	for (uint32_t i = 0; i < t->count; ++i) {
+		pos = get_varint(t->postings, t->postingLength, pos, &delta);
+		current += delta;
+		docs[i] = current - 1;
+	}
+
+	return docs;
+}
+
+static Term *find_term_slot(Term *slots, size_t slotCount, const char *text,
+	size_t length) {
+	size_t i = savedHash(text, length) & (slotCount - 1);
+
+	while (slots[i].text != NULL) {
+		if (slots[i].length == length &&
+			memcmp(slots[i].text, text, length) == 0) {
+			break;
+		}
+		i = (i + 1) & (slotCount - 1);
+	}
+
+	return slots + i;
+}
+
+static void grow_terms(Index *index) {
+	size_t slotCount = index->termSlotCount == 0 ?
+		4096 : index->termSlotCount * 2;
+	Term *slots = calloc(slotCount, sizeof(Term));
+
+	for (size_t i = 0; i < index->termSlotCount; ++i) {
+		Term *t = index->terms + i;
+
+		if (t->text != NULL) {
+			*find_term_slot(slots, slotCount, t->text, t->length) = *t;
+		}
+	}
+	free(index->terms);
+	index->terms = slots;
+	index->termSlotCount = slotCount;
+}
+
+static Term *get_term(Index *index, const char *text, size_t length) {
+	if ((index->termCount + 1) * 2 > index->termSlotCount) {
+		grow_terms(index);
+	}
+
+	Term *t = find_term_slot(index->terms, index->termSlotCount, text, length);
+
+	if (t->text == NULL) {
+		t->text = malloc(length);
+		memcpy(t->text, text, length);
+		t->length = length;
+		++index->termCount;
+	}
+
+	return t;
+}
+
+static void add_posting(Index *index, const char *token, size_t length,
+	uint32_t doc) {
+	Term *t = get_term(index, token, length);
+
+	if (t->lastDoc == doc + 1) {
+		return; //Already in this document
+	}
+
+	size_t before = t->postingLength;
+
+	put_varint(t, doc + 1 - t->lastDoc);
+	t->lastDoc = doc + 1;
+	++t->count;
+	index->postingBytes += t->postingLength - before;
+}
+
+static int is_token_char(unsigned char ch) {
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+		(ch >= '0' && ch <= '9') || ch == '_' || ch >= 0x80;
+}
+
+/*
+ * Splits text into lower case tokens. Single characters and tokens longer
+ * than MAX_TOKEN are skipped.
+ */
+static void tokenize(const char *text, size_t length, void *context,
+	void (*callback)(void *context, const char *token, size_t length)) {
+	char token[MAX_TOKEN];
+	size_t tokenLength = 0;
+	int tooLong = 0;
+
+	for (size_t i = 0; i <= length; ++i) {
+		unsigned char ch = i < length ? text[i] : ' ';
+
+		if (is_token_char(ch)) {
+			if (tokenLength == MAX_TOKEN) {
+				tooLong = 1;
+				continue;
+			}
+			token[tokenLength++] = (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch;
+			continue;
+		}
+		if (tokenLength > 1 && !tooLong) {
+			callback(context, token, tokenLength);
+		}
+		tokenLength = 0;
+		tooLong = 0;
+	}
+}
+
+typedef struct _DocumentContext {
+	Index *index;
+	uint32_t doc;
+} DocumentContext;
+
+static void index_token(void *context, const char *token, size_t length) {
+	DocumentContext *dc = context;
+
+	add_posting(dc->index, token, length, dc->doc);
+}
+
+static uint32_t *find_doc_slot(uint32_t *slots, size_t slotCount,
+	Document *docs, const char *uniqueId) {
+	size_t i = savedHash(uniqueId, strlen(uniqueId)) & (slotCount - 1);
+
+	while (slots[i] != 0) {
+		if (strcmp(docs[slots[i] - 1].uniqueId, uniqueId) == 0) {
+			break;
+		}
+		i = (i + 1) & (slotCount - 1);
+	}
+
+	return slots + i;
+}
+
+static void rebuild_doc_slots(Index *index) {
+	size_t slotCount = 4096;
+
+	while (slotCount < (size_t) index->docCount * 2 + 2) {
+		slotCount *= 2;
+	}
+	free(index->docSlots);
+	index->docSlots = calloc(slotCount, sizeof(uint32_t));
+	index->docSlotCount = slotCount;
+
+	for (uint32_t i = 0; i < index->docCount; ++i) {
+		*find_doc_slot(index->docSlots, slotCount, index->docs,
+			index->docs[i].uniqueId) = i + 1;
+	}
+}
+
+/*
+ * Returns the ID of a new document or -1 if it is already indexed.
+ */
+static long add_document(Index *index, const char *uniqueId) {
+	if (strlen(uniqueId) >= sizeof(index->docs->uniqueId)) {
+		return -1;
+	}
+	if ((index->docCount + 1) * 2 > index->docSlotCount) {
+		rebuild_doc_slots(index);
+	}
+
+	uint32_t *slot = find_doc_slot(index->docSlots, index->docSlotCount,
+		index->docs, uniqueId);
+
+	if (*slot != 0) {
+		return -1;
+	}
+	if (index->docCount == index->docCapacity) {
+		index->docCapacity = index->docCapacity == 0 ?
+			1024 : index->docCapacity * 2;
+		index->docs = realloc(index->docs,
+			index->docCapacity * sizeof(Document));
+	}
+
+	uint32_t doc = index->docCount++;
+
+	strcpy(index->docs[doc].uniqueId, uniqueId);
+	index->docs[doc].removed = 0;
+	*slot = doc + 1;
+
+	return doc;
+}
+
+
+static void index_record(Index *index, ProxyServer *p, const char *uniqueId,
+	RequestRecord *meta) {
+	RequestRecord *req = index->req;
+	ResponseRecord *res = index->res;
+	int hasRequest = proxyServerLoadRequest(p, uniqueId, req) == 0;
+	int hasResponse = proxyServerLoadResponse(p, uniqueId, res) == 0;
+
+	Buffer *reqBody = NULL, *resBody = NULL;
+	Slice contentType;
+
+	//Parse and decode before taking the lock so that searches are not held up
+	index->reqBody->length = 0;
+	index->resBody->length = 0;
+	if (hasRequest &&
+		requestRecordFindHeaderId(req, HEADER_CONTENT_TYPE, &contentType) == 0 &&
+		bodyIsText(&contentType) &&
+		requestRecordDecodeBody(req, MAX_INDEXED_BODY, index->reqBody) >= 0) {
+		reqBody = index->reqBody;
+	}
+	if (hasResponse &&
+		responseRecordFindHeaderId(res, HEADER_CONTENT_TYPE, &contentType) == 0 &&
+		bodyIsText(&contentType) &&
+		responseRecordDecodeBody(res, MAX_INDEXED_BODY, index->resBody) >= 0) {
+		resBody = index->resBody;
+	}
+
+	pthread_rwlock_wrlock(&index->lock);
+
+	long doc = add_document(index, uniqueId);
+
+	if (doc >= 0) {
+		DocumentContext dc;
+		Slice name, value;
+
+		dc.index = index;
+		dc.doc = doc;
+
+		tokenize(meta->host->buffer, meta->host->length, &dc, index_token);
+		if (hasRequest) {
+			tokenize(req->path->buffer, req->path->length, &dc, index_token);
+			tokenize(req->queryString->buffer, req->queryString->length,
+				&dc, index_token);
+			for (size_t i = 0; requestRecordHeaderAt(req, i, &name, &value) == 0;
+				++i) {
+				tokenize(value.buffer, value.length, &dc, index_token);
+			}
+		}
+		if (hasResponse) {
+			for (size_t i = 0; responseRecordHeaderAt(res, i, &name, &value) == 0;
+				++i) {
+				tokenize(value.buffer, value.length, &dc, index_token);
+			}
+		}
+		if (reqBody != NULL) {
+			tokenize(reqBody->buffer, reqBody->length, &dc, index_token);
+		}
+		if (resBody != NULL) {
+			tokenize(resBody->buffer, resBody->length, &dc, index_token);
+		}
+		savedStateChanged(&index->saved);
+	}
+
+	pthread_rwlock_unlock(&index->lock);
+
+	proxyServerResetRecords(p, req, res);
+}
+
+static void free_terms(Term *terms, size_t slotCount) {
+	for (size_t i = 0; i < slotCount; ++i) {
+		free(terms[i].text);
+		free(terms[i].postings);
+	}
+	free(terms);
+}
+
+/*
+ * Drops removed documents from the posting lists and renumbers the rest.
+ */
+static void compact_index(Index *index) {
+	uint32_t *newIds = malloc((index->docCount + 1) * sizeof(uint32_t));
+	uint32_t kept = 0;
+
+	for (uint32_t i = 0; i < index->docCount; ++i) {
+		if (index->docs[i].removed) {
+			newIds[i] = UINT32_MAX;
+			continue;
+		}
+		newIds[i] = kept;
+		index->docs[kept++] = index->docs[i];
+	}
+
+	Term *oldTerms = index->terms;
+	size_t oldSlotCount = index->termSlotCount;
+
+	index->terms = NULL;
+	index->termSlotCount = 0;
+	index->termCount = 0;
+	index->postingBytes = 0;
+	grow_terms(index);
+
+	for (size_t i = 0; i < oldSlotCount; ++i) {
+		Term *old = oldTerms + i;
+
+		if (old->text == NULL) {
+			continue;
+		}
+
+		uint32_t *docs = decode_postings(old);
+
+		for (uint32_t j = 0; j < old->count; ++j) {
+			if (newIds[docs[j]] != UINT32_MAX) {
+				add_posting(index, old->text, old->length, newIds[docs[j]]);
+			}
+		}
+		free(docs);
+	}
+
+	free_terms(oldTerms, oldSlotCount);
+	free(newIds);
+
+	index->docCount = kept;
+	index->removedCount = 0;
+	rebuild_doc_slots(index);
+}
+
+/*
+ * The caller holds a read lock, so the changes counted when the save
+ * begins are the ones being saved.
+ */
+static int save_index(Index *index, ProxyServer *p) {
+	FILE *file = savedStateBeginSave(&index->saved);
+
+	if (file == NULL) {
+		DIE(p, -1, "Failed to save index.");
+	}
+
+	int status = 0;
+	uint32_t termCount = index->termCount;
+
+	status |= savedWrite(file, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	status |= savedWrite(file, &index->cursor, sizeof(HistoryCursor));
+	status |= savedWrite(file, &index->docCount, sizeof(uint32_t));
+	for (uint32_t i = 0; i < index->docCount; ++i) {
+		status |= savedWrite(file, index->docs + i, sizeof(Document));
+	}
+	status |= savedWrite(file, &termCount, sizeof(uint32_t));
+	for (size_t i = 0; i < index->termSlotCount; ++i) {
+		Term *t = index->terms + i;
+		uint32_t length = t->postingLength;
+
+		if (t->text == NULL) {
+			continue;
+		}
+		status |= savedWrite(file, &t->length, sizeof(uint32_t));
+		status |= savedWrite(file, t->text, t->length);
+		status |= savedWrite(file, &t->count, sizeof(uint32_t));
+		status |= savedWrite(file, &t->lastDoc, sizeof(uint32_t));
+		status |= savedWrite(file, &length, sizeof(uint32_t));
+		status |= savedWrite(file, t->postings, length);
+	}
+
+	status = savedStateEndSave(&index->saved, file, status);
+	DIE(p, status, "Failed to save index.");
+
+	return 0;
+}
+
+/*
+ * Returns 1 if a loaded posting list holds count increasing document IDs
+ * below docCount that end at lastDoc and fill it exactly.
+ */
+static int valid_postings(Term *t, uint32_t docCount) {
+	uint64_t current = 0;
+	uint32_t delta;
+	size_t pos = 0;
+
+	for (uint32_t i = 0; i < t->count; ++i) {
+		if (pos >= t->postingLength) {
+			return 0;
+		}
+		pos = get_varint(t->postings, t->postingLength, pos, &delta);
+		current += delta;
+		if (delta == 0 || current > docCount) {
+			return 0;
+		}
+	}
+
+	return pos == t->postingLength && current == t->lastDoc;
+}
+
+/*
+ * Loads a saved index. A missing or damaged index is rebuilt from
+ * scratch.
+ */
+static void load_index(Index *index, ProxyServer *p) {
+	char magic[sizeof(INDEX_MAGIC)];
+	size_t size;
+	FILE *file = savedStateLoad(&index->saved, &size);
+
+	if (file == NULL) {
+		return;
+	}
+
+	uint32_t docCount = 0, termCount = 0;
+	int status = savedRead(file, magic, sizeof(magic));
+
+	if (status == 0 && memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0) {
+		status |= savedRead(file, &index->cursor, sizeof(HistoryCursor));
+		status |= savedRead(file, &docCount, sizeof(uint32_t));
+	} else {
+		status = -1;
+	}
+	if (status == 0 && docCount > size / sizeof(Document)) {
+		status = -1;
+	}
+
+	for (uint32_t i = 0; status == 0 && i < docCount; ++i) {
+		Document doc;
+
+		status |= savedRead(file, &doc, sizeof(Document));
+		doc.uniqueId[sizeof(doc.uniqueId) - 1] = '\0';
+		//Posting lists refer to documents by position, so none may be skipped
+		if (status == 0 && add_document(index, doc.uniqueId) < 0) {
+			status = -1;
+		}
+		if (status == 0) {
+			index->docs[index->docCount - 1].removed = doc.removed;
+			index->removedCount += doc.removed != 0;
+		}
+	}
+	if (status == 0) {
+		status |= savedRead(file, &termCount, sizeof(uint32_t));
+	}
+
+	char text[MAX_TOKEN];
+
+	for (uint32_t i = 0; status == 0 && i < termCount; ++i) {
+		uint32_t length, count, lastDoc, postingLength;
+
+		status |= savedRead(file, &length, sizeof(uint32_t));
+		if (status != 0 || length > MAX_TOKEN) {
+			status = -1;
+			break;
+		}
+		status |= savedRead(file, text, length);
+		status |= savedRead(file, &count, sizeof(uint32_t));
+		status |= savedRead(file, &lastDoc, sizeof(uint32_t));
+		status |= savedRead(file, &postingLength, sizeof(uint32_t));
+		if (status != 0 || lastDoc > index->docCount) {
+			status = -1;
+			break;
+		}
+
+		Term *t = get_term(index, text, length);
+
+		t->postings = malloc(postingLength + 1);
+		t->postingLength = t->postingCapacity = postingLength;
+		t->count = count;
+		t->lastDoc = lastDoc;
+		index->postingBytes += postingLength;
+		status |= savedRead(file, t->postings, postingLength);
+		if (status == 0 && !valid_postings(t, index->docCount)) {
+			status = -1;
+		}
+	}
+	fclose(file);
+
+	if (status != 0) {
+		//Start over
+		free_terms(index->terms, index->termSlotCount);
+		index->terms = NULL;
+		index->termSlotCount = index->termCount = 0;
+		index->docCount = 0;
+		index->removedCount = 0;
+		index->postingBytes = 0;
+		memset(&index->cursor, 0, sizeof(HistoryCursor));
+		rebuild_doc_slots(index);
+	}
+}
+
+static void on_feed_record(void *contextData, const char *uniqueId,
+	RequestRecord *req, ResponseRecord *res) {
+	ProxyServer *p = contextData;
+
+	index_record(p->index, p, uniqueId, req);
+}
+
+static void maybe_save(Index *index, ProxyServer *p, int force) {
+	if (!savedStateIsDue(&index->saved, force)) {
+		return;
+	}
+
+	if (index->removedCount > 1024 &&
+		index->removedCount * 2 > index->docCount) {
+		pthread_rwlock_wrlock(&index->lock);
+		compact_index(index);
+		pthread_rwlock_unlock(&index->lock);
+	}
+	//Documents are only added by this thread so a read lock is enough
+	pthread_rwlock_rdlock(&index->lock);
+	save_index(index, p);
+	pthread_rwlock_unlock(&index->lock);
+}
+
+static void *indexer_loop(void *data) {
+	ProxyServer *p = data;
+	Index *index = p->index;
+	HistoryFeed *feed = newHistoryFeed(p, &index->cursor);
+
+	while (__sync_fetch_and_add(&index->stopRequested, 0) == 0) {
+		historyFeedWait(feed, FEED_WAIT, p, on_feed_record);
+
+		HistoryCursor cursor;
+
+		historyFeedGetCursor(feed, &cursor);
+		pthread_rwlock_wrlock(&index->lock);
+		index->cursor = cursor;
+		pthread_rwlock_unlock(&index->lock);
+
+		maybe_save(index, p, 0);
+	}
+	maybe_save(index, p, 1);
+
+	deleteHistoryFeed(feed);
+
+	return NULL;
+}
+
+static void delete_index(Index *index) {
+	savedStateClose(&index->saved);
+	free_terms(index->terms, index->termSlotCount);
+	free(index->docs);
+	free(index->docSlots);
+	deleteRequestRecord(index->req);
+	deleteResponseRecord(index->res);
+	deleteBuffer(index->reqBody);
+	deleteBuffer(index->resBody);
+	pthread_rwlock_destroy(&index->lock);
+	free(index);
+}
+
+/*
+ * Loads the saved index and starts a thread that indexes new records.
+ */
+int proxyServerStartIndex(ProxyServer *p) {
+	if (p->index != NULL) {
+		return 0;
+	}
+
+	Index *index = calloc(1, sizeof(Index));
+
+	pthread_rwlock_init(&index->lock, NULL);
+	index->req = newRequestRecord();
+	index->res = newResponseRecord();
+	index->reqBody = newBufferWithCapacity(4096);
+	index->resBody = newBufferWithCapacity(4096);
+	rebuild_doc_slots(index);
+	grow_terms(index);
+	if (savedStateOpen(&index->saved, p, INDEX_FILE, LOCK_FILE,
+		SAVE_EVERY) < 0) {
+		delete_index(index);
+		DIE(p, -1, "Persistence folder path is too long.");
+	}
+
+	load_index(index, p);
+	p->index = index;
+
+	int status = pthread_create(&index->threadId, NULL, indexer_loop, p);
+
+	if (status != 0) {
+		p->index = NULL;
+		delete_index(index);
+		DIE(p, -1, "Failed to create indexer thread.");
+	}
+
+	return 0;
+}
+
+void proxyServerStopIndex(ProxyServer *p) {
+	Index *index = p->index;
+
+	if (index == NULL) {
+		return;
+	}
+
+	__sync_fetch_and_add(&index->stopRequested, 1);
+	pthread_join(index->threadId, NULL);
+
+	p->index = NULL;
+	delete_index(index);
+}
+
+/*
+ * Marks a record as removed so that it no longer shows up in search
+ * results. It is dropped from the posting lists when the index is
+ * compacted.
+ */
+void indexRecordRemoved(ProxyServer *p, const char *uniqueId) {
+	Index *index = p->index;
+
+	if (index == NULL) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&index->lock);
+	if (index->docSlotCount > 0) {
+		uint32_t *slot = find_doc_slot(index->docSlots, index->docSlotCount,
+			index->docs, uniqueId);
+
+		if (*slot != 0 && !index->docs[*slot - 1].removed) {
+			index->docs[*slot - 1].removed = 1;
+			++index->removedCount;
+			savedStateChanged(&index->saved);
+		}
+	}
+	pthread_rwlock_unlock(&index->lock);
+}
+
+typedef struct _Query {
+	char tokens[MAX_QUERY_TERMS][MAX_TOKEN];
+	size_t lengths[MAX_QUERY_TERMS];
+	size_t count;
+} Query;
+
+static void add_query_token(void *context, const char *token, size_t length) {
+	Query *q = context;
+
+	for (size_t i = 0; i < q->count; ++i) {
+		if (q->lengths[i] == length && memcmp(q->tokens[i], token, length) == 0) {
+			return;
+		}
+	}
+	if (q->count < MAX_QUERY_TERMS) {
+		memcpy(q->tokens[q->count], token, length);
+		q->lengths[q->count++] = length;
+	}
+}
+
+static int compare_term_counts(const void *a, const void *b) {
+	const Term *t1 = *(Term**) a, *t2 = *(Term**) b;
+
+	return t1->count < t2->count ? -1 : t1->count > t2->count;
+}
+
+/*
+ * Keeps the documents in docs that are also in the posting list.
+ */
+static uint32_t intersect(uint32_t *docs, uint32_t count, Term *t) {
+	uint32_t kept = 0, current = 0, delta, i = 0;
+	size_t pos = 0;
+
+	for (uint32_t j = 0; j < t->count && i < count; ++j) {
+		pos = get_varint(t->postings, t->postingLength, pos, &delta);
+		current += delta;
+
+		uint32_t doc = current - 1;
+
+		while (i < count && docs[i] < doc) {
+			++i;
+		}
+		if (i < count && docs[i] == doc) {
+			docs[kept++] = doc;
+			++i;
+		}
+	}
+
+	return kept;
+}
+
+/*
+ * Finds the records that contain every token in the query. Tokens are
+ * matched ignoring case. Returns the number of records found. Records
+ * are delivered oldest first after the index lock is released.
+ */
+int proxyServerSearch(ProxyServer *p, const char *query, void *contextData,
+	void (*callback)(void *contextData, const char *uniqueId)) {
+	Index *index = p->index;
+
+	if (index == NULL) {
+		DIE(p, -1, "Index is not running.");
+	}
+
+	Query q;
+	Term *terms[MAX_QUERY_TERMS];
+
+	q.count = 0;
+	tokenize(query, strlen(query), &q, add_query_token);
+	if (q.count == 0) {
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&index->lock);
+
+	for (size_t i = 0; i < q.count; ++i) {
+		Term *t = find_term_slot(index->terms, index->termSlotCount,
+			q.tokens[i], q.lengths[i]);
+
+		if (t->text == NULL) {
+			pthread_rwlock_unlock(&index->lock);
+
+			return 0;
+		}
+		terms[i] = t;
+	}
+
+	//Start with the rarest term
+	qsort(terms, q.count, sizeof(Term*), compare_term_counts);
+
+	uint32_t *docs = decode_postings(terms[0]);
+	uint32_t count = terms[0]->count;
+
+	for (size_t i = 1; i < q.count && count > 0; ++i) {
+		count = intersect(docs, count, terms[i]);
+	}
+
+	char (*ids)[64] = malloc((count + 1) * sizeof(*ids));
+	uint32_t found = 0;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		Document *doc = index->docs + docs[i];
+
+		if (!doc->removed) {
+			memcpy(ids[found++], doc->uniqueId, sizeof(doc->uniqueId));
+		}
+	}
+
+	pthread_rwlock_unlock(&index->lock);
+
+	if (callback != NULL) {
+		for (uint32_t i = 0; i < found; ++i) {
+			callback(contextData, ids[i]);
+		}
+	}
+
+	free(ids);
+	free(docs);
+
+	return found;
+}
+
+int proxyServerGetIndexStats(ProxyServer *p, IndexStats *stats) {
+	Index *index = p->index;
+
+	memset(stats, 0, sizeof(IndexStats));
+	if (index == NULL) {
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&index->lock);
+	stats->documents = index->docCount - index->removedCount;
+	stats->removed = index->removedCount;
+	stats->terms = index->termCount;
+	stats->postingBytes = index->postingBytes;
+	pthread_rwlock_unlock(&index->lock);
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * Inverted index over tokens in the path, query string, header values and
+ * decoded text bodies of captured records. Built incrementally by a background
+ * thread that follows the persistence folder. The index is saved in the
+ * folder so that it does not have to be rebuilt on restart.
+ *
+ * Only one process updates the saved index. Others load it and keep their
+ * own copy up to date in memory.
+ */
+#define INDEX_FILE "capture.index"
+
+typedef struct _IndexStats {
+	unsigned long documents;
+	unsigned long removed;
+	unsigned long terms;
+	unsigned long long postingBytes;
+} IndexStats;
+
+int proxyServerStartIndex(ProxyServer *p);
+void proxyServerStopIndex(ProxyServer *p);
+int proxyServerSearch(ProxyServer *p, const char *query, void *contextData,
+	void (*callback)(void *contextData, const char *uniqueId));
+int proxyServerGetIndexStats(ProxyServer *p, IndexStats *stats);
+void indexRecordRemoved(ProxyServer *p, const char *uniqueId);
@@ -0,0 +1,1461 @@
+//For strptime()
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "Proxy.h"
+#include "Persistence.h"
+#include "HistoryFeed.h"
+#include "MetaStore.h"
+#include "SavedState.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+#define STORE_MAGIC "PXCOL1"
+#define LOCK_FILE "capture.columns.lock"
+#define ID_LENGTH 32
+//Bytes of one row in the saved columns
+#define ROW_BYTES (ID_LENGTH + 4 * sizeof(int64_t) + sizeof(uint32_t) + \
+	sizeof(uint16_t) + 2 * sizeof(uint8_t))
+//Rows per zone map. Filters are evaluated a block at a time.
+#define BLOCK_ROWS 1024
+#define MAX_QUERY_NODES 64
+#define MAX_METHODS 32
+//Save after this many changes
+#define SAVE_EVERY 16384
+#define FEED_WAIT 250
+
+enum {
+	FIELD_START,
+	FIELD_END,
+	FIELD_DURATION,
+	FIELD_HOST,
+	FIELD_METHOD,
+	FIELD_STATUS,
+	FIELD_REQUEST_SIZE,
+	FIELD_RESPONSE_SIZE,
+	FIELD_COUNT
+};
+
+static const char *field_names[FIELD_COUNT] = {
+	"start", "end", "duration", "host", "method", "status", "reqsize",
+	"ressize"
+};
+
+typedef struct _StringTable {
+	char **strings;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t *slots; //ID + 1 by hash
+	size_t slotCount;
+} StringTable;
+
+typedef struct _ZoneMap {
+	int64_t min[FIELD_COUNT];
+	int64_t max[FIELD_COUNT];
+} ZoneMap;
+
+typedef struct _MetaStore {
+	pthread_t threadId;
+	pthread_rwlock_t lock;
+	int stopRequested;
+	pthread_mutex_t readyLock;
+	pthread_cond_t readyCondition;
+	int isReady; //Caught up with the folder
+	HistoryCursor cursor;
+
+	size_t rowCount;
+	size_t rowCapacity;
+	char (*ids)[ID_LENGTH];
+	int64_t *start;
+	int64_t *duration;
+	uint32_t *host;
+	uint8_t *method;
+	uint16_t *status;
+	uint64_t *requestSize;
+	uint64_t *responseSize;
+	uint8_t *removed;
+	ZoneMap *zones;
+
+	StringTable hosts;
+	StringTable methods;
+	uint32_t *idSlots; //Row + 1 by unique ID hash
+	size_t idSlotCount;
+
+	unsigned long removedCount;
+	SavedState saved;
+} MetaStore;
+
+static uint32_t *string_slot(StringTable *t, const char *s, size_t length) {
+	size_t i = savedHash(s, length) & (t->slotCount - 1);
+
+	while (t->slots[i] != 0) {
+		const char *other = t->strings[t->slots[i] - 1];
+
+		if (strncmp(other, s, length) == 0 && other[length] == '\0') {
+			break;
+		}
+		i = (i + 1) & (t->slotCount - 1);
+	}
+
+	return t->slots + i;
+}
+
+static void grow_string_table(StringTable *t) {
+	t->slotCount = t->slotCount == 0 ? 256 : t->slotCount * 2;
+	free(t->slots);
+	t->slots = calloc(t->slotCount, sizeof(uint32_t));
+	for (uint32_t i = 0; i < t->count; ++i) {
+		*string_slot(t, t->strings[i], strlen(t->strings[i])) = i + 1;
+	}
+}
+
+/*
+ * Returns the ID of a string or UINT32_MAX if it is not in the table.
+ */
+static uint32_t string_table_find(StringTable *t, const char *s,
+	size_t length) {
+	if (t->slotCount == 0) {
+		return UINT32_MAX;
+	}
+
+	uint32_t id = *string_slot(t, s, length);
+
+	return id == 0 ? UINT32_MAX : id - 1;
+}
+
+static uint32_t string_table_add(StringTable *t, const char *s,
+	size_t length) {
+	if ((t->count + 1) * 2 > t->slotCount) {
+		grow_string_table(t);
+	}
+
+	uint32_t *slot = string_slot(t, s, length);
+
+	if (*slot != 0) {
+		return *slot - 1;
+	}
+	if (t->count == t->capacity) {
+		t->capacity = t->capacity == 0 ? 64 : t->capacity * 2;
+		t->strings = realloc(t->strings, t->capacity * sizeof(char*));
+	}
+
+	char *copy = malloc(length + 1);
+
+	memcpy(copy, s, length);
+	copy[length] = '\0';
+	t->strings[t->count] = copy;
+	*slot = ++t->count;
+
+	return t->count - 1;
+}
+
+static void free_string_table(StringTable *t) {
+	for (uint32_t i = 0; i < t->count; ++i) {
+		free(t->strings[i]);
+	}
+	free(t->strings);
+	free(t->slots);
+	memset(t, 0, sizeof(StringTable));
+}
+
+static int64_t field_value(MetaStore *s, int field, size_t row) {
+	switch (field) {
+	case FIELD_START:
+		return s->start[row];
+	case FIELD_END:
+		return s->start[row] + s->duration[row];
+	case FIELD_DURATION:
+		return s->duration[row];
+	case FIELD_HOST:
+		return s->host[row];
+	case FIELD_METHOD:
+		return s->method[row];
+	case FIELD_STATUS:
+		return s->status[row];
+	case FIELD_REQUEST_SIZE:
+		return (int64_t) s->requestSize[row];
+	default:
+		return (int64_t) s->responseSize[row];
+	}
+}
+
+static void update_zone(MetaStore *s, size_t row) {
+	ZoneMap *z = s->zones + row / BLOCK_ROWS;
+	int first = row % BLOCK_ROWS == 0;
+
+	for (int f = 0; f < FIELD_COUNT; ++f) {
+		int64_t v = field_value(s, f, row);
+
+		if (first || v < z->min[f]) {
+			z->min[f] = v;
+		}
+		if (first || v > z->max[f]) {
+			z->max[f] = v;
+		}
+	}
+}
+
+static void reserve_rows(MetaStore *s, size_t rows) {
+	if (rows <= s->rowCapacity) {
+		return;
+	}
+
+	size_t capacity = s->rowCapacity == 0 ? 4 * BLOCK_ROWS : s->rowCapacity;
+
+	while (capacity < rows) {
+		capacity *= 2;
+	}
+	s->ids = realloc(s->ids, capacity * ID_LENGTH);
+	s->start = realloc(s->start, capacity * sizeof(int64_t));
+	s->duration = realloc(s->duration, capacity * sizeof(int64_t));
+	s->host = realloc(s->host, capacity * sizeof(uint32_t));
+	s->method = realloc(s->method, capacity * sizeof(uint8_t));
+	s->status = realloc(s->status, capacity * sizeof(uint16_t));
+	s->requestSize = realloc(s->requestSize, capacity * sizeof(uint64_t));
+	s->responseSize = realloc(s->responseSize, capacity * sizeof(uint64_t));
+	s->removed = realloc(s->removed, capacity * sizeof(uint8_t));
+	s->zones = realloc(s->zones, (capacity / BLOCK_ROWS + 1) * sizeof(ZoneMap));
+	s->rowCapacity = capacity;
+}
+
+static uint32_t *id_slot(MetaStore *s, const char *uniqueId) {
+	size_t i = savedHash(uniqueId, strlen(uniqueId)) & (s->idSlotCount - 1);
+
+	while (s->idSlots[i] != 0) {
+		if (strcmp(s->ids[s->idSlots[i] - 1], uniqueId) == 0) {
+			break;
+		}
+		i = (i + 1) & (s->idSlotCount - 1);
+	}
+
+	return s->idSlots + i;
+}
+
+static void rebuild_id_slots(MetaStore *s) {
+	size_t slotCount = 4096;
+
+	while (slotCount < s->rowCount * 2 + 2) {
+		slotCount *= 2;
+	}
+	free(s->idSlots);
+	s->idSlots = calloc(slotCount, sizeof(uint32_t));
+	s->idSlotCount = slotCount;
+
+	for (size_t i = 0; i < s->rowCount; ++i) {
+		*id_slot(s, s->ids[i]) = i + 1;
+	}
+}
+
+static int64_t to_micros(struct timeval *tv) {
+	return (int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void add_row(MetaStore *s, const char *uniqueId, RequestRecord *req,
+	ResponseRecord *res) {
+	if (strlen(uniqueId) >= ID_LENGTH) {
+		return;
+	}
+	if ((s->rowCount + 1) * 2 > s->idSlotCount) {
+		rebuild_id_slots(s);
+	}
+
+	uint32_t *slot = id_slot(s, uniqueId);
+
+	if (*slot != 0) {
+		return; //Already stored
+	}
+
+	reserve_rows(s, s->rowCount + 1);
+
+	size_t row = s->rowCount++;
+	int64_t start = to_micros(&req->requestStartTime);
+	int64_t end = to_micros(&req->responseEndTime);
+	uint32_t method = string_table_add(&s->methods,
+		req->method->buffer, req->method->length);
+
+	strcpy(s->ids[row], uniqueId);
+	s->start[row] = start;
+	s->duration[row] = end > start ? end - start : 0;
+	s->host[row] = string_table_add(&s->hosts,
+		req->host->buffer, req->host->length);
+	s->method[row] = method < MAX_METHODS ? method : MAX_METHODS;
+	s->status[row] = (uint16_t) atoi(stringAsCString(res->statusCode));
+	s->requestSize[row] = req->size;
+	s->responseSize[row] = res->size;
+	s->removed[row] = 0;
+	update_zone(s, row);
+	*slot = row + 1;
+	savedStateChanged(&s->saved);
+}
+
+/*
+ * Drops removed rows. Rows stay in the order they were added.
+ */
+static void compact_store(MetaStore *s) {
+	size_t kept = 0;
+
+	for (size_t i = 0; i < s->rowCount; ++i) {
+		if (s->removed[i]) {
+			continue;
+		}
+		memcpy(s->ids[kept], s->ids[i], ID_LENGTH);
+		s->start[kept] = s->start[i];
+		s->duration[kept] = s->duration[i];
+		s->host[kept] = s->host[i];
+		s->method[kept] = s->method[i];
+		s->status[kept] = s->status[i];
+		s->requestSize[kept] = s->requestSize[i];
+		s->responseSize[kept] = s->responseSize[i];
+		s->removed[kept] = 0;
+		update_zone(s, kept);
+		++kept;
+	}
+	s->rowCount = kept;
+	s->removedCount = 0;
+	rebuild_id_slots(s);
+}
+
+static int write_strings(FILE *file, StringTable *t) {
+	int status = savedWrite(file, &t->count, sizeof(uint32_t));
+
+	for (uint32_t i = 0; i < t->count; ++i) {
+		uint32_t length = strlen(t->strings[i]);
+
+		status |= savedWrite(file, &length, sizeof(uint32_t));
+		status |= savedWrite(file, t->strings[i], length);
+	}
+
+	return status;
+}
+
+static int read_strings(FILE *file, StringTable *t) {
+	uint32_t count;
+	char *buffer = NULL;
+	size_t capacity = 0;
+	int status = 0;
+
+	if (savedRead(file, &count, sizeof(uint32_t)) < 0) {
+		return -1;
+	}
+	for (uint32_t i = 0; i < count && status == 0; ++i) {
+		uint32_t length;
+
+		if (savedRead(file, &length, sizeof(uint32_t)) < 0) {
+			status = -1;
+			break;
+		}
+		if (length > capacity) {
+			char *larger = realloc(buffer, length);
+
+			if (larger == NULL) {
+				status = -1;
+				break;
+			}
+			buffer = larger;
+			capacity = length;
+		}
+		status = savedRead(file, buffer, length);
+		if (status == 0) {
+			string_table_add(t, buffer, length);
+		}
+	}
+	free(buffer);
+
+	return status == 0 && t->count == count ? 0 : -1;
+}
+
+/*
+ * Each column is written out as is. The zone maps are rebuilt on load.
+ */
+static int save_store(MetaStore *s, ProxyServer *p) {
+	FILE *file = savedStateBeginSave(&s->saved);
+
+	if (file == NULL) {
+		DIE(p, -1, "Failed to save meta data columns.");
+	}
+
+	uint64_t rows = s->rowCount;
+	int status = 0;
+
+	status |= savedWrite(file, STORE_MAGIC, sizeof(STORE_MAGIC));
+	status |= savedWrite(file, &s->cursor, sizeof(HistoryCursor));
+	status |= savedWrite(file, &rows, sizeof(uint64_t));
+	status |= write_strings(file, &s->hosts);
+	status |= write_strings(file, &s->methods);
+	status |= savedWrite(file, s->ids, rows * ID_LENGTH);
+	status |= savedWrite(file, s->start, rows * sizeof(int64_t));
+	status |= savedWrite(file, s->duration, rows * sizeof(int64_t));
+	status |= savedWrite(file, s->host, rows * sizeof(uint32_t));
+	status |= savedWrite(file, s->method, rows * sizeof(uint8_t));
+	status |= savedWrite(file, s->status, rows * sizeof(uint16_t));
+	status |= savedWrite(file, s->requestSize, rows * sizeof(uint64_t));
+	status |= savedWrite(file, s->responseSize, rows * sizeof(uint64_t));
+	status |= savedWrite(file, s->removed, rows * sizeof(uint8_t));
+
+	status = savedStateEndSave(&s->saved, file, status);
+	DIE(p, status, "Failed to save meta data columns.");
+
+	return 0;
+}
+
+/*
+ * Returns 1 if every loaded row refers to a host and method in the string
+ * tables.
+ */
+static int valid_rows(MetaStore *s, size_t rows) {
+	for (size_t i = 0; i < rows; ++i) {
+		if (s->host[i] >= s->hosts.count || (s->method[i] != MAX_METHODS &&
+			s->method[i] >= s->methods.count)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Loads the saved columns. Missing or damaged columns are rebuilt from
+ * the meta files.
+ */
+static void load_store(MetaStore *s, ProxyServer *p) {
+	char magic[sizeof(STORE_MAGIC)];
+	size_t size;
+	FILE *file = savedStateLoad(&s->saved, &size);
+
+	if (file == NULL) {
+		return;
+	}
+
+	uint64_t rows = 0;
+	int status = savedRead(file, magic, sizeof(magic));
+
+	if (status == 0 && memcmp(magic, STORE_MAGIC, sizeof(magic)) == 0) {
+		status |= savedRead(file, &s->cursor, sizeof(HistoryCursor));
+		status |= savedRead(file, &rows, sizeof(uint64_t));
+		status |= read_strings(file, &s->hosts);
+		status |= read_strings(file, &s->methods);
+	} else {
+		status = -1;
+	}
+
+	//The columns fill the rest of the file
+	long offset = status == 0 ? ftell(file) : -1;
+
+	if (offset < 0 || (size - offset) % ROW_BYTES != 0 ||
+		rows != (size - offset) / ROW_BYTES) {
+		status = -1;
+	}
+	if (status == 0) {
+		reserve_rows(s, rows);
+		status |= savedRead(file, s->ids, rows * ID_LENGTH);
+		status |= savedRead(file, s->start, rows * sizeof(int64_t));
+		status |= savedRead(file, s->duration, rows * sizeof(int64_t));
+		status |= savedRead(file, s->host, rows * sizeof(uint32_t));
+		status |= savedRead(file, s->method, rows * sizeof(uint8_t));
+		status |= savedRead(file, s->status, rows * sizeof(uint16_t));
+		status |= savedRead(file, s->requestSize, rows * sizeof(uint64_t));
+		status |= savedRead(file, s->responseSize, rows * sizeof(uint64_t));
+		status |= savedRead(file, s->removed, rows * sizeof(uint8_t));
+	}
+	fclose(file);
+	if (status == 0 && !valid_rows(s, rows)) {
+		status = -1;
+	}
+
+	if (status != 0) {
+		//Start over
+		free_string_table(&s->hosts);
+		free_string_table(&s->methods);
+		memset(&s->cursor, 0, sizeof(HistoryCursor));
+		s->rowCount = 0;
+
+		return;
+	}
+
+	s->rowCount = rows;
+	for (size_t i = 0; i < rows; ++i) {
+		s->ids[i][ID_LENGTH - 1] = '\0';
+		s->removedCount += s->removed[i] != 0;
+		update_zone(s, i);
+	}
+	rebuild_id_slots(s);
+}
+
+static void on_feed_record(void *contextData, const char *uniqueId,
+	RequestRecord *req, ResponseRecord *res) {
+	MetaStore *s = contextData;
+
+	pthread_rwlock_wrlock(&s->lock);
+	add_row(s, uniqueId, req, res);
+	pthread_rwlock_unlock(&s->lock);
+}
+
+static void maybe_save(MetaStore *s, ProxyServer *p, int force) {
+	if (!savedStateIsDue(&s->saved, force)) {
+		return;
+	}
+
+	if (s->removedCount > 4 * BLOCK_ROWS && s->removedCount * 2 > s->rowCount) {
+		pthread_rwlock_wrlock(&s->lock);
+		compact_store(s);
+		pthread_rwlock_unlock(&s->lock);
+	}
+	//Rows are only added by this thread so a read lock is enough
+	pthread_rwlock_rdlock(&s->lock);
+	save_store(s, p);
+	pthread_rwlock_unlock(&s->lock);
+}
+
+static void *store_loop(void *data) {
+	ProxyServer *p = data;
+	MetaStore *s = p->metaStore;
+	HistoryFeed *feed = newHistoryFeed(p, &s->cursor);
+
+	while (__sync_fetch_and_add(&s->stopRequested, 0) == 0) {
+		historyFeedWait(feed, FEED_WAIT, s, on_feed_record);
+
+		HistoryCursor cursor;
+
+		historyFeedGetCursor(feed, &cursor);
+		pthread_rwlock_wrlock(&s->lock);
+		s->cursor = cursor;
+		pthread_rwlock_unlock(&s->lock);
+
+		if (!s->isReady) {
+			pthread_mutex_lock(&s->readyLock);
+			s->isReady = 1;
+			pthread_cond_broadcast(&s->readyCondition);
+			pthread_mutex_unlock(&s->readyLock);
+		}
+
+		maybe_save(s, p, 0);
+	}
+	maybe_save(s, p, 1);
+
+	deleteHistoryFeed(feed);
+
+	return NULL;
+}
+
+static void delete_store(MetaStore *s) {
+	savedStateClose(&s->saved);
+	free(s->ids);
+	free(s->start);
+	free(s->duration);
+	free(s->host);
+	free(s->method);
+	free(s->status);
+	free(s->requestSize);
+	free(s->responseSize);
+	free(s->removed);
+	free(s->zones);
+	free(s->idSlots);
+	free_string_table(&s->hosts);
+	free_string_table(&s->methods);
+	pthread_rwlock_destroy(&s->lock);
+	pthread_mutex_destroy(&s->readyLock);
+	pthread_cond_destroy(&s->readyCondition);
+	free(s);
+}
+
+/*
+ * Loads the saved columns and starts a thread that adds new records.
+ */
+int proxyServerStartMetaStore(ProxyServer *p) {
+	if (p->metaStore != NULL) {
+		return 0;
+	}
+
+	MetaStore *s = calloc(1, sizeof(MetaStore));
+
+	pthread_rwlock_init(&s->lock, NULL);
+	pthread_mutex_init(&s->readyLock, NULL);
+	pthread_cond_init(&s->readyCondition, NULL);
+	reserve_rows(s, 1);
+	rebuild_id_slots(s);
+	if (savedStateOpen(&s->saved, p, META_STORE_FILE, LOCK_FILE,
+		SAVE_EVERY) < 0) {
+		delete_store(s);
+		DIE(p, -1, "Persistence folder path is too long.");
+	}
+
+	load_store(s, p);
+	p->metaStore = s;
+
+	int status = pthread_create(&s->threadId, NULL, store_loop, p);
+
+	if (status != 0) {
+		p->metaStore = NULL;
+		delete_store(s);
+		DIE(p, -1, "Failed to create meta data store thread.");
+	}
+
+	return 0;
+}
+
+void proxyServerStopMetaStore(ProxyServer *p) {
+	MetaStore *s = p->metaStore;
+
+	if (s == NULL) {
+		return;
+	}
+
+	__sync_fetch_and_add(&s->stopRequested, 1);
+	pthread_join(s->threadId, NULL);
+
+	p->metaStore = NULL;
+	delete_store(s);
+}
+
+/*
+ * Waits until the store has caught up with the records that were in the
+ * folder when it started.
+ */
+void proxyServerWaitMetaStore(ProxyServer *p) {
+	MetaStore *s = p->metaStore;
+
+	if (s == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&s->readyLock);
+	while (!s->isReady) {
+		pthread_cond_wait(&s->readyCondition, &s->readyLock);
+	}
+	pthread_mutex_unlock(&s->readyLock);
+}
+
+void metaStoreRecordRemoved(ProxyServer *p, const char *uniqueId) {
+	MetaStore *s = p->metaStore;
+
+	if (s == NULL) {
+		return;
+	}
+
+	pthread_rwlock_wrlock(&s->lock);
+
+	uint32_t *slot = id_slot(s, uniqueId);
+
+	if (*slot != 0 && !s->removed[*slot - 1]) {
+		s->removed[*slot - 1] = 1;
+		++s->removedCount;
+		savedStateChanged(&s->saved);
+	}
+
+	pthread_rwlock_unlock(&s->lock);
+}
+
+enum {
+	NODE_TRUE,
+	NODE_FALSE,
+	NODE_AND,
+	NODE_OR,
+	NODE_NOT,
+	NODE_COMPARE
+};
+
+enum {
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+	OP_IN_RANGE, //Between value and value2
+	OP_NOT_IN_RANGE
+};
+
+typedef struct _QueryNode {
+	int kind;
+	int field;
+	int op;
+	int64_t value;
+	int64_t value2;
+	char text[256]; //Host or method. Turned into an ID when the query runs.
+	struct _QueryNode *left;
+	struct _QueryNode *right;
+	uint8_t mask[BLOCK_ROWS];
+} QueryNode;
+
+typedef struct _Query {
+	const char *input;
+	const char *pos;
+	char token[256];
+	char error[320];
+	QueryNode *nodes;
+	int nodeCount;
+	QueryNode *root;
+	int orderField; //-1 if none
+	int descending;
+	long limit; //-1 if none
+	ProxyServer *p;
+	RequestRecord *record; //Loaded for methods the column does not hold
+} Query;
+
+static QueryNode *new_node(Query *q, int kind) {
+	if (q->nodeCount == MAX_QUERY_NODES) {
+		snprintf(q->error, sizeof(q->error), "Query is too long.");
+
+		return NULL;
+	}
+
+	QueryNode *node = q->nodes + q->nodeCount++;
+
+	memset(node, 0, sizeof(QueryNode) - BLOCK_ROWS);
+	node->kind = kind;
+
+	return node;
+}
+
+static int is_operator_char(char ch) {
+	return ch == '=' || ch == '!' || ch == '<' || ch == '>';
+}
+
+/*
+ * Reads the next token into q->token. Returns 0 at the end of the query.
+ */
+static int next_token(Query *q) {
+	const char *p = q->pos;
+	size_t length = 0;
+
+	while (isspace((unsigned char) *p)) {
+		++p;
+	}
+	if (*p == '\0') {
+		q->pos = p;
+		q->token[0] = '\0';
+
+		return 0;
+	}
+
+	if (*p == '(' || *p == ')') {
+		q->token[length++] = *p++;
+	} else if (is_operator_char(*p)) {
+		while (is_operator_char(*p) && length < 2) {
+			q->token[length++] = *p++;
+		}
+	} else if (*p == '\'' || *p == '"') {
+		char quote = *p++;
+
+		while (*p != '\0' && *p != quote && length < sizeof(q->token) - 1) {
+			q->token[length++] = *p++;
+		}
+		if (*p == quote) {
+			++p;
+		}
+	} else {
+		while (*p != '\0' && !isspace((unsigned char) *p) && *p != '(' &&
+			*p != ')' && !is_operator_char(*p) &&
+			length < sizeof(q->token) - 1) {
+			q->token[length++] = *p++;
+		}
+	}
+	q->token[length] = '\0';
+	q->pos = p;
+
+	return 1;
+}
+
+static int peek_keyword(Query *q, const char *keyword) {
+	const char *saved = q->pos;
+	int found = next_token(q) && strcasecmp(q->token, keyword) == 0;
+
+	if (!found) {
+		q->pos = saved;
+	}
+
+	return found;
+}
+
+static int find_field(const char *name) {
+	for (int f = 0; f < FIELD_COUNT; ++f) {
+		if (strcasecmp(name, field_names[f]) == 0) {
+			return f;
+		}
+	}
+
+	return -1;
+}
+
+static int parse_op(const char *token) {
+	const char *ops[] = {"=", "!=", "<", "<=", ">", ">="};
+
+	if (strcmp(token, "==") == 0) {
+		return OP_EQ;
+	}
+	for (int i = 0; i < 6; ++i) {
+		if (strcmp(token, ops[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Times are in local time. Returns -1 if the value is not a time.
+ */
+static int64_t parse_time(const char *text) {
+	struct tm tm;
+	time_t now = time(NULL);
+	const char *end;
+
+	localtime_r(&now, &tm);
+	tm.tm_sec = 0;
+
+	if (strchr(text, 'T') != NULL) {
+		end = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+		if (end == NULL || *end != '\0') {
+			tm.tm_sec = 0;
+			end = strptime(text, "%Y-%m-%dT%H:%M", &tm);
+		}
+	} else if (strchr(text, ':') != NULL) {
+		end = strptime(text, "%H:%M:%S", &tm);
+		if (end == NULL || *end != '\0') {
+			tm.tm_sec = 0;
+			end = strptime(text, "%H:%M", &tm);
+		}
+	} else {
+		char *numEnd;
+		long long seconds = strtoll(text, &numEnd, 10);
+
+		return *numEnd == '\0' && numEnd != text ? seconds * 1000000 : -1;
+	}
+	if (end == NULL || *end != '\0') {
+		return -1;
+	}
+	tm.tm_isdst = -1;
+
+	return (int64_t) mktime(&tm) * 1000000;
+}
+
+/*
+ * Parses a number followed by an optional unit.
+ */
+static int parse_scaled(const char *text, const char **units,
+	const double *scales, int64_t *value) {
+	char *end;
+	double number = strtod(text, &end);
+
+	if (end == text) {
+		return -1;
+	}
+	for (int i = 0; units[i] != NULL; ++i) {
+		if (strcasecmp(end, units[i]) == 0) {
+			*value = (int64_t) (number * scales[i]);
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int parse_value(Query *q, QueryNode *node) {
+	const char *text = q->token;
+
+	switch (node->field) {
+	case FIELD_START:
+	case FIELD_END:
+		node->value = parse_time(text);
+
+		return node->value < 0 ? -1 : 0;
+	case FIELD_DURATION: {
+		const char *units[] = {"", "us", "ms", "s", "min", NULL};
+		const double scales[] = {1000, 1, 1000, 1000000, 60000000};
+
+		return parse_scaled(text, units, scales, &node->value);
+	}
+	case FIELD_REQUEST_SIZE:
+	case FIELD_RESPONSE_SIZE: {
+		const char *units[] = {"", "b", "k", "kb", "m", "mb", "g", "gb", NULL};
+		const double scales[] = {1, 1, 1024, 1024, 1048576, 1048576,
+			1073741824.0, 1073741824.0};
+
+		return parse_scaled(text, units, scales, &node->value);
+	}
+	case FIELD_STATUS:
+		if (strlen(text) == 3 && isdigit((unsigned char) text[0]) &&
+			tolower((unsigned char) text[1]) == 'x' &&
+			tolower((unsigned char) text[2]) == 'x') {
+			//Status class
+			int64_t low = (text[0] - '0') * 100, high = low + 99;
+
+			if (node->op == OP_EQ || node->op == OP_NE) {
+				node->op = node->op == OP_EQ ? OP_IN_RANGE : OP_NOT_IN_RANGE;
+				node->value = low;
+				node->value2 = high;
+			} else {
+				node->value = node->op == OP_LT || node->op == OP_GE ?
+					low : high;
+			}
+
+			return 0;
+		} else {
+			char *end;
+
+			node->value = strtol(text, &end, 10);
+
+			return *end == '\0' && end != text ? 0 : -1;
+		}
+	default:
+		if (node->op != OP_EQ && node->op != OP_NE) {
+			return -1;
+		}
+		snprintf(node->text, sizeof(node->text), "%s", text);
+		if (node->field == FIELD_METHOD) {
+			for (char *c = node->text; *c != '\0'; ++c) {
+				*c = toupper((unsigned char) *c);
+			}
+		}
+
+		return 0;
+	}
+}
+
+static QueryNode *parse_or(Query *q);
+
+static QueryNode *parse_unary(Query *q) {
+	if (peek_keyword(q, "not")) {
+		QueryNode *node = new_node(q, NODE_NOT);
+
+		if (node != NULL && (node->left = parse_unary(q)) == NULL) {
+			return NULL;
+		}
+
+		return node;
+	}
+	if (peek_keyword(q, "(")) {
+		QueryNode *node = parse_or(q);
+
+		if (node != NULL && !peek_keyword(q, ")")) {
+			snprintf(q->error, sizeof(q->error), "Missing ) in query.");
+
+			return NULL;
+		}
+
+		return node;
+	}
+
+	if (!next_token(q)) {
+		snprintf(q->error, sizeof(q->error), "Query ended early.");
+
+		return NULL;
+	}
+
+	int field = find_field(q->token);
+
+	if (field < 0) {
+		snprintf(q->error, sizeof(q->error), "Unknown field: %s", q->token);
+
+		return NULL;
+	}
+
+	QueryNode *node = new_node(q, NODE_COMPARE);
+
+	if (node == NULL) {
+		return NULL;
+	}
+	node->field = field;
+
+	next_token(q);
+	node->op = parse_op(q->token);
+	if (node->op < 0) {
+		snprintf(q->error, sizeof(q->error), "Expected comparison after %s.",
+			field_names[field]);
+
+		return NULL;
+	}
+
+	if (!next_token(q) || parse_value(q, node) < 0) {
+		snprintf(q->error, sizeof(q->error), "Bad value for %s: %s",
+			field_names[field], q->token);
+
+		return NULL;
+	}
+
+	return node;
+}
+
+static QueryNode *parse_and(Query *q) {
+	QueryNode *left = parse_unary(q);
+
+	while (left != NULL && peek_keyword(q, "and")) {
+		QueryNode *node = new_node(q, NODE_AND);
+
+		if (node == NULL) {
+			return NULL;
+		}
+		node->left = left;
+		node->right = parse_unary(q);
+		left = node->right == NULL ? NULL : node;
+	}
+
+	return left;
+}
+
+static QueryNode *parse_or(Query *q) {
+	QueryNode *left = parse_and(q);
+
+	while (left != NULL && peek_keyword(q, "or")) {
+		QueryNode *node = new_node(q, NODE_OR);
+
+		if (node == NULL) {
+			return NULL;
+		}
+		node->left = left;
+		node->right = parse_and(q);
+		left = node->right == NULL ? NULL : node;
+	}
+
+	return left;
+}
+
+static int parse_query(Query *q) {
+	const char *saved;
+
+	q->pos = q->input;
+	q->orderField = -1;
+	q->limit = -1;
+
+	//Is there a filter at all?
+	saved = q->pos;
+	if (!next_token(q) || strcasecmp(q->token, "order") == 0 ||
+		strcasecmp(q->token, "limit") == 0) {
+		q->pos = saved;
+		q->root = new_node(q, NODE_TRUE);
+	} else {
+		q->pos = saved;
+		q->root = parse_or(q);
+		if (q->root == NULL) {
+			return -1;
+		}
+	}
+
+	if (peek_keyword(q, "order")) {
+		if (!peek_keyword(q, "by") || !next_token(q) ||
+			(q->orderField = find_field(q->token)) < 0) {
+			snprintf(q->error, sizeof(q->error), "Bad order by clause.");
+
+			return -1;
+		}
+		if (peek_keyword(q, "desc")) {
+			q->descending = 1;
+		} else {
+			peek_keyword(q, "asc");
+		}
+	}
+	if (peek_keyword(q, "limit")) {
+		char *end;
+
+		if (!next_token(q) || (q->limit = strtol(q->token, &end, 10)) < 0 ||
+			*end != '\0') {
+			snprintf(q->error, sizeof(q->error), "Bad limit.");
+
+			return -1;
+		}
+	}
+	if (next_token(q)) {
+		snprintf(q->error, sizeof(q->error), "Unexpected in query: %s",
+			q->token);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Turns host and method names into IDs. A name that was never seen can't
+ * match anything. Methods past the first MAX_METHODS all get MAX_METHODS
+ * and are told apart by check_folded_methods().
+ */
+static void bind_names(MetaStore *s, Query *q) {
+	for (int i = 0; i < q->nodeCount; ++i) {
+		QueryNode *node = q->nodes + i;
+
+		if (node->kind != NODE_COMPARE ||
+			(node->field != FIELD_HOST && node->field != FIELD_METHOD)) {
+			continue;
+		}
+
+		StringTable *t = node->field == FIELD_HOST ? &s->hosts : &s->methods;
+		uint32_t id = string_table_find(t, node->text, strlen(node->text));
+
+		if (id == UINT32_MAX) {
+			node->kind = node->op == OP_EQ ? NODE_FALSE : NODE_TRUE;
+		} else {
+			node->value = node->field == FIELD_METHOD && id >= MAX_METHODS ?
+				MAX_METHODS : id;
+		}
+	}
+}
+
+/*
+ * Uses the zone map of a block to tell if a node can match any row in it.
+ */
+static int may_match(ZoneMap *z, QueryNode *node) {
+	switch (node->kind) {
+	case NODE_TRUE:
+		return 1;
+	case NODE_FALSE:
+		return 0;
+	case NODE_AND:
+		return may_match(z, node->left) && may_match(z, node->right);
+	case NODE_OR:
+		return may_match(z, node->left) || may_match(z, node->right);
+	case NODE_NOT:
+		return 1;
+	}
+
+	int64_t min = z->min[node->field], max = z->max[node->field];
+	int64_t v = node->value;
+
+	if (node->field == FIELD_METHOD && v == MAX_METHODS && node->op == OP_NE) {
+		//Rows with folded methods may still differ
+		return 1;
+	}
+
+	switch (node->op) {
+	case OP_EQ:
+		return v >= min && v <= max;
+	case OP_NE:
+		return !(min == v && max == v);
+	case OP_LT:
+		return min < v;
+	case OP_LE:
+		return min <= v;
+	case OP_GT:
+		return max > v;
+	case OP_GE:
+		return max >= v;
+	case OP_IN_RANGE:
+		return max >= v && min <= node->value2;
+	default:
+		return !(min >= v && max <= node->value2);
+	}
+}
+
+/*
+ * Copies a column of the block into values so that comparisons run over
+ * a plain array.
+ */
+static void load_column(MetaStore *s, int field, size_t from, size_t n,
+	int64_t *values) {
+	switch (field) {
+	case FIELD_START:
+		memcpy(values, s->start + from, n * sizeof(int64_t));
+		break;
+	case FIELD_END:
+		for (size_t i = 0; i < n; ++i) {
+			values[i] = s->start[from + i] + s->duration[from + i];
+		}
+		break;
+	case FIELD_DURATION:
+		memcpy(values, s->duration + from, n * sizeof(int64_t));
+		break;
+	case FIELD_HOST:
+		for (size_t i = 0; i < n; ++i) {
+			values[i] = s->host[from + i];
+		}
+		break;
+	case FIELD_METHOD:
+		for (size_t i = 0; i < n; ++i) {
+			values[i] = s->method[from + i];
+		}
+		break;
+	case FIELD_STATUS:
+		for (size_t i = 0; i < n; ++i) {
+			values[i] = s->status[from + i];
+		}
+		break;
+	case FIELD_REQUEST_SIZE:
+		for (size_t i = 0; i < n; ++i) {
+			values[i] = (int64_t) s->requestSize[from + i];
+		}
+		break;
+	default:
+		for (size_t i = 0; i < n; ++i) {
+			values[i] = (int64_t) s->responseSize[from + i];
+		}
+		break;
+	}
+}
+
+static void compare_values(const int64_t *values, size_t n, int op,
+	int64_t v, int64_t v2, uint8_t *mask) {
+	switch (op) {
+	case OP_EQ:
+		for (size_t i = 0; i < n; ++i) mask[i] = values[i] == v;
+		break;
+	case OP_NE:
+		for (size_t i = 0; i < n; ++i) mask[i] = values[i] != v;
+		break;
+	case OP_LT:
+		for (size_t i = 0; i < n; ++i) mask[i] = values[i] < v;
+		break;
+	case OP_LE:
+		for (size_t i = 0; i < n; ++i) mask[i] = values[i] <= v;
+		break;
+	case OP_GT:
+		for (size_t i = 0; i < n; ++i) mask[i] = values[i] > v;
+		break;
+	case OP_GE:
+		for (size_t i = 0; i < n; ++i) mask[i] = values[i] >= v;
+		break;
+	case OP_IN_RANGE:
+		for (size_t i = 0; i < n; ++i) {
+			mask[i] = (values[i] >= v) & (values[i] <= v2);
+		}
+		break;
+	default:
+		for (size_t i = 0; i < n; ++i) {
+			mask[i] = (values[i] < v) | (values[i] > v2);
+		}
+		break;
+	}
+}
+
+/*
+ * Methods past the first MAX_METHODS share one value in the column. Rows
+ * with that value are checked against the method in the record.
+ */
+static void check_folded_methods(MetaStore *s, Query *q, QueryNode *node,
+	size_t from, size_t n, const int64_t *values) {
+	if (node->value != MAX_METHODS ||
+		(node->op != OP_EQ && node->op != OP_NE)) {
+		return;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (values[i] != MAX_METHODS || s->removed[from + i]) {
+			continue;
+		}
+		if (q->record == NULL) {
+			q->record = newRequestRecord();
+		}
+
+		int isEqual = proxyServerLoadRequest(q->p, s->ids[from + i],
+			q->record) == 0 &&
+			strcmp(stringAsCString(q->record->method), node->text) == 0;
+
+		proxyServerResetRecords(q->p, q->record, NULL);
+		node->mask[i] = node->op == OP_EQ ? isEqual : !isEqual;
+	}
+}
+
+/*
+ * Evaluates a node over n rows of a block into node->mask.
+ */
+static void evaluate(MetaStore *s, Query *q, QueryNode *node, size_t from,
+	size_t n, int64_t *values) {
+	uint8_t *mask = node->mask;
+
+	switch (node->kind) {
+	case NODE_TRUE:
+	case NODE_FALSE:
+		memset(mask, node->kind == NODE_TRUE, n);
+		break;
+	case NODE_AND:
+		evaluate(s, q, node->left, from, n, values);
+		evaluate(s, q, node->right, from, n, values);
+		for (size_t i = 0; i < n; ++i) {
+			mask[i] = node->left->mask[i] & node->right->mask[i];
+		}
+		break;
+	case NODE_OR:
+		evaluate(s, q, node->left, from, n, values);
+		evaluate(s, q, node->right, from, n, values);
+		for (size_t i = 0; i < n; ++i) {
+			mask[i] = node->left->mask[i] | node->right->mask[i];
+		}
+		break;
+	case NODE_NOT:
+		evaluate(s, q, node->left, from, n, values);
+		for (size_t i = 0; i < n; ++i) {
+			mask[i] = !node->left->mask[i];
+		}
+		break;
+	default:
+		load_column(s, node->field, from, n, values);
+		compare_values(values, n, node->op, node->value, node->value2, mask);
+		if (node->field == FIELD_METHOD) {
+			check_folded_methods(s, q, node, from, n, values);
+		}
+		break;
+	}
+}
+
+typedef struct _SortKey {
+	int64_t key;
+	size_t row;
+} SortKey;
+
+static int compare_keys(const void *a, const void *b) {
+	const SortKey *k1 = a, *k2 = b;
+
+	if (k1->key != k2->key) {
+		return k1->key < k2->key ? -1 : 1;
+	}
+
+	return k1->row < k2->row ? -1 : k1->row > k2->row;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(**(char***) a, **(char***) b);
+}
+
+/*
+ * Rank of every string in alphabetical order so that rows can be sorted
+ * by host or method.
+ */
+static int64_t *string_ranks(StringTable *t) {
+	char ***order = malloc((t->count + 1) * sizeof(char**));
+	int64_t *ranks = malloc((t->count + 1) * sizeof(int64_t));
+
+	for (uint32_t i = 0; i < t->count; ++i) {
+		order[i] = t->strings + i;
+	}
+	qsort(order, t->count, sizeof(char**), compare_names);
+	for (uint32_t i = 0; i < t->count; ++i) {
+		ranks[order[i] - t->strings] = i;
+	}
+	free(order);
+
+	return ranks;
+}
+
+/*
+ * Runs a query and calls back for every matching record. Returns the
+ * number of matches or -1 if the query could not be parsed.
+ */
+long proxyServerQuery(ProxyServer *p, const char *query, void *contextData,
+	void (*callback)(void *contextData, QueryRow *row)) {
+	MetaStore *s = p->metaStore;
+
+	if (s == NULL) {
+		DIE(p, -1, "Meta data store is not running.");
+	}
+
+	Query q;
+
+	memset(&q, 0, sizeof(q));
+	q.input = query;
+	q.p = p;
+	q.nodes = malloc(MAX_QUERY_NODES * sizeof(QueryNode));
+	if (parse_query(&q) < 0) {
+		free(q.nodes);
+		DIE(p, -1, q.error);
+	}
+
+	int64_t *values = malloc(BLOCK_ROWS * sizeof(int64_t));
+	size_t matchCount = 0, matchCapacity = 1024;
+	SortKey *matches = malloc(matchCapacity * sizeof(SortKey));
+	//Without order by the scan can stop at the limit
+	size_t stopAt = q.orderField < 0 && q.limit >= 0 ? (size_t) q.limit :
+		SIZE_MAX;
+
+	pthread_rwlock_rdlock(&s->lock);
+	bind_names(s, &q);
+
+	for (size_t from = 0; from < s->rowCount && matchCount < stopAt;
+		from += BLOCK_ROWS) {
+		size_t n = s->rowCount - from < BLOCK_ROWS ?
+			s->rowCount - from : BLOCK_ROWS;
+
+		if (!may_match(s->zones + from / BLOCK_ROWS, q.root)) {
+			continue;
+		}
+
+		evaluate(s, &q, q.root, from, n, values);
+
+		for (size_t i = 0; i < n && matchCount < stopAt; ++i) {
+			if (!q.root->mask[i] || s->removed[from + i]) {
+				continue;
+			}
+			if (matchCount == matchCapacity) {
+				matchCapacity *= 2;
+				matches = realloc(matches, matchCapacity * sizeof(SortKey));
+			}
+			matches[matchCount].row = from + i;
+			matches[matchCount].key = 0;
+			++matchCount;
+		}
+	}
+
+	if (q.orderField >= 0) {
+		int64_t *ranks = NULL;
+
+		if (q.orderField == FIELD_HOST || q.orderField == FIELD_METHOD) {
+			ranks = string_ranks(q.orderField == FIELD_HOST ?
+				&s->hosts : &s->methods);
+		}
+		for (size_t i = 0; i < matchCount; ++i) {
+			int64_t key = field_value(s, q.orderField, matches[i].row);
+
+			if (ranks != NULL) {
+				key = q.orderField == FIELD_METHOD && key == MAX_METHODS ?
+					INT64_MAX : ranks[key];
+			}
+			matches[i].key = q.descending ? -key : key;
+		}
+		free(ranks);
+		qsort(matches, matchCount, sizeof(SortKey), compare_keys);
+	}
+	if (q.limit >= 0 && matchCount > (size_t) q.limit) {
+		matchCount = q.limit;
+	}
+
+	//Copy the results out so that the callback runs without the lock
+	char (*ids)[ID_LENGTH] = malloc((matchCount + 1) * ID_LENGTH);
+	QueryRow *rows = malloc((matchCount + 1) * sizeof(QueryRow));
+
+	for (size_t i = 0; i < matchCount; ++i) {
+		size_t row = matches[i].row;
+		QueryRow *r = rows + i;
+
+		memcpy(ids[i], s->ids[row], ID_LENGTH);
+		r->uniqueId = ids[i];
+		//Strings are never removed from the tables
+		r->host = s->hosts.strings[s->host[row]];
+		r->method = s->method[row] < MAX_METHODS ?
+			s->methods.strings[s->method[row]] : "";
+		r->status = s->status[row];
+		r->startTime = s->start[row];
+		r->duration = s->duration[row];
+		r->requestSize = s->requestSize[row];
+		r->responseSize = s->responseSize[row];
+	}
+
+	pthread_rwlock_unlock(&s->lock);
+
+	if (callback != NULL) {
+		for (size_t i = 0; i < matchCount; ++i) {
+			callback(contextData, rows + i);
+		}
+	}
+
+	free(rows);
+	free(ids);
+	free(matches);
+	free(values);
+	free(q.nodes);
+	if (q.record != NULL) {
+		deleteRequestRecord(q.record);
+	}
+
+	return matchCount;
+}
@@ -0,0 +1,35 @@
+/*
+ * Column store of record meta data that answers queries without loading
+ * meta files. Kept up to date by a background thread that follows the
+ * persistence folder and saved in the folder between runs.
+ *
+ * Queries are written in a small expression language:
+ *
+ *   status >= 500 and host = api.example.com and start >= 14:00
+ *     and start < 14:05 and duration > 2s order by duration desc limit 20
+ *
+ * Fields are start, end, duration, host, method, status, reqsize and
+ * ressize. Comparisons can be combined with and, or, not and parentheses.
+ * Times are HH:MM[:SS] today, YYYY-MM-DDTHH:MM[:SS] or seconds since the
+ * epoch. Durations take us, ms (the default), s or min. Sizes take k or m.
+ * A status like 5xx matches the whole class.
+ */
+#define META_STORE_FILE "capture.columns"
+
+typedef struct _QueryRow {
+	const char *uniqueId;
+	const char *host;
+	const char *method;
+	int status;
+	long long startTime; //Microseconds since the epoch
+	long long duration; //Microseconds
+	unsigned long long requestSize;
+	unsigned long long responseSize;
+} QueryRow;
+
+int proxyServerStartMetaStore(ProxyServer *p);
+void proxyServerStopMetaStore(ProxyServer *p);
+void proxyServerWaitMetaStore(ProxyServer *p);
+long proxyServerQuery(ProxyServer *p, const char *query, void *contextData,
+	void (*callback)(void *contextData, QueryRow *row));
+void metaStoreRecordRemoved(ProxyServer *p, const char *uniqueId);
@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+
+#include "Proxy.h"
+#include "Metrics.h"
+#include "Alloc.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+//Threads beyond this share shards. Updates are still atomic.
+#define MAX_SHARDS 16
+//Values below this have a bucket each
+#define LINEAR_BUCKETS 16
+#define SUB_BUCKET_BITS 3
+
+typedef struct _MetricShard {
+	long long values[METRIC_COUNT];
+	HistogramSnapshot histograms[HISTOGRAM_COUNT];
+} __attribute__((aligned(64))) MetricShard;
+
+typedef struct _Metrics {
+	MetricShard shards[MAX_SHARDS];
+	//Admin listener
+	pthread_t threadId;
+	int listenFd;
+	int stopRequested;
+} Metrics;
+
+typedef struct _MetricInfo {
+	const char *name;
+	const char *type;
+	const char *help;
+} MetricInfo;
+
+static const MetricInfo metric_info[METRIC_COUNT] = {
+	{"pixie_connections_accepted_total", "counter",
+		"Client connections accepted."},
+	{"pixie_connections_rejected_total", "counter",
+		"Client connections closed because every slot was in use."},
+	{"pixie_active_slots", "gauge", "Client connections in use."},
+	{"pixie_requests_total", "counter", "Requests started."},
+	{"pixie_request_bytes_total", "counter", "Bytes read from clients."},
+	{"pixie_response_bytes_total", "counter", "Bytes read from servers."},
+	{"pixie_dns_failures_total", "counter",
+		"Server names that could not be resolved."},
+	{"pixie_connect_failures_total", "counter",
+		"Connections to servers that failed."},
+	{"pixie_commit_backlog", "gauge",
+		"Records waiting to be made durable."},
+	{"pixie_cache_hits_total", "counter",
+		"Responses served from the response cache."},
+	{"pixie_cache_revalidated_total", "counter",
+		"Stale cached responses served after the server answered 304."},
+	{"pixie_cache_misses_total", "counter",
+		"Requests looked up in the response cache and sent to the server."},
+	{"pixie_replay_served_total", "counter",
+		"Requests answered from a captured record in replay mode."},
+	{"pixie_replay_missed_total", "counter",
+		"Requests that matched no captured record in replay mode."},
+	{"pixie_rule_matches_total", "counter",
+		"Requests matched by at least one rule."},
+	{"pixie_rule_blocks_total", "counter",
+		"Requests blocked by a rule."},
+	{"pixie_shaping_delays_total", "counter",
+		"Writes held back by bandwidth shaping."},
+	{"pixie_shaping_stalls_total", "counter",
+		"Writes stalled to emulate packet loss."},
+	{"pixie_shaping_hosts", "gauge",
+		"Hosts with their own shaping buckets."}
+};
+
+static const MetricInfo histogram_info[HISTOGRAM_COUNT] = {
+	{"pixie_request_duration_seconds", "histogram",
+		"Time from the start of a request to the end of its response."},
+	{"pixie_connect_seconds", "histogram",
+		"Time taken to resolve and connect to a server."},
+	{"pixie_time_to_first_byte_seconds", "histogram",
+		"Time from sending a request to the first byte of the response."}
+};
+
+//Bucket bounds in seconds for the Prometheus text format
+static const double export_bounds[] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1,
+	2.5, 5, 10, 30, 60
+};
+
+static int next_thread_slot = 0;
+static __thread int thread_slot = -1;
+
+static MetricShard *get_shard(ProxyServer *p) {
+	if (thread_slot < 0) {
+		thread_slot = __atomic_fetch_add(&next_thread_slot, 1,
+			__ATOMIC_RELAXED);
+	}
+
+	return p->metrics->shards + thread_slot % MAX_SHARDS;
+}
+
+static int bucket_of(unsigned long long value) {
+	if (value < LINEAR_BUCKETS) {
+		return (int) value;
+	}
+
+	int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+	int bucket = (shift + 1) * (1 << SUB_BUCKET_BITS) + (int) (value >> shift) -
+		(1 << SUB_BUCKET_BITS);
+
+	return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+//Smallest value that goes in a bucket
+static unsigned long long bucket_start(int bucket) {
+	if (bucket < LINEAR_BUCKETS) {
+		return bucket;
+	}
+
+	int shift = bucket / (1 << SUB_BUCKET_BITS) - 1;
+	unsigned long long sub = bucket % (1 << SUB_BUCKET_BITS) +
+		(1 << SUB_BUCKET_BITS);
+
+	return sub << shift;
+}
+
+struct _Metrics *newMetrics() {
+	Metrics *m = NULL;
+
+	if (posix_memalign((void**) &m, 64, sizeof(Metrics)) != 0) {
+		return NULL;
+	}
+	memset(m, 0, sizeof(Metrics));
+	m->listenFd = -1;
+
+	return m;
+}
+
+void deleteMetrics(struct _Metrics *m) {
+	free(m);
+}
+
+/*
+ * Adds to a counter or gauge. Can be called from any thread.
+ */
+void metricsAdd(ProxyServer *p, int metricId, long long delta) {
+	if (p->metrics == NULL) {
+		return;
+	}
+
+	MetricShard *shard = get_shard(p);
+
+	__atomic_fetch_add(&shard->values[metricId], delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * Records a duration in microseconds. Can be called from any thread.
+ */
+void metricsRecord(ProxyServer *p, int histogramId, long long micros) {
+	if (p->metrics == NULL || micros < 0) {
+		return;
+	}
+
+	HistogramSnapshot *h = get_shard(p)->histograms + histogramId;
+
+	__atomic_fetch_add(&h->buckets[bucket_of(micros)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, micros, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Records a value in a histogram owned by the caller. Not thread safe.
+ */
+void histogramAdd(HistogramSnapshot *h, long long micros) {
+	if (micros < 0) {
+		return;
+	}
+
+	h->buckets[bucket_of(micros)] += 1;
+	h->sum += micros;
+	h->count += 1;
+}
+
+/*
+ * Adds up the shards. Values being updated while this runs may be
+ * partly included.
+ */
+int proxyServerGetMetrics(ProxyServer *p, MetricsSnapshot *snapshot) {
+	memset(snapshot, 0, sizeof(MetricsSnapshot));
+	if (p->metrics == NULL) {
+		return -1;
+	}
+
+	for (int s = 0; s < MAX_SHARDS; ++s) {
+		MetricShard *shard = p->metrics->shards + s;
+
+		for (int i = 0; i < METRIC_COUNT; ++i) {
+			snapshot->values[i] += __atomic_load_n(&shard->values[i],
+				__ATOMIC_RELAXED);
+		}
+		for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+			HistogramSnapshot *from = shard->histograms + i;
+			HistogramSnapshot *to = snapshot->histograms + i;
+
+			if (__atomic_load_n(&from->count, __ATOMIC_RELAXED) == 0) {
+				continue;
+			}
+			to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+			to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+			for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+				to->buckets[b] += __atomic_load_n(&from->buckets[b],
+					__ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the value in microseconds below which the given fraction of
+ * recorded values fall. Returns -1 if nothing was recorded.
+ */
+long long histogramQuantile(const HistogramSnapshot *h, double quantile) {
+	unsigned long long total = 0;
+
+	for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		total += h->buckets[b];
+	}
+	if (total == 0) {
+		return -1;
+	}
+
+	unsigned long long rank = (unsigned long long) (quantile * total);
+	unsigned long long seen = 0;
+
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+		seen += h->buckets[b];
+		if (seen > rank) {
+			//Report the top of the bucket
+			return b + 1 < HISTOGRAM_BUCKETS ? bucket_start(b + 1) - 1 :
+				bucket_start(b);
+		}
+	}
+
+	return bucket_start(HISTOGRAM_BUCKETS - 1);
+}
+
+static void append_format(Buffer *out, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void append_format(Buffer *out, const char *format, ...) {
+	char line[256];
+	va_list args;
+
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	if (length > 0) {
+		bufferAppendBytes(out, line,
+			length < (int) sizeof(line) ? length : (int) sizeof(line) - 1);
+	}
+}
+
+static void append_header(Buffer *out, const MetricInfo *info) {
+	append_format(out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help,
+		info->name, info->type);
+}
+
+/*
+ * Writes the metrics in the Prometheus text exposition format.
+ */
+void proxyServerFormatMetrics(ProxyServer *p, Buffer *out) {
+	MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+
+	proxyServerGetMetrics(p, snapshot);
+	for (int i = 0; i < METRIC_COUNT; ++i) {
+		append_header(out, metric_info + i);
+		append_format(out, "%s %lld\n", metric_info[i].name,
+			snapshot->values[i]);
+	}
+
+	for (int i = 0; i < HISTOGRAM_COUNT; ++i) {
+		HistogramSnapshot *h = snapshot->histograms + i;
+		const char *name = histogram_info[i].name;
+		unsigned long long cumulative = 0;
+		int b = 0;
+
+		append_header(out, histogram_info + i);
+		for (size_t j = 0; j < sizeof(export_bounds) / sizeof(export_bounds[0]);
+			++j) {
+			unsigned long long bound = export_bounds[j] * 1000000;
+
+			//A bucket counts under a bound once all of its values are at
+			//or below it. The last bucket has no top.
+			for (; b + 1 < HISTOGRAM_BUCKETS &&
+				bucket_start(b + 1) - 1 <= bound; ++b) {
+				cumulative += h->buckets[b];
+			}
+			append_format(out, "%s_bucket{le=\"%g\"} %llu\n", name,
+				export_bounds[j], cumulative);
+		}
+		append_format(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, h->count);
+		append_format(out, "%s_sum %.6f\n", name, h->sum / 1000000.0);
+		append_format(out, "%s_count %llu\n", name, h->count);
+	}
+	allocFormatMetrics(out);
+
+	free(snapshot);
+}
+
+static void serve_scrape(ProxyServer *p, int fd) {
+	char request[1024];
+	struct timeval timeout = {1, 0};
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	//Any request gets the metrics. Only the start of it is read.
+	if (read(fd, request, sizeof(request)) <= 0) {
+		return;
+	}
+
+	Buffer *body = newBufferWithCapacity(16 * 1024);
+	Buffer *response = newBufferWithCapacity(16 * 1024 + 256);
+
+	proxyServerFormatMetrics(p, body);
+	append_format(response, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n", body->length);
+	bufferAppendBytes(response, body->buffer, body->length);
+
+	for (size_t written = 0; written < response->length; ) {
+		ssize_t n = write(fd, response->buffer + written,
+			response->length - written);
+
+		if (n <= 0) {
+			break;
+		}
+		written += n;
+	}
+
+	deleteBuffer(body);
+	deleteBuffer(response);
+}
+
+static void *admin_loop(void *data) {
+	ProxyServer *p = data;
+	Metrics *m = p->metrics;
+
+	while (!__atomic_load_n(&m->stopRequested, __ATOMIC_ACQUIRE)) {
+		int fd = accept(m->listenFd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			//The socket was shut down
+			break;
+		}
+		serve_scrape(p, fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts the admin listener on metricsPort. It listens on loopback
+ * unless metricsAddress says otherwise.
+ */
+int proxyServerStartMetrics(ProxyServer *p) {
+	Metrics *m = p->metrics;
+
+	if (m == NULL || m->listenFd >= 0 || p->metricsPort <= 0) {
+		return 0;
+	}
+
+	int sock = socket(PF_INET, SOCK_STREAM, 0);
+
+	DIE(p, sock, "Failed to open metrics socket.");
+
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(p->metricsPort);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (p->metricsAddress != NULL &&
+		inet_pton(AF_INET, p->metricsAddress, &addr.sin_addr) != 1) {
+		close(sock);
+		DIE(p, -1, "Invalid metrics address.");
+	}
+
+	if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+		listen(sock, 10) < 0) {
+		close(sock);
+		DIE(p, -1, "Failed to listen on metrics port.");
+	}
+
+	m->listenFd = sock;
+	m->stopRequested = 0;
+
+	int status = pthread_create(&m->threadId, NULL, admin_loop, p);
+
+	if (status != 0) {
+		close(sock);
+		m->listenFd = -1;
+		DIE(p, -1, "Failed to create metrics thread.");
+	}
+
+	return 0;
+}
+
+void proxyServerStopMetrics(ProxyServer *p) {
+	Metrics *m = p->metrics;
+
+	if (m == NULL || m->listenFd < 0) {
+		return;
+	}
+
+	__atomic_store_n(&m->stopRequested, 1, __ATOMIC_RELEASE);
+	//Wakes up accept()
+	shutdown(m->listenFd, SHUT_RDWR);
+	pthread_join(m->threadId, NULL);
+	close(m->listenFd);
+	m->listenFd = -1;
+}
@@ -0,0 +1,66 @@
+/*
+ * Counters and latency histograms about the proxy itself. Every thread
+ * that updates metrics gets its own shard so an update is a relaxed
+ * atomic add to a cache line no other thread writes. Readers add the
+ * shards up.
+ *
+ * Histograms hold microseconds in log linear buckets like an HDR
+ * histogram. Each power of two is split into 8 buckets so a value is
+ * known to within 12.5%.
+ *
+ * Metrics are read with proxyServerGetMetrics() or scraped in the
+ * Prometheus text format from the admin listener on metricsPort.
+ */
+typedef enum _MetricId {
+	METRIC_CONNECTIONS_ACCEPTED,
+	METRIC_CONNECTIONS_REJECTED, //No free slot
+	METRIC_ACTIVE_SLOTS, //Gauge
+	METRIC_REQUESTS,
+	METRIC_REQUEST_BYTES, //Read from clients
+	METRIC_RESPONSE_BYTES, //Read from servers
+	METRIC_DNS_FAILURES,
+	METRIC_CONNECT_FAILURES,
+	METRIC_COMMIT_BACKLOG, //Gauge. Records waiting to be made durable.
+	METRIC_CACHE_HITS, //Served from the response cache
+	METRIC_CACHE_REVALIDATED, //Served from the cache after a 304
+	METRIC_CACHE_MISSES, //Looked up and sent to the server
+	METRIC_REPLAY_SERVED, //Answered from a captured record
+	METRIC_REPLAY_MISSED, //Matched no captured record
+	METRIC_RULE_MATCHES, //Requests matched by a rule
+	METRIC_RULE_BLOCKS, //Requests blocked by a rule
+	METRIC_SHAPING_DELAYS, //Writes held back for lack of tokens
+	METRIC_SHAPING_STALLS, //Emulated packet loss stalls
+	METRIC_SHAPING_HOSTS, //Gauge. Hosts with their own buckets.
+	METRIC_COUNT
+} MetricId;
+
+typedef enum _HistogramId {
+	HISTOGRAM_REQUEST_DURATION, //Start of request to end of response
+	HISTOGRAM_CONNECT, //Header complete to server connected
+	HISTOGRAM_TIME_TO_FIRST_BYTE, //Request sent to first response byte
+	HISTOGRAM_COUNT
+} HistogramId;
+
+#define HISTOGRAM_BUCKETS 304
+
+typedef struct _HistogramSnapshot {
+	unsigned long long count;
+	unsigned long long sum; //Microseconds
+	unsigned long long buckets[HISTOGRAM_BUCKETS];
+} HistogramSnapshot;
+
+typedef struct _MetricsSnapshot {
+	long long values[METRIC_COUNT];
+	HistogramSnapshot histograms[HISTOGRAM_COUNT];
+} MetricsSnapshot;
+
+struct _Metrics *newMetrics();
+void deleteMetrics(struct _Metrics *m);
+void metricsAdd(ProxyServer *p, int metricId, long long delta);
+void metricsRecord(ProxyServer *p, int histogramId, long long micros);
+int proxyServerGetMetrics(ProxyServer *p, MetricsSnapshot *snapshot);
+void histogramAdd(HistogramSnapshot *h, long long micros);
+long long histogramQuantile(const HistogramSnapshot *h, double quantile);
+void proxyServerFormatMetrics(ProxyServer *p, Buffer *out);
+int proxyServerStartMetrics(ProxyServer *p);
+void proxyServerStopMetrics(ProxyServer *p);
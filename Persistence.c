@@ -6,12 +6,21 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "Proxy.h"
 #include "Persistence.h"
+#include "HeaderCodec.h"
+#include "Ring.h"
+#include "HistoryFeed.h"
+#include "Index.h"
+#include "MetaStore.h"
+#include "ResponseCache.h"
+#include "Alloc.h"
 
 #define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
 
@@ -26,8 +35,77 @@
 #define PARSE_STATUS_MESSAGE 8
 #define PARSE_DONE 9
 
+#define DEFAULT_HISTORY_BATCH 256
+
 #define FORM_ENC "application/x-www-form-urlencoded"
-#define CONTENT_TYPE "Content-Type"
+#define MULTIPART_FORM "multipart/form-data"
+//Longest boundary allowed by RFC 2046
+#define MAX_BOUNDARY 70
+#define ARENA_BLOCK 4096
+
+//Bump allocator for decoded parameters. Blocks never move.
+typedef struct _ArenaBlock {
+	struct _ArenaBlock *next;
+	size_t used;
+	size_t capacity;
+	char data[];
+} ArenaBlock;
+
+static char *arena_alloc(ArenaBlock **arena, size_t length) {
+	ArenaBlock *block = *arena;
+
+	if (block == NULL || block->capacity - block->used < length) {
+		size_t capacity = length > ARENA_BLOCK ? length : ARENA_BLOCK;
+
+		block = malloc(sizeof(ArenaBlock) + capacity);
+		block->next = *arena;
+		block->used = 0;
+		block->capacity = capacity;
+		*arena = block;
+	}
+
+	char *data = block->data + block->used;
+
+	block->used += length;
+
+	return data;
+}
+
+/*
+ * Keeps the newest block for the next record and frees the rest.
+ */
+static void arena_reset(ArenaBlock **arena, int freeAll) {
+	ArenaBlock *block = *arena;
+
+	if (block == NULL) {
+		return;
+	}
+
+	ArenaBlock *next = block->next;
+
+	while (next != NULL) {
+		ArenaBlock *later = next->next;
+
+		free(next);
+		next = later;
+	}
+	block->next = NULL;
+	block->used = 0;
+
+	if (freeAll) {
+		free(block);
+		*arena = NULL;
+	}
+}
+
+static void clear_timings(PhaseTimings *t) {
+	t->headerComplete = -1;
+	t->dnsDone = -1;
+	t->connectDone = -1;
+	t->requestSent = -1;
+	t->firstByte = -1;
+	t->responseComplete = -1;
+}
 
 RequestRecord *newRequestRecord() {
 	RequestRecord *rec = calloc(1, sizeof(RequestRecord));
@@ -43,6 +121,8 @@ RequestRecord *newRequestRecord() {
 	rec->headerValues = newArray(10);
 	rec->parameterNames = newArray(10);
 	rec->parameterValues = newArray(10);
+	rec->decoded = newBufferWithCapacity(1024);
+	clear_timings(&rec->timings);
 
 	rec->fd = -1;
 
@@ -57,12 +137,58 @@ ResponseRecord *newResponseRecord() {
 
 	rec->headerNames = newArray(10);
 	rec->headerValues = newArray(10);
+	rec->decoded = newBufferWithCapacity(1024);
 
 	rec->fd = -1;
 
 	return rec;
 }
 
+static void clear_strings(Array *names, Array *values) {
+	for (size_t i = 0; i < names->length; ++i) {
+		deleteString(arrayGet(names, i));
+		arraySet(names, i, NULL);
+	}
+	for (size_t i = 0; i < values->length; ++i) {
+		deleteString(arrayGet(values, i));
+		arraySet(values, i, NULL);
+	}
+	names->length = 0;
+	values->length = 0;
+}
+
+static void reset_field_list(FieldList *list) {
+	list->length = 0;
+	list->isParsed = 0;
+}
+
+static void free_field_list(FieldList *list) {
+	free(list->names);
+	free(list->values);
+	free(list->flags);
+	free(list->ids);
+	memset(list, 0, sizeof(FieldList));
+}
+
+static void field_list_add(FieldList *list, const char *name, size_t nameLength,
+	const char *value, size_t valueLength) {
+	if (list->length == list->capacity) {
+		list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+		list->names = realloc(list->names, list->capacity * sizeof(Slice));
+		list->values = realloc(list->values, list->capacity * sizeof(Slice));
+		list->flags = realloc(list->flags, list->capacity);
+		list->ids = realloc(list->ids, list->capacity * sizeof(unsigned short));
+	}
+
+	list->names[list->length].buffer = name;
+	list->names[list->length].length = nameLength;
+	list->values[list->length].buffer = value;
+	list->values[list->length].length = valueLength;
+	list->flags[list->length] = 0;
+	list->ids[list->length] = HEADER_UNKNOWN;
+	++list->length;
+}
+
 void reset_request_record(RequestRecord *rec) {
 	rec->host->length = 0;
 	rec->port->length = 0;
@@ -70,37 +196,29 @@ void reset_request_record(RequestRecord *rec) {
 	rec->protocol->length = 0;
 	rec->path->length = 0;
 	rec->queryString->length = 0;
-
-	//Delete all header strings
-	for (size_t i = 0; i < rec->headerNames->length; ++i) {
-		deleteString(arrayGet(rec->headerNames, i));
-		arraySet(rec->headerNames, i, NULL);
-	}
-	for (size_t i = 0; i < rec->headerValues->length; ++i) {
-		deleteString(arrayGet(rec->headerValues, i));
-		arraySet(rec->headerValues, i, NULL);
-	}
-	rec->headerNames->length = 0;
-	rec->headerValues->length = 0;
-
-	//Delete all parameter strings
-	for (size_t i = 0; i < rec->parameterNames->length; ++i) {
-		deleteString(arrayGet(rec->parameterNames, i));
-		arraySet(rec->parameterNames, i, NULL);
-	}
-	for (size_t i = 0; i < rec->parameterValues->length; ++i) {
-		deleteString(arrayGet(rec->parameterValues, i));
-		arraySet(rec->parameterValues, i, NULL);
-	}
-	rec->parameterNames->length = 0;
-	rec->parameterValues->length = 0;
-
-	if (rec->map.buffer != NULL && rec->map.buffer != MAP_FAILED) {
+	timerclear(&rec->requestStartTime);
+	timerclear(&rec->responseEndTime);
+	clear_timings(&rec->timings);
+	rec->size = 0;
+
+	//Delete all header and parameter strings
+	clear_strings(rec->headerNames, rec->headerValues);
+	clear_strings(rec->parameterNames, rec->parameterValues);
+	reset_field_list(&rec->headers);
+	reset_field_list(&rec->parameters);
+	reset_field_list(&rec->parts);
+	rec->queryParameterCount = 0;
+	rec->partsStart = 0;
+	arena_reset(&rec->arena, 0);
+	rec->arraysFilled = 0;
+
+	if (rec->map.buffer != NULL && rec->map.buffer != MAP_FAILED &&
+		rec->map.buffer != rec->decoded->buffer) {
 		munmap(rec->map.buffer, rec->map.length);
-
-		rec->map.buffer = NULL;
-		rec->map.length = 0;
 	}
+	rec->map.buffer = NULL;
+	rec->map.length = 0;
+	rec->decoded->length = 0;
 
 	if (rec->fd >= 0) {
 		close(rec->fd);	
@@ -114,25 +232,21 @@ void reset_request_record(RequestRecord *rec) {
 void reset_response_record(ResponseRecord *rec) {
 	rec->statusCode->length = 0;
 	rec->statusMessage->length = 0;
+	rec->size = 0;
+	rec->cacheStatus = CACHE_NONE;
 
 	//Delete all header strings
-	for (size_t i = 0; i < rec->headerNames->length; ++i) {
-		deleteString(arrayGet(rec->headerNames, i));
-		arraySet(rec->headerNames, i, NULL);
-	}
-	for (size_t i = 0; i < rec->headerValues->length; ++i) {
-		deleteString(arrayGet(rec->headerValues, i));
-		arraySet(rec->headerValues, i, NULL);
-	}
-	rec->headerNames->length = 0;
-	rec->headerValues->length = 0;
+	clear_strings(rec->headerNames, rec->headerValues);
+	reset_field_list(&rec->headers);
+	rec->arraysFilled = 0;
 
-	if (rec->map.buffer != NULL && rec->map.buffer != MAP_FAILED) {
+	if (rec->map.buffer != NULL && rec->map.buffer != MAP_FAILED &&
+		rec->map.buffer != rec->decoded->buffer) {
 		munmap(rec->map.buffer, rec->map.length);
-
-		rec->map.buffer = NULL;
-		rec->map.length = 0;
 	}
+	rec->map.buffer = NULL;
+	rec->map.length = 0;
+	rec->decoded->length = 0;
 	if (rec->fd >= 0) {
 		close(rec->fd);	
 		rec->fd = -1;
@@ -155,6 +269,11 @@ void deleteRequestRecord(RequestRecord *rec) {
 	deleteArray(rec->headerValues);
 	deleteArray(rec->parameterNames);
 	deleteArray(rec->parameterValues);
+	deleteBuffer(rec->decoded);
+	free_field_list(&rec->headers);
+	free_field_list(&rec->parameters);
+	free_field_list(&rec->parts);
+	arena_reset(&rec->arena, 1);
 
 	free(rec);
 }
@@ -167,364 +286,1065 @@ void deleteResponseRecord(ResponseRecord *rec) {
 
 	deleteArray(rec->headerNames);
 	deleteArray(rec->headerValues);
+	deleteBuffer(rec->decoded);
+	free_field_list(&rec->headers);
 
 	free(rec);
 }
 
-static void parse_url_params(const char *buffer, size_t length, 
-	Array *names, Array *values) {
-
-	int is_name = 1;
-	String *name = NULL, *value = NULL;
+static void parse_url_params(const char *buffer, size_t length,
+	FieldList *list) {
+	size_t start = 0;
+
+	while (start < length) {
+		const char *pair = buffer + start;
+		const char *end = memchr(pair, '&', length - start);
+		size_t pairLength = end == NULL ? length - start : (size_t) (end - pair);
+		const char *eq = memchr(pair, '=', pairLength);
+
+		if (eq == NULL) {
+			//Empty value
+			field_list_add(list, pair, pairLength, pair + pairLength, 0);
+		} else {
+			field_list_add(list, pair, eq - pair,
+				eq + 1, pairLength - (eq - pair) - 1);
+		}
+		list->flags[list->length - 1] = FIELD_URL_ENCODED;
 
-	for (size_t i = 0; i < length; ++i) {
-		char ch = buffer[i];
+		start += pairLength + 1;
+	}
+}
 
-		if (is_name == 1) {
-			if (name == NULL) {
-				name = newString();
-			}
-			if (ch == '=') {
-				is_name = 0;
-				arrayAdd(names, name);
-				name = NULL;
+static int slice_equals(Slice *s, const char *str) {
+	size_t length = strlen(str);
 
-				continue;
-			}
-			if (ch == '&') {
-				//Empty value
-				is_name = 1;
-				arrayAdd(names, name);
-				arrayAdd(values, newString());
-				name = NULL;
+	return s->length == length && strncasecmp(s->buffer, str, length) == 0;
+}
 
-				continue;
-			}
-			stringAppendChar(name, ch);
-			continue;
-		}
-		if (is_name == 0) {
-			if (value == NULL) {
-				value = newString();
-			}
+static int slice_has_prefix(Slice *s, const char *str) {
+	size_t length = strlen(str);
 
-			if (ch == '&') {
-				is_name = 1;
-				arrayAdd(values, value);
-				value = NULL;
+	return s->length >= length && strncasecmp(s->buffer, str, length) == 0;
+}
 
-				continue;
-			}
-			stringAppendChar(value, ch);
-			continue;
-		}
+static int hex_value(char ch) {
+	if (ch >= '0' && ch <= '9') {
+		return ch - '0';
 	}
-	if (is_name == 1 && name != NULL) {
-		//Query ended with a name
-		arrayAdd(names, name);
-		arrayAdd(values, newString());
-	} else if (is_name == 0 && value != NULL) {
-		//Query ended with a value
-		arrayAdd(values, value);
-	} else if (is_name == 0 && value == NULL) {
-		//Query ended with an empty value
-		arrayAdd(values, newString());
+	if (ch >= 'a' && ch <= 'f') {
+		return ch - 'a' + 10;
 	}
+	if (ch >= 'A' && ch <= 'F') {
+		return ch - 'A' + 10;
+	}
+
+	return -1;
 }
 
-static String *get_header_value(const char *name, RequestRecord *rec) {
-	for (size_t i = 0; i < rec->headerNames->length; ++i) {
-		String *thisName = arrayGet(rec->headerNames, i);
-		if (stringEqualsCString(thisName, name)) {
-			return arrayGet(rec->headerValues, i);
+/*
+ * Decodes %XX and + into the arena. Slices with nothing to decode are
+ * left pointing into the record. Bad escapes are kept as is.
+ */
+static void url_decode(Slice *s, ArenaBlock **arena) {
+	const char *in = s->buffer, *end = s->buffer + s->length;
+
+	if (memchr(in, '%', s->length) == NULL && memchr(in, '+', s->length) == NULL) {
+		return;
+	}
+
+	char *out = arena_alloc(arena, s->length), *start = out;
+
+	while (in < end) {
+		if (*in == '+') {
+			*out++ = ' ';
+			++in;
+		} else if (*in == '%' && end - in >= 3 &&
+			hex_value(in[1]) >= 0 && hex_value(in[2]) >= 0) {
+			*out++ = (char) (hex_value(in[1]) * 16 + hex_value(in[2]));
+			in += 3;
+		} else {
+			*out++ = *in++;
 		}
 	}
 
-	return NULL;
+	s->buffer = start;
+	s->length = out - start;
 }
 
-String *responseRecordGetHeader(ResponseRecord *rec, const char *name) {
-	for (size_t i = 0; i < rec->headerNames->length; ++i) {
-		String *thisName = arrayGet(rec->headerNames, i);
-		if (stringEqualsCString(thisName, name)) {
-			return arrayGet(rec->headerValues, i);
+/*
+ * Boyer-Moore-Horspool search so that large uploads are skipped over
+ * several bytes at a time.
+ */
+static const char *find_delimiter(const char *data, size_t length,
+	const char *delimiter, size_t delimiterLength, const size_t *skip) {
+	size_t pos = 0;
+	unsigned char last = delimiter[delimiterLength - 1];
+
+	while (pos + delimiterLength <= length) {
+		unsigned char ch = data[pos + delimiterLength - 1];
+
+		if (ch == last && memcmp(data + pos, delimiter, delimiterLength - 1) == 0) {
+			return data + pos;
 		}
+		pos += skip[ch];
 	}
 
 	return NULL;
 }
 
-int proxyServerLoadRequest(ProxyServer *p, const char *uniqueId,
-        RequestRecord *rec) {
-
-	reset_request_record(rec);
+/*
+ * Reads a parameter of a header value like name="x" into value. Quotes
+ * are removed.
+ */
+static int find_header_param(const char *buffer, const char *end,
+	const char *name, Slice *value) {
+	size_t nameLength = strlen(name);
+	const char *p = memchr(buffer, ';', end - buffer);
+
+	while (p != NULL && p < end) {
+		++p;
+		while (p < end && (*p == ' ' || *p == '\t')) {
+			++p;
+		}
 
-	char file_name[512];
-	struct stat stat_buf;
-	snprintf(file_name, sizeof(file_name), "%s/%s.req",
-		stringAsCString(p->persistenceFolder), uniqueId);
+		const char *next = memchr(p, ';', end - p);
+		const char *paramEnd = next == NULL ? end : next;
 
-	rec->fd = open(file_name, O_RDONLY);
-	DIE(p, rec->fd, "Failed to open request file.");
+		if (paramEnd - p > (long) nameLength && p[nameLength] == '=' &&
+			strncasecmp(p, name, nameLength) == 0) {
+			const char *v = p + nameLength + 1;
 
-	int status = fstat(rec->fd, &stat_buf);
-	DIE(p, status, "Failed to get request file size.");
+			if (v < paramEnd && *v == '"') {
+				const char *quote = memchr(v + 1, '"', end - v - 1);
 
-	rec->map.length = stat_buf.st_size; //Save the size
+				value->buffer = v + 1;
+				value->length = (quote == NULL ? end : quote) - value->buffer;
+			} else {
+				while (paramEnd > v && (paramEnd[-1] == ' ' ||
+					paramEnd[-1] == '\r')) {
+					--paramEnd;
+				}
+				value->buffer = v;
+				value->length = paramEnd - v;
+			}
 
-	//If file size is 0 then just return
-	if (rec->map.length == 0) {
-		return 0;
+			return 0;
+		}
+		p = next;
 	}
 
-	rec->map.buffer = mmap(NULL, stat_buf.st_size, PROT_READ,
-		MAP_SHARED, rec->fd, 0);
-	if (rec->map.buffer == MAP_FAILED) {
-		DIE(p, -1, "Failed to map request file.");
+	return -1;
+}
+
+/*
+ * Adds a parameter for every part of a multipart/form-data body. The
+ * body is scanned for the boundary once. A body that was cut off ends
+ * with a shorter last part.
+ */
+static void parse_multipart(RequestRecord *rec, Slice *contentType) {
+	Slice boundary;
+	char delimiter[MAX_BOUNDARY + 4];
+	size_t skip[256];
+
+	if (find_header_param(contentType->buffer,
+		contentType->buffer + contentType->length, "boundary", &boundary) < 0 ||
+		boundary.length == 0 || boundary.length > MAX_BOUNDARY) {
+		return;
 	}
 
-	//We are good to go. Start parsing.
-	String *str = newString();
-	int state = PARSE_METHOD;
-	for (size_t i = 0; i < rec->map.length; ++i) {
-		char ch = rec->map.buffer[i];
+	size_t delimiterLength = boundary.length + 4;
 
-		//printf("[%c %d]", ch, state);
-		if (ch == '\r') {
-			continue; //Ignored
+	memcpy(delimiter, "\r\n--", 4);
+	memcpy(delimiter + 4, boundary.buffer, boundary.length);
+	for (size_t i = 0; i < 256; ++i) {
+		skip[i] = delimiterLength;
+	}
+	for (size_t i = 0; i + 1 < delimiterLength; ++i) {
+		skip[(unsigned char) delimiter[i]] = delimiterLength - 1 - i;
+	}
+
+	const char *body = rec->bodyBuffer.buffer;
+	const char *end = body + rec->bodyBuffer.length;
+	const char *cursor;
+
+	//The first delimiter usually has no line break before it
+	if (rec->bodyBuffer.length >= delimiterLength - 2 &&
+		memcmp(body, delimiter + 2, delimiterLength - 2) == 0) {
+		cursor = body + delimiterLength - 2;
+	} else {
+		cursor = find_delimiter(body, end - body, delimiter, delimiterLength,
+			skip);
+		if (cursor == NULL) {
+			return;
 		}
-		if (state == PARSE_METHOD) {
-			if (ch == ' ') {
-				if (strcmp("CONNECT", 
-					stringAsCString(rec->method)) == 0) {
-					state = PARSE_CONNECT_ADDRESS;
-				} else {
-					state = PARSE_PATH;
-				}
-				continue;
-			}
-			stringAppendChar(rec->method, ch);
-			continue;
+		cursor += delimiterLength;
+	}
+
+	rec->partsStart = rec->parameters.length;
+
+	while (cursor < end) {
+		if (end - cursor >= 2 && cursor[0] == '-' && cursor[1] == '-') {
+			break; //Closing delimiter
 		}
-		if (state == PARSE_PATH) {
-			if (ch == '?') {
-				state = PARSE_QUERY_STRING;
-				continue;
+
+		const char *line = memchr(cursor, '\n', end - cursor);
+		const char *partBody = NULL;
+		Slice name = {NULL, 0}, fileName = {NULL, 0}, type = {NULL, 0};
+		int hasFile = 0;
+
+		//Part header
+		while (line != NULL && ++line < end) {
+			const char *eol = memchr(line, '\n', end - line);
+			const char *lineEnd = eol == NULL ? end : eol;
+			Slice field = {line, lineEnd - line};
+
+			if (field.length > 0 && lineEnd[-1] == '\r') {
+				--field.length;
 			}
-			if (ch == ' ') {
-				state = PARSE_PROTOCOL_VERSION;
-				continue;
+			if (field.length == 0) {
+				partBody = eol == NULL ? end : eol + 1;
+				break;
 			}
-			stringAppendChar(rec->path, ch);
-			continue;
-		}
-		if (state == PARSE_QUERY_STRING) {
-			if (ch == ' ') {
-				state = PARSE_PROTOCOL_VERSION;
-				continue;
+			if (slice_has_prefix(&field, "Content-Disposition:")) {
+				find_header_param(line, line + field.length, "name", &name);
+				hasFile = find_header_param(line, line + field.length,
+					"filename", &fileName) == 0;
+			} else if (slice_has_prefix(&field, "Content-Type:")) {
+				type.buffer = line + 13;
+				type.length = field.length - 13;
+				while (type.length > 0 && *type.buffer == ' ') {
+					++type.buffer;
+					--type.length;
+				}
 			}
-			stringAppendChar(rec->queryString, ch);
-			continue;
+			line = eol;
 		}
-		if (state == PARSE_PROTOCOL_VERSION) {
-			if (ch == '\n') {
-				state = PARSE_HEADER_NAME;
-				continue;
-			}
-			//Don't store version
-			continue;
+		if (partBody == NULL) {
+			break; //Header was cut off
 		}
-		if (state == PARSE_CONNECT_ADDRESS) {
-			if (ch == ' ') {
-				state = PARSE_PROTOCOL_VERSION;
-				continue;
-			}
-			//Don't store address
-			continue;
+
+		const char *next = find_delimiter(partBody, end - partBody, delimiter,
+			delimiterLength, skip);
+		const char *partEnd = next == NULL ? end : next;
+
+		if (name.buffer == NULL) {
+			name.buffer = partBody;
 		}
-		if (state == PARSE_HEADER_NAME) {
-			if (ch == ':') {
-				arrayAdd(rec->headerNames, 
-					newStringWithString(str));
-				str->length = 0;
-				state = PARSE_HEADER_VALUE;
-				continue;
-			}
-			if (ch == '\n') {
-				//End of request headers
-				rec->headerBuffer.buffer = 
-					rec->map.buffer;
-				rec->headerBuffer.length = i + 1;
-
-				rec->bodyBuffer.buffer =
-					rec->map.buffer + i + 1;
-				rec->bodyBuffer.length = 
-					rec->map.length - 
-					rec->headerBuffer.length;
-				
-				//End parsing for now
-				break;
-			}
-			stringAppendChar(str, ch);
-			continue;
+		field_list_add(&rec->parameters, name.buffer, name.length,
+			partBody, partEnd - partBody);
+		field_list_add(&rec->parts, fileName.buffer, fileName.length,
+			type.buffer, type.length);
+		if (hasFile) {
+			rec->parameters.flags[rec->parameters.length - 1] = FIELD_FILE;
 		}
-		if (state == PARSE_HEADER_VALUE) {
-			if (ch == '\n') {
-				arrayAdd(rec->headerValues, 
-					newStringWithString(str));
-				str->length = 0;
-				state = PARSE_HEADER_NAME;
-				continue;
-			}
-			if ((str->length == 0) && ch == ' ') {
-				//Skip leading space.
-				continue;
-			}
-			stringAppendChar(str, ch);
-			continue;
+
+		if (next == NULL) {
+			break;
 		}
+		cursor = next + delimiterLength;
 	}
-	
-	deleteString(str);
-
-	//Parse URL parameters
-	parse_url_params(rec->queryString->buffer, rec->queryString->length, 
-		rec->parameterNames, rec->parameterValues);
+}
 
-	//If form post then parse request body for parameters
-	String *contentType = get_header_value(CONTENT_TYPE, rec);
-	if (contentType != NULL && 
-	    stringEqualsCString(contentType, FORM_ENC) &&
-	    rec->bodyBuffer.length > 0) {
-		parse_url_params(rec->bodyBuffer.buffer, 
-			rec->bodyBuffer.length, 
-			rec->parameterNames, 
-			rec->parameterValues);
+/*
+ * Parses the header fields that follow the first line of a message.
+ * A line without a colon ends the header.
+ */
+static void parse_header_fields(Buffer *map, Buffer *header, FieldList *list) {
+	if (list->isParsed) {
+		return;
 	}
+	list->isParsed = 1;
 
-	//It is safe to close the file now. It will 
-	//closed anyway by reset method. 
-	close(rec->fd);
-	rec->fd = -1;
-
-	return 0;
-}
+	//The header may have been decoded apart from the mapped body
+	const char *buffer = header->length > 0 ? header->buffer : map->buffer;
+	size_t length = header->length > 0 ? header->length : map->length;
+	const char *line = buffer == NULL ? NULL : memchr(buffer, '\n', length);
 
-int proxyServerLoadResponse(ProxyServer *p, const char *uniqueId,
-        ResponseRecord *rec) {
+	if (line == NULL) {
+		return;
+	}
+	++line;
 
-	reset_response_record(rec);
+	const char *end = buffer + length;
 
-	char file_name[512];
-	struct stat stat_buf;
-	snprintf(file_name, sizeof(file_name), "%s/%s.res",
-		stringAsCString(p->persistenceFolder), uniqueId);
+	while (line < end) {
+		const char *eol = memchr(line, '\n', end - line);
+		const char *lineEnd = eol == NULL ? end : eol;
+		const char *colon = memchr(line, ':', lineEnd - line);
 
-	rec->fd = open(file_name, O_RDONLY);
-	DIE(p, rec->fd, "Failed to open response file.");
+		if (colon == NULL) {
+			break;
+		}
 
-	int status = fstat(rec->fd, &stat_buf);
-	DIE(p, status, "Failed to get response file size.");
+		const char *value = colon + 1;
+		const char *valueEnd = lineEnd;
 
-	rec->map.length = stat_buf.st_size; //Save the size
+		while (value < valueEnd && *value == ' ') {
+			++value;
+		}
+		if (valueEnd > value && valueEnd[-1] == '\r') {
+			--valueEnd;
+		}
+		field_list_add(list, line, colon - line, value, valueEnd - value);
+		list->ids[list->length - 1] = headerNameLookup(line, colon - line);
 
-	//If file size is 0 then just return
-	if (rec->map.length == 0) {
-		return 0;
+		if (eol == NULL) {
+			break;
+		}
+		line = eol + 1;
 	}
+}
 
-	rec->map.buffer = mmap(NULL, stat_buf.st_size, PROT_READ,
-		MAP_SHARED, rec->fd, 0);
-	if (rec->map.buffer == MAP_FAILED) {
-		DIE(p, -1, "Failed to map response file.");
-	}
+/*
+ * Finds the blank line that ends the header. Sets headerBuffer and
+ * bodyBuffer. Nothing is set if the header is incomplete.
+ */
+static void split_message(Buffer *map, Buffer *header, Buffer *body) {
+	const char *end = map->buffer + map->length;
+	const char *line = memchr(map->buffer, '\n', map->length);
 
-	//We are good to go. Start parsing header.
-	String *str = newString();
-	int state = PARSE_PROTOCOL_VERSION;
-	for (size_t i = 0; i < rec->map.length; ++i) {
-		char ch = rec->map.buffer[i];
+	while (line != NULL && ++line < end) {
+		const char *next = line;
 
-		//printf("[%c %d]", ch, state);
-		if (ch == '\r') {
-			continue; //Ignored
+		if (*next == '\r' && next + 1 < end) {
+			++next;
 		}
+		if (*next == '\n') {
+			header->buffer = map->buffer;
+			header->length = next + 1 - map->buffer;
+			body->buffer = map->buffer + header->length;
+			body->length = map->length - header->length;
 
-		if (state == PARSE_PROTOCOL_VERSION) {
-			if (ch == ' ') {
-				state = PARSE_STATUS_CODE;
-				continue;
-			}
-			//Don't store version
-			continue;
-		}
-		if (state == PARSE_STATUS_CODE) {
-			if (ch == ' ') {
-				state = PARSE_STATUS_MESSAGE;
-				continue;
-			}
-			stringAppendChar(rec->statusCode, ch);
-			continue;
-		}
-		if (state == PARSE_STATUS_MESSAGE) {
-			if (ch == '\n') {
-				state = PARSE_HEADER_NAME;
-				continue;
-			}
-			stringAppendChar(rec->statusMessage, ch);
-			continue;
-		}
-		if (state == PARSE_HEADER_NAME) {
-			if (ch == ':') {
-				arrayAdd(rec->headerNames, 
-					newStringWithString(str));
-				str->length = 0;
-				state = PARSE_HEADER_VALUE;
-				continue;
-			}
-			if (ch == '\n') {
-				//End of request headers
-				rec->headerBuffer.buffer = 
-					rec->map.buffer;
-				rec->headerBuffer.length = i + 1;
-
-				rec->bodyBuffer.buffer =
-					rec->map.buffer + i + 1;
-				rec->bodyBuffer.length = 
-					rec->map.length - 
-					rec->headerBuffer.length;
-				
-				//End parsing for now
-				break;
-			}
-			stringAppendChar(str, ch);
-			continue;
-		}
-		if (state == PARSE_HEADER_VALUE) {
-			if (ch == '\n') {
-				arrayAdd(rec->headerValues, 
-					newStringWithString(str));
-				str->length = 0;
-				state = PARSE_HEADER_NAME;
-				continue;
-			}
-			if ((str->length == 0) && ch == ' ') {
-				//Skip leading space.
-				continue;
-			}
-			stringAppendChar(str, ch);
-			continue;
+			return;
 		}
+
+		line = memchr(line, '\n', end - line);
 	}
-	
-	deleteString(str);
+}
 
-	//It is safe to close the file now. It will 
-	//closed anyway by reset method. 
-	close(rec->fd);
-	rec->fd = -1;
+size_t requestRecordHeaderCount(RequestRecord *rec) {
+	parse_header_fields(&rec->map, &rec->headerBuffer, &rec->headers);
 
-	return 0;
+	return rec->headers.length;
+}
+
+int requestRecordHeaderAt(RequestRecord *rec, size_t index,
+	Slice *name, Slice *value) {
+	if (index >= requestRecordHeaderCount(rec)) {
+		return -1;
+	}
+
+	*name = rec->headers.names[index];
+	*value = rec->headers.values[index];
+
+	return 0;
+}
+
+/*
+ * Well known names are matched by ID. Others are compared as text.
+ * Returns the index of the first field or -1.
+ */
+static long find_field(FieldList *list, const char *name) {
+	int id = headerNameLookup(name, strlen(name));
+
+	for (size_t i = 0; i < list->length; ++i) {
+		if (id != HEADER_UNKNOWN ? list->ids[i] == id :
+			slice_equals(list->names + i, name)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static long find_field_id(FieldList *list, int headerId) {
+	for (size_t i = 0; i < list->length; ++i) {
+		if (list->ids[i] == headerId) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Header names are compared ignoring case. Returns -1 if not found.
+ */
+int requestRecordFindHeader(RequestRecord *rec, const char *name,
+	Slice *value) {
+	requestRecordHeaderCount(rec);
+
+	long i = find_field(&rec->headers, name);
+
+	if (i < 0) {
+		return -1;
+	}
+	*value = rec->headers.values[i];
+
+	return 0;
+}
+
+/*
+ * Same as requestRecordFindHeader() with a HeaderNameId.
+ */
+int requestRecordFindHeaderId(RequestRecord *rec, int headerId,
+	Slice *value) {
+	requestRecordHeaderCount(rec);
+
+	long i = find_field_id(&rec->headers, headerId);
+
+	if (i < 0) {
+		return -1;
+	}
+	*value = rec->headers.values[i];
+
+	return 0;
+}
+
+/*
+ * Parameters come from the query string followed by the fields of a
+ * URL encoded or multipart form post.
+ */
+size_t requestRecordParameterCount(RequestRecord *rec) {
+	FieldList *list = &rec->parameters;
+
+	if (list->isParsed) {
+		return list->length;
+	}
+	list->isParsed = 1;
+
+	parse_url_params(rec->queryString->buffer, rec->queryString->length,
+		list);
+	rec->queryParameterCount = list->length;
+
+	//If form post then parse request body for parameters
+	Slice contentType;
+
+	if (rec->bodyBuffer.length > 0 &&
+		requestRecordFindHeaderId(rec, HEADER_CONTENT_TYPE, &contentType) == 0) {
+		if (slice_has_prefix(&contentType, FORM_ENC)) {
+			parse_url_params(rec->bodyBuffer.buffer, rec->bodyBuffer.length,
+				list);
+		} else if (slice_has_prefix(&contentType, MULTIPART_FORM)) {
+			parse_multipart(rec, &contentType);
+		}
+	}
+
+	return list->length;
+}
+
+/*
+ * Parameters with an index below this came from the query string.
+ */
+size_t requestRecordQueryParameterCount(RequestRecord *rec) {
+	requestRecordParameterCount(rec);
+
+	return rec->queryParameterCount;
+}
+
+/*
+ * Returns the decoded name and value of a parameter.
+ */
+int requestRecordParameterAt(RequestRecord *rec, size_t index,
+	Slice *name, Slice *value) {
+	if (index >= requestRecordParameterCount(rec)) {
+		return -1;
+	}
+
+	FieldList *list = &rec->parameters;
+
+	if (list->flags[index] & FIELD_URL_ENCODED) {
+		url_decode(list->names + index, &rec->arena);
+		url_decode(list->values + index, &rec->arena);
+		list->flags[index] &= ~FIELD_URL_ENCODED;
+	}
+
+	*name = list->names[index];
+	*value = list->values[index];
+
+	return 0;
+}
+
+/*
+ * Returns the file name and content type of a multipart form field. Either
+ * may be empty. Returns -1 if the parameter did not come from a multipart
+ * body.
+ */
+int requestRecordPartAt(RequestRecord *rec, size_t index,
+	Slice *fileName, Slice *contentType) {
+	if (index >= requestRecordParameterCount(rec) || index < rec->partsStart ||
+		index - rec->partsStart >= rec->parts.length) {
+		return -1;
+	}
+
+	*fileName = rec->parts.names[index - rec->partsStart];
+	*contentType = rec->parts.values[index - rec->partsStart];
+
+	return 0;
+}
+
+static void fill_strings(FieldList *list, Array *names, Array *values) {
+	for (size_t i = 0; i < list->length; ++i) {
+		String *name = newStringWithCapacity(list->names[i].length + 1);
+		String *value = newStringWithCapacity(list->values[i].length + 1);
+
+		stringAppendBuffer(name, list->names[i].buffer, list->names[i].length);
+		stringAppendBuffer(value, list->values[i].buffer,
+			list->values[i].length);
+		arrayAdd(names, name);
+		arrayAdd(values, value);
+	}
+}
+
+/*
+ * Copies header fields and parameters into the String arrays of the
+ * record for code that still uses them.
+ */
+int requestRecordFillArrays(RequestRecord *rec) {
+	if (rec->arraysFilled) {
+		return 0;
+	}
+	rec->arraysFilled = 1;
+
+	requestRecordHeaderCount(rec);
+	requestRecordParameterCount(rec);
+	fill_strings(&rec->headers, rec->headerNames, rec->headerValues);
+	//Decode parameters first
+	for (size_t i = 0; i < rec->parameters.length; ++i) {
+		Slice name, value;
+
+		requestRecordParameterAt(rec, i, &name, &value);
+	}
+	fill_strings(&rec->parameters, rec->parameterNames, rec->parameterValues);
+
+	return 0;
+}
+
+size_t responseRecordHeaderCount(ResponseRecord *rec) {
+	parse_header_fields(&rec->map, &rec->headerBuffer, &rec->headers);
+
+	return rec->headers.length;
+}
+
+int responseRecordHeaderAt(ResponseRecord *rec, size_t index,
+	Slice *name, Slice *value) {
+	if (index >= responseRecordHeaderCount(rec)) {
+		return -1;
+	}
+
+	*name = rec->headers.names[index];
+	*value = rec->headers.values[index];
+
+	return 0;
+}
+
+int responseRecordFindHeader(ResponseRecord *rec, const char *name,
+	Slice *value) {
+	responseRecordHeaderCount(rec);
+
+	long i = find_field(&rec->headers, name);
+
+	if (i < 0) {
+		return -1;
+	}
+	*value = rec->headers.values[i];
+
+	return 0;
+}
+
+int responseRecordFindHeaderId(ResponseRecord *rec, int headerId,
+	Slice *value) {
+	responseRecordHeaderCount(rec);
+
+	long i = find_field_id(&rec->headers, headerId);
+
+	if (i < 0) {
+		return -1;
+	}
+	*value = rec->headers.values[i];
+
+	return 0;
+}
+
+int responseRecordFillArrays(ResponseRecord *rec) {
+	if (rec->arraysFilled) {
+		return 0;
+	}
+	rec->arraysFilled = 1;
+
+	responseRecordHeaderCount(rec);
+	fill_strings(&rec->headers, rec->headerNames, rec->headerValues);
+
+	return 0;
+}
+
+/*
+ * Header names are compared ignoring case.
+ */
+String *responseRecordGetHeader(ResponseRecord *rec, const char *name) {
+	responseRecordFillArrays(rec);
+
+	long i = find_field(&rec->headers, name);
+
+	return i < 0 ? NULL : arrayGet(rec->headerValues, i);
+}
+
+/*
+ * If the header block of a record was stored encoded, decodes it into
+ * decoded. The body stays in the mapped file at bodyOffset. Returns the
+ * length of the decoded header block, 0 if the record was stored as is
+ * and -1 in case of error.
+ */
+static long decode_record(ProxyServer *p, Buffer *map, Buffer *decoded,
+	size_t *bodyOffset) {
+	if (!headerCodecIsEncoded(map->buffer, map->length)) {
+		return 0;
+	}
+
+	HeaderDictionary *d = headerDictionaryOpenOnce(&p->headerDictionary,
+		stringAsCString(p->persistenceFolder));
+	size_t consumed = 0;
+
+	decoded->length = 0;
+	if (d == NULL || headerCodecDecode(d, map->buffer, map->length,
+		decoded, NULL, NULL, &consumed) < 0) {
+		return -1;
+	}
+
+	//Body is stored as is after the header
+	*bodyOffset = consumed;
+
+	return decoded->length;
+}
+
+static pthread_mutex_t ringReaderLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Records captured in flight recorder mode live in the ring. Use the
+ * server's ring if it has one or else open the ring file for reading.
+ * The ring file is kept open so that its record index is built once.
+ */
+static Ring *acquire_ring(ProxyServer *p) {
+	if (p->ring != NULL) {
+		return p->ring;
+	}
+
+	pthread_mutex_lock(&ringReaderLock);
+	if (p->ringReader == NULL) {
+		char file_name[512];
+
+		snprintf(file_name, sizeof(file_name), "%s/%s",
+			stringAsCString(p->persistenceFolder), RING_FILE);
+		p->ringReader = openRing(file_name);
+	}
+	pthread_mutex_unlock(&ringReaderLock);
+
+	return p->ringReader;
+}
+
+typedef struct _RingLookup {
+	const char *uniqueId;
+	int kind;
+	Buffer *out;
+	uint64_t record;
+	uint64_t beginPosition;
+} RingLookup;
+
+static int ring_lookup_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	RingLookup *lookup = context;
+
+	if (lookup->record == 0) {
+		if (f->kind == RING_BEGIN &&
+			f->length == strlen(lookup->uniqueId) &&
+			memcmp(payload, lookup->uniqueId, f->length) == 0) {
+			lookup->record = f->record;
+			lookup->beginPosition = position;
+		}
+
+		return 0;
+	}
+	if (f->record != lookup->record) {
+		return 0;
+	}
+	if (f->kind == lookup->kind) {
+		bufferAppendBytes(lookup->out, payload, f->length);
+	}
+
+	//Stop at the end of the record
+	return f->kind == RING_META;
+}
+
+/*
+ * Copies the request, response or meta data of a record out of the ring.
+ * Returns -1 if the record is not in the ring any more.
+ */
+static int load_ring_data(ProxyServer *p, const char *uniqueId, int kind,
+	Buffer *out) {
+	Ring *ring = acquire_ring(p);
+	uint64_t position, sequence;
+
+	if (ring == NULL ||
+		ringFindRecord(ring, uniqueId, strlen(uniqueId),
+			&position, &sequence) < 0) {
+		return -1;
+	}
+
+	RingLookup lookup;
+
+	memset(&lookup, 0, sizeof(lookup));
+	lookup.uniqueId = uniqueId;
+	lookup.kind = kind;
+	lookup.out = out;
+	out->length = 0;
+
+	//Walk from the begin fragment to the end of the record only
+	sequence -= 1;
+	ringWalkFrom(ring, &position, &sequence, &lookup, ring_lookup_callback);
+
+	return lookup.record != 0 &&
+		ringIsValid(ring, lookup.beginPosition) ? 0 : -1;
+}
+
+int proxyServerLoadRequest(ProxyServer *p, const char *uniqueId,
+        RequestRecord *rec) {
+
+	reset_request_record(rec);
+
+	char file_name[512];
+	struct stat stat_buf;
+	snprintf(file_name, sizeof(file_name), "%s/%s.req",
+		stringAsCString(p->persistenceFolder), uniqueId);
+
+	long headerLength = 0;
+	size_t bodyOffset = 0;
+
+	rec->fd = open(file_name, O_RDONLY);
+	if (rec->fd < 0 && errno == ENOENT &&
+		load_ring_data(p, uniqueId, RING_REQUEST, rec->decoded) == 0) {
+		//Captured in flight recorder mode
+		rec->map.buffer = rec->decoded->buffer;
+		rec->map.length = rec->decoded->length;
+	} else {
+		DIE(p, rec->fd, "Failed to open request file.");
+
+		int status = fstat(rec->fd, &stat_buf);
+		DIE(p, status, "Failed to get request file size.");
+
+		rec->map.length = stat_buf.st_size; //Save the size
+
+		//If file size is 0 then just return
+		if (rec->map.length == 0) {
+			return 0;
+		}
+
+		rec->map.buffer = mmap(NULL, stat_buf.st_size, PROT_READ,
+			MAP_SHARED, rec->fd, 0);
+		if (rec->map.buffer == MAP_FAILED) {
+			DIE(p, -1, "Failed to map request file.");
+		}
+
+		headerLength = decode_record(p, &rec->map, rec->decoded,
+			&bodyOffset);
+		DIE(p, headerLength, "Failed to decode request header.");
+	}
+
+	//We are good to go. Parse the request line.
+	Buffer *text = headerLength > 0 ? rec->decoded : &rec->map;
+	int state = PARSE_METHOD;
+	for (size_t i = 0; i < text->length; ++i) {
+		char ch = text->buffer[i];
+
+		//printf("[%c %d]", ch, state);
+		if (ch == '\r') {
+			continue; //Ignored
+		}
+		if (state == PARSE_METHOD) {
+			if (ch == ' ') {
+				if (strcmp("CONNECT", 
+					stringAsCString(rec->method)) == 0) {
+					state = PARSE_CONNECT_ADDRESS;
+				} else {
+					state = PARSE_PATH;
+				}
+				continue;
+			}
+			stringAppendChar(rec->method, ch);
+			continue;
+		}
+		if (state == PARSE_PATH) {
+			if (ch == '?') {
+				state = PARSE_QUERY_STRING;
+				continue;
+			}
+			if (ch == ' ') {
+				state = PARSE_PROTOCOL_VERSION;
+				continue;
+			}
+			stringAppendChar(rec->path, ch);
+			continue;
+		}
+		if (state == PARSE_QUERY_STRING) {
+			if (ch == ' ') {
+				state = PARSE_PROTOCOL_VERSION;
+				continue;
+			}
+			stringAppendChar(rec->queryString, ch);
+			continue;
+		}
+		if (state == PARSE_PROTOCOL_VERSION) {
+			if (ch == '\n') {
+				state = PARSE_HEADER_NAME;
+				continue;
+			}
+			//Don't store version
+			continue;
+		}
+		if (state == PARSE_CONNECT_ADDRESS) {
+			if (ch == ' ') {
+				state = PARSE_PROTOCOL_VERSION;
+				continue;
+			}
+			//Don't store address
+			continue;
+		}
+		if (state == PARSE_HEADER_NAME) {
+			//The rest is parsed on demand
+			if (headerLength > 0) {
+				//Decoded header with the body left in the mapped file
+				rec->headerBuffer.buffer = rec->decoded->buffer;
+				rec->headerBuffer.length = headerLength;
+
+				rec->bodyBuffer.buffer = rec->map.buffer + bodyOffset;
+				rec->bodyBuffer.length = rec->map.length - bodyOffset;
+			} else {
+				split_message(&rec->map, &rec->headerBuffer,
+					&rec->bodyBuffer);
+			}
+
+			break;
+		}
+	}
+
+	//It is safe to close the file now. It will 
+	//closed anyway by reset method. 
+	close(rec->fd);
+	rec->fd = -1;
+
+	return 0;
+}
+
+int proxyServerLoadResponse(ProxyServer *p, const char *uniqueId,
+        ResponseRecord *rec) {
+
+	reset_response_record(rec);
+
+	char file_name[512];
+	struct stat stat_buf;
+	snprintf(file_name, sizeof(file_name), "%s/%s.res",
+		stringAsCString(p->persistenceFolder), uniqueId);
+
+	long headerLength = 0;
+	size_t bodyOffset = 0;
+
+	rec->fd = open(file_name, O_RDONLY);
+	if (rec->fd < 0 && errno == ENOENT &&
+		load_ring_data(p, uniqueId, RING_RESPONSE, rec->decoded) == 0) {
+		//Captured in flight recorder mode
+		rec->map.buffer = rec->decoded->buffer;
+		rec->map.length = rec->decoded->length;
+	} else {
+		DIE(p, rec->fd, "Failed to open response file.");
+
+		int status = fstat(rec->fd, &stat_buf);
+		DIE(p, status, "Failed to get response file size.");
+
+		rec->map.length = stat_buf.st_size; //Save the size
+
+		//If file size is 0 then just return
+		if (rec->map.length == 0) {
+			return 0;
+		}
+
+		rec->map.buffer = mmap(NULL, stat_buf.st_size, PROT_READ,
+			MAP_SHARED, rec->fd, 0);
+		if (rec->map.buffer == MAP_FAILED) {
+			DIE(p, -1, "Failed to map response file.");
+		}
+
+		headerLength = decode_record(p, &rec->map, rec->decoded,
+			&bodyOffset);
+		DIE(p, headerLength, "Failed to decode response header.");
+	}
+
+	//We are good to go. Parse the status line.
+	Buffer *text = headerLength > 0 ? rec->decoded : &rec->map;
+	int state = PARSE_PROTOCOL_VERSION;
+	for (size_t i = 0; i < text->length; ++i) {
+		char ch = text->buffer[i];
+
+		//printf("[%c %d]", ch, state);
+		if (ch == '\r') {
+			continue; //Ignored
+		}
+
+		if (state == PARSE_PROTOCOL_VERSION) {
+			if (ch == ' ') {
+				state = PARSE_STATUS_CODE;
+				continue;
+			}
+			//Don't store version
+			continue;
+		}
+		if (state == PARSE_STATUS_CODE) {
+			if (ch == ' ') {
+				state = PARSE_STATUS_MESSAGE;
+				continue;
+			}
+			stringAppendChar(rec->statusCode, ch);
+			continue;
+		}
+		if (state == PARSE_STATUS_MESSAGE) {
+			if (ch == '\n') {
+				state = PARSE_HEADER_NAME;
+				continue;
+			}
+			stringAppendChar(rec->statusMessage, ch);
+			continue;
+		}
+		if (state == PARSE_HEADER_NAME) {
+			//The rest is parsed on demand
+			if (headerLength > 0) {
+				//Decoded header with the body left in the mapped file
+				rec->headerBuffer.buffer = rec->decoded->buffer;
+				rec->headerBuffer.length = headerLength;
+
+				rec->bodyBuffer.buffer = rec->map.buffer + bodyOffset;
+				rec->bodyBuffer.length = rec->map.length - bodyOffset;
+			} else {
+				split_message(&rec->map, &rec->headerBuffer,
+					&rec->bodyBuffer);
+			}
+
+			break;
+		}
+	}
+
+	//It is safe to close the file now. It will 
+	//closed anyway by reset method. 
+	close(rec->fd);
+	rec->fd = -1;
+
+	return 0;
+}
+
+/*
+ * Finds where the header of a response file ends without reading the
+ * body. The start of the file is read and read again with more bytes
+ * until the header fits. Returns 1 if the header was found, 0 if more
+ * bytes are needed and -1 if it can't be read.
+ */
+static int locate_header(ProxyServer *p, const char *data, size_t length,
+	int isComplete, Buffer *header, off_t *bodyOffset) {
+	header->length = 0;
+	if (headerCodecIsEncoded(data, length)) {
+		HeaderDictionary *d = headerDictionaryOpenOnce(&p->headerDictionary,
+			stringAsCString(p->persistenceFolder));
+		size_t consumed = 0;
+
+		if (d == NULL) {
+			return -1;
+		}
+		if (headerCodecDecode(d, data, length, header, NULL, NULL,
+			&consumed) < 0) {
+			//A cut short block can't be told from a bad one
+			return isComplete ? -1 : 0;
+		}
+		*bodyOffset = consumed;
+
+		return 1;
+	}
+
+	Buffer map, headerPart, bodyPart;
+
+	map.buffer = (char*) data;
+	map.length = length;
+	headerPart.length = 0;
+	bodyPart.buffer = map.buffer + map.length;
+	split_message(&map, &headerPart, &bodyPart);
+	if (headerPart.length == 0) {
+		if (!isComplete) {
+			return 0;
+		}
+		//Header was cut short
+		headerPart.buffer = map.buffer;
+		headerPart.length = map.length;
+	}
+	bufferAppendBytes(header, headerPart.buffer, headerPart.length);
+	*bodyOffset = headerPart.length;
+
+	return 1;
+}
+
+/*
+ * Finds where the body of a captured response starts in its file so that
+ * it can be sent without reading it. The header block is decoded into
+ * header. Returns -1 if the record has no response file, such as when it
+ * was captured in flight recorder mode.
+ */
+int proxyServerLocateResponseBody(ProxyServer *p, const char *uniqueId,
+	Buffer *header, char *fileName, size_t size, off_t *bodyOffset,
+	size_t *bodyLength) {
+	struct stat stat_buf;
+
+	snprintf(fileName, size, "%s/%s.res",
+		stringAsCString(p->persistenceFolder), uniqueId);
+
+	int fd = open(fileName, O_RDONLY);
+
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &stat_buf) < 0 || stat_buf.st_size == 0) {
+		close(fd);
+
+		return -1;
+	}
+
+	size_t fileLength = stat_buf.st_size;
+	size_t capacity = 0;
+	char *data = NULL;
+	int status = 0;
+
+	for (size_t length = 4096; status == 0; length *= 4) {
+		if (length > fileLength) {
+			length = fileLength;
+		}
+		if (length > capacity) {
+			char *bigger = realloc(data, length);
+
+			if (bigger == NULL) {
+				status = -1;
+				break;
+			}
+			data = bigger;
+			capacity = length;
+		}
+		if (pread(fd, data, length, 0) != (ssize_t) length) {
+			status = -1;
+			break;
+		}
+		status = locate_header(p, data, length, length == fileLength,
+			header, bodyOffset);
+	}
+	free(data);
+	close(fd);
+	if (status < 0) {
+		return -1;
+	}
+	*bodyLength = fileLength - *bodyOffset;
+
+	return 0;
 }
 
 int proxyServerResetRecords(ProxyServer *p, RequestRecord *reqRec, 
@@ -536,134 +1356,478 @@ int proxyServerResetRecords(ProxyServer *p, RequestRecord *reqRec,
 		reset_response_record(resRec);
 	}
 
-	return 0;
-}
+	return 0;
+}
+
+int proxyServerDeleteRecord(ProxyServer *p, const char *uniqueId) {
+	int status, res = 0;
+	char file_name[512];
+
+	indexRecordRemoved(p, uniqueId);
+	metaStoreRecordRemoved(p, uniqueId);
+
+	snprintf(file_name, sizeof(file_name), "%s/%s.meta",
+		stringAsCString(p->persistenceFolder), uniqueId);
+	status = unlink(file_name);
+	res = status < 0 ? status : res;
+
+	snprintf(file_name, sizeof(file_name), "%s/%s.res",
+		stringAsCString(p->persistenceFolder), uniqueId);
+	status = unlink(file_name);
+	res = status < 0 ? status : res;
+
+	snprintf(file_name, sizeof(file_name), "%s/%s.req",
+		stringAsCString(p->persistenceFolder), uniqueId);
+	status = unlink(file_name);
+	res = status < 0 ? status : res;
+
+	return res;
+}
+
+int proxyServerSaveBuffer(ProxyServer *p, 
+	const char *fileName, 
+	Buffer *buffer) {
+
+	FILE *file = fopen(fileName, "w");
+
+	if (file == NULL) {
+		DIE(p, -1, "Failed to save buffer.");
+	}
+
+	size_t sz = fwrite(buffer->buffer, sizeof(char), buffer->length, file);
+	fclose(file);
+
+	if (sz != buffer->length) {
+		DIE(p, -1, "Failed to save buffer properly.");
+	}
+
+	return 0;
+}
+
+/*
+ * Reads one line into the supplied String.
+ * Returns 1 if there is more data left to be read
+ * in the file. In case of end of file or error, returns 0.
+ */
+int read_line(FILE *file, String *line, char stopChar) {
+	int ch, stopped = 0;
+
+	line->length = 0;
+
+	//A file is only ever read by one thread
+	while ((ch = getc_unlocked(file)) != EOF) {
+		if (ch == '\r') {
+			continue;
+		}
+		if (ch == '\n') {
+			break;
+		}
+
+		stopped = stopped == 1 || ch == stopChar;
+
+		if (stopped == 0) {
+			stringAppendChar(line, (char) ch);
+		}
+	}
+
+	return ch != EOF;
+}
+
+static long long *phase_field(PhaseTimings *t, const char *name) {
+	if (strcmp(name, "header-complete") == 0) {
+		return &t->headerComplete;
+	} else if (strcmp(name, "dns") == 0) {
+		return &t->dnsDone;
+	} else if (strcmp(name, "connect") == 0) {
+		return &t->connectDone;
+	} else if (strcmp(name, "request-sent") == 0) {
+		return &t->requestSent;
+	} else if (strcmp(name, "first-byte") == 0) {
+		return &t->firstByte;
+	} else if (strcmp(name, "response-complete") == 0) {
+		return &t->responseComplete;
+	}
+
+	return NULL;
+}
+
+/*
+ * Parses meta data fields from a file. Returns -2 if the file
+ * is empty.
+ */
+static int load_meta(FILE *file, RequestRecord* req, ResponseRecord *res) {
+	String *name = newString();
+	String *value = newString();
+	int incompleteFile = 1;
+
+	for (int hasMore = 1; hasMore == 1; ) {
+		hasMore = read_line(file, name, '\0');
+
+		if (hasMore == 0) {
+			break;
+		}
+
+		//Must have a valid name
+		assert(name->length > 0);
+
+		incompleteFile = 0;
+
+		const char *nameStr = stringAsCString(name);
+
+		if (strcmp(nameStr, "protocol-line") == 0) {
+			hasMore = read_line(file, req->method, ' ');
+		} else if (strcmp(nameStr, "protocol") == 0) {
+			hasMore = read_line(file, req->protocol, '\0');
+		} else if (strcmp(nameStr, "host") == 0) {
+			hasMore = read_line(file, req->host, '\0');
+		} else if (strcmp(nameStr, "port") == 0) {
+			hasMore = read_line(file, req->port, '\0');
+		} else if (strcmp(nameStr, "path") == 0) {
+			//Deal with query string
+			hasMore = read_line(file, req->path, ' ');
+		} else if (strcmp(nameStr, "response-status-code") == 0) {
+			hasMore = read_line(file, res->statusCode, '\0');
+		} else if (strcmp(nameStr, "response-status-message") == 0) {
+			hasMore = read_line(file, res->statusMessage, '\0');
+		} else if (strcmp(nameStr, "request-start-seconds") == 0) {
+			hasMore = read_line(file, value, '\0');
+			req->requestStartTime.tv_sec = atol(stringAsCString(value));
+		} else if (strcmp(nameStr, "request-start-microseconds") == 0) {
+			hasMore = read_line(file, value, '\0');
+			req->requestStartTime.tv_usec = atol(stringAsCString(value));
+		} else if (strcmp(nameStr, "response-end-seconds") == 0) {
+			hasMore = read_line(file, value, '\0');
+			req->responseEndTime.tv_sec = atol(stringAsCString(value));
+		} else if (strcmp(nameStr, "response-end-microseconds") == 0) {
+			hasMore = read_line(file, value, '\0');
+			req->responseEndTime.tv_usec = atol(stringAsCString(value));
+		} else if (strcmp(nameStr, "request-bytes") == 0) {
+			hasMore = read_line(file, value, '\0');
+			req->size = strtoull(stringAsCString(value), NULL, 10);
+		} else if (strcmp(nameStr, "response-bytes") == 0) {
+			hasMore = read_line(file, value, '\0');
+			res->size = strtoull(stringAsCString(value), NULL, 10);
+		} else if (strcmp(nameStr, "cache") == 0) {
+			hasMore = read_line(file, value, '\0');
+			for (int i = CACHE_MISS; i <= CACHE_REVALIDATED; ++i) {
+				if (strcmp(stringAsCString(value), cacheStatusName(i)) == 0) {
+					res->cacheStatus = i;
+				}
+			}
+		} else if (strncmp(nameStr, "timing-", 7) == 0) {
+			long long *phase = phase_field(&req->timings, nameStr + 7);
+
+			hasMore = read_line(file, value, '\0');
+			if (phase != NULL) {
+				*phase = atoll(stringAsCString(value));
+			}
+		}
+	}
+
+	deleteString(name);
+	deleteString(value);
+
+	return incompleteFile == 1 ? -2 : 0;
+}
+
+int proxyServerLoadMeta(ProxyServer *p,
+	const char *uniqueId, RequestRecord* req, ResponseRecord *res) {
+	char file_name[512];
+
+	proxyServerResetRecords(p, req, res);
+
+	snprintf(file_name, sizeof(file_name), "%s/%s.meta",
+		stringAsCString(p->persistenceFolder), uniqueId);
+	
+	FILE *file = fopen(file_name, "r");
+
+	if (file == NULL) {
+		DIE(p, -1, "Failed to open meta file.");
+	}
+
+	int status = load_meta(file, req, res);
+
+	fclose(file);
+
+	return status;
+}
+
+/*
+ * Parses meta data held in memory, such as the meta fragment of a record
+ * in the capture ring.
+ */
+int proxyServerLoadMetaBuffer(ProxyServer *p, const char *data, size_t length,
+	RequestRecord* req, ResponseRecord *res) {
+	proxyServerResetRecords(p, req, res);
+
+	if (length == 0) {
+		return -2;
+	}
+
+	FILE *file = fmemopen((void*) data, length, "r");
 
-int proxyServerDeleteRecord(ProxyServer *p, const char *uniqueId) {
-	int status, res = 0;
-	char file_name[512];
+	if (file == NULL) {
+		DIE(p, -1, "Failed to open meta data.");
+	}
 
-	snprintf(file_name, sizeof(file_name), "%s/%s.meta",
-		stringAsCString(p->persistenceFolder), uniqueId);
-	status = unlink(file_name);
-	res = status < 0 ? status : res;
+	int status = load_meta(file, req, res);
 
-	snprintf(file_name, sizeof(file_name), "%s/%s.res",
-		stringAsCString(p->persistenceFolder), uniqueId);
-	status = unlink(file_name);
-	res = status < 0 ? status : res;
+	fclose(file);
 
-	snprintf(file_name, sizeof(file_name), "%s/%s.req",
-		stringAsCString(p->persistenceFolder), uniqueId);
-	status = unlink(file_name);
-	res = status < 0 ? status : res;
+	return status;
+}
 
-	return res;
+typedef struct _RingRecordInfo {
+	uint64_t record;
+	uint64_t beginPosition;
+	char uniqueId[64];
+	char *meta;
+	size_t metaLength;
+} RingRecordInfo;
+
+typedef struct _RingHistory {
+	RingRecordInfo *records;
+	size_t length;
+	size_t capacity;
+} RingHistory;
+
+static RingRecordInfo *find_ring_record(RingHistory *h, uint64_t record) {
+	//Records begin in increasing order
+	size_t low = 0, high = h->length;
+
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+
+		if (h->records[mid].record < record) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low < h->length && h->records[low].record == record ?
+		h->records + low : NULL;
 }
 
-int proxyServerSaveBuffer(ProxyServer *p, 
-	const char *fileName, 
-	Buffer *buffer) {
+static int ring_history_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	RingHistory *h = context;
 
-	FILE *file = fopen(fileName, "w");
+	if (f->kind == RING_BEGIN) {
+		if (f->length >= sizeof(h->records[0].uniqueId)) {
+			return 0;
+		}
+		if (h->length == h->capacity) {
+			h->capacity = h->capacity == 0 ? 256 : h->capacity * 2;
+			h->records = realloc(h->records,
+				h->capacity * sizeof(RingRecordInfo));
+		}
 
-	if (file == NULL) {
-		DIE(p, -1, "Failed to save buffer.");
-	}
+		RingRecordInfo *info = h->records + h->length++;
 
-	size_t sz = fwrite(buffer->buffer, sizeof(char), buffer->length, file);
-	fclose(file);
+		memset(info, 0, sizeof(RingRecordInfo));
+		info->record = f->record;
+		info->beginPosition = position;
+		memcpy(info->uniqueId, payload, f->length);
+	} else if (f->kind == RING_META) {
+		RingRecordInfo *info = find_ring_record(h, f->record);
 
-	if (sz != buffer->length) {
-		DIE(p, -1, "Failed to save buffer properly.");
+		if (info != NULL && info->meta == NULL) {
+			info->meta = malloc(f->length);
+			info->metaLength = f->length;
+			memcpy(info->meta, payload, f->length);
+		}
 	}
 
 	return 0;
 }
 
 /*
- * Reads one line into the supplied String.
- * Returns 1 if there is more data left to be read
- * in the file. In case of end of file or error, returns 0.
+ * Gets the complete records in the ring, oldest first. Data is copied
+ * out so that the writer can carry on.
  */
-int read_line(FILE *file, String *line, char stopChar) {
-	int ch, stopped = 0;
+static void list_ring_records(Ring *ring, RingHistory *h) {
+	memset(h, 0, sizeof(RingHistory));
 
-	line->length = 0;
+	ringWalk(ring, h, ring_history_callback);
 
-	while ((ch = fgetc(file)) != EOF) {
-		if (ch == '\r') {
-			continue;
-		}
-		if (ch == '\n') {
-			break;
+	//Drop records that got overwritten while we were walking
+	for (size_t i = 0; i < h->length; ++i) {
+		if (!ringIsValid(ring, h->records[i].beginPosition)) {
+			free(h->records[i].meta);
+			h->records[i].meta = NULL;
 		}
+	}
+}
 
-		stopped = stopped == 1 || ch == stopChar;
+static void free_ring_records(RingHistory *h) {
+	for (size_t i = 0; i < h->length; ++i) {
+		free(h->records[i].meta);
+	}
+	free(h->records);
+}
 
-		if (stopped == 0) {
-			stringAppendChar(line, (char) ch);
+static int load_ring_history(ProxyServer *p, void *contextData,
+	void (*callback)(void *, const char*, RequestRecord*, ResponseRecord*),
+	RequestRecord *req, ResponseRecord *res) {
+	Ring *ring = acquire_ring(p);
+
+	if (ring == NULL) {
+		return 0; //Not in flight recorder mode
+	}
+
+	RingHistory h;
+
+	list_ring_records(ring, &h);
+
+	for (size_t i = 0; i < h.length; ++i) {
+		RingRecordInfo *info = h.records + i;
+
+		if (info->meta == NULL) {
+			continue;
+		}
+		if (proxyServerLoadMetaBuffer(p, info->meta, info->metaLength,
+			req, res) == 0) {
+			callback(contextData, info->uniqueId, req, res);
 		}
 	}
 
-	return ch != EOF;
+	free_ring_records(&h);
+
+	return 0;
 }
 
-int proxyServerLoadMeta(ProxyServer *p,
-	const char *uniqueId, RequestRecord* req, ResponseRecord *res) {
+static int append_to_file(const char *folder, const char *uniqueId,
+	const char *ext, const char *data, size_t length) {
 	char file_name[512];
 
-	proxyServerResetRecords(p, req, res);
+	snprintf(file_name, sizeof(file_name), "%s/%s%s", folder, uniqueId, ext);
 
-	snprintf(file_name, sizeof(file_name), "%s/%s.meta",
-		stringAsCString(p->persistenceFolder), uniqueId);
-	
-	FILE *file = fopen(file_name, "r");
+	int fd = open(file_name, O_WRONLY | O_CREAT | O_APPEND, 0600);
 
-	if (file == NULL) {
-		DIE(p, -1, "Failed to open meta file.");
+	if (fd < 0) {
+		return -1;
 	}
 
-	String *name = newString();
-	int incompleteFile = 1;
+	ssize_t sz = write(fd, data, length);
 
-	for (int hasMore = 1; hasMore == 1; ) {
-		hasMore = read_line(file, name, '\0');
+	close(fd);
 
-		if (hasMore == 0) {
-			break;
-		}
+	return sz == (ssize_t) length ? 0 : -1;
+}
 
-		//Must have a valid name
-		assert(name->length > 0);
+typedef struct _RingSnapshot {
+	RingHistory *history;
+	const char *folder;
+	int status;
+} RingSnapshot;
+
+static int ring_snapshot_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	RingSnapshot *snapshot = context;
+	const char *ext = NULL;
+
+	if (f->kind == RING_REQUEST) {
+		ext = ".req";
+	} else if (f->kind == RING_RESPONSE) {
+		ext = ".res";
+	} else {
+		return 0;
+	}
 
-		incompleteFile = 0;
+	RingRecordInfo *info = find_ring_record(snapshot->history, f->record);
 
-		const char *nameStr = stringAsCString(name);
+	if (info == NULL || info->meta == NULL) {
+		return 0;
+	}
+	if (append_to_file(snapshot->folder, info->uniqueId, ext,
+		payload, f->length) < 0) {
+		snapshot->status = -1;
 
-		if (strcmp(nameStr, "protocol-line") == 0) {
-			hasMore = read_line(file, req->method, ' ');
-		} else if (strcmp(nameStr, "protocol") == 0) {
-			hasMore = read_line(file, req->protocol, '\0');
-		} else if (strcmp(nameStr, "host") == 0) {
-			hasMore = read_line(file, req->host, '\0');
-		} else if (strcmp(nameStr, "port") == 0) {
-			hasMore = read_line(file, req->port, '\0');
-		} else if (strcmp(nameStr, "path") == 0) {
-			//Deal with query string
-			hasMore = read_line(file, req->path, ' ');
-		} else if (strcmp(nameStr, "response-status-code") == 0) {
-			hasMore = read_line(file, res->statusCode, '\0');
-		} else if (strcmp(nameStr, "response-status-message") == 0) {
-			hasMore = read_line(file, res->statusMessage, '\0');
+		return 1;
+	}
+
+	return 0;
+}
+
+//Returns 1 if the folder has no entries, 0 if it has or can't be read
+static int is_empty_folder(const char *folder) {
+	DIR *dir = opendir(folder);
+	struct dirent *ent;
+	int empty = dir != NULL;
+
+	while (empty && (ent = readdir(dir)) != NULL) {
+		empty = strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0;
+	}
+	if (dir != NULL) {
+		closedir(dir);
+	}
+
+	return empty;
+}
+
+/*
+ * Freezes the flight recorder ring into a new regular capture folder that
+ * can be loaded by pointing persistenceFolder to it. Only records that
+ * completed are saved. The folder may exist but must be empty, since the
+ * record files are appended to fragment by fragment.
+ */
+int proxyServerSnapshotRing(ProxyServer *p, const char *folder) {
+	Ring *ring = acquire_ring(p);
+
+	if (ring == NULL) {
+		DIE(p, -1, "Failed to open capture ring.");
+	}
+
+	int status = mkdir(folder, 0700);
+
+	if (status < 0 && errno != EEXIST) {
+		DIE(p, status, "Failed to create snapshot folder.");
+	}
+	if (status < 0 && !is_empty_folder(folder)) {
+		DIE(p, -1, "Snapshot folder is not empty.");
+	}
+
+	RingHistory h;
+	RingSnapshot snapshot;
+
+	list_ring_records(ring, &h);
+
+	snapshot.history = &h;
+	snapshot.folder = folder;
+	snapshot.status = 0;
+
+	ringWalk(ring, &snapshot, ring_snapshot_callback);
+
+	for (size_t i = 0; i < h.length; ++i) {
+		RingRecordInfo *info = h.records + i;
+
+		if (info->meta == NULL) {
+			continue;
+		}
+		//Every saved record has all three files
+		append_to_file(folder, info->uniqueId, ".req", "", 0);
+		append_to_file(folder, info->uniqueId, ".res", "", 0);
+		if (!ringIsValid(ring, info->beginPosition) ||
+			append_to_file(folder, info->uniqueId, ".meta",
+				info->meta, info->metaLength) < 0) {
+			//Overwritten while we were copying
+			char file_name[512];
+
+			snprintf(file_name, sizeof(file_name), "%s/%s.req",
+				folder, info->uniqueId);
+			unlink(file_name);
+			snprintf(file_name, sizeof(file_name), "%s/%s.res",
+				folder, info->uniqueId);
+			unlink(file_name);
 		}
 	}
 
-	deleteString(name);
+	free_ring_records(&h);
 
-	fclose(file);
+	DIE(p, snapshot.status, "Failed to save ring snapshot.");
 
-	return incompleteFile == 1 ? -2 : 0;
+	return 0;
 }
 
 int proxyServerLoadHistory(ProxyServer *p, 
@@ -717,6 +1881,9 @@ int proxyServerLoadHistory(ProxyServer *p,
 
 	//Clean up
 	closedir(dir);
+
+	load_ring_history(p, contextData, callback, req, res);
+
 	deleteRequestRecord(req);
 	deleteResponseRecord(res);
 	deleteString(uniqueId);
@@ -725,3 +1892,312 @@ int proxyServerLoadHistory(ProxyServer *p,
 
 	return 0;
 }
+
+typedef struct _MetaId {
+	char uniqueId[64];
+	long startSeconds;
+	long startMicroseconds;
+} MetaId;
+
+static int compare_meta_ids(const void *a, const void *b) {
+	const MetaId *m1 = a, *m2 = b;
+
+	if (m1->startSeconds != m2->startSeconds) {
+		return m1->startSeconds < m2->startSeconds ? -1 : 1;
+	}
+	if (m1->startMicroseconds != m2->startMicroseconds) {
+		return m1->startMicroseconds < m2->startMicroseconds ? -1 : 1;
+	}
+
+	return strcmp(m1->uniqueId, m2->uniqueId);
+}
+
+/*
+ * Lists the unique IDs of all meta files in the folder.
+ */
+static MetaId *list_meta_ids(const char *folder, size_t *count) {
+	DIR *dir = opendir(folder);
+
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	const char *ext = ".meta";
+	size_t extLen = strlen(ext);
+	size_t capacity = 256, length = 0;
+	MetaId *ids = malloc(capacity * sizeof(MetaId));
+	struct dirent *ent;
+
+	while ((ent = readdir(dir)) != NULL) {
+		size_t name_len = strlen(ent->d_name);
+
+		if (name_len <= extLen || name_len - extLen >= sizeof(ids->uniqueId) ||
+			strcmp(ent->d_name + name_len - extLen, ext) != 0) {
+			continue;
+		}
+		if (length == capacity) {
+			capacity *= 2;
+			ids = realloc(ids, capacity * sizeof(MetaId));
+		}
+
+		MetaId *id = ids + length++;
+
+		memset(id, 0, sizeof(MetaId));
+		memcpy(id->uniqueId, ent->d_name, name_len - extLen);
+		//Unique ID starts with the start time
+		sscanf(id->uniqueId, "%ld-%ld",
+			&id->startSeconds, &id->startMicroseconds);
+	}
+	closedir(dir);
+
+	*count = length;
+
+	return ids;
+}
+
+typedef struct _HistoryLoad {
+	ProxyServer *p;
+	HistoryOrder order;
+	void *contextData;
+	HistoryBatchCallback callback;
+	HistoryPrepareCallback prepare; //Pipelined loads only
+	HistoryDeliverCallback deliver;
+	MetaId *ids;
+	size_t idCount;
+	size_t batchSize;
+	size_t batchCount;
+	size_t nextBatch; //Next batch to be loaded
+	size_t nextDelivery; //Next batch to be delivered in ordered mode
+	pthread_mutex_t lock;
+	pthread_cond_t delivered;
+} HistoryLoad;
+
+static void *history_worker(void *data) {
+	HistoryLoad *load = data;
+	size_t batchSize = load->batchSize;
+	RequestRecord **requests = malloc(batchSize * sizeof(RequestRecord*));
+	ResponseRecord **responses = malloc(batchSize * sizeof(ResponseRecord*));
+	HistoryEntry *entries = malloc(batchSize * sizeof(HistoryEntry));
+
+	//Scratch records owned by this thread
+	for (size_t i = 0; i < batchSize; ++i) {
+		requests[i] = newRequestRecord();
+		responses[i] = newResponseRecord();
+	}
+
+	while (1) {
+		size_t batch = __sync_fetch_and_add(&load->nextBatch, 1);
+
+		if (batch >= load->batchCount) {
+			break;
+		}
+
+		size_t first = batch * batchSize;
+		size_t last = first + batchSize;
+		size_t count = 0;
+
+		if (last > load->idCount) {
+			last = load->idCount;
+		}
+		for (size_t i = first; i < last; ++i) {
+			const char *uniqueId = load->ids[i].uniqueId;
+
+			if (proxyServerLoadMeta(load->p, uniqueId,
+				requests[count], responses[count]) < 0) {
+				continue;
+			}
+			entries[count].uniqueId = uniqueId;
+			entries[count].request = requests[count];
+			entries[count].response = responses[count];
+			++count;
+		}
+
+		if (load->order == HISTORY_UNORDERED) {
+			if (count > 0) {
+				load->callback(load->contextData, entries, count);
+			}
+			continue;
+		}
+
+		//Work that can be done out of order
+		void *prepared = NULL;
+
+		if (load->prepare != NULL && count > 0) {
+			prepared = load->prepare(load->contextData, entries, count);
+		}
+
+		//Wait for our turn
+		pthread_mutex_lock(&load->lock);
+		while (load->nextDelivery != batch) {
+			pthread_cond_wait(&load->delivered, &load->lock);
+		}
+		pthread_mutex_unlock(&load->lock);
+
+		if (count > 0) {
+			if (load->prepare != NULL) {
+				load->deliver(load->contextData, prepared);
+			} else {
+				load->callback(load->contextData, entries, count);
+			}
+		}
+
+		pthread_mutex_lock(&load->lock);
+		++load->nextDelivery;
+		pthread_cond_broadcast(&load->delivered);
+		pthread_mutex_unlock(&load->lock);
+	}
+
+	for (size_t i = 0; i < batchSize; ++i) {
+		deleteRequestRecord(requests[i]);
+		deleteResponseRecord(responses[i]);
+	}
+	free(requests);
+	free(responses);
+	free(entries);
+
+	return NULL;
+}
+
+typedef struct _RingBatch {
+	void *contextData;
+	HistoryBatchCallback callback;
+	HistoryPrepareCallback prepare;
+	HistoryDeliverCallback deliver;
+} RingBatch;
+
+static void ring_batch_callback(void *context, const char *uniqueId,
+	RequestRecord *req, ResponseRecord *res) {
+	RingBatch *rb = context;
+	HistoryEntry entry;
+
+	entry.uniqueId = uniqueId;
+	entry.request = req;
+	entry.response = res;
+
+	if (rb->prepare != NULL) {
+		rb->deliver(rb->contextData, rb->prepare(rb->contextData, &entry, 1));
+	} else {
+		rb->callback(rb->contextData, &entry, 1);
+	}
+}
+
+/*
+ * Runs the workers of a load. The caller sets up the callbacks and order.
+ */
+static int run_history_load(ProxyServer *p, int threadCount,
+	size_t batchSize, HistoryLoad *load) {
+	if (threadCount <= 0) {
+		threadCount = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threadCount <= 0) {
+		threadCount = 1;
+	}
+	if (batchSize == 0) {
+		batchSize = DEFAULT_HISTORY_BATCH;
+	}
+
+	load->ids = list_meta_ids(stringAsCString(p->persistenceFolder),
+		&load->idCount);
+	if (load->ids == NULL) {
+		DIE(p, -1, "Failed to get listing of persistence directory.");
+	}
+	if (load->order == HISTORY_BY_START_TIME) {
+		qsort(load->ids, load->idCount, sizeof(MetaId), compare_meta_ids);
+	}
+
+	load->p = p;
+	load->batchSize = batchSize;
+	load->batchCount = (load->idCount + batchSize - 1) / batchSize;
+	pthread_mutex_init(&load->lock, NULL);
+	pthread_cond_init(&load->delivered, NULL);
+
+	if ((size_t) threadCount > load->batchCount) {
+		threadCount = load->batchCount > 0 ? (int) load->batchCount : 1;
+	}
+
+	pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+	int started = 0;
+
+	//The calling thread does its share as well
+	for (int i = 1; i < threadCount; ++i) {
+		if (pthread_create(threads + i, NULL, history_worker, load) != 0) {
+			break;
+		}
+		++started;
+	}
+	history_worker(load);
+	for (int i = 1; i <= started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(load->ids);
+	pthread_mutex_destroy(&load->lock);
+	pthread_cond_destroy(&load->delivered);
+
+	//Flight recorder records go last
+	RequestRecord *req = newRequestRecord();
+	ResponseRecord *res = newResponseRecord();
+	RingBatch rb;
+
+	rb.contextData = load->contextData;
+	rb.callback = load->callback;
+	rb.prepare = load->prepare;
+	rb.deliver = load->deliver;
+	load_ring_history(p, &rb, ring_batch_callback, req, res);
+
+	deleteRequestRecord(req);
+	deleteResponseRecord(res);
+
+	return 0;
+}
+
+/*
+ * Loads history using threadCount threads. If threadCount is 0 or less
+ * one thread per CPU is used. Records are delivered in batches of up to
+ * batchSize records. See HistoryOrder for the ordering contract.
+ *
+ * Records captured in flight recorder mode are delivered after the
+ * ones in the folder, oldest first, one per batch.
+ */
+int proxyServerLoadHistoryParallel(ProxyServer *p, int threadCount,
+	HistoryOrder order, size_t batchSize, void *contextData,
+	HistoryBatchCallback callback) {
+
+	if (callback == NULL) {
+		return 0; //What's the point?
+	}
+
+	HistoryLoad load;
+
+	memset(&load, 0, sizeof(load));
+	load.order = order;
+	load.contextData = contextData;
+	load.callback = callback;
+
+	return run_history_load(p, threadCount, batchSize, &load);
+}
+
+/*
+ * Loads history oldest first like HISTORY_BY_START_TIME but lets the
+ * expensive part of handling a batch run in parallel. prepare is called
+ * for batches concurrently from several threads. What it returns is
+ * handed to deliver, which is called for one batch at a time in order.
+ */
+int proxyServerLoadHistoryPipelined(ProxyServer *p, int threadCount,
+	size_t batchSize, void *contextData, HistoryPrepareCallback prepare,
+	HistoryDeliverCallback deliver) {
+	if (prepare == NULL || deliver == NULL) {
+		return 0;
+	}
+
+	HistoryLoad load;
+
+	memset(&load, 0, sizeof(load));
+	load.order = HISTORY_BY_START_TIME;
+	load.contextData = contextData;
+	load.prepare = prepare;
+	load.deliver = deliver;
+
+	return run_history_load(p, threadCount, batchSize, &load);
+}
@@ -1,8 +1,56 @@
+//Points into the mapped bytes of a record. Not NUL terminated.
+typedef struct _Slice {
+	const char *buffer;
+	size_t length;
+} Slice;
+
+//Field flags
+#define FIELD_URL_ENCODED 1 //Still has to be percent decoded
+#define FIELD_FILE 2 //Multipart part with a file name
+
+typedef struct _FieldList {
+	Slice *names;
+	Slice *values;
+	unsigned char *flags;
+	unsigned short *ids; //HeaderNameId of header fields
+	size_t length;
+	size_t capacity;
+	int isParsed;
+} FieldList;
+
+//Microseconds from the start of a request to each phase. -1 if unknown.
+typedef struct _PhaseTimings {
+	long long headerComplete;
+	long long dnsDone;
+	long long connectDone;
+	long long requestSent;
+	long long firstByte;
+	long long responseComplete;
+} PhaseTimings;
+
+/*
+ * Records are parsed lazily. Loading only parses the first line and finds
+ * the end of the header. Header fields and parameters are parsed into
+ * slices on first access. The String arrays are only filled by
+ * requestRecordFillArrays() and responseRecordFillArrays().
+ *
+ * Parameters point into the record until they are read. URL encoded
+ * names and values are decoded on first access into an arena owned by
+ * the record. Multipart form fields point at the part bodies.
+ */
 //Structure to store either request or response header data
 typedef struct _RequestRecord {
 	//Private stuff
 	int fd;
 	Buffer map;
+	Buffer *decoded; //Decoded header block if it was stored encoded
+	FieldList headers;
+	FieldList parameters;
+	FieldList parts; //File name and content type of multipart parameters
+	size_t queryParameterCount; //Parameters from the query string come first
+	size_t partsStart; //Index of the first multipart parameter
+	struct _ArenaBlock *arena; //Holds decoded parameters
+	int arraysFilled;
 	//Public stuff
 	String *host;
 	String *port;
@@ -16,12 +64,20 @@ typedef struct _RequestRecord {
 	Array *parameterValues;
 	Buffer headerBuffer;
 	Buffer bodyBuffer;	
+	//From the meta data
+	struct timeval requestStartTime;
+	struct timeval responseEndTime;
+	PhaseTimings timings;
+	unsigned long long size; //Bytes sent by the client
 } RequestRecord;
 
 typedef struct _ResponseRecord {
 	//Private stuff
 	int fd;
 	Buffer map;
+	Buffer *decoded; //Decoded header block if it was stored encoded
+	FieldList headers;
+	int arraysFilled;
 	//Public stuff
 	String *statusCode;
 	String *statusMessage;
@@ -29,8 +85,42 @@ typedef struct _ResponseRecord {
 	Array *headerValues;
 	Buffer headerBuffer;
 	Buffer bodyBuffer;	
+	unsigned long long size; //Bytes sent by the server. From the meta data.
+	int cacheStatus; //CacheStatus. From the meta data.
 } ResponseRecord;
 
+typedef struct _RetentionStats {
+	long recordsScanned;
+	long recordsRemoved;
+	long long bytesRemoved;
+	long long bytesRetained;
+	double elapsedSeconds;
+} RetentionStats;
+
+typedef enum _HistoryOrder {
+	//Batches may be delivered concurrently from several threads
+	HISTORY_UNORDERED,
+	//Batches are delivered one at a time, oldest record first
+	HISTORY_BY_START_TIME
+} HistoryOrder;
+
+typedef struct _HistoryEntry {
+	const char *uniqueId;
+	RequestRecord *request;
+	ResponseRecord *response;
+} HistoryEntry;
+
+/*
+ * Entries and their records are only valid during the callback.
+ */
+typedef void (*HistoryBatchCallback)(void *contextData,
+	HistoryEntry *entries, size_t count);
+//Runs concurrently. Entries are only valid during the call.
+typedef void *(*HistoryPrepareCallback)(void *contextData,
+	HistoryEntry *entries, size_t count);
+//Receives what prepare returned. Called one batch at a time in order.
+typedef void (*HistoryDeliverCallback)(void *contextData, void *prepared);
+
 RequestRecord *newRequestRecord();
 void deleteRequestRecord(RequestRecord *rec);
 ResponseRecord *newResponseRecord();
@@ -38,13 +128,51 @@ void deleteResponseRecord(ResponseRecord *rec);
 
 int proxyServerLoadHistory(ProxyServer *p, void *contextData, 
 	void (*callback)(void *, const char*, RequestRecord *, ResponseRecord *));
+int proxyServerLoadHistoryParallel(ProxyServer *p, int threadCount,
+	HistoryOrder order, size_t batchSize, void *contextData,
+	HistoryBatchCallback callback);
+int proxyServerLoadHistoryPipelined(ProxyServer *p, int threadCount,
+	size_t batchSize, void *contextData, HistoryPrepareCallback prepare,
+	HistoryDeliverCallback deliver);
+int proxyServerLoadMeta(ProxyServer *p, const char *uniqueId,
+	RequestRecord* req, ResponseRecord *res);
+int proxyServerLoadMetaBuffer(ProxyServer *p, const char *data, size_t length,
+	RequestRecord* req, ResponseRecord *res);
 int proxyServerLoadRequest(ProxyServer *p, const char *uniqueId, 
 	RequestRecord *rec);
 int proxyServerLoadResponse(ProxyServer *p, const char *uniqueId, 
 	ResponseRecord *rec);
+int proxyServerLocateResponseBody(ProxyServer *p, const char *uniqueId,
+	Buffer *header, char *fileName, size_t size, off_t *bodyOffset,
+	size_t *bodyLength);
 int proxyServerResetRecords(ProxyServer *p, RequestRecord *reqRec, 
 	ResponseRecord *resRec);
 int proxyServerDeleteRecord(ProxyServer *p, const char *uniqueId);
 int proxyServerSaveBuffer(ProxyServer *p, const char *fileName, Buffer *buffer);
+int proxyServerEnforceRetention(ProxyServer *p, RetentionStats *stats);
+int proxyServerGetRetentionStats(ProxyServer *p, RetentionStats *stats);
+int proxyServerSnapshotRing(ProxyServer *p, const char *folder);
 
 String *responseRecordGetHeader(ResponseRecord *rec, const char *name);
+size_t requestRecordHeaderCount(RequestRecord *rec);
+int requestRecordHeaderAt(RequestRecord *rec, size_t index,
+	Slice *name, Slice *value);
+int requestRecordFindHeader(RequestRecord *rec, const char *name,
+	Slice *value);
+int requestRecordFindHeaderId(RequestRecord *rec, int headerId,
+	Slice *value);
+size_t requestRecordParameterCount(RequestRecord *rec);
+size_t requestRecordQueryParameterCount(RequestRecord *rec);
+int requestRecordParameterAt(RequestRecord *rec, size_t index,
+	Slice *name, Slice *value);
+int requestRecordPartAt(RequestRecord *rec, size_t index,
+	Slice *fileName, Slice *contentType);
+int requestRecordFillArrays(RequestRecord *rec);
+size_t responseRecordHeaderCount(ResponseRecord *rec);
+int responseRecordHeaderAt(ResponseRecord *rec, size_t index,
+	Slice *name, Slice *value);
+int responseRecordFindHeader(ResponseRecord *rec, const char *name,
+	Slice *value);
+int responseRecordFindHeaderId(ResponseRecord *rec, int headerId,
+	Slice *value);
+int responseRecordFillArrays(ResponseRecord *rec);
@@ -0,0 +1,61 @@
+/*
+ * USDT probes of the "pixie" provider for bpftrace, perf and SystemTap.
+ * A probe is a single nop until a tracer attaches to it. The arguments
+ * are plain loads of values the proxy already has.
+ *
+ * Probes are built in when sys/sdt.h (systemtap-sdt-dev) is installed.
+ * Build with SDT=0 to leave them out. List them with:
+ *
+ * bpftrace -l 'usdt:./pixie:pixie:*'
+ *
+ * Times are CLOCK_MONOTONIC microseconds from RequestTimings and unique
+ * IDs are NUL terminated strings.
+ */
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+
+//(uniqueId, clientFd, slot)
+#define PROBE_REQUEST_BEGIN(id, fd, slot) \
+	DTRACE_PROBE3(pixie, request__begin, id, fd, slot)
+//(uniqueId, clientFd, method, host, headerComplete)
+#define PROBE_REQUEST_HEADER(id, fd, method, host, time) \
+	DTRACE_PROBE5(pixie, request__header, id, fd, method, host, time)
+//(uniqueId, clientFd, host, port)
+#define PROBE_CONNECT_START(id, fd, host, port) \
+	DTRACE_PROBE4(pixie, connect__start, id, fd, host, port)
+//(uniqueId, serverFd, status, dnsDone, connectDone). status is 0 or -1.
+#define PROBE_CONNECT_DONE(id, fd, status, dns, connect) \
+	DTRACE_PROBE5(pixie, connect__done, id, fd, status, dns, connect)
+//(uniqueId, clientFd, bytes, responseBytes so far)
+#define PROBE_WRITE_CLIENT(id, fd, bytes, total) \
+	DTRACE_PROBE4(pixie, write__client, id, fd, bytes, total)
+//(uniqueId, serverFd, bytes, requestBytes so far)
+#define PROBE_WRITE_SERVER(id, fd, bytes, total) \
+	DTRACE_PROBE4(pixie, write__server, id, fd, bytes, total)
+//(uniqueId, clientFd, serverFd)
+#define PROBE_CHANNEL_SHUTDOWN(id, clientFd, serverFd) \
+	DTRACE_PROBE3(pixie, channel__shutdown, id, clientFd, serverFd)
+//(uniqueId, clientFd, requestBytes, responseBytes, RequestTimings *)
+#define PROBE_REQUEST_END(id, fd, requestBytes, responseBytes, timings) \
+	DTRACE_PROBE5(pixie, request__end, id, fd, requestBytes, \
+		responseBytes, timings)
+
+#else
+
+#define PROBE_REQUEST_BEGIN(id, fd, slot) do {} while (0)
+#define PROBE_REQUEST_HEADER(id, fd, method, host, time) do {} while (0)
+#define PROBE_CONNECT_START(id, fd, host, port) do {} while (0)
+#define PROBE_CONNECT_DONE(id, fd, status, dns, connect) do {} while (0)
+#define PROBE_WRITE_CLIENT(id, fd, bytes, total) do {} while (0)
+#define PROBE_WRITE_SERVER(id, fd, bytes, total) do {} while (0)
+#define PROBE_CHANNEL_SHUTDOWN(id, clientFd, serverFd) do {} while (0)
+#define PROBE_REQUEST_END(id, fd, requestBytes, responseBytes, timings) \
+	do {} while (0)
+
+#endif
@@ -1,18 +1,39 @@
 #include <stdio.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
 #include <assert.h>
 
 #include "Proxy.h"
+#include "HeaderCodec.h"
+#include "Retention.h"
+#include "Ring.h"
+#include "Committer.h"
+#include "Persistence.h"
+#include "HistoryFeed.h"
+#include "Index.h"
+#include "MetaStore.h"
+#include "BodyCodec.h"
+#include "ResponseCache.h"
+#include "Replay.h"
+#include "Rules.h"
+#include "Shaper.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Probes.h"
+#include "Alloc.h"
 
 #define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
 
@@ -33,37 +54,100 @@
 #define RES_HEADER_STATE_STATUS_MSG 2
 #define RES_HEADER_STATE_DONE 5
 
+#define FRAME_HEADER 0 //Response header. Request headers are parsed elsewhere.
+#define FRAME_LENGTH 1
+#define FRAME_CHUNK_SIZE 2
+#define FRAME_CHUNK_DATA 3
+#define FRAME_CHUNK_END 4 //Line break after the chunk data
+#define FRAME_TRAILER 5
+#define FRAME_UNTIL_CLOSE 6
+#define FRAME_DONE 7
+
 #define CMD_NONE 0
 #define CMD_STOP 1
 
-static int bTrace = 0;
+#define CAPTURE_HEADER 0
+#define CAPTURE_BODY 1
+//Give up on encoding a header block larger than this
+#define MAX_CAPTURE_HEADER (64 * 1024)
+#define DEFAULT_RING_SIZE (256ULL * 1024 * 1024)
 
 static void default_on_error(const char *msg) {
 	perror(msg);
 }
 
+/*
+ * Turns binary tracing on or off. See Trace.h.
+ */
 void proxySetTrace(int t) {
-	bTrace = t;
+	traceEnabled = t;
 }
 
-static void
-_info(const char* fmt, ...) {
-	if (bTrace == 0) {
-		return;
+int disconnect_clients(ProxyServer *p) {
+
+	return 0;
+}
+
+/*
+ * Moves the header strings to the spare list so that the next request
+ * on the connection does not allocate them again.
+ */
+static void recycle_headers(Request *req) {
+	for (size_t j = 0; j < req->headerNames->length; ++j) {
+		arrayAdd(req->spareStrings, arrayGet(req->headerNames, j));
 	}
+	req->headerNames->length = 0;
 
-	va_list ap;
+	for (size_t j = 0; j < req->headerValues->length; ++j) {
+		//Empty values are never allocated
+		if (arrayGet(req->headerValues, j) != NULL) {
+			arrayAdd(req->spareStrings, arrayGet(req->headerValues, j));
+		}
+	}
+	req->headerValues->length = 0;
+	req->headerIds->length = 0;
+}
+
+/*
+ * Returns the value of a request header by its HeaderNameId or NULL.
+ */
+String *requestGetHeader(Request *req, int headerId) {
+	const unsigned short *ids = (const unsigned short*) req->headerIds->buffer;
+	size_t count = req->headerIds->length / sizeof(unsigned short);
 
-	va_start(ap, fmt);
+	for (size_t i = 0; i < count && i < req->headerValues->length; ++i) {
+		if (ids[i] == headerId) {
+			return arrayGet(req->headerValues, i);
+		}
+	}
 
-	printf("INFO: ");
-	vprintf(fmt, ap);
-	printf("\n");
+	return NULL;
 }
 
-int disconnect_clients(ProxyServer *p) {
+static String *take_string(Request *req) {
+	if (req->spareStrings->length == 0) {
+		return newString();
+	}
 
-	return 0;
+	String *s = arrayGet(req->spareStrings, req->spareStrings->length - 1);
+
+	--req->spareStrings->length;
+	s->length = 0;
+
+	return s;
+}
+
+static long long monotonic_micros() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//The earlier of two due times where 0 means none
+static long long earliest(long long a, long long b) {
+	return a == 0 || (b != 0 && b < a) ? b : a;
 }
 
 /*
@@ -74,16 +158,7 @@ static void reset_request_state(Request *req) {
 	req->clientFd = -1;
 	req->serverFd = -1;
 
-	//Free all header strings
-	for (size_t j = 0; j < req->headerNames->length; ++j) {
-		deleteString(arrayGet(req->headerNames, j));
-	}
-	req->headerNames->length = 0;
-
-	for (size_t j = 0; j < req->headerValues->length; ++j) {
-		deleteString(arrayGet(req->headerValues, j));
-	}
-	req->headerValues->length = 0;
+	recycle_headers(req);
 
 	req->clientIOFlag = RW_STATE_NONE;
 	req->serverIOFlag = RW_STATE_NONE;
@@ -106,15 +181,233 @@ static void reset_request_state(Request *req) {
 	req->requestStartTime.tv_usec = 0;
 	req->responseEndTime.tv_sec = 0;
 	req->responseEndTime.tv_usec = 0;
+	memset(&req->timings, 0, sizeof(req->timings));
+	memset(&req->requestFraming, 0, sizeof(req->requestFraming));
+	memset(&req->responseFraming, 0, sizeof(req->responseFraming));
 	req->responseHeaderParseState = RES_HEADER_STATE_PROTOCOL;
+	req->cacheStatus = CACHE_NONE;
+	req->cacheStore = 0;
+	req->replayFd = -1;
+	req->replayRemaining = 0;
+	req->replayDue = 0;
+	if (req->replayPipelined != NULL) {
+		req->replayPipelined->length = 0;
+	}
+	req->closeAfterWrite = 0;
+	req->blockStatus = 0;
+	memset(req->shapeBuckets, 0, sizeof(req->shapeBuckets));
+	req->shapeHost = NULL;
+	req->shapeDue[SHAPE_DOWN] = req->shapeDue[SHAPE_UP] = 0;
+	req->shapeReserved[SHAPE_DOWN] = req->shapeReserved[SHAPE_UP] = 0;
+	req->shapeResponseStarted = 0;
+}
+
+static void write_capture(FILE *file, const char *data, size_t length) {
+	if (length == 0) {
+		return;
+	}
+
+	size_t sz = fwrite(data, length, 1, file);
+
+	if (sz == 0) {
+		TRACE_ERROR(TRACE_CAPTURE_FAILED, fileno(file), length, 0);
+	}
+}
+
+/*
+ * Writes out a complete header block. The block is stored in the encoded
+ * form if possible and as is otherwise.
+ */
+static void flush_capture_header(ProxyServer *p, FILE *file,
+	const char *header, size_t length) {
+	Buffer *encoded = newBufferWithCapacity(length);
+
+	if (p->headerDictionary != NULL &&
+		headerCodecEncode(p->headerDictionary, header, length, encoded) == 0) {
+		write_capture(file, encoded->buffer, encoded->length);
+	} else {
+		write_capture(file, header, length);
+	}
+
+	deleteBuffer(encoded);
+}
+
+/*
+ * Saves the data flowing in one direction of a channel. Data is held
+ * back until we have seen the whole header block. Everything after
+ * the header is written as is.
+ */
+static void capture_data(ProxyServer *p, FILE *file, Buffer *header, int *state,
+	const char *data, size_t length) {
+	if (p->persistenceEnabled != 1 || file == NULL) {
+		return;
+	}
+	if (*state == CAPTURE_BODY) {
+		write_capture(file, data, length);
+
+		return;
+	}
+
+	//The end marker may straddle the previous and this chunk
+	size_t searchFrom = header->length < 3 ? 0 : header->length - 3;
+
+	bufferAppendBytes(header, data, length);
+
+	for (size_t i = searchFrom; i + 4 <= header->length; ++i) {
+		if (memcmp(header->buffer + i, "\r\n\r\n", 4) == 0) {
+			size_t headerLength = i + 4;
+
+			flush_capture_header(p, file, header->buffer, headerLength);
+			write_capture(file, header->buffer + headerLength,
+				header->length - headerLength);
+			header->length = 0;
+			*state = CAPTURE_BODY;
+
+			return;
+		}
+	}
+
+	if (header->length > MAX_CAPTURE_HEADER) {
+		//Does not look like HTTP. Stop trying.
+		write_capture(file, header->buffer, header->length);
+		header->length = 0;
+		*state = CAPTURE_BODY;
+	}
+}
+
+/*
+ * In flight recorder mode data goes straight into the ring. We don't
+ * encode headers there since that needs extra buffering.
+ */
+static int capture_to_ring(ProxyServer *p, Request *req, int kind, Buffer *data) {
+	if (p->ring == NULL) {
+		return 0;
+	}
+	if (p->persistenceEnabled == 1 && req->ringRecord != 0) {
+		ringAppend(p->ring, kind, req->ringRecord, data->buffer, data->length);
+	}
+
+	return 1;
+}
+
+static void capture_request_data(ProxyServer *p, Request *req) {
+	req->requestBytes += req->requestBuffer->length;
+	if (capture_to_ring(p, req, RING_REQUEST, req->requestBuffer)) {
+		return;
+	}
+	capture_data(p, req->requestFile, req->requestHeaderCapture,
+		&req->requestCaptureState,
+		req->requestBuffer->buffer, req->requestBuffer->length);
+	committerWritten(p, req);
+}
+
+static void capture_response_data(ProxyServer *p, Request *req) {
+	req->responseBytes += req->responseBuffer->length;
+	if (capture_to_ring(p, req, RING_RESPONSE, req->responseBuffer)) {
+		return;
+	}
+	capture_data(p, req->responseFile, req->responseHeaderCapture,
+		&req->responseCaptureState,
+		req->responseBuffer->buffer, req->responseBuffer->length);
+	committerWritten(p, req);
+}
+
+static void append_meta_field(Buffer *out, const char *name,
+	const char *value, size_t length) {
+	bufferAppendBytes(out, name, strlen(name));
+	bufferAppendBytes(out, "\n", 1);
+	bufferAppendBytes(out, value, length);
+	bufferAppendBytes(out, "\n", 1);
+}
+
+static void append_meta_number(Buffer *out, const char *name,
+	unsigned long value) {
+	char num[32];
+	int sz = snprintf(num, sizeof(num), "%lu", value);
+
+	append_meta_field(out, name, num, sz);
+}
+
+//Phases are saved as microseconds since the start of the request
+static void append_meta_timing(Buffer *out, const char *name,
+	Request *req, long long value) {
+	if (value != 0) {
+		append_meta_number(out, name,
+			(unsigned long) (value - req->timings.start));
+	}
+}
+
+/*
+ * Formats the meta data about a request. Each field is a name line
+ * followed by a value line.
+ */
+static void format_meta(Request *req, Buffer *out) {
+	out->length = 0;
+
+	append_meta_field(out, "protocol-line",
+		req->protocolLine->buffer, req->protocolLine->length);
+	append_meta_field(out, "protocol",
+		req->protocol->buffer, req->protocol->length);
+	append_meta_field(out, "host",
+		req->host->buffer, req->host->length);
+	append_meta_field(out, "port",
+		req->port->buffer, req->port->length);
+	append_meta_field(out, "path",
+		req->path->buffer, req->path->length);
+	append_meta_number(out, "request-start-seconds",
+		(unsigned long)req->requestStartTime.tv_sec);
+	append_meta_number(out, "request-start-microseconds",
+		(unsigned long)req->requestStartTime.tv_usec);
+	append_meta_number(out, "response-end-seconds",
+		(unsigned long)req->responseEndTime.tv_sec);
+	append_meta_number(out, "response-end-microseconds",
+		(unsigned long)req->responseEndTime.tv_usec);
+	append_meta_field(out, "response-status-code",
+		req->responseStatusCode->buffer, req->responseStatusCode->length);
+	append_meta_field(out, "response-status-message",
+		req->responseStatusMessage->buffer,
+		req->responseStatusMessage->length);
+	append_meta_number(out, "request-bytes", req->requestBytes);
+	append_meta_number(out, "response-bytes", req->responseBytes);
+	append_meta_timing(out, "timing-header-complete", req,
+		req->timings.headerComplete);
+	append_meta_timing(out, "timing-dns", req, req->timings.dnsDone);
+	append_meta_timing(out, "timing-connect", req, req->timings.connectDone);
+	append_meta_timing(out, "timing-request-sent", req,
+		req->timings.requestSent);
+	append_meta_timing(out, "timing-first-byte", req, req->timings.firstByte);
+	append_meta_timing(out, "timing-response-complete", req,
+		req->timings.responseComplete);
+	if (req->cacheStatus != CACHE_NONE) {
+		const char *status = cacheStatusName(req->cacheStatus);
+
+		append_meta_field(out, "cache", status, strlen(status));
+	}
+}
+
+/*
+ * Writes out any incomplete header that was held back.
+ */
+static void end_capture(FILE *file, Buffer *header, int *state) {
+	if (file != NULL && header->length > 0) {
+		write_capture(file, header->buffer, header->length);
+	}
+	header->length = 0;
+	*state = CAPTURE_HEADER;
 }
 
 static void on_begin_request(ProxyServer *p, Request *req) {
+	ALLOC_PHASE(ALLOC_PHASE_BEGIN);
+
 	/*
 	 * Store the request start time. Also use it to generate a unique ID for
 	 * the request.
 	 */
 	assert(gettimeofday(&req->requestStartTime, NULL) == 0);
+	memset(&req->timings, 0, sizeof(req->timings));
+	req->timings.start = monotonic_micros();
+	memset(&req->requestFraming, 0, sizeof(req->requestFraming));
+	memset(&req->responseFraming, 0, sizeof(req->responseFraming));
 
 	char uid[256];
 
@@ -126,17 +419,38 @@ static void on_begin_request(ProxyServer *p, Request *req) {
 
 	req->uniqueId->length = 0; //Rest old value
 	stringAppendBuffer(req->uniqueId, uid, sz);
+	//Probes pass the ID as a C string
+	stringAsCString(req->uniqueId);
+	PROBE_REQUEST_BEGIN(req->uniqueId->buffer, req->clientFd,
+		(int) (req - p->requests));
 
-	//Open the files if persistence is enabled
-	if (p->persistenceEnabled == 1) {
-		_info("Opening files for: %.*s",
-			req->uniqueId->length, req->uniqueId->buffer);
+	req->requestHeaderCapture->length = 0;
+	req->responseHeaderCapture->length = 0;
+	req->requestCaptureState = CAPTURE_HEADER;
+	req->responseCaptureState = CAPTURE_HEADER;
 
+	req->ringRecord = 0;
+	req->requestBytes = 0;
+	req->responseBytes = 0;
+	req->cacheStatus = CACHE_NONE;
+
+	metricsAdd(p, METRIC_REQUESTS, 1);
+	TRACE_INFO(TRACE_REQUEST_BEGIN, req->clientFd, req->requestStartTime.tv_sec,
+		req->requestStartTime.tv_usec);
+
+	//Open the files if persistence is enabled
+	if (p->persistenceEnabled == 1 && p->ring != NULL) {
+		//Flight recorder mode. No files to open.
+		req->ringRecord = ringBeginRecord(p->ring, uid, sz);
+	} else if (p->persistenceEnabled == 1) {
 		char file_name[512];
 
-		snprintf(file_name, sizeof(file_name), "%s/%s.meta",
-			stringAsCString(p->persistenceFolder), uid);
-		req->metaFile = fopen(file_name, "w");
+		//With a committer the meta file is written once the data is durable
+		if (p->committer == NULL) {
+			snprintf(file_name, sizeof(file_name), "%s/%s.meta",
+				stringAsCString(p->persistenceFolder), uid);
+			req->metaFile = fopen(file_name, "w");
+		}
 		snprintf(file_name, sizeof(file_name), "%s/%s.req",
 			stringAsCString(p->persistenceFolder), uid);
 		req->requestFile = fopen(file_name, "w");
@@ -144,12 +458,14 @@ static void on_begin_request(ProxyServer *p, Request *req) {
 			stringAsCString(p->persistenceFolder), uid);
 		req->responseFile = fopen(file_name, "w");
 
-		if (req->metaFile == NULL || req->requestFile == NULL || req->responseFile == NULL) {
-			_info("Failed to save HTTP data files.");
+		if ((req->metaFile == NULL && p->committer == NULL) ||
+			req->requestFile == NULL || req->responseFile == NULL) {
+			TRACE_ERROR(TRACE_OPEN_FILES_FAILED, req->clientFd, 0, 0);
 			if (p->onError != NULL) {
 				p->onError("Failed to save HTTP data files.");
 			}
 		}
+		committerTrack(p, req);
 	}
 
 	if (p->onBeginRequest != NULL) {
@@ -157,43 +473,57 @@ static void on_begin_request(ProxyServer *p, Request *req) {
 	}
 }
 
+static void record_timings(ProxyServer *p, Request *req) {
+	RequestTimings *t = &req->timings;
+
+	if (t->responseComplete != 0) {
+		metricsRecord(p, HISTOGRAM_REQUEST_DURATION,
+			t->responseComplete - t->start);
+	}
+	if (t->connectDone != 0 && t->headerComplete != 0) {
+		metricsRecord(p, HISTOGRAM_CONNECT, t->connectDone - t->headerComplete);
+	}
+	if (t->firstByte != 0 && t->requestSent != 0) {
+		metricsRecord(p, HISTOGRAM_TIME_TO_FIRST_BYTE,
+			t->firstByte - t->requestSent);
+	}
+}
+
 static void on_end_request(ProxyServer *p, Request *req) {
+	ALLOC_PHASE(ALLOC_PHASE_END);
+	TRACE_INFO(TRACE_REQUEST_END, req->clientFd, req->requestBytes,
+		req->responseBytes);
+	PROBE_REQUEST_END(req->uniqueId->buffer, req->clientFd, req->requestBytes,
+		req->responseBytes, &req->timings);
+	record_timings(p, req);
 	//Close all files
 	if (p->persistenceEnabled == 1) {
 		//Write the meta data about this request.
+		int committed = p->committer != NULL &&
+			(req->requestFile != NULL || req->responseFile != NULL ||
+			req->ringRecord != 0);
+
+		if (req->metaFile != NULL || req->ringRecord != 0 || committed) {
+			format_meta(req, req->metaBuffer);
+		}
 		if (req->metaFile != NULL) {
-			fprintf(req->metaFile, "protocol-line\n%.*s\n",
-				(int)req->protocolLine->length, req->protocolLine->buffer);
-			fprintf(req->metaFile, "protocol\n%.*s\n",
-				(int)req->protocol->length, req->protocol->buffer);
-			fprintf(req->metaFile, "host\n%.*s\n",
-				(int)req->host->length, req->host->buffer);
-			fprintf(req->metaFile, "port\n%.*s\n",
-				(int)req->port->length, req->port->buffer);
-			fprintf(req->metaFile, "path\n%.*s\n",
-				(int)req->path->length, req->path->buffer);
-			fprintf(req->metaFile, "request-start-seconds\n%lu\n",
-				(unsigned long)req->requestStartTime.tv_sec);
-			fprintf(req->metaFile, "request-start-microseconds\n%lu\n",
-				(unsigned long)req->requestStartTime.tv_usec);
-			fprintf(req->metaFile, "response-end-seconds\n%lu\n",
-				(unsigned long)req->responseEndTime.tv_sec);
-			fprintf(req->metaFile, "response-end-microseconds\n%lu\n",
-				(unsigned long)req->responseEndTime.tv_usec);
-			fprintf(req->metaFile, "response-status-code\n%.*s\n",
-				(int)req->responseStatusCode->length,
-				req->responseStatusCode->buffer);
-			fprintf(req->metaFile, "response-status-message\n%.*s\n",
-				(int)req->responseStatusMessage->length,
-				req->responseStatusMessage->buffer);
-		}
-
-		_info("Closing files for: %.*s",
-			req->uniqueId->length, req->uniqueId->buffer);
-		if (req->metaFile != NULL) {
-			fclose(req->metaFile);
-			req->metaFile = NULL;
+			write_capture(req->metaFile,
+				req->metaBuffer->buffer, req->metaBuffer->length);
+		}
+		if (req->ringRecord != 0 && p->ring != NULL) {
+			ringAppend(p->ring, RING_META, req->ringRecord,
+				req->metaBuffer->buffer, req->metaBuffer->length);
+		}
+
+		end_capture(req->requestFile, req->requestHeaderCapture,
+			&req->requestCaptureState);
+		end_capture(req->responseFile, req->responseHeaderCapture,
+			&req->responseCaptureState);
+		if (committed) {
+			//The committer closes the files
+			committerSubmit(p, req);
 		}
+		//Data goes first so that a complete meta file means a complete record
 		if (req->requestFile != NULL) {
 			fclose(req->requestFile);
 			req->requestFile = NULL;
@@ -202,22 +532,36 @@ static void on_end_request(ProxyServer *p, Request *req) {
 			fclose(req->responseFile);
 			req->responseFile = NULL;
 		}
+		if (req->metaFile != NULL) {
+			fclose(req->metaFile);
+			req->metaFile = NULL;
+		}
+		req->ringRecord = 0;
+	}
+	if (p->responseCache != NULL) {
+		responseCacheEndRequest(p, req);
 	}
 	if (p->onEndRequest != NULL) {
 		p->onEndRequest(p, req);
 	}
+
+	compactorNotify(p);
 }
 
 int shutdown_channel(ProxyServer *p, Request *req) {
-	_info("Shutting down channel. Client %d server %d",
-		req->clientFd, req->serverFd);
+	TRACE_INFO(TRACE_CHANNEL_SHUTDOWN, req->clientFd, req->serverFd, 0);
+	PROBE_CHANNEL_SHUTDOWN(req->uniqueId->buffer, req->clientFd, req->serverFd);
 
 	if (req->clientFd >= 0) {
 		close(req->clientFd);
+		metricsAdd(p, METRIC_ACTIVE_SLOTS, -1);
 	}
 	if (req->serverFd >= 0) {
 		close(req->serverFd);
 	}
+	if (req->replayFd >= 0) {
+		close(req->replayFd);
+	}
 
 	/*
 	 * Mark the request as ended. This may be a successful end
@@ -229,6 +573,9 @@ int shutdown_channel(ProxyServer *p, Request *req) {
 	if (req->requestState != REQ_STATE_NONE) {
 		on_end_request(p, req);
 	}
+	if (p->shaper != NULL) {
+		shaperEndRequest(p, req);
+	}
 
 	reset_request_state(req);
 
@@ -236,15 +583,7 @@ int shutdown_channel(ProxyServer *p, Request *req) {
 }
 
 static void persist_request_buffer(ProxyServer *p, Request *req) {
-	if (p->persistenceEnabled == 1 && req->requestFile != NULL) {
-		size_t sz = fwrite(req->requestBuffer->buffer,
-			req->requestBuffer->length,
-			1,
-			req->requestFile);
-		if (sz == 0) {
-			_info("Failed to write request data to file.");
-		}
-	}
+	capture_request_data(p, req);
 }
 
 /*
@@ -252,7 +591,8 @@ static void persist_request_buffer(ProxyServer *p, Request *req) {
  * Returns 0 in case of success else an error status.
  */
 int connect_to_server(ProxyServer *p, Request *req, const char *host, int port) {
-	_info("Connecting to %s:%d for client %d", host, port, req->clientFd);
+	TRACE_INFO(TRACE_CONNECT_START, req->clientFd, port, 0);
+	PROBE_CONNECT_START(req->uniqueId->buffer, req->clientFd, host, port);
 
 	assert(req->serverFd < 0);
 
@@ -265,17 +605,26 @@ int connect_to_server(ProxyServer *p, Request *req, const char *host, int port)
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_INET;
 	hints.ai_socktype = SOCK_STREAM;
-	_info("Resolving name: %s.", host);
 	int status = getaddrinfo(host, port_str, &hints, &res);
+	if (status != 0 || res == NULL) {
+		TRACE_ERROR(TRACE_DNS_FAILED, req->clientFd, status, port);
+		metricsAdd(p, METRIC_DNS_FAILURES, 1);
+	}
 	DIE(p, status, "getaddrinfo() failed.");
 	if (res == NULL) {
-		_info("Failed to resolve address: %s", host);
 		DIE(p, -1, "Failed to resolve address");
 	}
+	//getaddrinfo() blocks so this includes any time spent waiting on DNS
+	req->timings.dnsDone = monotonic_micros();
 
 	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 	DIE(p, sock, "Failed to open socket.");
 
+	//Relayed data is written as it arrives. Nagle would hold a second
+	//small write back until the peer's delayed ACK.
+	int noDelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+
 	//Enable non-blocking I/O and connect
 	status = fcntl(sock, F_SETFL, O_NONBLOCK);
 	DIE(p, status, "Failed to set non blocking mode for socket.");
@@ -285,17 +634,24 @@ int connect_to_server(ProxyServer *p, Request *req, const char *host, int port)
 		if (errno != EINPROGRESS) {
 			close(sock);
 			freeaddrinfo(res);
+			metricsAdd(p, METRIC_CONNECT_FAILURES, 1);
+			TRACE_ERROR(TRACE_CONNECT_FAILED, sock, errno, req->clientFd);
+			PROBE_CONNECT_DONE(req->uniqueId->buffer, sock, -1,
+				req->timings.dnsDone, 0LL);
 
 			DIE(p, status, "Failed to connect to server.");
 		} else {
 			req->connectionEstablished = 0; //Just to be safe
 			req->serverFd = sock;
-			_info("Server connection is pending: %d", req->serverFd);
+			TRACE_INFO(TRACE_CONNECT_PENDING, sock, req->clientFd, 0);
 		}
 	} else {
 		req->connectionEstablished = 1;
 		req->serverFd = sock;
-		_info("Server connected immediately: %d", req->serverFd);
+		req->timings.connectDone = monotonic_micros();
+		TRACE_INFO(TRACE_CONNECTED, sock, req->clientFd, 1);
+		PROBE_CONNECT_DONE(req->uniqueId->buffer, sock, 0,
+			req->timings.dnsDone, req->timings.connectDone);
 	}
 
 	freeaddrinfo(res);
@@ -340,16 +696,149 @@ static void parse_response_header(ProxyServer *p, Request *req) {
 
 }
 
+static int has_token(const char *value, const char *token) {
+	size_t length = strlen(token);
+
+	for (; *value != '\0'; ++value) {
+		if (strncasecmp(value, token, length) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Decides how the body is framed once the header is complete.
+ */
+static void frame_start_body(MessageFraming *f, int noBody, int untilClose) {
+	f->lineLength = 0;
+	if (noBody) {
+		f->state = FRAME_DONE;
+	} else if (f->chunked) {
+		f->state = FRAME_CHUNK_SIZE;
+	} else if (f->hasLength) {
+		f->state = f->remaining > 0 ? FRAME_LENGTH : FRAME_DONE;
+	} else {
+		f->state = untilClose ? FRAME_UNTIL_CLOSE : FRAME_DONE;
+	}
+}
+
+static void frame_end_line(MessageFraming *f, int headRequest) {
+	const char *line = f->line;
+
+	if (f->state == FRAME_CHUNK_SIZE) {
+		f->remaining = strtoull(line, NULL, 16);
+		f->state = f->remaining > 0 ? FRAME_CHUNK_DATA : FRAME_TRAILER;
+	} else if (f->state == FRAME_TRAILER) {
+		if (f->lineLength == 0) {
+			f->state = FRAME_DONE;
+		}
+	} else if (f->status == 0) {
+		//Status line
+		if (sscanf(line, "%*s %d", &f->status) != 1 || f->status <= 0) {
+			f->status = -1;
+		}
+	} else if (f->lineLength > 0) {
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			f->hasLength = 1;
+			f->remaining = strtoull(line + 15, NULL, 10);
+		} else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+			f->chunked = has_token(line + 18, "chunked");
+		}
+	} else if (f->status >= 100 && f->status < 200 && f->status != 101) {
+		//Interim response. The real one follows.
+		memset(f, 0, sizeof(MessageFraming));
+	} else if (f->status == 101) {
+		f->state = FRAME_UNTIL_CLOSE;
+	} else {
+		frame_start_body(f, headRequest || f->status == 204 ||
+			f->status == 304, 1);
+	}
+}
+
+/*
+ * Returns how many bytes belong to the message. Bytes after its end are
+ * the start of the next one.
+ */
+static size_t frame_bytes(MessageFraming *f, const char *data, size_t length,
+	int headRequest) {
+	size_t i;
+
+	for (i = 0; i < length && f->state != FRAME_DONE; ++i) {
+		char ch = data[i];
+
+		if (f->state == FRAME_HEADER || f->state == FRAME_CHUNK_SIZE ||
+			f->state == FRAME_TRAILER) {
+			if (ch == '\n') {
+				f->line[f->lineLength] = '\0';
+				frame_end_line(f, headRequest);
+				f->lineLength = 0;
+			} else if (ch != '\r' && f->lineLength < sizeof(f->line) - 1) {
+				f->line[f->lineLength++] = ch;
+			}
+		} else if (f->state == FRAME_LENGTH || f->state == FRAME_CHUNK_DATA) {
+			size_t n = length - i;
+
+			if (n > f->remaining) {
+				n = f->remaining;
+			}
+			f->remaining -= n;
+			i += n - 1;
+			if (f->remaining == 0) {
+				f->state = f->state == FRAME_LENGTH ?
+					FRAME_DONE : FRAME_CHUNK_END;
+			}
+		} else if (f->state == FRAME_CHUNK_END) {
+			if (ch == '\n') {
+				f->state = FRAME_CHUNK_SIZE;
+			}
+		} else {
+			//Ends when the server closes the connection
+			return length;
+		}
+	}
+
+	return i;
+}
+
+static int frame_message(MessageFraming *f, const char *data, size_t length,
+	int headRequest) {
+	frame_bytes(f, data, length, headRequest);
+
+	return f->state == FRAME_DONE;
+}
+
+/*
+ * Sets up the request body framing from the parsed header.
+ */
+static void frame_request(Request *req) {
+	MessageFraming *f = &req->requestFraming;
+	String *length = requestGetHeader(req, HEADER_CONTENT_LENGTH);
+	String *encoding = requestGetHeader(req, HEADER_TRANSFER_ENCODING);
+
+	memset(f, 0, sizeof(MessageFraming));
+	if (length != NULL) {
+		f->hasLength = 1;
+		f->remaining = strtoull(stringAsCString(length), NULL, 10);
+	}
+	if (encoding != NULL) {
+		f->chunked = has_token(stringAsCString(encoding), "chunked");
+	}
+	frame_start_body(f, req->requestState == REQ_CONNECT_TUNNEL_MODE, 0);
+}
+
 int schedule_write_to_client(ProxyServer *p, Request *req) {
 	assert(req->clientFd >= 0);
 
 	if (req->clientIOFlag & RW_STATE_WRITE) {
 		//Already writing
-		_info("Write to client is already scheduled.");
+		TRACE_DEBUG(TRACE_WRITE_BUSY, req->clientFd, 0, 0);
 
 		return -2;
 	}
-	_info("Scheduling write to client: %d", req->clientFd);
+	TRACE_DEBUG(TRACE_WRITE_SCHEDULED, req->clientFd,
+		req->responseBuffer->length, 0);
 
 	/*
 	 * If we have not finished parsing header keep parsing it.
@@ -360,17 +849,14 @@ int schedule_write_to_client(ProxyServer *p, Request *req) {
 
 	req->clientWriteCompleted = 0;
 	req->clientIOFlag |= RW_STATE_WRITE;
+	if (p->shaper != NULL) {
+		shaperScheduleWrite(p, req, SHAPE_DOWN, monotonic_micros());
+	}
 
 	//Save the response data
-	if (p->persistenceEnabled == 1 && req->responseFile != NULL) {
-		size_t sz = fwrite(req->responseBuffer->buffer,
-			req->responseBuffer->length,
-			1,
-			req->responseFile);
-		if (sz == 0) {
-			_info("Failed to write response data.");
-		}
-	}
+	capture_response_data(p, req);
+	PROBE_WRITE_CLIENT(req->uniqueId->buffer, req->clientFd,
+		req->responseBuffer->length, req->responseBytes);
 
 	if (p->onQueueWriteToClient != NULL) {
 		p->onQueueWriteToClient(p, req);
@@ -384,26 +870,24 @@ int schedule_write_to_server(ProxyServer *p, Request *req) {
 
 	if (req->serverIOFlag & RW_STATE_WRITE) {
 		//Already writing
-		_info("Write to server is already scheduled.");
+		TRACE_DEBUG(TRACE_WRITE_BUSY, req->serverFd, 0, 0);
 
 		return -2;
 	}
 
-	_info("Scheduling write to server: %d", req->serverFd);
+	TRACE_DEBUG(TRACE_WRITE_SCHEDULED, req->serverFd,
+		req->requestBuffer->length, 0);
 
 	req->serverWriteCompleted = 0;
 	req->serverIOFlag |= RW_STATE_WRITE;
+	if (p->shaper != NULL) {
+		shaperScheduleWrite(p, req, SHAPE_UP, monotonic_micros());
+	}
 
 	//Save the request data
-	if (p->persistenceEnabled == 1 && req->requestFile != NULL) {
-		size_t sz = fwrite(req->requestBuffer->buffer,
-			req->requestBuffer->length,
-			1,
-			req->requestFile);
-		if (sz == 0) {
-			_info("Failed to write request data to file.");
-		}
-	}
+	capture_request_data(p, req);
+	PROBE_WRITE_SERVER(req->uniqueId->buffer, req->serverFd,
+		req->requestBuffer->length, req->requestBytes);
 
 	if (p->onQueueWriteToServer != NULL) {
 		p->onQueueWriteToServer(p, req);
@@ -412,6 +896,251 @@ int schedule_write_to_server(ProxyServer *p, Request *req) {
 	return 0;
 }
 
+/*
+ * Answers a request from the response cache. The response was placed in
+ * the response buffer by the lookup and the server is not contacted.
+ */
+static void serve_from_cache(ProxyServer *p, Request *req) {
+	//The request is never written to a server so save it here
+	persist_request_buffer(p, req);
+
+	req->requestState = REQ_READ_RESPONSE;
+	req->responseFraming.state = FRAME_DONE;
+	req->timings.firstByte = req->timings.responseComplete =
+		monotonic_micros();
+	assert(gettimeofday(&req->responseEndTime, NULL) == 0);
+	schedule_write_to_client(p, req);
+}
+
+static void send_replay(ProxyServer *p, Request *req) {
+	req->replayDue = 0;
+	req->timings.firstByte = req->timings.responseComplete =
+		monotonic_micros();
+	assert(gettimeofday(&req->responseEndTime, NULL) == 0);
+	schedule_write_to_client(p, req);
+}
+
+/*
+ * Answers a request in replay mode once it has been read in full. The
+ * response is held back until the captured duration has passed since
+ * the request started.
+ */
+static void replay_response(ProxyServer *p, Request *req) {
+	ReplayResponse response;
+
+	replayLookup(p, req, req->replayBody->buffer, req->replayBody->length,
+		req->responseBuffer, &response);
+	req->requestState = REQ_READ_RESPONSE;
+	req->responseFraming.state = FRAME_DONE;
+	req->closeAfterWrite = response.closeAfter;
+	if (response.fileName[0] != '\0') {
+		req->replayFd = open(response.fileName, O_RDONLY);
+		req->replayOffset = response.bodyOffset;
+		req->replayRemaining = response.bodyLength;
+		if (req->replayFd < 0) {
+			//The header promised a body. Only closing can end it now.
+			req->closeAfterWrite = 1;
+		}
+	}
+	if (response.delay > 0 &&
+		req->timings.start + response.delay > monotonic_micros()) {
+		req->replayDue = req->timings.start + response.delay;
+
+		return;
+	}
+	send_replay(p, req);
+}
+
+/*
+ * Keeps the bytes of pipelined requests that arrive with the one being
+ * answered in replay mode. They are handled once its response is sent.
+ */
+static void hold_pipelined(Request *req, const char *data, size_t length) {
+	if (length == 0) {
+		return;
+	}
+	if (req->replayPipelined == NULL) {
+		req->replayPipelined = newBufferWithCapacity(length);
+	}
+	bufferAppendBytes(req->replayPipelined, data, length);
+}
+
+/*
+ * Collects the request body in replay mode. Nothing is sent to a server.
+ */
+static int collect_replay_body(ProxyServer *p, Request *req) {
+	size_t used = frame_bytes(&req->requestFraming,
+		req->requestBuffer->buffer, req->requestBuffer->length, 0);
+
+	hold_pipelined(req, req->requestBuffer->buffer + used,
+		req->requestBuffer->length - used);
+	req->requestBuffer->length = used;
+	if (used == 0) {
+		return 0;
+	}
+	persist_request_buffer(p, req);
+	bufferAppendBytes(req->replayBody, req->requestBuffer->buffer,
+		req->requestBuffer->length);
+	if (req->requestFraming.state == FRAME_DONE) {
+		replay_response(p, req);
+	}
+
+	return 0;
+}
+
+static void remove_header(Request *req, size_t index) {
+	unsigned short *ids = (unsigned short*) req->headerIds->buffer;
+	size_t count = req->headerNames->length;
+
+	arrayAdd(req->spareStrings, arrayGet(req->headerNames, index));
+	if (arrayGet(req->headerValues, index) != NULL) {
+		arrayAdd(req->spareStrings, arrayGet(req->headerValues, index));
+	}
+	for (size_t i = index; i + 1 < count; ++i) {
+		arraySet(req->headerNames, i, arrayGet(req->headerNames, i + 1));
+		arraySet(req->headerValues, i, arrayGet(req->headerValues, i + 1));
+		ids[i] = ids[i + 1];
+	}
+	--req->headerNames->length;
+	--req->headerValues->length;
+	req->headerIds->length -= sizeof(unsigned short);
+}
+
+/*
+ * Sets the value of a request header, replacing every earlier value. A
+ * NULL value removes the header.
+ */
+static void edit_header(Request *req, const char *name, const char *value) {
+	size_t length = strlen(name);
+	int found = 0;
+
+	for (size_t i = 0; i < req->headerNames->length; ++i) {
+		String *n = arrayGet(req->headerNames, i);
+
+		if (n->length != length || strncasecmp(n->buffer, name, length) != 0) {
+			continue;
+		}
+		if (value == NULL || found) {
+			remove_header(req, i--);
+
+			continue;
+		}
+
+		String *v = arrayGet(req->headerValues, i);
+
+		if (v == NULL) {
+			v = take_string(req);
+			arraySet(req->headerValues, i, v);
+		}
+		v->length = 0;
+		stringAppendCString(v, value);
+		found = 1;
+	}
+	if (found || value == NULL) {
+		return;
+	}
+
+	String *n = take_string(req);
+	String *v = take_string(req);
+	unsigned short id = headerNameLookup(name, length);
+
+	stringAppendCString(n, name);
+	stringAppendCString(v, value);
+	arrayAdd(req->headerNames, n);
+	arrayAdd(req->headerValues, v);
+	bufferAppendBytes(req->headerIds, (char*) &id, sizeof(id));
+}
+
+/*
+ * Drops the capture of the current request. Nothing has been written yet
+ * since the request header is held back until it is complete.
+ */
+static void discard_capture(ProxyServer *p, Request *req) {
+	FILE **files[] = {&req->metaFile, &req->requestFile, &req->responseFile};
+	const char *extensions[] = {"meta", "req", "res"};
+
+	committerUntrack(p, req);
+	for (int i = 0; i < 3; ++i) {
+		if (*files[i] == NULL) {
+			continue;
+		}
+
+		char file_name[512];
+
+		fclose(*files[i]);
+		*files[i] = NULL;
+		snprintf(file_name, sizeof(file_name), "%s/%s.%s",
+			stringAsCString(p->persistenceFolder),
+			stringAsCString(req->uniqueId), extensions[i]);
+		unlink(file_name);
+	}
+	//A ring record without meta data is skipped when read
+	req->ringRecord = 0;
+}
+
+/*
+ * Applies the rules to a request whose header has just been parsed.
+ * A block is carried out once the rest of the header is handled.
+ */
+static void apply_rules(ProxyServer *p, Request *req, struct _RuleSet *rules) {
+	RuleMatch match;
+
+	if (ruleSetMatch(rules, req, &match) == 0) {
+		return;
+	}
+	metricsAdd(p, METRIC_RULE_MATCHES, 1);
+
+	for (int i = 0; i < match.editCount; ++i) {
+		edit_header(req, match.edits[i].name, match.edits[i].value);
+	}
+	if (match.mapHost != NULL) {
+		req->host->length = 0;
+		stringAppendCString(req->host, match.mapHost);
+		if (match.mapPort != NULL) {
+			req->port->length = 0;
+			stringAppendCString(req->port, match.mapPort);
+		}
+
+		//Keep the Host header in line
+		char host[512];
+
+		snprintf(host, sizeof(host), "%s%s%s", match.mapHost,
+			req->port->length > 0 ? ":" : "", stringAsCString(req->port));
+		edit_header(req, "Host", host);
+	}
+	if (match.noCapture) {
+		discard_capture(p, req);
+	}
+	if (match.blockStatus != 0) {
+		req->blockStatus = match.blockStatus;
+		metricsAdd(p, METRIC_RULE_BLOCKS, 1);
+	}
+}
+
+/*
+ * Answers a request blocked by a rule. Nothing more is read from the
+ * client and the connection is closed once the response is written.
+ */
+static void block_request(ProxyServer *p, Request *req) {
+	char response[128];
+	int length = snprintf(response, sizeof(response),
+		"HTTP/1.1 %d Blocked\r\nContent-Length: 0\r\n"
+		"Connection: close\r\n\r\n", req->blockStatus);
+
+	//Saved here as it is never written to a server
+	persist_request_buffer(p, req);
+	req->clientIOFlag &= ~RW_STATE_READ;
+	req->closeAfterWrite = 1;
+	req->requestState = REQ_READ_RESPONSE;
+	req->responseFraming.state = FRAME_DONE;
+	req->responseBuffer->length = 0;
+	bufferAppendBytes(req->responseBuffer, response, length);
+	req->timings.firstByte = req->timings.responseComplete =
+		monotonic_micros();
+	assert(gettimeofday(&req->responseEndTime, NULL) == 0);
+	schedule_write_to_client(p, req);
+}
+
 #define PROT_NONE 0
 #define PROT_METHOD 1
 #define PROT_PROTOCOL 2
@@ -497,6 +1226,24 @@ static void output_headers(ProxyServer *p, Request *req) {
 		}
 	}
 
+	req->timings.headerComplete = monotonic_micros();
+	PROBE_REQUEST_HEADER(req->uniqueId->buffer, req->clientFd,
+		stringAsCString(req->method), stringAsCString(req->host),
+		req->timings.headerComplete);
+
+	struct _RuleSet *rules = __atomic_load_n(&p->rules, __ATOMIC_SEQ_CST);
+
+	if (rules != NULL) {
+		apply_rules(p, req, rules);
+	}
+	if (p->shaper != NULL) {
+		shaperBeginRequest(p, req, monotonic_micros());
+	}
+	frame_request(req);
+	if (req->requestState == REQ_CONNECT_TUNNEL_MODE) {
+		req->responseFraming.state = FRAME_UNTIL_CLOSE;
+	}
+
 	//If we have already read a bit of body save it in overflow buffer
 	req->requestBodyOverflowBuffer->length = 0;
 	if (req->requestBuffer->position < req->requestBuffer->length) {
@@ -505,6 +1252,15 @@ static void output_headers(ProxyServer *p, Request *req) {
 			req->requestBuffer->length - req->requestBuffer->position);
 	}
 
+	if (p->responseCache != NULL && p->replay == NULL &&
+		req->blockStatus == 0 &&
+		req->requestState != REQ_CONNECT_TUNNEL_MODE) {
+		//Pipelined requests go to the server so responses stay in order
+		responseCacheLookup(p, req,
+			req->requestBodyOverflowBuffer->length == 0 &&
+			!(req->clientIOFlag & RW_STATE_WRITE));
+	}
+
 	//Save the header and any overflow in the request buffer
 	//and then schedule it for writing
 	req->requestBuffer->length = 0;
@@ -528,20 +1284,59 @@ static void output_headers(ProxyServer *p, Request *req) {
 			value->buffer, value->length);
 		bufferAppendBytes(req->requestBuffer, newLine, 2);
 	}
+	if (req->cacheEntry != NULL) {
+		responseCacheAddValidators(req, req->requestBuffer);
+	}
 
 	bufferAppendBytes(req->requestBuffer, newLine, 2);
 
+	size_t overflowUsed = 0;
+
 	//Any overflow from body?
 	if (req->requestBodyOverflowBuffer->length > 0) {
 		bufferAppendBytes(req->requestBuffer,
 			req->requestBodyOverflowBuffer->buffer,
 			req->requestBodyOverflowBuffer->length);
+		overflowUsed = frame_bytes(&req->requestFraming,
+			req->requestBodyOverflowBuffer->buffer,
+			req->requestBodyOverflowBuffer->length, 0);
 	}
 
 	//Notify listener
 	if (p->onRequestHeaderParsed != NULL) {
 		p->onRequestHeaderParsed(p, req);
 	}
+	if (req->blockStatus != 0) {
+		block_request(p, req);
+
+		return;
+	}
+	if (p->replay != NULL) {
+		size_t surplus = req->requestBodyOverflowBuffer->length - overflowUsed;
+
+		//Later requests wait for this one to be answered
+		hold_pipelined(req,
+			req->requestBodyOverflowBuffer->buffer + overflowUsed, surplus);
+		req->requestBuffer->length -= surplus;
+		//Saved here as it is never written to a server
+		persist_request_buffer(p, req);
+		if (req->replayBody == NULL) {
+			req->replayBody = newBufferWithCapacity(1024);
+		}
+		req->replayBody->length = 0;
+		bufferAppendBytes(req->replayBody,
+			req->requestBodyOverflowBuffer->buffer, overflowUsed);
+		if (req->requestFraming.state == FRAME_DONE) {
+			replay_response(p, req);
+		}
+
+		return;
+	}
+	if (req->cacheStatus == CACHE_HIT) {
+		serve_from_cache(p, req);
+
+		return;
+	}
 
 	//Connect to server if we haven't already
 	if (req->serverFd < 0) {
@@ -555,10 +1350,11 @@ static void output_headers(ProxyServer *p, Request *req) {
 			port = isHTTPS ? 443 : 80;
 		}
 
+		ALLOC_PHASE(ALLOC_PHASE_CONNECT);
 		int status = connect_to_server(p, req, stringAsCString(req->host), port);
+		ALLOC_PHASE(ALLOC_PHASE_REQUEST_HEADER);
 
 		if (status < 0) {
-			_info("Failed to connect to server. Disconnecting.");
 			//Set the response status message
 			req->responseStatusMessage->length = 0;
 			stringAppendCString(req->responseStatusMessage,
@@ -597,10 +1393,10 @@ static void output_headers(ProxyServer *p, Request *req) {
  * parsing client request buffer.
  */
 void read_request_header(ProxyServer *p, Request *req) {
+	ALLOC_PHASE(ALLOC_PHASE_REQUEST_HEADER);
 	if (req->requestState == REQ_STATE_NONE) {
 		req->protocolLine->length = 0;
-		req->headerNames->length = 0;
-		req->headerValues->length = 0;
+		recycle_headers(req);
 		req->headerName = NULL;
 		req->headerValue = NULL;
 		req->requestState = REQ_PARSE_PROTOCOL;
@@ -620,8 +1416,7 @@ void read_request_header(ProxyServer *p, Request *req) {
 				req->requestState = REQ_PARSE_HEADER_NAME;
 				req->headerName = NULL;
 				req->headerValue = NULL;
-				req->headerNames->length = 0;
-				req->headerValues->length = 0;
+				recycle_headers(req);
 
 				continue;
 			}
@@ -641,15 +1436,19 @@ void read_request_header(ProxyServer *p, Request *req) {
 				continue;
 			}
 			if (ch == ':') {
+				unsigned short id = headerNameLookup(req->headerName->buffer,
+					req->headerName->length);
+
 				req->requestState = REQ_PARSE_HEADER_VALUE;
 				arrayAdd(req->headerNames, req->headerName);
+				bufferAppendBytes(req->headerIds, (char*) &id, sizeof(id));
 				req->headerName = NULL;
 
 				continue;
 			}
 
 			if (req->headerName == NULL) {
-				req->headerName = newString();
+				req->headerName = take_string(req);
 			}
 
 			stringAppendChar(req->headerName, ch);
@@ -665,7 +1464,7 @@ void read_request_header(ProxyServer *p, Request *req) {
 				continue;
 			}
 			if (req->headerValue == NULL) {
-				req->headerValue = newString();
+				req->headerValue = take_string(req);
 			}
 			if ((req->headerValue->length == 0) &&
 				ch == ' ') {
@@ -685,7 +1484,7 @@ void read_request_header(ProxyServer *p, Request *req) {
  */
 int transfer_request_to_server(ProxyServer *p, Request *req) {
 	if (req->requestState == REQ_READ_RESPONSE) {
-		_info("A new request using an old connection.");
+		TRACE_INFO(TRACE_CONNECTION_REUSED, req->clientFd, 0, 0);
 		//Mark the old request as has ended.
 		on_end_request(p, req);
 
@@ -703,6 +1502,13 @@ int transfer_request_to_server(ProxyServer *p, Request *req) {
 		 * Transfer request data as is if header is already parsed
 		 * or if we are in tunnel mode.
 		 */
+		ALLOC_PHASE(ALLOC_PHASE_RELAY);
+		if (p->replay != NULL) {
+			return collect_replay_body(p, req);
+		}
+		frame_message(&req->requestFraming, req->requestBuffer->buffer,
+			req->requestBuffer->length, 0);
+
 		return schedule_write_to_server(p, req);
 	}
 
@@ -721,6 +1527,120 @@ int on_server_disconnect(ProxyServer *p, Request *req) {
 	return 0;
 }
 
+/*
+ * Returns how much of a write shaping lets through now. If none the
+ * request has been given a time to try again.
+ */
+static size_t shaped_length(ProxyServer *p, Request *req, int direction,
+	size_t length) {
+	if (p->shaper == NULL) {
+		return length;
+	}
+
+	return shaperAllow(p, req, direction, length, monotonic_micros());
+}
+
+static void end_client_write(ProxyServer *p, Request *req) {
+	//Clear flag
+	req->clientIOFlag = req->clientIOFlag & (~RW_STATE_WRITE);
+	if (req->closeAfterWrite) {
+		//Body ends with the connection or the request was not read in full
+		shutdown_channel(p, req);
+	} else if (req->replayPipelined != NULL &&
+		req->replayPipelined->length > 0) {
+		//Answer the next request that came in while this one was sent
+		req->requestBuffer->length = 0;
+		bufferAppendBytes(req->requestBuffer, req->replayPipelined->buffer,
+			req->replayPipelined->length);
+		req->replayPipelined->length = 0;
+		transfer_request_to_server(p, req);
+	}
+}
+
+/*
+ * Reads the next piece of a replayed body into the response buffer so it
+ * is captured on its way to the client like a server's response.
+ */
+static int read_replay_body(ProxyServer *p, Request *req) {
+	size_t length = req->responseBuffer->capacity;
+
+	if (length > req->replayRemaining) {
+		length = req->replayRemaining;
+	}
+
+	ssize_t bytesRead = pread(req->replayFd, req->responseBuffer->buffer,
+		length, req->replayOffset);
+
+	if (bytesRead < 0) {
+		return -1;
+	}
+	req->replayOffset += bytesRead;
+	req->replayRemaining -= bytesRead;
+	if (bytesRead == 0 || req->replayRemaining == 0) {
+		if (req->replayRemaining > 0) {
+			//File got shorter. Only closing can end the body now.
+			req->closeAfterWrite = 1;
+		}
+		close(req->replayFd);
+		req->replayFd = -1;
+	}
+	req->clientIOFlag &= ~RW_STATE_WRITE;
+	if (bytesRead == 0) {
+		end_client_write(p, req);
+
+		return 0;
+	}
+	req->responseBuffer->length = bytesRead;
+	schedule_write_to_client(p, req);
+
+	return 0;
+}
+
+/*
+ * Sends the body of a replayed response straight from its capture file.
+ */
+static int send_replay_body(ProxyServer *p, Request *req) {
+	if (req->responseFile != NULL || req->ringRecord != 0) {
+		return read_replay_body(p, req);
+	}
+
+	size_t length = shaped_length(p, req, SHAPE_DOWN, req->replayRemaining);
+
+	if (length == 0 && req->replayRemaining > 0) {
+		return 0;
+	}
+
+	ssize_t sent = sendfile(req->clientFd, req->replayFd, &req->replayOffset,
+		length);
+
+	TRACE_DEBUG(TRACE_CLIENT_WRITE, req->clientFd, sent, req->replayRemaining);
+
+	if (sent < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+		TRACE_DEBUG(TRACE_WOULD_BLOCK, req->clientFd, 0, 0);
+
+		return 0;
+	}
+
+	req->replayRemaining -= sent;
+	if (p->shaper != NULL) {
+		shaperConsume(p, req, SHAPE_DOWN, sent);
+	}
+	if (sent == 0 || req->replayRemaining == 0) {
+		if (req->replayRemaining > 0) {
+			//File got shorter. Only closing can end the body now.
+			req->closeAfterWrite = 1;
+		}
+		close(req->replayFd);
+		req->replayFd = -1;
+		end_client_write(p, req);
+	}
+
+	return 0;
+}
+
 /*
  * Client has finished reading data. Let's write more if needed.
  */
@@ -728,51 +1648,64 @@ int handle_client_read(ProxyServer *p, int position) {
 	Request *req = p->requests + position;
 
 	if (!(req->clientIOFlag & RW_STATE_WRITE)) {
-		_info("We are not trying to write to client socket.");
+		TRACE_DEBUG(TRACE_NOTHING_TO_WRITE, req->clientFd, 0, 0);
 
 		return -1;
 	}
+	if (req->replayFd >= 0 &&
+		req->clientWriteCompleted == req->responseBuffer->length) {
+		return send_replay_body(p, req);
+	}
 	if (req->responseBuffer->length == 0) {
-		_info("Request buffer empty.");
+		TRACE_DEBUG(TRACE_NOTHING_TO_WRITE, req->clientFd, 0, 0);
 
 		return -1;
 	}
 	if (req->responseBuffer->length == req->clientWriteCompleted) {
-		_info("Write to client was already completed.");
+		TRACE_DEBUG(TRACE_NOTHING_TO_WRITE, req->clientFd, 0, 0);
 
 		return -1;
 	}
 
+	size_t length = shaped_length(p, req, SHAPE_DOWN,
+		req->responseBuffer->length - req->clientWriteCompleted);
+
+	if (length == 0) {
+		return 0;
+	}
+
 	char *buffer_start =
 		req->responseBuffer->buffer + req->clientWriteCompleted;
-	int bytesWritten = write(req->clientFd,
-		buffer_start,
-		req->responseBuffer->length - req->clientWriteCompleted);
+	int bytesWritten = write(req->clientFd, buffer_start, length);
 
-	_info("Written to client (%d) %d of %d bytes", req->clientFd,
-		bytesWritten, req->responseBuffer->length);
+	TRACE_DEBUG(TRACE_CLIENT_WRITE, req->clientFd, bytesWritten,
+		req->responseBuffer->length);
 
 	if (bytesWritten < 0) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			return -1;
 		}
 		//Read will block. Not an error.
-		_info("Write block detected.");
+		TRACE_DEBUG(TRACE_WOULD_BLOCK, req->clientFd, 0, 0);
 
 		return 0;
 	}
 	if (bytesWritten == 0) {
 		//Client has disconnected. We convert that to an error.
-		_info("Client seems to have disconnected: %d", req->clientFd);
+		TRACE_DEBUG(TRACE_PEER_CLOSED, req->clientFd, 0, 0);
 
 		return -1;
 	}
 
 	req->clientWriteCompleted += bytesWritten;
+	if (p->shaper != NULL) {
+		shaperConsume(p, req, SHAPE_DOWN, bytesWritten);
+	}
 
-	if (req->clientWriteCompleted == req->responseBuffer->length) {
-		//Clear flag
-		req->clientIOFlag = req->clientIOFlag & (~RW_STATE_WRITE);
+	//A replayed body follows the header
+	if (req->clientWriteCompleted == req->responseBuffer->length &&
+		req->replayFd < 0) {
+		end_client_write(p, req);
 	}
 
 	return 0;
@@ -784,9 +1717,9 @@ int handle_client_read(ProxyServer *p, int position) {
 int handle_server_read(ProxyServer *p, int position) {
 	Request *req = p->requests + position;
 
+	ALLOC_PHASE(ALLOC_PHASE_RELAY);
+
 	if (req->connectionEstablished == 0) {
-		_info("Asynch connection has completed. Client %d server %d.",
-			req->clientFd, req->serverFd);
 		//Non-blocking connection is now done. See if it worked.
 		int valopt;
 		socklen_t lon = sizeof(int);
@@ -797,8 +1730,12 @@ int handle_server_read(ProxyServer *p, int position) {
 			DIE(p, status, "Error in getsockopt()");
 		}
 		//Check the value of valopt
-		_info("SOL_SOCKET: %d", valopt);
 		if (valopt) {
+			TRACE_ERROR(TRACE_CONNECT_FAILED, req->serverFd, valopt,
+				req->clientFd);
+			PROBE_CONNECT_DONE(req->uniqueId->buffer, req->serverFd, -1,
+				req->timings.dnsDone, 0LL);
+			metricsAdd(p, METRIC_CONNECT_FAILURES, 1);
 			//Connection failed
 			//Set the response status message
 			req->responseStatusMessage->length = 0;
@@ -808,30 +1745,37 @@ int handle_server_read(ProxyServer *p, int position) {
 			DIE(p, -1, "Failed to connect to server.");
 		}
 		//Connection was successful
-		_info("Connection was successful.");
+		TRACE_INFO(TRACE_CONNECTED, req->serverFd, req->clientFd, 0);
 		req->connectionEstablished = 1;
+		req->timings.connectDone = monotonic_micros();
+		PROBE_CONNECT_DONE(req->uniqueId->buffer, req->serverFd, 0,
+			req->timings.dnsDone, req->timings.connectDone);
 
 		return 0;
 	}
 
 	if (!(req->serverIOFlag & RW_STATE_WRITE)) {
-		_info("We are not trying to write to the server socket.");
+		TRACE_DEBUG(TRACE_NOTHING_TO_WRITE, req->serverFd, 0, 0);
 
 		return -1;
 	}
 	if (req->requestBuffer->length == 0) {
-		_info("Request buffer is empty.");
+		TRACE_DEBUG(TRACE_NOTHING_TO_WRITE, req->serverFd, 0, 0);
 
 		return -1;
 	}
 
-	char *buffer_start = req->requestBuffer->buffer + req->serverWriteCompleted;
-	int bytesWritten = write(req->serverFd,
-		buffer_start,
+	size_t length = shaped_length(p, req, SHAPE_UP,
 		req->requestBuffer->length - req->serverWriteCompleted);
 
-	_info("Written to server (%d) %d of %d bytes",
-		req->serverFd, bytesWritten,
+	if (length == 0) {
+		return 0;
+	}
+
+	char *buffer_start = req->requestBuffer->buffer + req->serverWriteCompleted;
+	int bytesWritten = write(req->serverFd, buffer_start, length);
+
+	TRACE_DEBUG(TRACE_SERVER_WRITE, req->serverFd, bytesWritten,
 		req->requestBuffer->length);
 
 	if (bytesWritten < 0) {
@@ -839,7 +1783,7 @@ int handle_server_read(ProxyServer *p, int position) {
 			return -1;
 		}
 		//Read will block. Not an error.
-		_info("Write block detected.");
+		TRACE_DEBUG(TRACE_WOULD_BLOCK, req->serverFd, 0, 0);
 
 		return 0;
 	}
@@ -850,15 +1794,32 @@ int handle_server_read(ProxyServer *p, int position) {
 
 
 	req->serverWriteCompleted += bytesWritten;
+	if (p->shaper != NULL) {
+		shaperConsume(p, req, SHAPE_UP, bytesWritten);
+	}
 
 	if (req->serverWriteCompleted == req->requestBuffer->length) {
 		//Clear flag
 		req->serverIOFlag = req->serverIOFlag & (~RW_STATE_WRITE);
+		if (req->requestFraming.state == FRAME_DONE &&
+			req->timings.requestSent == 0 &&
+			req->requestState != REQ_CONNECT_TUNNEL_MODE) {
+			req->timings.requestSent = monotonic_micros();
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * In replay mode there is no server write to wait for. A request is not
+ * read until the response to the one before it has been sent.
+ */
+static int replay_pending(ProxyServer *p, Request *req) {
+	return p->replay != NULL && ((req->clientIOFlag & RW_STATE_WRITE) ||
+		req->replayDue != 0 || req->replayFd >= 0);
+}
+
 /*
  * Client has written data. Let's read it.
  */
@@ -867,8 +1828,8 @@ int handle_client_write(ProxyServer *p, int position) {
 
 	//Check to see if there is any pending write to the server
 	//If so, do not read the data from the client now.
-	if (req->serverIOFlag & RW_STATE_WRITE) {
-		_info("Write to server is pending. Will not read from client.");
+	if ((req->serverIOFlag & RW_STATE_WRITE) || replay_pending(p, req)) {
+		TRACE_DEBUG(TRACE_READ_DEFERRED, req->clientFd, 0, 0);
 
 		return -1;
 	}
@@ -879,15 +1840,14 @@ int handle_client_write(ProxyServer *p, int position) {
 		req->requestBuffer->buffer,
 		req->requestBuffer->capacity);
 
-	_info("Read request from client (%d) %d bytes",
-		req->clientFd, bytesRead);
+	TRACE_DEBUG(TRACE_CLIENT_READ, req->clientFd, bytesRead, 0);
 
 	if (bytesRead < 0) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			return -1;
 		}
 		//Read will block. Not an error.
-		_info("Read block detected.");
+		TRACE_DEBUG(TRACE_WOULD_BLOCK, req->clientFd, 0, 0);
 		return 0;
 	}
 	if (bytesRead == 0) {
@@ -898,6 +1858,7 @@ int handle_client_write(ProxyServer *p, int position) {
 	}
 
 	//fwrite(req->requestBuffer->buffer, 1, bytesRead, stdout);
+	metricsAdd(p, METRIC_REQUEST_BYTES, bytesRead);
 	req->requestBuffer->length = bytesRead;
 	transfer_request_to_server(p, req);
 
@@ -913,7 +1874,7 @@ int handle_server_write(ProxyServer *p, int position) {
 	//Check to see if there is any pending write to the client
 	//If so, do not read the data from the server now.
 	if (req->clientIOFlag & RW_STATE_WRITE) {
-		_info("Write to client is pending. Will not read from server.");
+		TRACE_DEBUG(TRACE_READ_DEFERRED, req->serverFd, 0, 0);
 
 		return -1;
 	}
@@ -924,29 +1885,35 @@ int handle_server_write(ProxyServer *p, int position) {
 		req->responseBuffer->buffer,
 		req->responseBuffer->capacity);
 
-	_info("Read response from server (%d) %d bytes",
-		req->serverFd, bytesRead);
-
-	/*
-	 * We update the response end time here even though we are most likely
-	 * in the middle of a response. This is needed because there is currently
-	 * no reliable way to accurately determine when the response ended.
-	 * The on_end_request may not get called for a long time for the last request
-	 * in a keep alive situation.
-	 *
-	 * The current approach gives us the accuracy at the expense of calling
-	 * gettimeofday() unnecessarily too many times.
-	 */
-	assert(gettimeofday(&req->responseEndTime, NULL) == 0);
+	TRACE_DEBUG(TRACE_SERVER_READ, req->serverFd, bytesRead, 0);
 
 	if (bytesRead < 0) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			return -1;
 		}
 		//Read will block. Not an error.
-		_info("Read block detected.");
+		TRACE_DEBUG(TRACE_WOULD_BLOCK, req->serverFd, 0, 0);
 		return 0;
 	}
+
+	/*
+	 * The response ends at the read that completes its framing. Responses
+	 * without a length or cut short end when the server closes. The
+	 * on_end_request may not get called for a long time for the last
+	 * request in a keep alive situation so we can't wait for that.
+	 */
+	if (req->responseFraming.state != FRAME_DONE) {
+		long long now = monotonic_micros();
+
+		if (bytesRead > 0 && req->timings.firstByte == 0) {
+			req->timings.firstByte = now;
+		}
+		frame_message(&req->responseFraming, req->responseBuffer->buffer,
+			bytesRead, strcmp(stringAsCString(req->method), "HEAD") == 0);
+		req->timings.responseComplete = now;
+		assert(gettimeofday(&req->responseEndTime, NULL) == 0);
+	}
+
 	if (bytesRead == 0) {
 		//Server has disconnected. 
 		on_server_disconnect(p, req);
@@ -955,6 +1922,7 @@ int handle_server_write(ProxyServer *p, int position) {
 	}
 
 	//fwrite(req->responseBuffer->buffer, 1, bytesRead, stdout);
+	metricsAdd(p, METRIC_RESPONSE_BYTES, bytesRead);
 	/*
 	 * In tunnel mode we stay in that model until connection is severed. Else,
 	 * we move forward to REQ_READ_RESPONSE mode.
@@ -963,13 +1931,28 @@ int handle_server_write(ProxyServer *p, int position) {
 		req->requestState = REQ_READ_RESPONSE;
 	}
 	req->responseBuffer->length = bytesRead;
+	if (req->cacheStatus == CACHE_MISS &&
+		responseCacheOnResponse(p, req,
+			req->responseFraming.state != FRAME_HEADER,
+			req->responseFraming.state == FRAME_DONE) == 1) {
+		//Revalidation response header is not complete yet
+		return 0;
+	}
 	schedule_write_to_client(p, req);
 
 	return 0;
 }
 
-void
+/*
+ * Writes held back by shaping are left out of the write set. Returns the
+ * earliest time one of them is due or 0 if none are.
+ */
+long long
 populate_fd_set(ProxyServer *p, fd_set *pReadFdSet, fd_set *pWriteFdSet) {
+	long long now = p->shaper != NULL ?
+		monotonic_micros() + SHAPE_SLACK_MICROS : 0;
+	long long next = 0;
+
 	FD_ZERO(pReadFdSet);
 	FD_ZERO(pWriteFdSet);
 
@@ -985,10 +1968,19 @@ populate_fd_set(ProxyServer *p, fd_set *pReadFdSet, fd_set *pWriteFdSet) {
 			continue;
 		}
 
-		if (req->clientIOFlag & RW_STATE_READ) {
+		//A write held back by shaping also holds back reading more
+		int downHeld = (req->clientIOFlag & RW_STATE_WRITE) &&
+			req->shapeDue[SHAPE_DOWN] > now;
+		int upHeld = (req->serverIOFlag & RW_STATE_WRITE) &&
+			req->shapeDue[SHAPE_UP] > now;
+
+		if ((req->clientIOFlag & RW_STATE_READ) && !upHeld &&
+			!replay_pending(p, req)) {
 			FD_SET(req->clientFd, pReadFdSet);
 		}
-		if (req->clientIOFlag & RW_STATE_WRITE) {
+		if (downHeld) {
+			next = earliest(next, req->shapeDue[SHAPE_DOWN]);
+		} else if (req->clientIOFlag & RW_STATE_WRITE) {
 			FD_SET(req->clientFd, pWriteFdSet);
 		}
 
@@ -997,14 +1989,19 @@ populate_fd_set(ProxyServer *p, fd_set *pReadFdSet, fd_set *pWriteFdSet) {
 			continue;
 		}
 
-		if (req->serverIOFlag & RW_STATE_READ) {
+		if ((req->serverIOFlag & RW_STATE_READ) && !downHeld) {
 			FD_SET(req->serverFd, pReadFdSet);
 		}
-		if ((req->serverIOFlag & RW_STATE_WRITE) ||
-			(req->connectionEstablished == 0)) {
+		if (req->connectionEstablished == 0) {
+			FD_SET(req->serverFd, pWriteFdSet);
+		} else if (upHeld) {
+			next = earliest(next, req->shapeDue[SHAPE_UP]);
+		} else if (req->serverIOFlag & RW_STATE_WRITE) {
 			FD_SET(req->serverFd, pWriteFdSet);
 		}
 	}
+
+	return next;
 }
 
 int add_client_fd(ProxyServer *p, int clientFd) {
@@ -1021,14 +2018,14 @@ int add_client_fd(ProxyServer *p, int clientFd) {
 		}
 	}
 
-	return 0;
+	return -1;
 }
 
 int handle_client_connect(ProxyServer *p, Request *req) {
 	//Start reading from client
 	req->clientIOFlag = RW_STATE_READ;
 
-	_info("Client connected: %d\n", req->clientFd);
+	TRACE_INFO(TRACE_CLIENT_ACCEPTED, req->clientFd, req - p->requests, 0);
 
 	return 0;
 }
@@ -1039,15 +2036,61 @@ int handle_control_command(ProxyServer *p) {
 	int sz = read(p->controlPipe[0], buff, sizeof(buff));
 	DIE(p, sz, "Failed to read control command.");
 
-	_info("Received control command: %.*s", sz, buff);
+	TRACE_INFO(TRACE_CONTROL_COMMAND, -1, buff[0], 0);
 	if (strncmp(buff, "Q", 1) == 0) {
-		_info("Received stop control command.");
 		p->runStatus = STOPPED;
 	}
 
 	return 0;
 }
 
+//Shortens the select() timeout to a due time. 0 leaves it.
+static void shorten_timeout(struct timeval *timeout, long long due) {
+	if (due == 0) {
+		return;
+	}
+
+	long long wait = due - monotonic_micros();
+
+	if (wait < 0) {
+		wait = 0;
+	}
+	if (wait < timeout->tv_sec * 1000000LL + timeout->tv_usec) {
+		timeout->tv_sec = wait / 1000000;
+		timeout->tv_usec = wait % 1000000;
+	}
+}
+
+//When the next replayed response is due. 0 if none.
+static long long next_replay_due(ProxyServer *p) {
+	long long next = 0;
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		next = earliest(next, p->requests[i].replayDue);
+	}
+
+	return next;
+}
+
+static void send_due_replays(ProxyServer *p) {
+	long long now = monotonic_micros();
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		Request *req = p->requests + i;
+
+		if (req->clientFd >= 0 && req->replayDue != 0 && req->replayDue <= now) {
+			send_replay(p, req);
+		}
+	}
+}
+
+//Makes the loop epoch even. See proxyServerLoadRules().
+static void rules_quiescent(ProxyServer *p) {
+	if (__atomic_load_n(&p->loopEpoch, __ATOMIC_SEQ_CST) & 1) {
+		__atomic_add_fetch(&p->loopEpoch, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
 int server_loop(ProxyServer *p) {
 	fd_set readFdSet, writeFdSet;
 	struct timeval timeout;
@@ -1055,28 +2098,53 @@ int server_loop(ProxyServer *p) {
 	p->runStatus = RUNNING;
 
 	while (p->runStatus == RUNNING) {
-		populate_fd_set(p, &readFdSet, &writeFdSet);
+		//Rules swapped out before here are no longer in use
+		rules_quiescent(p);
+		long long shapeDue = populate_fd_set(p, &readFdSet, &writeFdSet);
 
 		timeout.tv_sec = 60 * 1;
 		timeout.tv_usec = 0;
+		if (p->replay != NULL) {
+			shorten_timeout(&timeout, next_replay_due(p));
+		}
+		shorten_timeout(&timeout, shapeDue);
 
 		int numEvents = select(FD_SETSIZE, &readFdSet, &writeFdSet, NULL, &timeout);
 		DIE(p, numEvents, "select() failed.");
+		TRACE_DEBUG(TRACE_SELECT, -1, numEvents, 0);
+		ALLOC_PHASE(ALLOC_PHASE_OTHER);
+		__atomic_add_fetch(&p->loopEpoch, 1, __ATOMIC_SEQ_CST);
 
-		if (numEvents == 0) {
-			_info("select() timed out. Looping back.");
+		if (p->replay != NULL) {
+			send_due_replays(p);
+		}
 
+		if (numEvents == 0) {
 			continue;
 		}
 		//Make sense out of the event
 		if (FD_ISSET(p->serverSocket, &readFdSet)) {
-			_info("Client connected.");
+			ALLOC_PHASE(ALLOC_PHASE_BEGIN);
 			int clientFd = accept(p->serverSocket, NULL, NULL);
 
 			DIE(p, clientFd, "accept() failed.");
 
 			int position = add_client_fd(p, clientFd);
 
+			if (position < 0) {
+				TRACE_ERROR(TRACE_CLIENT_REJECTED, clientFd, 0, 0);
+				close(clientFd);
+				metricsAdd(p, METRIC_CONNECTIONS_REJECTED, 1);
+
+				continue;
+			}
+			metricsAdd(p, METRIC_CONNECTIONS_ACCEPTED, 1);
+			metricsAdd(p, METRIC_ACTIVE_SLOTS, 1);
+
+			int noDelay = 1;
+			setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+				sizeof noDelay);
+
 			int status = fcntl(clientFd, F_SETFL, O_NONBLOCK);
 			DIE(p, status,
 				"Failed to set non blocking mode for client socket.");
@@ -1113,7 +2181,8 @@ int server_loop(ProxyServer *p) {
 			}
 		}
 	}
-	_info("Server shutting down.");
+	rules_quiescent(p);
+	TRACE_INFO(TRACE_SERVER_STOP, -1, 0, 0);
 	disconnect_clients(p);
 
 	return 0;
@@ -1128,6 +2197,7 @@ ProxyServer* newProxyServer(int port) {
 	p->runStatus = STOPPED;
 	p->serverSocket = -1;
 	p->controlPipe[0] = p->controlPipe[1] = -1; //Reset
+	p->metrics = newMetrics();
 
 	for (int i = 0; i < MAX_CLIENTS; ++i) {
 		Request *req = p->requests + i;
@@ -1143,9 +2213,15 @@ ProxyServer* newProxyServer(int port) {
 		req->responseStatusCode = newStringWithCapacity(4);
 		req->headerNames = newArray(10);
 		req->headerValues = newArray(10);
+		req->headerIds = newBufferWithCapacity(20);
+		req->spareStrings = newArray(20);
 		req->requestBuffer = newBufferWithCapacity(512);
 		req->responseBuffer = newBufferWithCapacity(1024);
 		req->requestBodyOverflowBuffer = newBufferWithCapacity(256);
+		req->requestHeaderCapture = newBufferWithCapacity(512);
+		req->responseHeaderCapture = newBufferWithCapacity(512);
+		req->metaBuffer = newBufferWithCapacity(512);
+		req->replayFd = -1;
 
 		reset_request_state(req);
 	}
@@ -1170,14 +2246,61 @@ void deleteProxyServer(ProxyServer *p) {
 		deleteBuffer(req->requestBuffer);
 		deleteBuffer(req->responseBuffer);
 		deleteBuffer(req->requestBodyOverflowBuffer);
+		deleteBuffer(req->requestHeaderCapture);
+		deleteBuffer(req->responseHeaderCapture);
+		deleteBuffer(req->metaBuffer);
+		if (req->cacheBuffer != NULL) {
+			deleteBuffer(req->cacheBuffer);
+		}
+		if (req->replayPipelined != NULL) {
+			deleteBuffer(req->replayPipelined);
+		}
+		if (req->replayBody != NULL) {
+			deleteBuffer(req->replayBody);
+		}
+
+		recycle_headers(req);
+		for (size_t j = 0; j < req->spareStrings->length; ++j) {
+			deleteString(arrayGet(req->spareStrings, j));
+		}
+		deleteArray(req->spareStrings);
+		deleteBuffer(req->headerIds);
 
 		deleteArray(req->headerNames);
 
 		deleteArray(req->headerValues);
 	}
 
+	//May have been started without the proxy
+	proxyServerStopIndex(p);
+	proxyServerStopMetaStore(p);
 	deleteString(p->persistenceFolder);
 
+	if (p->headerDictionary != NULL) {
+		deleteHeaderDictionary(p->headerDictionary);
+	}
+	if (p->ring != NULL) {
+		deleteRing(p->ring);
+	}
+	if (p->ringReader != NULL) {
+		deleteRing(p->ringReader);
+	}
+	if (p->bodyCache != NULL) {
+		deleteBodyCache(p->bodyCache);
+	}
+	if (p->responseCache != NULL) {
+		deleteResponseCache(p->responseCache);
+	}
+	if (p->shaper != NULL) {
+		deleteShaper(p->shaper);
+	}
+	if (p->replay != NULL) {
+		deleteReplay(p->replay);
+	}
+	deleteRuleSet(p->rules);
+	proxyServerStopMetrics(p);
+	deleteMetrics(p->metrics);
+
 	free(p);
 }
 
@@ -1192,13 +2315,10 @@ static int configure_persistence_folder(ProxyServer *p) {
 
 	const char *dir = stringAsCString(p->persistenceFolder);
 
-	_info("Creating persistence folder: %s", dir);
-
 	int status = mkdir(dir, 0700);
 	if (status < 0) {
 		if (errno == EEXIST) {
 			//Path already exists. It may not be a folder. For now do nothing.
-			_info("Persistence folder already exists.");
 		} else {
 			DIE(p, status, "Failed to create persistence folder.");
 		}
@@ -1216,6 +2336,34 @@ int proxyServerStart(ProxyServer* p) {
 
 	//Get the folder to persist data
 	configure_persistence_folder(p);
+	headerDictionaryOpenOnce(&p->headerDictionary,
+		stringAsCString(p->persistenceFolder));
+
+	if (p->persistenceEnabled == 1 && p->captureMode == CAPTURE_RING &&
+		p->ring == NULL) {
+		char file_name[512];
+
+		snprintf(file_name, sizeof(file_name), "%s/%s",
+			stringAsCString(p->persistenceFolder), RING_FILE);
+		p->ring = newRing(file_name,
+			p->ringSize > 0 ? p->ringSize : DEFAULT_RING_SIZE);
+		if (p->ring == NULL) {
+			DIE(p, -1, "Failed to open capture ring.");
+		}
+	}
+
+	if (p->responseCacheEnabled && p->responseCache == NULL) {
+		p->responseCache = newResponseCache(p);
+	}
+	if (p->replayEnabled && p->replay == NULL) {
+		p->replay = newReplay(p);
+		if (p->replay == NULL) {
+			DIE(p, -1, "Failed to load captured records for replay.");
+		}
+	}
+	if (p->shapingEnabled && p->shaper == NULL) {
+		p->shaper = newShaper(p);
+	}
 
 	//Create the server control pipes
 	status = pipe(p->controlPipe);
@@ -1238,21 +2386,34 @@ int proxyServerStart(ProxyServer* p) {
 	addr.sin_addr.s_addr = INADDR_ANY;
 	addr.sin_port = htons(p->port);
 
-	_info("Proxy server binding to port: %d", p->port);
 	status = bind(sock, (struct sockaddr*) &addr, sizeof(addr));
 
 	DIE(p, status, "Failed to bind to port.");
 
-	_info("Calling listen.");
 	status = listen(sock, 10);
-	_info("listen returned.");
 
 	DIE(p, status, "Failed to listen.");
 
 	p->serverSocket = sock;
+	TRACE_INFO(TRACE_SERVER_START, sock, p->port, 0);
+
+	proxyServerStartMetrics(p);
+
+	if (p->persistenceEnabled == 1) {
+		compactorStart(p);
+		committerStart(p);
+		if (p->indexEnabled) {
+			proxyServerStartIndex(p);
+		}
+		if (p->metaStoreEnabled) {
+			proxyServerStartMetaStore(p);
+		}
+	}
 
 	server_loop(p);
 
+	compactorStop(p);
+
 	close(sock);
 	p->serverSocket = -1;
 
@@ -1269,6 +2430,12 @@ int proxyServerStart(ProxyServer* p) {
 		}
 	}
 
+	//Wait for everything captured so far to be committed
+	committerStop(p);
+	proxyServerStopIndex(p);
+	proxyServerStopMetaStore(p);
+	proxyServerStopMetrics(p);
+
 	//Reset all server state
 	p->isInBackgroundMode = 0;
 	p->runStatus = STOPPED;
@@ -1298,10 +2465,8 @@ int proxyServerStop(ProxyServer *p) {
 
 	if (status >= 0) {
 		//Wait for the thread to end.
-		_info("Waiting for background thread to end.");
 		status = pthread_join(p->backgroundThreadId, NULL);
 		DIE(p, status, "Failed to wait for background thread to end.");
-		_info("Done waiting for background thread to end.");
 	} else {
 		//May be try to kill the thread
 	}
@@ -1312,13 +2477,10 @@ int proxyServerStop(ProxyServer *p) {
 static void * _bgStartHelper(void *p) {
 	proxyServerStart((ProxyServer*)p);
 
-	_info("Background thread exiting.");
 	return NULL;
 }
 
 int proxyServerStartInBackground(ProxyServer* server) {
-	_info("Creating background thread to run the server.");
-
 	int status = pthread_create(&(server->backgroundThreadId),
 		NULL, _bgStartHelper, server);
 
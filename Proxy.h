@@ -4,6 +4,54 @@
 #include "../Cute/String.h"
 #include "../Cute/Array.h"
 #include "../Cute/Buffer.h"
+#include "HeaderNames.h"
+
+/*
+ * Follows the framing of a message as it streams through so that the end
+ * of its body is known.
+ */
+typedef struct _MessageFraming {
+	int state;
+	int status; //Response status code. -1 if it could not be parsed.
+	int chunked;
+	int hasLength;
+	unsigned long long remaining; //Bytes left in the body or current chunk
+	size_t lineLength;
+	char line[128]; //Current header or chunk size line. May be truncated.
+} MessageFraming;
+
+/*
+ * CLOCK_MONOTONIC times in microseconds of the phases of a request. A
+ * phase that has not happened is 0. Requests that reuse a server
+ * connection have no DNS or connect phase.
+ */
+typedef struct _RequestTimings {
+	long long start; //First byte from the client
+	long long headerComplete; //Request header parsed
+	long long dnsDone;
+	long long connectDone;
+	long long requestSent; //Last byte of the request written to the server
+	long long firstByte; //First byte of the response
+	long long responseComplete;
+} RequestTimings;
+
+typedef enum _ShapeDirection {
+	SHAPE_DOWN, //Towards the client
+	SHAPE_UP //Towards the server
+} ShapeDirection;
+
+//Bytes that may be written now. Refilled at the bucket's rate.
+typedef struct _TokenBucket {
+	double tokens;
+	long long updated; //CLOCK_MONOTONIC microseconds. 0 when full and unused.
+} TokenBucket;
+
+typedef enum _CacheStatus {
+	CACHE_NONE, //Not looked up in the response cache
+	CACHE_MISS,
+	CACHE_HIT,
+	CACHE_REVALIDATED //Stale entry confirmed by the server with a 304
+} CacheStatus;
 
 typedef struct _Request {
 	String *uniqueId; //Every HTTP request gets a unique ID
@@ -24,6 +72,8 @@ typedef struct _Request {
 	Buffer *requestBodyOverflowBuffer;
 	Array *headerNames;
 	Array *headerValues;
+	Buffer *headerIds; //HeaderNameId of each header as unsigned short
+	Array *spareStrings; //Header strings kept for the next request
 	int requestState;
 	int responseHeaderParseState;
 	int clientIOFlag;
@@ -38,25 +88,147 @@ typedef struct _Request {
 	FILE *metaFile;
 	FILE *requestFile;
 	FILE *responseFile;
+	struct _OpenRecord *openRecord; //Synced by group commits until it ends
+	Buffer *metaBuffer;
+	unsigned long long requestBytes; //Captured so far
+	unsigned long long responseBytes;
+	unsigned long long ringRecord; //Record number in flight recorder mode
+	//Header blocks are held back until complete so they can be encoded
+	Buffer *requestHeaderCapture;
+	Buffer *responseHeaderCapture;
+	int requestCaptureState;
+	int responseCaptureState;
+
+	MessageFraming requestFraming;
+	MessageFraming responseFraming;
+
+	//Response cache. See ResponseCache.h.
+	int cacheStatus; //CacheStatus of the current request
+	int cacheStore; //Response is being collected to be stored
+	struct _CachedResponse *cacheEntry; //Stale entry being revalidated
+	Buffer *cacheBuffer; //Response collected so far
+
+	//Replay mode. See Replay.h.
+	Buffer *replayBody; //Request body collected for matching
+	Buffer *replayPipelined; //Requests read while a response is pending
+	int replayFd; //Response body still to be sent. -1 if none.
+	off_t replayOffset;
+	size_t replayRemaining;
+	long long replayDue; //CLOCK_MONOTONIC microseconds. 0 if not waiting.
+	int closeAfterWrite; //Close the connection once the response is sent
+	int blockStatus; //Set by a rule. 0 if not blocked.
+
+	//Traffic shaping. See Shaper.h.
+	TokenBucket shapeBuckets[2]; //This connection. Indexed by ShapeDirection.
+	struct _HostShape *shapeHost; //Shared by connections to the host
+	long long shapeDue[2]; //No writes until then. 0 if not held back.
+	size_t shapeReserved[2]; //Bytes paid for while waiting for a turn
+	int shapeResponseStarted; //Response latency has been added
 
 	//Timing
 	struct timeval requestStartTime;
 	struct timeval responseEndTime;
+	RequestTimings timings;
 } Request;
 
 #define MAX_CLIENTS 256
 
+/*
+ * Limits on how much captured data is kept in the persistence folder.
+ * Oldest records are removed first. A limit of 0 means no limit.
+ *
+ * maxBytes counts every file in the folder, including the ring, the
+ * index, the meta data columns and the header dictionary. Only records
+ * are removed to get under it. The response cache spill folder has its
+ * own limit and is not counted.
+ */
+typedef struct _RetentionPolicy {
+	long maxAgeSeconds;
+	long long maxBytes;
+	long maxRecords;
+	int intervalSeconds; //How often the compactor runs. Defaults to 60.
+} RetentionPolicy;
+
+/*
+ * Network conditions to emulate. See Shaper.h. Rates are bytes per second
+ * indexed by ShapeDirection. A rate of 0 means no limit.
+ */
+typedef struct _ShapingPolicy {
+	long long connectionRate[2];
+	long long hostRate[2];
+	long long globalRate[2];
+	int latencyMs; //Before each response
+	int chunkLatencyMs; //Before each write
+	double stallPercent; //Chance of a stall before each write
+	int stallMs;
+} ShapingPolicy;
+
 typedef enum _RunStatus {
 	STOPPED,
 	RUNNING
 } RunStatus;
 
+typedef enum _CaptureMode {
+	CAPTURE_FILES, //A set of files per request
+	CAPTURE_RING //Flight recorder. Fixed size ring file.
+} CaptureMode;
+
+typedef enum _DurabilityMode {
+	DURABILITY_NONE, //Leave it to the OS
+	DURABILITY_GROUP, //Commit all open and finished records every commitIntervalMs
+	DURABILITY_RECORD //Commit every record as soon as it ends
+} DurabilityMode;
+
+typedef struct _CommitStats {
+	unsigned long batches;
+	unsigned long records;
+	unsigned long lastBatchSize;
+	unsigned long maxBatchSize;
+	//Time from the end of a request to its data being on disk
+	double lastLatencyMs;
+	double maxLatencyMs;
+	double totalLatencyMs;
+} CommitStats;
+
 typedef struct _ProxyServer {
 	Request requests[MAX_CLIENTS];
 	int persistenceEnabled;
 	int port;
 	int serverSocket;
 	String *persistenceFolder;
+	struct _HeaderDictionary *headerDictionary;
+	RetentionPolicy retention;
+	struct _Compactor *compactor;
+	CaptureMode captureMode;
+	unsigned long long ringSize; //Bytes. Used in CAPTURE_RING mode.
+	struct _Ring *ring;
+	struct _Ring *ringReader; //Ring file opened by readers when not capturing
+	DurabilityMode durability;
+	int commitIntervalMs; //Used in DURABILITY_GROUP mode. Defaults to 100.
+	int commitFullSync; //Use fsync() instead of fdatasync()
+	struct _Committer *committer;
+	int indexEnabled; //Build the search index while capturing
+	struct _Index *index;
+	int metaStoreEnabled; //Maintain the meta data column store while capturing
+	struct _MetaStore *metaStore;
+	unsigned long long bodyCacheSize; //Bytes of decoded bodies. Defaults to 32MB.
+	struct _BodyCache *bodyCache;
+	int responseCacheEnabled; //Serve cacheable GET responses from memory
+	unsigned long long responseCacheSize; //Bytes in memory. Defaults to 64MB.
+	unsigned long long responseCacheSpillSize; //Bytes on disk. 0 for none.
+	struct _ResponseCache *responseCache;
+	int replayEnabled; //Answer requests from the persistence folder
+	int replayMatch; //ReplayMatch flags
+	double replayTimeScale; //0 sends at once. 1 keeps the captured timing.
+	struct _Replay *replay;
+	struct _RuleSet *rules; //Swapped whole by proxyServerLoadRules()
+	unsigned long loopEpoch; //Odd while the event loop handles events
+	int shapingEnabled; //Slow traffic down as set by shaping
+	ShapingPolicy shaping;
+	struct _Shaper *shaper;
+	int metricsPort; //Admin listener for Prometheus. 0 to disable.
+	const char *metricsAddress; //IPv4 address to listen on. Loopback if NULL.
+	struct _Metrics *metrics;
 	pthread_t backgroundThreadId;
 	int isInBackgroundMode;
 
@@ -71,6 +243,8 @@ typedef struct _ProxyServer {
 	void (*onEndRequest)(struct _ProxyServer *p, Request *req);
 	void (*onQueueWriteToServer)(struct _ProxyServer *p, Request *req);
 	void (*onQueueWriteToClient)(struct _ProxyServer *p, Request *req);
+	//Called from the compactor thread when retention removes a record
+	void (*onRecordRemoved)(struct _ProxyServer *p, const char *uniqueId);
 } ProxyServer;
 
 ProxyServer* newProxyServer(int port);
@@ -79,3 +253,5 @@ int proxyServerStartInBackground(ProxyServer* server);
 int proxyServerStop(ProxyServer* server);
 void deleteProxyServer(ProxyServer* server);
 void proxySetTrace(int t);
+String *requestGetHeader(Request *req, int headerId);
+int proxyServerGetCommitStats(ProxyServer *p, CommitStats *stats);
@@ -0,0 +1,613 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "Regex.h"
+
+#define NFA_CLASS 0 //Takes a byte in the class to out
+#define NFA_SPLIT 1 //Goes to out and out1
+#define NFA_EMPTY 2 //Goes to out
+#define NFA_MATCH 3
+
+//Deeper groups are rejected so that parsing can't run out of stack
+#define MAX_GROUP_DEPTH 64
+
+typedef struct _NfaState {
+	int type;
+	int out;
+	int out1;
+	int atEnd; //NFA_MATCH only counts at the end of the text
+	size_t id; //Of the pattern
+	uint64_t bytes[4]; //NFA_CLASS
+} NfaState;
+
+typedef struct _DfaState {
+	int *nfa; //Sorted NFA_CLASS and NFA_MATCH states
+	size_t nfaCount;
+	size_t *accept; //Patterns matched on reaching the state
+	size_t acceptCount;
+	size_t *acceptAtEnd; //Patterns matched if the text ends here
+	size_t acceptAtEndCount;
+	unsigned hash;
+	int next[256]; //-1 until built
+} DfaState;
+
+struct _RegexSet {
+	NfaState *nfa;
+	size_t nfaCount;
+	size_t nfaCapacity;
+	int *anchored; //Start states of patterns anchored with ^
+	size_t anchoredCount;
+	int *floating; //Start states of the rest. Entered again at every byte.
+	size_t floatingCount;
+	DfaState *states;
+	size_t stateCount;
+	size_t stateCapacity;
+	int *table; //States by NFA set. -1 if empty.
+	size_t tableSize;
+	int start; //-1 until built
+	//Scratch space for building states, sized to the NFA
+	int *stack;
+	int *list;
+	unsigned *marks;
+	unsigned generation;
+	size_t scratchSize;
+};
+
+typedef struct _Fragment {
+	int start;
+	int end; //NFA_EMPTY whose out is still to be set
+} Fragment;
+
+typedef struct _Parser {
+	struct _RegexSet *set;
+	const char *at;
+	const char *end;
+	int depth;
+	int failed;
+} Parser;
+
+static Fragment parse_alternation(Parser *ps);
+
+static void set_bit(uint64_t *bytes, unsigned char ch) {
+	bytes[ch >> 6] |= 1ULL << (ch & 63);
+}
+
+static int has_bit(const uint64_t *bytes, unsigned char ch) {
+	return (bytes[ch >> 6] >> (ch & 63)) & 1;
+}
+
+//Grows a list whenever its length reaches a power of two
+static void append_int(int **list, size_t *count, int value) {
+	if (*count == 0 || (*count & (*count - 1)) == 0) {
+		*list = realloc(*list, (*count == 0 ? 1 : *count * 2) * sizeof(int));
+	}
+	(*list)[(*count)++] = value;
+}
+
+static int add_state(struct _RegexSet *set, int type, int out, int out1) {
+	if (set->nfaCount == set->nfaCapacity) {
+		set->nfaCapacity = set->nfaCapacity == 0 ? 64 : set->nfaCapacity * 2;
+		set->nfa = realloc(set->nfa, set->nfaCapacity * sizeof(NfaState));
+	}
+
+	NfaState *s = set->nfa + set->nfaCount;
+
+	memset(s, 0, sizeof(NfaState));
+	s->type = type;
+	s->out = out;
+	s->out1 = out1;
+
+	return (int) set->nfaCount++;
+}
+
+static Fragment class_fragment(Parser *ps, const uint64_t *bytes) {
+	int end = add_state(ps->set, NFA_EMPTY, -1, -1);
+	int start = add_state(ps->set, NFA_CLASS, end, -1);
+
+	memcpy(ps->set->nfa[start].bytes, bytes, sizeof(ps->set->nfa[start].bytes));
+
+	return (Fragment) {start, end};
+}
+
+/*
+ * Adds the bytes of \d, \w, \s or, in upper case, their negation.
+ * Returns 0 if ch is none of them.
+ */
+static int escape_class(char ch, uint64_t *bytes) {
+	uint64_t escaped[4] = {0, 0, 0, 0};
+	int lower = tolower((unsigned char) ch);
+
+	if (lower != 'd' && lower != 'w' && lower != 's') {
+		return 0;
+	}
+	for (int c = 0; c < 256; ++c) {
+		int in = lower == 'd' ? isdigit(c) :
+			lower == 'w' ? isalnum(c) || c == '_' : isspace(c);
+
+		if (in) {
+			set_bit(escaped, c);
+		}
+	}
+	for (int i = 0; i < 4; ++i) {
+		bytes[i] |= isupper((unsigned char) ch) ? ~escaped[i] : escaped[i];
+	}
+
+	return 1;
+}
+
+//After the opening [
+static Fragment parse_class(Parser *ps) {
+	uint64_t bytes[4] = {0, 0, 0, 0};
+	int negate = 0;
+	int first = 1;
+
+	if (ps->at < ps->end && *ps->at == '^') {
+		negate = 1;
+		++ps->at;
+	}
+	//A ] right after [ or [^ is taken literally
+	while (ps->at < ps->end && (*ps->at != ']' || first)) {
+		unsigned char low = *ps->at++;
+
+		first = 0;
+		if (low == '\\') {
+			if (ps->at == ps->end) {
+				break;
+			}
+			if (escape_class(*ps->at, bytes)) {
+				++ps->at;
+				continue;
+			}
+			low = *ps->at++;
+		}
+
+		unsigned char high = low;
+
+		if (ps->at + 1 < ps->end && *ps->at == '-' && ps->at[1] != ']') {
+			high = ps->at[1];
+			ps->at += 2;
+			if (high == '\\' && ps->at < ps->end) {
+				high = *ps->at++;
+			}
+		}
+		for (int c = low; c <= high; ++c) {
+			set_bit(bytes, c);
+		}
+	}
+	if (ps->at == ps->end) {
+		//No closing ]
+		ps->failed = 1;
+
+		return (Fragment) {-1, -1};
+	}
+	++ps->at;
+	if (negate) {
+		for (int i = 0; i < 4; ++i) {
+			bytes[i] = ~bytes[i];
+		}
+	}
+
+	return class_fragment(ps, bytes);
+}
+
+static Fragment parse_atom(Parser *ps) {
+	Fragment f = {-1, -1};
+	uint64_t bytes[4] = {0, 0, 0, 0};
+	char ch = *ps->at++;
+
+	switch (ch) {
+	case '(':
+		if (++ps->depth > MAX_GROUP_DEPTH) {
+			ps->failed = 1;
+
+			return f;
+		}
+		f = parse_alternation(ps);
+		--ps->depth;
+		if (ps->failed || ps->at == ps->end || *ps->at != ')') {
+			ps->failed = 1;
+
+			return f;
+		}
+		++ps->at;
+
+		return f;
+	case '[':
+		return parse_class(ps);
+	case '.':
+		memset(bytes, 0xff, sizeof(bytes));
+
+		return class_fragment(ps, bytes);
+	case '\\':
+		if (ps->at == ps->end) {
+			ps->failed = 1;
+
+			return f;
+		}
+		ch = *ps->at++;
+		if (escape_class(ch, bytes)) {
+			return class_fragment(ps, bytes);
+		}
+		break;
+	case '*':
+	case '+':
+	case '?':
+	case '^':
+	case '$':
+		//Nothing to repeat, or an anchor not at the ends
+		ps->failed = 1;
+
+		return f;
+	}
+	set_bit(bytes, (unsigned char) ch);
+
+	return class_fragment(ps, bytes);
+}
+
+static Fragment parse_repeat(Parser *ps) {
+	Fragment f = parse_atom(ps);
+
+	while (!ps->failed && ps->at < ps->end &&
+		(*ps->at == '*' || *ps->at == '+' || *ps->at == '?')) {
+		char op = *ps->at++;
+		int end = add_state(ps->set, NFA_EMPTY, -1, -1);
+		int split = add_state(ps->set, NFA_SPLIT, f.start, end);
+
+		if (op == '?') {
+			ps->set->nfa[f.end].out = end;
+			f.start = split;
+		} else {
+			//Loop back. + must go through once, * need not.
+			ps->set->nfa[f.end].out = split;
+			if (op == '*') {
+				f.start = split;
+			}
+		}
+		f.end = end;
+	}
+
+	return f;
+}
+
+static Fragment parse_concat(Parser *ps) {
+	int empty = add_state(ps->set, NFA_EMPTY, -1, -1);
+	Fragment f = {empty, empty};
+
+	while (!ps->failed && ps->at < ps->end && *ps->at != '|' &&
+		*ps->at != ')') {
+		Fragment next = parse_repeat(ps);
+
+		if (ps->failed) {
+			break;
+		}
+		ps->set->nfa[f.end].out = next.start;
+		f.end = next.end;
+	}
+
+	return f;
+}
+
+static Fragment parse_alternation(Parser *ps) {
+	Fragment f = parse_concat(ps);
+
+	while (!ps->failed && ps->at < ps->end && *ps->at == '|') {
+		++ps->at;
+
+		Fragment other = parse_concat(ps);
+		int end = add_state(ps->set, NFA_EMPTY, -1, -1);
+		int split = add_state(ps->set, NFA_SPLIT, f.start, other.start);
+
+		ps->set->nfa[f.end].out = end;
+		ps->set->nfa[other.end].out = end;
+		f.start = split;
+		f.end = end;
+	}
+
+	return f;
+}
+
+static void drop_states(struct _RegexSet *set) {
+	for (size_t i = 0; i < set->stateCount; ++i) {
+		free(set->states[i].nfa);
+		free(set->states[i].accept);
+		free(set->states[i].acceptAtEnd);
+	}
+	set->stateCount = 0;
+	memset(set->table, 0xff, set->tableSize * sizeof(int));
+	set->start = -1;
+}
+
+static void next_generation(struct _RegexSet *set) {
+	if (++set->generation == 0) {
+		memset(set->marks, 0, set->scratchSize * sizeof(unsigned));
+		set->generation = 1;
+	}
+}
+
+/*
+ * Adds the NFA_CLASS and NFA_MATCH states reached from a state without
+ * taking a byte to the list. States already marked in this generation
+ * are skipped.
+ */
+static void add_closure(struct _RegexSet *set, int state, size_t *count) {
+	size_t top = 0;
+
+	set->stack[top++] = state;
+	while (top > 0) {
+		int s = set->stack[--top];
+
+		if (s < 0 || set->marks[s] == set->generation) {
+			continue;
+		}
+		set->marks[s] = set->generation;
+
+		NfaState *n = set->nfa + s;
+
+		if (n->type == NFA_SPLIT) {
+			set->stack[top++] = n->out1;
+			set->stack[top++] = n->out;
+		} else if (n->type == NFA_EMPTY) {
+			set->stack[top++] = n->out;
+		} else {
+			set->list[(*count)++] = s;
+		}
+	}
+}
+
+static int compare_ints(const void *a, const void *b) {
+	int x = *(const int*) a;
+	int y = *(const int*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void table_insert(struct _RegexSet *set, int index) {
+	size_t mask = set->tableSize - 1;
+	size_t i = set->states[index].hash & mask;
+
+	while (set->table[i] >= 0) {
+		i = (i + 1) & mask;
+	}
+	set->table[i] = index;
+}
+
+/*
+ * Returns the DFA state for the NFA states in the scratch list, adding
+ * it if it is new.
+ */
+static int find_or_add_state(struct _RegexSet *set, size_t count) {
+	unsigned hash = 2166136261u;
+
+	qsort(set->list, count, sizeof(int), compare_ints);
+	for (size_t i = 0; i < count; ++i) {
+		hash = (hash ^ (unsigned) set->list[i]) * 16777619u;
+	}
+
+	size_t mask = set->tableSize - 1;
+
+	for (size_t i = hash & mask; set->table[i] >= 0; i = (i + 1) & mask) {
+		DfaState *d = set->states + set->table[i];
+
+		if (d->hash == hash && d->nfaCount == count &&
+			memcmp(d->nfa, set->list, count * sizeof(int)) == 0) {
+			return set->table[i];
+		}
+	}
+
+	if (set->stateCount == set->stateCapacity) {
+		set->stateCapacity = set->stateCapacity == 0 ?
+			16 : set->stateCapacity * 2;
+		set->states = realloc(set->states,
+			set->stateCapacity * sizeof(DfaState));
+	}
+
+	DfaState *d = set->states + set->stateCount;
+
+	memset(d, 0, sizeof(DfaState));
+	memset(d->next, 0xff, sizeof(d->next));
+	d->hash = hash;
+	d->nfaCount = count;
+	d->nfa = malloc((count > 0 ? count : 1) * sizeof(int));
+	memcpy(d->nfa, set->list, count * sizeof(int));
+	for (size_t i = 0; i < count; ++i) {
+		NfaState *n = set->nfa + set->list[i];
+
+		if (n->type != NFA_MATCH) {
+			continue;
+		}
+		if (n->atEnd) {
+			d->acceptAtEnd = realloc(d->acceptAtEnd,
+				(d->acceptAtEndCount + 1) * sizeof(size_t));
+			d->acceptAtEnd[d->acceptAtEndCount++] = n->id;
+		} else {
+			d->accept = realloc(d->accept,
+				(d->acceptCount + 1) * sizeof(size_t));
+			d->accept[d->acceptCount++] = n->id;
+		}
+	}
+
+	int index = (int) set->stateCount++;
+
+	//Keep the table at most half full
+	if (set->stateCount * 2 > set->tableSize) {
+		set->tableSize *= 2;
+		set->table = realloc(set->table, set->tableSize * sizeof(int));
+		memset(set->table, 0xff, set->tableSize * sizeof(int));
+		for (size_t i = 0; i < set->stateCount; ++i) {
+			table_insert(set, (int) i);
+		}
+	} else {
+		table_insert(set, index);
+	}
+
+	return index;
+}
+
+static int start_state(struct _RegexSet *set) {
+	if (set->start < 0) {
+		size_t count = 0;
+
+		next_generation(set);
+		for (size_t i = 0; i < set->anchoredCount; ++i) {
+			add_closure(set, set->anchored[i], &count);
+		}
+		for (size_t i = 0; i < set->floatingCount; ++i) {
+			add_closure(set, set->floating[i], &count);
+		}
+		set->start = find_or_add_state(set, count);
+	}
+
+	return set->start;
+}
+
+static int build_next(struct _RegexSet *set, int state, unsigned char ch) {
+	if (set->stateCount >= MAX_DFA_STATES) {
+		//Start the cache over from the state we are in
+		size_t count = set->states[state].nfaCount;
+
+		memcpy(set->list, set->states[state].nfa, count * sizeof(int));
+		drop_states(set);
+		state = find_or_add_state(set, count);
+	}
+
+	size_t count = 0;
+	DfaState *d = set->states + state;
+
+	next_generation(set);
+	for (size_t i = 0; i < d->nfaCount; ++i) {
+		NfaState *n = set->nfa + d->nfa[i];
+
+		if (n->type == NFA_CLASS && has_bit(n->bytes, ch)) {
+			add_closure(set, n->out, &count);
+		}
+	}
+	for (size_t i = 0; i < set->floatingCount; ++i) {
+		add_closure(set, set->floating[i], &count);
+	}
+
+	int next = find_or_add_state(set, count);
+
+	set->states[state].next[ch] = next;
+
+	return next;
+}
+
+static void report(const size_t *ids, size_t count, uint64_t *matched) {
+	for (size_t i = 0; i < count; ++i) {
+		matched[ids[i] / 64] |= 1ULL << (ids[i] % 64);
+	}
+}
+
+struct _RegexSet *newRegexSet() {
+	struct _RegexSet *set = calloc(1, sizeof(struct _RegexSet));
+
+	set->tableSize = 64;
+	set->table = malloc(set->tableSize * sizeof(int));
+	memset(set->table, 0xff, set->tableSize * sizeof(int));
+	set->start = -1;
+
+	return set;
+}
+
+void deleteRegexSet(struct _RegexSet *set) {
+	if (set == NULL) {
+		return;
+	}
+	drop_states(set);
+	free(set->states);
+	free(set->table);
+	free(set->nfa);
+	free(set->anchored);
+	free(set->floating);
+	free(set->stack);
+	free(set->list);
+	free(set->marks);
+	free(set);
+}
+
+/*
+ * Adds a pattern. A match sets bit id in the bitmap given to
+ * regexSetMatch(). Returns -1 if the pattern is not valid.
+ */
+int regexSetAdd(struct _RegexSet *set, const char *pattern, size_t id) {
+	size_t length = strlen(pattern);
+	size_t saved = set->nfaCount;
+	Parser ps = {set, pattern, pattern + length, 0, 0};
+	int anchored = 0;
+	int atEnd = 0;
+
+	if (ps.at < ps.end && *ps.at == '^') {
+		anchored = 1;
+		++ps.at;
+	}
+	if (ps.end > ps.at && ps.end[-1] == '$' &&
+		(ps.end - 1 == ps.at || ps.end[-2] != '\\')) {
+		atEnd = 1;
+		--ps.end;
+	}
+
+	Fragment f = parse_alternation(&ps);
+
+	//Stopping early means an unmatched )
+	if (ps.failed || ps.at != ps.end) {
+		set->nfaCount = saved;
+
+		return -1;
+	}
+
+	int match = add_state(set, NFA_MATCH, -1, -1);
+
+	set->nfa[match].id = id;
+	set->nfa[match].atEnd = atEnd;
+	set->nfa[f.end].out = match;
+	if (anchored) {
+		append_int(&set->anchored, &set->anchoredCount, f.start);
+	} else {
+		append_int(&set->floating, &set->floatingCount, f.start);
+	}
+
+	//Cached states refer to the old NFA
+	drop_states(set);
+	if (set->scratchSize < set->nfaCount) {
+		set->scratchSize = set->nfaCapacity;
+		set->stack = realloc(set->stack,
+			(2 * set->scratchSize + 1) * sizeof(int));
+		set->list = realloc(set->list, set->scratchSize * sizeof(int));
+		free(set->marks);
+		set->marks = calloc(set->scratchSize, sizeof(unsigned));
+		set->generation = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Sets the bit of every pattern that matches the text in matched.
+ */
+void regexSetMatch(struct _RegexSet *set, const char *text, size_t length,
+	uint64_t *matched) {
+	if (set->anchoredCount + set->floatingCount == 0) {
+		return;
+	}
+
+	int state = start_state(set);
+
+	for (size_t i = 0; i < length; ++i) {
+		DfaState *d = set->states + state;
+
+		if (d->nfaCount == 0) {
+			//Nothing can match any more
+			return;
+		}
+		report(d->accept, d->acceptCount, matched);
+
+		int next = d->next[(unsigned char) text[i]];
+
+		state = next >= 0 ? next : build_next(set, state, text[i]);
+	}
+	report(set->states[state].accept, set->states[state].acceptCount, matched);
+	report(set->states[state].acceptAtEnd, set->states[state].acceptAtEndCount,
+		matched);
+}
@@ -0,0 +1,24 @@
+/*
+ * Matches a string against many regular expressions in one pass. The
+ * patterns of a set are compiled into a single NFA which is scanned as a
+ * DFA. DFA states are built the first time they are reached and cached,
+ * so once warm the cost is one table lookup per byte however many
+ * patterns there are. The cache is dropped and rebuilt if it grows past
+ * MAX_DFA_STATES.
+ *
+ * Syntax: literals, ., [] classes with ranges and ^, \d \w \s and their
+ * negations, other escaped characters, groups, |, *, + and ?. ^ at the
+ * start anchors a pattern at the start of the text and $ at the end
+ * anchors it at the end. Other patterns may match anywhere.
+ *
+ * A set is not thread safe since matching adds to the state cache.
+ */
+#include <stdint.h>
+
+#define MAX_DFA_STATES 4096
+
+struct _RegexSet *newRegexSet();
+void deleteRegexSet(struct _RegexSet *set);
+int regexSetAdd(struct _RegexSet *set, const char *pattern, size_t id);
+void regexSetMatch(struct _RegexSet *set, const char *text, size_t length,
+	uint64_t *matched);
@@ -0,0 +1,411 @@
+//For memmem()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "Proxy.h"
+#include "Persistence.h"
+#include "Metrics.h"
+#include "Replay.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+#define MAX_KEY 2048
+#define INITIAL_BUCKETS 1024
+
+typedef struct _ReplayRecord {
+	char uniqueId[64];
+	uint64_t queryHash;
+	uint64_t bodyHash;
+	long long duration; //Microseconds from request start to response end
+	int served;
+	struct _ReplayRecord *next; //Same key in capture order
+} ReplayRecord;
+
+typedef struct _ReplayKey {
+	char *key;
+	size_t keyLength;
+	ReplayRecord *first;
+	ReplayRecord *last;
+	struct _ReplayKey *bucketNext;
+} ReplayKey;
+
+typedef struct _Replay {
+	pthread_mutex_t lock;
+	ReplayKey **buckets;
+	size_t bucketCount; //Power of 2
+	ReplayStats stats;
+} Replay;
+
+typedef struct _ReplayLoad {
+	ProxyServer *p;
+	Replay *replay;
+	RequestRecord *body; //For body hashes
+} ReplayLoad;
+
+static uint64_t hash_bytes(const char *data, size_t length) {
+	uint64_t h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < length; ++i) {
+		h ^= (unsigned char) data[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+/*
+ * Writes the key of a request as "METHOD host:port/path". The query
+ * string is left out and its position returned in query.
+ */
+static size_t make_key(char *out, String *method, String *host,
+	String *port, const char *path, size_t pathLength, const char **query,
+	size_t *queryLength) {
+	const char *mark = memchr(path, '?', pathLength);
+	size_t length = mark != NULL ? (size_t) (mark - path) : pathLength;
+
+	*query = mark != NULL ? mark + 1 : path + pathLength;
+	*queryLength = path + pathLength - *query;
+
+	int sz = snprintf(out, MAX_KEY, "%s %s:%s%.*s", stringAsCString(method),
+		stringAsCString(host), stringAsCString(port), (int) length, path);
+
+	return sz < MAX_KEY ? (size_t) sz : MAX_KEY - 1;
+}
+
+static ReplayKey *find_key(Replay *replay, const char *key, size_t length) {
+	size_t bucket = hash_bytes(key, length) & (replay->bucketCount - 1);
+
+	for (ReplayKey *k = replay->buckets[bucket]; k != NULL;
+		k = k->bucketNext) {
+		if (k->keyLength == length && memcmp(k->key, key, length) == 0) {
+			return k;
+		}
+	}
+
+	return NULL;
+}
+
+static long long micros_between(struct timeval *start, struct timeval *end) {
+	return (long long) (end->tv_sec - start->tv_sec) * 1000000 +
+		(end->tv_usec - start->tv_usec);
+}
+
+static void insert_key(Replay *replay, ReplayKey *k) {
+	size_t bucket = hash_bytes(k->key, k->keyLength) &
+		(replay->bucketCount - 1);
+
+	k->bucketNext = replay->buckets[bucket];
+	replay->buckets[bucket] = k;
+}
+
+//Keeps the table at no more than one key per bucket
+static void add_key(Replay *replay, ReplayKey *k) {
+	if (replay->stats.keys >= replay->bucketCount) {
+		ReplayKey **old = replay->buckets;
+		size_t oldCount = replay->bucketCount;
+
+		replay->bucketCount *= 2;
+		replay->buckets = calloc(replay->bucketCount, sizeof(ReplayKey*));
+		for (size_t i = 0; i < oldCount; ++i) {
+			ReplayKey *other = old[i];
+
+			while (other != NULL) {
+				ReplayKey *next = other->bucketNext;
+
+				insert_key(replay, other);
+				other = next;
+			}
+		}
+		free(old);
+	}
+	insert_key(replay, k);
+	++replay->stats.keys;
+}
+
+/*
+ * Adds the records of a batch. Batches arrive one at a time, oldest
+ * first.
+ */
+static void add_records(void *contextData, HistoryEntry *entries,
+	size_t count) {
+	ReplayLoad *load = contextData;
+	char key[MAX_KEY];
+
+	for (size_t i = 0; i < count; ++i) {
+		RequestRecord *req = entries[i].request;
+		const char *query;
+		size_t queryLength;
+		size_t length = make_key(key, req->method, req->host, req->port,
+			req->path->buffer, req->path->length, &query, &queryLength);
+		ReplayRecord *r = calloc(1, sizeof(ReplayRecord));
+
+		snprintf(r->uniqueId, sizeof(r->uniqueId), "%s", entries[i].uniqueId);
+		r->queryHash = hash_bytes(query, queryLength);
+		r->duration = micros_between(&req->requestStartTime,
+			&req->responseEndTime);
+		if (r->duration < 0 || req->responseEndTime.tv_sec == 0) {
+			r->duration = 0;
+		}
+		if ((load->p->replayMatch & REPLAY_MATCH_BODY) &&
+			proxyServerLoadRequest(load->p, r->uniqueId, load->body) == 0) {
+			r->bodyHash = hash_bytes(load->body->bodyBuffer.buffer,
+				load->body->bodyBuffer.length);
+			proxyServerResetRecords(load->p, load->body, NULL);
+		} else {
+			r->bodyHash = hash_bytes(NULL, 0);
+		}
+
+		ReplayKey *k = find_key(load->replay, key, length);
+
+		if (k == NULL) {
+			k = calloc(1, sizeof(ReplayKey));
+			k->key = strndup(key, length);
+			k->keyLength = length;
+			add_key(load->replay, k);
+		}
+		if (k->last != NULL) {
+			k->last->next = r;
+		} else {
+			k->first = r;
+		}
+		k->last = r;
+		++load->replay->stats.records;
+	}
+}
+
+/*
+ * Builds the lookup table from what is in the persistence folder. Returns
+ * NULL if the history could not be read.
+ */
+Replay *newReplay(ProxyServer *p) {
+	Replay *replay = calloc(1, sizeof(Replay));
+	ReplayLoad load;
+
+	pthread_mutex_init(&replay->lock, NULL);
+	replay->bucketCount = INITIAL_BUCKETS;
+	replay->buckets = calloc(replay->bucketCount, sizeof(ReplayKey*));
+
+	memset(&load, 0, sizeof(load));
+	load.p = p;
+	load.replay = replay;
+	load.body = newRequestRecord();
+
+	int status = proxyServerLoadHistoryParallel(p, 0, HISTORY_BY_START_TIME,
+		256, &load, add_records);
+
+	deleteRequestRecord(load.body);
+
+	if (status < 0) {
+		deleteReplay(replay);
+
+		return NULL;
+	}
+
+	return replay;
+}
+
+void deleteReplay(Replay *replay) {
+	for (size_t i = 0; i < replay->bucketCount; ++i) {
+		ReplayKey *k = replay->buckets[i];
+
+		while (k != NULL) {
+			ReplayKey *nextKey = k->bucketNext;
+			ReplayRecord *r = k->first;
+
+			while (r != NULL) {
+				ReplayRecord *next = r->next;
+
+				free(r);
+				r = next;
+			}
+			free(k->key);
+			free(k);
+			k = nextKey;
+		}
+	}
+	free(replay->buckets);
+	pthread_mutex_destroy(&replay->lock);
+	free(replay);
+}
+
+/*
+ * Picks the first record of a key that matches and has not been served.
+ * Once all have been served the last match is repeated.
+ */
+static ReplayRecord *pick_record(ProxyServer *p, ReplayKey *k,
+	uint64_t queryHash, uint64_t bodyHash) {
+	ReplayRecord *last = NULL;
+
+	for (ReplayRecord *r = k->first; r != NULL; r = r->next) {
+		if ((p->replayMatch & REPLAY_MATCH_QUERY) && r->queryHash != queryHash) {
+			continue;
+		}
+		if ((p->replayMatch & REPLAY_MATCH_BODY) && r->bodyHash != bodyHash) {
+			continue;
+		}
+		if (!r->served) {
+			r->served = 1;
+
+			return r;
+		}
+		last = r;
+	}
+
+	return last;
+}
+
+/*
+ * Decides if the body of a response can only end when the connection
+ * closes.
+ */
+static int ends_at_close(const char *header, size_t length, int isHead) {
+	const char *end = header + length;
+	int status = 0;
+	int framed = 0;
+	int close = 0;
+
+	sscanf(header, "%*s %d", &status);
+	for (const char *line = header; line < end; ) {
+		const char *next = memchr(line, '\n', end - line);
+
+		next = next != NULL ? next + 1 : end;
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			framed = 1;
+		} else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+			framed = memmem(line, next - line, "chunked", 7) != NULL;
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			close = memmem(line, next - line, "close", 5) != NULL;
+		}
+		line = next;
+	}
+
+	return close || !(framed || isHead || status == 204 || status == 304 ||
+		(status >= 100 && status < 200));
+}
+
+static void not_found(Request *req, Buffer *out) {
+	char body[MAX_KEY + 64];
+	char header[128];
+	int bodyLength = snprintf(body, sizeof(body),
+		"No captured response for %s\n", stringAsCString(req->protocolLine));
+
+	if (bodyLength >= (int) sizeof(body)) {
+		bodyLength = sizeof(body) - 1;
+	}
+
+	int headerLength = snprintf(header, sizeof(header),
+		"HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+		"Content-Length: %d\r\n\r\n", bodyLength);
+
+	out->length = 0;
+	bufferAppendBytes(out, header, headerLength);
+	bufferAppendBytes(out, body, bodyLength);
+}
+
+/*
+ * Finds the captured response for a request whose body has been read in
+ * full. The header is placed in out and the body is to be sent from the
+ * file named in the response. Only when the record has no file of its
+ * own, as in flight recorder mode where it is spread over ring entries,
+ * is the whole message placed in out.
+ *
+ * Returns 0 if a record matched. Otherwise a 404 is placed in out and -1
+ * is returned.
+ */
+int replayLookup(ProxyServer *p, Request *req, const char *body,
+	size_t bodyLength, Buffer *out, ReplayResponse *response) {
+	Replay *replay = p->replay;
+	char key[MAX_KEY];
+	const char *query;
+	size_t queryLength;
+	size_t pathLength = strcspn(stringAsCString(req->path), " ");
+	size_t length = make_key(key, req->method, req->host, req->port,
+		req->path->buffer, pathLength, &query, &queryLength);
+	int isHead = strcmp(stringAsCString(req->method), "HEAD") == 0;
+
+	memset(response, 0, sizeof(ReplayResponse));
+
+	pthread_mutex_lock(&replay->lock);
+
+	ReplayKey *k = find_key(replay, key, length);
+	ReplayRecord *r = k == NULL ? NULL : pick_record(p, k,
+		hash_bytes(query, queryLength), hash_bytes(body, bodyLength));
+	char uniqueId[64];
+	size_t headerLength = 0;
+
+	if (r != NULL) {
+		snprintf(uniqueId, sizeof(uniqueId), "%s", r->uniqueId);
+		response->delay = (long long) (r->duration * p->replayTimeScale);
+	}
+	pthread_mutex_unlock(&replay->lock);
+
+	if (r != NULL && proxyServerLocateResponseBody(p, uniqueId, out, response->fileName,
+		sizeof(response->fileName), &response->bodyOffset,
+		&response->bodyLength) == 0) {
+		response->matched = 1;
+		headerLength = out->length;
+		if (isHead) {
+			response->bodyLength = 0;
+		}
+	} else if (r != NULL) {
+		ResponseRecord *res = newResponseRecord();
+
+		response->fileName[0] = '\0';
+		if (proxyServerLoadResponse(p, uniqueId, res) == 0) {
+			headerLength = res->headerBuffer.length;
+			out->length = 0;
+			bufferAppendBytes(out, res->headerBuffer.buffer,
+				res->headerBuffer.length);
+			if (!isHead) {
+				bufferAppendBytes(out, res->bodyBuffer.buffer,
+					res->bodyBuffer.length);
+			}
+			response->matched = out->length > 0;
+		}
+		deleteResponseRecord(res);
+	}
+
+	if (!response->matched) {
+		response->fileName[0] = '\0';
+		response->delay = 0;
+		not_found(req, out);
+	} else {
+		response->closeAfter = ends_at_close(out->buffer, headerLength,
+			isHead);
+	}
+	if (response->bodyLength == 0) {
+		response->fileName[0] = '\0';
+	}
+
+	pthread_mutex_lock(&replay->lock);
+	if (response->matched) {
+		++replay->stats.served;
+	} else {
+		++replay->stats.missed;
+	}
+	pthread_mutex_unlock(&replay->lock);
+	metricsAdd(p, response->matched ? METRIC_REPLAY_SERVED :
+		METRIC_REPLAY_MISSED, 1);
+
+	return response->matched ? 0 : -1;
+}
+
+int proxyServerGetReplayStats(ProxyServer *p, ReplayStats *stats) {
+	Replay *replay = p->replay;
+
+	if (replay == NULL) {
+		memset(stats, 0, sizeof(ReplayStats));
+
+		return -1;
+	}
+	pthread_mutex_lock(&replay->lock);
+	*stats = replay->stats;
+	pthread_mutex_unlock(&replay->lock);
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Replay mode. Requests are answered from the records in the persistence
+ * folder and no server is contacted. At start a lookup table is built of
+ * the records by method, host, port and path. Optionally the query string
+ * and a hash of the request body must match too.
+ *
+ * Records with the same key are served in the order they were captured
+ * and the last one is repeated once all have been served. Requests that
+ * match nothing get a 404.
+ *
+ * The response is sent after the captured duration of the request times
+ * the time scale. A scale of 0 sends it at once.
+ */
+typedef enum _ReplayMatch {
+	REPLAY_MATCH_PATH = 0, //Method, host, port and path
+	REPLAY_MATCH_QUERY = 1, //Also the query string
+	REPLAY_MATCH_BODY = 2 //Also a hash of the request body
+} ReplayMatch;
+
+/*
+ * How to send a response. The header, or the whole message when there is
+ * no file, is placed in a buffer.
+ */
+typedef struct _ReplayResponse {
+	char fileName[512]; //Body is sent from here. Empty if none.
+	off_t bodyOffset;
+	size_t bodyLength;
+	long long delay; //Microseconds to wait before sending
+	int closeAfter; //Body ends when the connection is closed
+	int matched;
+} ReplayResponse;
+
+typedef struct _ReplayStats {
+	unsigned long records;
+	unsigned long keys;
+	unsigned long served;
+	unsigned long missed;
+} ReplayStats;
+
+struct _Replay *newReplay(ProxyServer *p);
+void deleteReplay(struct _Replay *replay);
+int replayLookup(ProxyServer *p, Request *req, const char *body,
+	size_t bodyLength, Buffer *out, ReplayResponse *response);
+int proxyServerGetReplayStats(ProxyServer *p, ReplayStats *stats);
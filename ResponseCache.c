@@ -0,0 +1,1182 @@
+//For strptime() and timegm()
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "Proxy.h"
+#include "Metrics.h"
+#include "ResponseCache.h"
+
+#define CACHE_BUCKETS 1024
+//Responses larger than this part of the memory size are not stored
+#define MAX_OBJECT_SHARE 8
+//Heuristic freshness is 10% of the time since Last-Modified up to a day
+#define MAX_HEURISTIC_LIFETIME (24 * 60 * 60)
+
+typedef struct _CachedResponse {
+	char *key; //Method and URL
+	size_t keyLength;
+	char *vary; //Vary header of the response. NULL if none.
+	char *varyValues; //Request header values named by vary
+	Buffer *data; //Status line, header and body. NULL while spilled.
+	size_t headerLength; //Up to and including the blank line
+	size_t length; //Of data
+	unsigned long spillId; //File number while spilled. 0 when in memory.
+	time_t responseTime; //When stored or last refreshed
+	long long initialAge; //Seconds. Corrected initial age.
+	long long lifetime; //Freshness lifetime in seconds
+	char *etag;
+	char *lastModified;
+	int refs; //Requests revalidating the entry
+	int removed; //No longer in the cache. Freed when refs drops to 0.
+	struct _CachedResponse *newer;
+	struct _CachedResponse *older;
+	struct _CachedResponse *bucketNext;
+} CachedResponse;
+
+typedef struct _LruList {
+	CachedResponse *newest;
+	CachedResponse *oldest;
+} LruList;
+
+typedef struct _ResponseCache {
+	pthread_mutex_t lock;
+	CachedResponse *buckets[CACHE_BUCKETS];
+	LruList memory;
+	LruList spilled;
+	unsigned long long memorySize;
+	unsigned long long spillSize;
+	char folder[512]; //Spill files. Empty if spilling is off.
+	unsigned long nextSpillId;
+	Buffer *scratch; //Vary values of the request being looked up
+	ResponseCacheStats stats;
+} ResponseCache;
+
+typedef struct _CacheControl {
+	int noStore;
+	int noCache;
+	int isPrivate;
+	int isPublic;
+	int mustRevalidate;
+	long long maxAge; //-1 if absent
+	long long sMaxAge;
+	long long minFresh;
+} CacheControl;
+
+typedef struct _ResponseInfo {
+	CacheControl cc;
+	int hasExpires;
+	time_t expires; //0 if it could not be parsed. Means already expired.
+	time_t date; //0 if absent
+	long long age;
+	time_t lastModified;
+	int setCookie;
+	const char *etag; //Point into the header. NULL if absent.
+	size_t etagLength;
+	const char *lastModifiedValue;
+	size_t lastModifiedLength;
+	const char *vary;
+	size_t varyLength;
+} ResponseInfo;
+
+static const char *status_names[] = {"none", "miss", "hit", "revalidated"};
+
+const char *cacheStatusName(int status) {
+	return status >= CACHE_NONE && status <= CACHE_REVALIDATED ?
+		status_names[status] : status_names[CACHE_NONE];
+}
+
+/*
+ * Returns the length of the line at data without the line break and sets
+ * next to the start of the following line.
+ */
+static size_t line_at(const char *data, const char *end, const char **next) {
+	const char *newLine = memchr(data, '\n', end - data);
+	const char *stop = newLine != NULL ? newLine : end;
+
+	*next = newLine != NULL ? newLine + 1 : end;
+	if (stop > data && stop[-1] == '\r') {
+		--stop;
+	}
+
+	return stop - data;
+}
+
+/*
+ * Returns the value of a header line whose name is nameLength bytes
+ * long. Leading spaces are skipped.
+ */
+static const char *field_value(const char *line, size_t length,
+	size_t nameLength, size_t *valueLength) {
+	const char *value = line + nameLength + 1;
+	const char *end = line + length;
+
+	while (value < end && (*value == ' ' || *value == '\t')) {
+		++value;
+	}
+	*valueLength = end - value;
+
+	return value;
+}
+
+static int same_name(const char *a, size_t aLength, const char *b,
+	size_t bLength) {
+	return aLength == bLength && strncasecmp(a, b, aLength) == 0;
+}
+
+//Length of the name of a header line. 0 if it has no colon.
+static size_t name_length(const char *line, size_t length) {
+	const char *colon = memchr(line, ':', length);
+
+	return colon != NULL ? colon - line : 0;
+}
+
+/*
+ * Returns the length of the header up to and including the blank line.
+ * 0 if the header is not complete.
+ */
+static size_t header_length(const char *data, size_t length) {
+	const char *end = data + length;
+
+	for (const char *line = data, *next; line < end; line = next) {
+		size_t lineLength = line_at(line, end, &next);
+
+		if (lineLength == 0 && line != data && next[-1] == '\n') {
+			return next - data;
+		}
+	}
+
+	return 0;
+}
+
+static long long parse_number(const char *value, size_t length) {
+	char text[32];
+
+	if (length >= sizeof(text)) {
+		length = sizeof(text) - 1;
+	}
+	memcpy(text, value, length);
+	text[length] = '\0';
+
+	return strtoll(text, NULL, 10);
+}
+
+/*
+ * Parses the preferred HTTP date format and the two obsolete ones.
+ * Returns 0 if the date could not be parsed.
+ */
+static time_t parse_http_date(const char *value, size_t length) {
+	static const char *formats[] = {"%a, %d %b %Y %H:%M:%S",
+		"%A, %d-%b-%y %H:%M:%S", "%a %b %d %H:%M:%S %Y"};
+	char text[64];
+	struct tm tm;
+
+	if (length >= sizeof(text)) {
+		return 0;
+	}
+	memcpy(text, value, length);
+	text[length] = '\0';
+	for (int i = 0; i < 3; ++i) {
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(text, formats[i], &tm) != NULL) {
+			return timegm(&tm);
+		}
+	}
+
+	return 0;
+}
+
+static void reset_cache_control(CacheControl *cc) {
+	memset(cc, 0, sizeof(CacheControl));
+	cc->maxAge = cc->sMaxAge = cc->minFresh = -1;
+}
+
+/*
+ * Adds the directives of a Cache-Control value. A private or no-cache
+ * that lists header names is treated as applying to the whole response.
+ */
+static void parse_cache_control(CacheControl *cc, const char *value,
+	size_t length) {
+	const char *end = value + length;
+
+	while (value < end) {
+		const char *comma = memchr(value, ',', end - value);
+		const char *stop = comma != NULL ? comma : end;
+
+		while (value < stop && (*value == ' ' || *value == '\t')) {
+			++value;
+		}
+
+		const char *equals = memchr(value, '=', stop - value);
+		size_t nameLength = (equals != NULL ? equals : stop) - value;
+		long long number = -1;
+
+		while (nameLength > 0 && value[nameLength - 1] == ' ') {
+			--nameLength;
+		}
+		if (equals != NULL) {
+			const char *argument = equals + 1;
+
+			if (argument < stop && *argument == '"') {
+				++argument;
+			}
+			number = parse_number(argument, stop - argument);
+		}
+		if (same_name(value, nameLength, "no-store", 8)) {
+			cc->noStore = 1;
+		} else if (same_name(value, nameLength, "no-cache", 8)) {
+			cc->noCache = 1;
+		} else if (same_name(value, nameLength, "private", 7)) {
+			cc->isPrivate = 1;
+		} else if (same_name(value, nameLength, "public", 6)) {
+			cc->isPublic = 1;
+		} else if (same_name(value, nameLength, "must-revalidate", 15) ||
+			same_name(value, nameLength, "proxy-revalidate", 16)) {
+			cc->mustRevalidate = 1;
+		} else if (same_name(value, nameLength, "max-age", 7)) {
+			cc->maxAge = number >= 0 ? number : 0;
+		} else if (same_name(value, nameLength, "s-maxage", 8)) {
+			cc->sMaxAge = number >= 0 ? number : 0;
+		} else if (same_name(value, nameLength, "min-fresh", 9)) {
+			cc->minFresh = number >= 0 ? number : 0;
+		}
+		value = stop + 1;
+	}
+}
+
+/*
+ * Collects what caching needs from a response header. The status line
+ * is skipped.
+ */
+static void parse_response(const char *data, size_t length,
+	ResponseInfo *info) {
+	const char *end = data + length;
+	const char *line;
+	const char *next;
+
+	memset(info, 0, sizeof(ResponseInfo));
+	reset_cache_control(&info->cc);
+	line_at(data, end, &next);
+	for (line = next; line < end; line = next) {
+		size_t lineLength = line_at(line, end, &next);
+		const char *value;
+		size_t valueLength;
+
+		if (lineLength == 0) {
+			break;
+		}
+		size_t nameLength = name_length(line, lineLength);
+
+		if (nameLength == 0) {
+			continue;
+		}
+		value = field_value(line, lineLength, nameLength, &valueLength);
+		switch (headerNameLookup(line, nameLength)) {
+		case HEADER_CACHE_CONTROL:
+			parse_cache_control(&info->cc, value, valueLength);
+			break;
+		case HEADER_EXPIRES:
+			info->hasExpires = 1;
+			info->expires = parse_http_date(value, valueLength);
+			break;
+		case HEADER_DATE:
+			info->date = parse_http_date(value, valueLength);
+			break;
+		case HEADER_AGE:
+			info->age = parse_number(value, valueLength);
+			break;
+		case HEADER_LAST_MODIFIED:
+			info->lastModified = parse_http_date(value, valueLength);
+			info->lastModifiedValue = value;
+			info->lastModifiedLength = valueLength;
+			break;
+		case HEADER_ETAG:
+			info->etag = value;
+			info->etagLength = valueLength;
+			break;
+		case HEADER_VARY:
+			info->vary = value;
+			info->varyLength = valueLength;
+			break;
+		case HEADER_SET_COOKIE:
+			info->setCookie = 1;
+			break;
+		}
+	}
+	if (info->age < 0) {
+		info->age = 0;
+	}
+}
+
+//Responses that may be given a heuristic freshness lifetime
+static int heuristic_status(int status) {
+	return status == 200 || status == 203 || status == 204 ||
+		status == 300 || status == 301 || status == 308 || status == 404 ||
+		status == 405 || status == 410 || status == 414 || status == 501;
+}
+
+static long long freshness_lifetime(const ResponseInfo *info, int status,
+	time_t responseTime) {
+	time_t base = info->date != 0 ? info->date : responseTime;
+
+	if (info->cc.noCache) {
+		return 0;
+	}
+	if (info->cc.sMaxAge >= 0) {
+		return info->cc.sMaxAge;
+	}
+	if (info->cc.maxAge >= 0) {
+		return info->cc.maxAge;
+	}
+	if (info->hasExpires) {
+		return info->expires > base ? info->expires - base : 0;
+	}
+	if (info->lastModified != 0 && info->lastModified < base &&
+		heuristic_status(status)) {
+		long long lifetime = (base - info->lastModified) / 10;
+
+		return lifetime < MAX_HEURISTIC_LIFETIME ?
+			lifetime : MAX_HEURISTIC_LIFETIME;
+	}
+
+	return 0;
+}
+
+//RFC 7234 section 4.2.3
+static long long initial_age(const ResponseInfo *info, time_t requestTime,
+	time_t responseTime) {
+	long long apparentAge = info->date != 0 && responseTime > info->date ?
+		responseTime - info->date : 0;
+	long long responseDelay = responseTime > requestTime ?
+		responseTime - requestTime : 0;
+	long long correctedAge = info->age + responseDelay;
+
+	return apparentAge > correctedAge ? apparentAge : correctedAge;
+}
+
+static long long current_age(const CachedResponse *e, time_t now) {
+	return e->initialAge + (now > e->responseTime ? now - e->responseTime : 0);
+}
+
+static String *find_request_header(Request *req, const char *name,
+	size_t length) {
+	for (size_t i = 0; i < req->headerNames->length; ++i) {
+		String *headerName = arrayGet(req->headerNames, i);
+
+		if (same_name(headerName->buffer, headerName->length, name, length)) {
+			return arrayGet(req->headerValues, i);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Writes the values of the request headers named in a Vary list, one
+ * per line. Missing headers give an empty line.
+ */
+static void vary_values(Request *req, const char *vary, size_t length,
+	Buffer *out) {
+	const char *end = vary + length;
+
+	out->length = 0;
+	while (vary < end) {
+		const char *comma = memchr(vary, ',', end - vary);
+		const char *stop = comma != NULL ? comma : end;
+
+		while (vary < stop && *vary == ' ') {
+			++vary;
+		}
+
+		size_t nameLength = stop - vary;
+
+		while (nameLength > 0 && vary[nameLength - 1] == ' ') {
+			--nameLength;
+		}
+		if (nameLength > 0) {
+			String *value = find_request_header(req, vary, nameLength);
+
+			if (value != NULL) {
+				bufferAppendBytes(out, value->buffer, value->length);
+			}
+			bufferAppendBytes(out, "\n", 1);
+		}
+		vary = stop + 1;
+	}
+	bufferAppendBytes(out, "", 1);
+}
+
+//The protocol line without the HTTP version
+static size_t key_length(Request *req) {
+	String *line = req->protocolLine;
+
+	for (size_t i = line->length; i > 0; --i) {
+		if (line->buffer[i - 1] == ' ') {
+			return i - 1;
+		}
+	}
+
+	return line->length;
+}
+
+static size_t bucket_of(const char *key, size_t length) {
+	size_t h = 5381;
+
+	for (size_t i = 0; i < length; ++i) {
+		h = h * 33 + (unsigned char) key[i];
+	}
+
+	return h % CACHE_BUCKETS;
+}
+
+static LruList *list_of(ResponseCache *cache, CachedResponse *e) {
+	return e->spillId != 0 ? &cache->spilled : &cache->memory;
+}
+
+static void unlink_entry(LruList *list, CachedResponse *e) {
+	if (e->newer != NULL) {
+		e->newer->older = e->older;
+	} else {
+		list->newest = e->older;
+	}
+	if (e->older != NULL) {
+		e->older->newer = e->newer;
+	} else {
+		list->oldest = e->newer;
+	}
+	e->newer = e->older = NULL;
+}
+
+static void push_newest(LruList *list, CachedResponse *e) {
+	e->older = list->newest;
+	if (list->newest != NULL) {
+		list->newest->newer = e;
+	}
+	list->newest = e;
+	if (list->oldest == NULL) {
+		list->oldest = e;
+	}
+}
+
+static void spill_file_name(ResponseCache *cache, unsigned long spillId,
+	char *fileName, size_t size) {
+	snprintf(fileName, size, "%s/%lu.cache", cache->folder, spillId);
+}
+
+static void free_entry(ResponseCache *cache, CachedResponse *e) {
+	if (e->spillId != 0) {
+		char fileName[600];
+
+		spill_file_name(cache, e->spillId, fileName, sizeof(fileName));
+		unlink(fileName);
+	}
+	if (e->data != NULL) {
+		deleteBuffer(e->data);
+	}
+	free(e->key);
+	free(e->vary);
+	free(e->varyValues);
+	free(e->etag);
+	free(e->lastModified);
+	free(e);
+}
+
+static void count_entry(ResponseCache *cache, CachedResponse *e, int delta) {
+	if (e->spillId != 0) {
+		cache->stats.spilledEntries += delta;
+		cache->stats.spilledBytes += delta * (long long) e->length;
+	} else {
+		cache->stats.entries += delta;
+		cache->stats.bytes += delta * (long long) e->length;
+	}
+}
+
+/*
+ * Takes an entry out of the cache. An entry being revalidated is kept
+ * until the request lets go of it.
+ */
+static void remove_entry(ResponseCache *cache, CachedResponse *e) {
+	CachedResponse **link = cache->buckets + bucket_of(e->key, e->keyLength);
+
+	while (*link != e) {
+		link = &(*link)->bucketNext;
+	}
+	*link = e->bucketNext;
+	unlink_entry(list_of(cache, e), e);
+	count_entry(cache, e, -1);
+
+	if (e->refs > 0) {
+		e->removed = 1;
+	} else {
+		free_entry(cache, e);
+	}
+}
+
+static void release_entry(ResponseCache *cache, CachedResponse *e) {
+	if (--e->refs == 0 && e->removed) {
+		free_entry(cache, e);
+	}
+}
+
+/*
+ * Moves an entry from memory to a spill file. The entry is removed if
+ * the file can not be written.
+ */
+static void spill_entry(ResponseCache *cache, CachedResponse *e) {
+	char fileName[600];
+	unsigned long spillId = ++cache->nextSpillId;
+
+	spill_file_name(cache, spillId, fileName, sizeof(fileName));
+
+	FILE *file = fopen(fileName, "w");
+	int ok = file != NULL &&
+		fwrite(e->data->buffer, 1, e->length, file) == e->length;
+
+	if (file != NULL && fclose(file) != 0) {
+		ok = 0;
+	}
+	if (!ok) {
+		unlink(fileName);
+		remove_entry(cache, e);
+
+		return;
+	}
+
+	unlink_entry(&cache->memory, e);
+	count_entry(cache, e, -1);
+	deleteBuffer(e->data);
+	e->data = NULL;
+	e->spillId = spillId;
+	push_newest(&cache->spilled, e);
+	count_entry(cache, e, 1);
+}
+
+/*
+ * Makes room in memory for the given number of bytes. The oldest entries
+ * are spilled or dropped. Entries being revalidated stay in memory.
+ */
+static void make_room(ResponseCache *cache, size_t length) {
+	CachedResponse *e = cache->memory.oldest;
+
+	while (e != NULL && cache->stats.bytes + length > cache->memorySize) {
+		CachedResponse *newer = e->newer;
+
+		if (e->refs == 0) {
+			if (cache->spillSize > 0 && cache->folder[0] != '\0' &&
+				e->length <= cache->spillSize) {
+				spill_entry(cache, e);
+			} else {
+				remove_entry(cache, e);
+			}
+		}
+		e = newer;
+	}
+	while (cache->spilled.oldest != NULL &&
+		cache->stats.spilledBytes > cache->spillSize) {
+		remove_entry(cache, cache->spilled.oldest);
+	}
+}
+
+/*
+ * Reads a spilled entry back into memory. Returns -1 and removes the
+ * entry if its file is gone.
+ */
+static int load_entry(ResponseCache *cache, CachedResponse *e) {
+	char fileName[600];
+	Buffer *data = newBufferWithCapacity(e->length);
+
+	spill_file_name(cache, e->spillId, fileName, sizeof(fileName));
+
+	FILE *file = fopen(fileName, "r");
+
+	if (file != NULL) {
+		data->length = fread(data->buffer, 1, e->length, file);
+		fclose(file);
+	}
+	if (data->length != e->length) {
+		deleteBuffer(data);
+		remove_entry(cache, e);
+
+		return -1;
+	}
+
+	unlink(fileName);
+	unlink_entry(&cache->spilled, e);
+	count_entry(cache, e, -1);
+	e->spillId = 0;
+	e->data = data;
+	make_room(cache, e->length);
+	push_newest(&cache->memory, e);
+	count_entry(cache, e, 1);
+
+	return 0;
+}
+
+/*
+ * Finds the entry for the request's URL whose Vary values match the
+ * request.
+ */
+static CachedResponse *find_variant(ResponseCache *cache, Request *req) {
+	size_t length = key_length(req);
+	const char *key = req->protocolLine->buffer;
+
+	for (CachedResponse *e = cache->buckets[bucket_of(key, length)];
+		e != NULL; e = e->bucketNext) {
+		if (e->keyLength != length || memcmp(e->key, key, length) != 0) {
+			continue;
+		}
+		if (e->vary == NULL) {
+			return e;
+		}
+		vary_values(req, e->vary, strlen(e->vary), cache->scratch);
+		if (strcmp(e->varyValues, cache->scratch->buffer) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Drops every stored variant of a URL. Used when an unsafe method is
+ * sent to it.
+ */
+static void invalidate(ResponseCache *cache, const char *url, size_t length) {
+	char key[2048];
+
+	if (length + 4 > sizeof(key)) {
+		return;
+	}
+	memcpy(key, "GET ", 4);
+	memcpy(key + 4, url, length);
+	length += 4;
+
+	CachedResponse *e = cache->buckets[bucket_of(key, length)];
+
+	while (e != NULL) {
+		CachedResponse *next = e->bucketNext;
+
+		if (e->keyLength == length && memcmp(e->key, key, length) == 0) {
+			remove_entry(cache, e);
+		}
+		e = next;
+	}
+}
+
+static int is_unsafe(const char *method) {
+	return strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0 &&
+		strcmp(method, "OPTIONS") != 0 && strcmp(method, "TRACE") != 0;
+}
+
+//Hop by hop headers and those that a cached copy must not change
+static int keep_header(const char *line, size_t length, int refresh) {
+	switch (headerNameLookup(line, name_length(line, length))) {
+	case HEADER_AGE:
+	case HEADER_CONNECTION:
+	case HEADER_KEEP_ALIVE:
+	case HEADER_PROXY_CONNECTION:
+		return 0;
+	case HEADER_CONTENT_LENGTH:
+	case HEADER_CONTENT_ENCODING:
+	case HEADER_CONTENT_RANGE:
+	case HEADER_TRANSFER_ENCODING:
+	case HEADER_TRAILER:
+	case HEADER_TE:
+	case HEADER_UPGRADE:
+		return !refresh;
+	}
+
+	return 1;
+}
+
+/*
+ * Writes a cached response with an Age header for the time it has spent
+ * in caches.
+ */
+static void copy_response(CachedResponse *e, long long age, Buffer *out) {
+	const char *data = e->data->buffer;
+	const char *end = data + e->headerLength;
+	const char *next;
+	char ageLine[48];
+	size_t length = line_at(data, end, &next);
+
+	out->length = 0;
+	bufferAppendBytes(out, data, length);
+	bufferAppendBytes(out, "\r\n", 2);
+	for (const char *line = next; line < end; line = next) {
+		length = line_at(line, end, &next);
+		if (length > 0 && keep_header(line, length, 0)) {
+			bufferAppendBytes(out, line, length);
+			bufferAppendBytes(out, "\r\n", 2);
+		}
+	}
+
+	int sz = snprintf(ageLine, sizeof(ageLine), "Age: %lld\r\n\r\n", age);
+
+	bufferAppendBytes(out, ageLine, sz);
+	bufferAppendBytes(out, data + e->headerLength,
+		e->length - e->headerLength);
+}
+
+static char *copy_value(const char *value, size_t length) {
+	return value != NULL ? strndup(value, length) : NULL;
+}
+
+//Sets the freshness of an entry from its stored header
+static void update_freshness(CachedResponse *e, int status,
+	time_t requestTime) {
+	ResponseInfo info;
+
+	parse_response(e->data->buffer, e->headerLength, &info);
+	e->responseTime = time(NULL);
+	e->initialAge = initial_age(&info, requestTime, e->responseTime);
+	e->lifetime = freshness_lifetime(&info, status, e->responseTime);
+	free(e->etag);
+	free(e->lastModified);
+	e->etag = copy_value(info.etag, info.etagLength);
+	e->lastModified = copy_value(info.lastModifiedValue,
+		info.lastModifiedLength);
+}
+
+/*
+ * Updates a stored response with the header fields of a 304 as in
+ * RFC 7234 section 4.3.4.
+ */
+static void refresh_entry(ResponseCache *cache, CachedResponse *e,
+	const char *header, size_t headerLength, time_t requestTime) {
+	const char *data = e->data->buffer;
+	const char *end = data + e->headerLength;
+	const char *notModifiedEnd = header + headerLength;
+	const char *next;
+	const char *other;
+	Buffer *merged = newBufferWithCapacity(e->length + headerLength);
+	size_t length = line_at(data, end, &next);
+	int status = 0;
+
+	sscanf(data, "%*s %d", &status);
+
+	bufferAppendBytes(merged, data, length);
+	bufferAppendBytes(merged, "\r\n", 2);
+	for (const char *line = next; line < end; line = next) {
+		size_t nameLength;
+		int replaced = 0;
+
+		length = line_at(line, end, &next);
+		nameLength = name_length(line, length);
+		if (length == 0) {
+			continue;
+		}
+		line_at(header, notModifiedEnd, &other);
+		while (!replaced && other < notModifiedEnd) {
+			const char *otherLine = other;
+			size_t otherLength = line_at(otherLine, notModifiedEnd, &other);
+
+			replaced = otherLength > 0 &&
+				keep_header(otherLine, otherLength, 1) &&
+				same_name(line, nameLength, otherLine,
+					name_length(otherLine, otherLength));
+		}
+		if (!replaced) {
+			bufferAppendBytes(merged, line, length);
+			bufferAppendBytes(merged, "\r\n", 2);
+		}
+	}
+	line_at(header, notModifiedEnd, &next);
+	for (const char *line = next; line < notModifiedEnd; line = next) {
+		length = line_at(line, notModifiedEnd, &next);
+		if (length > 0 && keep_header(line, length, 1)) {
+			bufferAppendBytes(merged, line, length);
+			bufferAppendBytes(merged, "\r\n", 2);
+		}
+	}
+	bufferAppendBytes(merged, "\r\n", 2);
+
+	size_t mergedHeaderLength = merged->length;
+
+	bufferAppendBytes(merged, data + e->headerLength,
+		e->length - e->headerLength);
+
+	if (!e->removed) {
+		count_entry(cache, e, -1);
+	}
+	deleteBuffer(e->data);
+	e->data = merged;
+	e->headerLength = mergedHeaderLength;
+	e->length = merged->length;
+	if (!e->removed) {
+		count_entry(cache, e, 1);
+		unlink_entry(&cache->memory, e);
+		push_newest(&cache->memory, e);
+	}
+	update_freshness(e, status, requestTime);
+}
+
+/*
+ * Stores the response that was collected for a request if RFC 7234
+ * section 3 allows it. Responses that set cookies are not shared.
+ */
+static void store_response(ProxyServer *p, ResponseCache *cache,
+	Request *req) {
+	Buffer *b = req->cacheBuffer;
+	int status = req->responseFraming.status;
+	int firstStatus = 0;
+	size_t headerLength = header_length(b->buffer, b->length);
+	ResponseInfo info;
+
+	//A 1xx response may have come first
+	if (headerLength == 0 || sscanf(b->buffer, "%*s %d", &firstStatus) != 1 ||
+		firstStatus != status) {
+		return;
+	}
+	parse_response(b->buffer, headerLength, &info);
+
+	CacheControl *cc = &info.cc;
+	int explicitLifetime = cc->maxAge >= 0 || cc->sMaxAge >= 0 ||
+		info.hasExpires;
+
+	if (cc->noStore || cc->isPrivate || info.setCookie) {
+		return;
+	}
+	if (!heuristic_status(status) && !(explicitLifetime &&
+		(status == 302 || status == 307))) {
+		return;
+	}
+	if (info.vary != NULL && memchr(info.vary, '*', info.varyLength) != NULL) {
+		return;
+	}
+	if (requestGetHeader(req, HEADER_AUTHORIZATION) != NULL &&
+		!cc->isPublic && !cc->mustRevalidate && cc->sMaxAge < 0) {
+		return;
+	}
+
+	time_t now = time(NULL);
+
+	if (freshness_lifetime(&info, status, now) <= 0 && info.etag == NULL &&
+		info.lastModifiedValue == NULL) {
+		//Would never be used
+		return;
+	}
+
+	CachedResponse *e = calloc(1, sizeof(CachedResponse));
+
+	e->keyLength = key_length(req);
+	e->key = strndup(req->protocolLine->buffer, e->keyLength);
+	e->data = newBufferWithCapacity(b->length);
+	bufferAppendBytes(e->data, b->buffer, b->length);
+	e->headerLength = headerLength;
+	e->length = b->length;
+	update_freshness(e, status, req->requestStartTime.tv_sec);
+
+	pthread_mutex_lock(&cache->lock);
+	if (info.vary != NULL) {
+		e->vary = strndup(info.vary, info.varyLength);
+		vary_values(req, e->vary, info.varyLength, cache->scratch);
+		e->varyValues = strdup(cache->scratch->buffer);
+	}
+
+	CachedResponse *old = find_variant(cache, req);
+
+	if (old != NULL) {
+		remove_entry(cache, old);
+	}
+	make_room(cache, e->length);
+
+	size_t bucket = bucket_of(e->key, e->keyLength);
+
+	e->bucketNext = cache->buckets[bucket];
+	cache->buckets[bucket] = e;
+	push_newest(&cache->memory, e);
+	count_entry(cache, e, 1);
+	++cache->stats.stored;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static int has_body(Request *req) {
+	String *length = requestGetHeader(req, HEADER_CONTENT_LENGTH);
+
+	return requestGetHeader(req, HEADER_TRANSFER_ENCODING) != NULL ||
+		(length != NULL && strtoull(stringAsCString(length), NULL, 10) > 0);
+}
+
+/*
+ * Looks up a request once its header is parsed. On a fresh hit the
+ * response is placed in the response buffer and 1 is returned. A stale
+ * entry that can be revalidated is held by the request. Unsafe methods
+ * drop what is stored for their URL. When canServe is 0 the request is
+ * not looked up but still invalidates.
+ */
+int responseCacheLookup(ProxyServer *p, Request *req, int canServe) {
+	ResponseCache *cache = p->responseCache;
+	const char *method = stringAsCString(req->method);
+
+	if (is_unsafe(method)) {
+		size_t length = key_length(req);
+
+		pthread_mutex_lock(&cache->lock);
+		invalidate(cache, req->protocolLine->buffer + req->method->length + 1,
+			length - req->method->length - 1);
+		pthread_mutex_unlock(&cache->lock);
+
+		return 0;
+	}
+	if (!canServe || strcmp(method, "GET") != 0 || has_body(req) ||
+		requestGetHeader(req, HEADER_RANGE) != NULL) {
+		return 0;
+	}
+
+	CacheControl cc;
+	String *value = requestGetHeader(req, HEADER_CACHE_CONTROL);
+
+	reset_cache_control(&cc);
+	if (value != NULL) {
+		parse_cache_control(&cc, value->buffer, value->length);
+	} else if ((value = requestGetHeader(req, HEADER_PRAGMA)) != NULL) {
+		parse_cache_control(&cc, value->buffer, value->length);
+	}
+	if (cc.noStore) {
+		return 0;
+	}
+
+	int conditional = requestGetHeader(req, HEADER_IF_NONE_MATCH) != NULL ||
+		requestGetHeader(req, HEADER_IF_MODIFIED_SINCE) != NULL;
+
+	req->cacheStatus = CACHE_MISS;
+	req->cacheStore = 1;
+
+	pthread_mutex_lock(&cache->lock);
+
+	CachedResponse *e = find_variant(cache, req);
+
+	if (e != NULL && e->data == NULL && load_entry(cache, e) < 0) {
+		e = NULL;
+	}
+	if (e != NULL) {
+		time_t now = time(NULL);
+		long long age = current_age(e, now);
+
+		if (!cc.noCache && age < e->lifetime &&
+			(cc.maxAge < 0 || age <= cc.maxAge) &&
+			(cc.minFresh < 0 || e->lifetime - age >= cc.minFresh)) {
+			copy_response(e, age, req->responseBuffer);
+			unlink_entry(&cache->memory, e);
+			push_newest(&cache->memory, e);
+			++cache->stats.hits;
+			pthread_mutex_unlock(&cache->lock);
+
+			req->cacheStatus = CACHE_HIT;
+			req->cacheStore = 0;
+			metricsAdd(p, METRIC_CACHE_HITS, 1);
+
+			return 1;
+		}
+		//The client's own conditions are passed on as they are
+		if (!conditional && (e->etag != NULL || e->lastModified != NULL)) {
+			++e->refs;
+			req->cacheEntry = e;
+		}
+	}
+	++cache->stats.misses;
+	pthread_mutex_unlock(&cache->lock);
+	metricsAdd(p, METRIC_CACHE_MISSES, 1);
+
+	return 0;
+}
+
+/*
+ * Adds the conditional headers for the entry being revalidated.
+ */
+void responseCacheAddValidators(Request *req, Buffer *out) {
+	CachedResponse *e = req->cacheEntry;
+
+	if (e->etag != NULL) {
+		bufferAppendBytes(out, "If-None-Match: ", 15);
+		bufferAppendBytes(out, e->etag, strlen(e->etag));
+		bufferAppendBytes(out, "\r\n", 2);
+	}
+	if (e->lastModified != NULL) {
+		bufferAppendBytes(out, "If-Modified-Since: ", 19);
+		bufferAppendBytes(out, e->lastModified, strlen(e->lastModified));
+		bufferAppendBytes(out, "\r\n", 2);
+	}
+}
+
+/*
+ * Follows the response data read from the server into the response
+ * buffer. The response is collected so that it can be stored once
+ * complete. While an entry is being revalidated the data is held back
+ * until the header is complete. Then a 304 is replaced by the refreshed
+ * entry and anything else by the data held so far.
+ *
+ * Returns 1 if the response buffer must not be sent to the client yet.
+ */
+int responseCacheOnResponse(ProxyServer *p, Request *req, int headerDone,
+	int complete) {
+	ResponseCache *cache = p->responseCache;
+	Buffer *data = req->responseBuffer;
+
+	if (req->cacheEntry == NULL && !req->cacheStore) {
+		return 0;
+	}
+	if (req->cacheBuffer == NULL) {
+		req->cacheBuffer = newBufferWithCapacity(data->length + 1024);
+	}
+	bufferAppendBytes(req->cacheBuffer, data->buffer, data->length);
+
+	if (req->cacheEntry != NULL) {
+		if (!headerDone) {
+			return 1;
+		}
+
+		CachedResponse *e = req->cacheEntry;
+
+		pthread_mutex_lock(&cache->lock);
+		req->cacheEntry = NULL;
+		if (req->responseFraming.status == 304) {
+			refresh_entry(cache, e, req->cacheBuffer->buffer,
+				header_length(req->cacheBuffer->buffer,
+					req->cacheBuffer->length),
+				req->requestStartTime.tv_sec);
+			copy_response(e, current_age(e, time(NULL)), data);
+			++cache->stats.revalidated;
+		}
+		release_entry(cache, e);
+		pthread_mutex_unlock(&cache->lock);
+
+		if (req->responseFraming.status == 304) {
+			req->cacheStatus = CACHE_REVALIDATED;
+			req->cacheStore = 0;
+			req->cacheBuffer->length = 0;
+			metricsAdd(p, METRIC_CACHE_REVALIDATED, 1);
+
+			return 0;
+		}
+		//The entry is out of date. The new response goes out as a miss.
+		data->length = 0;
+		bufferAppendBytes(data, req->cacheBuffer->buffer,
+			req->cacheBuffer->length);
+	}
+
+	if (req->cacheStore &&
+		req->cacheBuffer->length > cache->memorySize / MAX_OBJECT_SHARE) {
+		req->cacheStore = 0;
+	}
+	if (req->cacheStore && complete) {
+		store_response(p, cache, req);
+		req->cacheStore = 0;
+	}
+	if (!req->cacheStore) {
+		req->cacheBuffer->length = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Lets go of any entry held by a request that ended early and of data
+ * collected for a response that never completed.
+ */
+void responseCacheEndRequest(ProxyServer *p, Request *req) {
+	ResponseCache *cache = p->responseCache;
+
+	if (req->cacheEntry != NULL) {
+		pthread_mutex_lock(&cache->lock);
+		release_entry(cache, req->cacheEntry);
+		pthread_mutex_unlock(&cache->lock);
+		req->cacheEntry = NULL;
+	}
+	req->cacheStore = 0;
+	if (req->cacheBuffer != NULL) {
+		//Don't hold on to a large response
+		if (req->cacheBuffer->capacity > 64 * 1024) {
+			deleteBuffer(req->cacheBuffer);
+			req->cacheBuffer = NULL;
+		} else {
+			req->cacheBuffer->length = 0;
+		}
+	}
+}
+
+//Removes spill files left behind by a proxy that did not shut down
+static void clean_folder(const char *folder) {
+	DIR *dir = opendir(folder);
+	struct dirent *entry;
+
+	if (dir == NULL) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		char fileName[1024];
+
+		if (length > 6 && strcmp(entry->d_name + length - 6, ".cache") == 0) {
+			snprintf(fileName, sizeof(fileName), "%s/%s", folder,
+				entry->d_name);
+			unlink(fileName);
+		}
+	}
+	closedir(dir);
+}
+
+struct _ResponseCache *newResponseCache(ProxyServer *p) {
+	ResponseCache *cache = calloc(1, sizeof(ResponseCache));
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->memorySize = p->responseCacheSize > 0 ?
+		p->responseCacheSize : DEFAULT_RESPONSE_CACHE_SIZE;
+	cache->spillSize = p->responseCacheSpillSize;
+	cache->scratch = newBufferWithCapacity(256);
+
+	if (cache->spillSize > 0) {
+		snprintf(cache->folder, sizeof(cache->folder), "%s/%s",
+			stringAsCString(p->persistenceFolder), RESPONSE_CACHE_FOLDER);
+		if (mkdir(cache->folder, 0700) < 0 && errno != EEXIST) {
+			cache->folder[0] = '\0';
+			if (p->onError != NULL) {
+				p->onError("Failed to create response cache folder.");
+			}
+		} else {
+			clean_folder(cache->folder);
+		}
+	}
+
+	return cache;
+}
+
+void deleteResponseCache(ResponseCache *cache) {
+	for (int i = 0; i < CACHE_BUCKETS; ++i) {
+		while (cache->buckets[i] != NULL) {
+			remove_entry(cache, cache->buckets[i]);
+		}
+	}
+	if (cache->folder[0] != '\0') {
+		rmdir(cache->folder);
+	}
+	deleteBuffer(cache->scratch);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+int proxyServerGetResponseCacheStats(ProxyServer *p,
+	ResponseCacheStats *stats) {
+	ResponseCache *cache = p->responseCache;
+
+	if (cache == NULL) {
+		memset(stats, 0, sizeof(ResponseCacheStats));
+
+		return -1;
+	}
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Shared HTTP cache for GET responses following RFC 7234. Responses are
+ * kept in memory keyed by method and URL, with one entry per set of
+ * request header values named by the response's Vary header. Fresh
+ * entries are served without contacting the server. A stale entry with
+ * an ETag or Last-Modified is revalidated with a conditional request and
+ * a 304 refreshes its headers before it is served.
+ *
+ * When a spill size is set entries pushed out of memory are written to
+ * RESPONSE_CACHE_FOLDER in the persistence folder and read back when used.
+ * Spilled entries do not outlive the proxy.
+ *
+ * The cache is used from the event loop. Stats may be read from any thread.
+ */
+#define DEFAULT_RESPONSE_CACHE_SIZE (64 * 1024 * 1024)
+#define RESPONSE_CACHE_FOLDER "response-cache"
+
+typedef struct _ResponseCacheStats {
+	unsigned long hits;
+	unsigned long revalidated;
+	unsigned long misses;
+	unsigned long stored;
+	unsigned long entries; //In memory
+	unsigned long long bytes;
+	unsigned long spilledEntries;
+	unsigned long long spilledBytes;
+} ResponseCacheStats;
+
+struct _ResponseCache *newResponseCache(ProxyServer *p);
+void deleteResponseCache(struct _ResponseCache *cache);
+int proxyServerGetResponseCacheStats(ProxyServer *p, ResponseCacheStats *stats);
+const char *cacheStatusName(int status);
+
+int responseCacheLookup(ProxyServer *p, Request *req, int canServe);
+void responseCacheAddValidators(Request *req, Buffer *out);
+int responseCacheOnResponse(ProxyServer *p, Request *req, int headerDone,
+	int complete);
+void responseCacheEndRequest(ProxyServer *p, Request *req);
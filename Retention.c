@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "Proxy.h"
+#include "Persistence.h"
+#include "HistoryFeed.h"
+#include "Index.h"
+#include "MetaStore.h"
+#include "Retention.h"
+
+#define DIE(p, value, msg) if (value < 0) {if (p->onError != NULL) {p->onError(msg);} return value;}
+
+#define DEFAULT_INTERVAL 60
+//Wake up the compactor early after this many new records
+#define NOTIFY_EVERY 1024
+//Pause briefly after this many deletes so that we don't hog the disk
+#define DELETE_BATCH 256
+
+typedef struct _Compactor {
+	pthread_t threadId;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeUp;
+	int stopRequested;
+	unsigned long newRecords;
+	RetentionStats lastStats;
+} Compactor;
+
+typedef struct _StoredRecord {
+	char uniqueId[64];
+	long startSeconds;
+	long startMicroseconds;
+	off_t bytes;
+	int hasMeta;
+	int isComplete; //Meta data has been written
+} StoredRecord;
+
+static int compare_records(const void *a, const void *b) {
+	const StoredRecord *r1 = a, *r2 = b;
+
+	if (r1->startSeconds != r2->startSeconds) {
+		return r1->startSeconds < r2->startSeconds ? -1 : 1;
+	}
+	if (r1->startMicroseconds != r2->startMicroseconds) {
+		return r1->startMicroseconds < r2->startMicroseconds ? -1 : 1;
+	}
+
+	return strcmp(r1->uniqueId, r2->uniqueId);
+}
+
+static int is_capture_file(const char *name, size_t *idLength) {
+	const char *dot = strrchr(name, '.');
+
+	if (dot == NULL || dot == name) {
+		return 0;
+	}
+	if (strcmp(dot, ".meta") != 0 && strcmp(dot, ".req") != 0 &&
+		strcmp(dot, ".res") != 0) {
+		return 0;
+	}
+
+	*idLength = dot - name;
+
+	return *idLength < sizeof(((StoredRecord*) 0)->uniqueId);
+}
+
+/*
+ * Lists all records in the folder sorted oldest first. The start time
+ * is taken from the unique ID so no file needs to be opened. The size of
+ * the other files in the folder, like the index, is added to otherBytes.
+ */
+static StoredRecord *list_records(int dirFd, size_t *count,
+	long long *otherBytes) {
+	int fd = dup(dirFd);
+	DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+
+	if (dir == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		return NULL;
+	}
+
+	size_t capacity = 256, length = 0;
+	StoredRecord *records = malloc(capacity * sizeof(StoredRecord));
+	struct dirent *ent;
+	struct stat stat_buf;
+
+	while ((ent = readdir(dir)) != NULL) {
+		size_t idLength;
+
+		if (fstatat(dirFd, ent->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW) < 0 ||
+			!S_ISREG(stat_buf.st_mode)) {
+			continue;
+		}
+		if (!is_capture_file(ent->d_name, &idLength)) {
+			*otherBytes += stat_buf.st_size;
+			continue;
+		}
+
+		//Files of a record are usually listed next to each other
+		StoredRecord *rec = NULL;
+
+		for (size_t i = length; i > 0 && i + 8 > length; --i) {
+			if (strncmp(records[i - 1].uniqueId, ent->d_name, idLength) == 0 &&
+				records[i - 1].uniqueId[idLength] == '\0') {
+				rec = records + i - 1;
+				break;
+			}
+		}
+		if (rec == NULL) {
+			if (length == capacity) {
+				capacity *= 2;
+				records = realloc(records, capacity * sizeof(StoredRecord));
+			}
+			rec = records + length++;
+			memset(rec, 0, sizeof(StoredRecord));
+			memcpy(rec->uniqueId, ent->d_name, idLength);
+			sscanf(rec->uniqueId, "%ld-%ld",
+				&rec->startSeconds, &rec->startMicroseconds);
+		}
+
+		rec->bytes += stat_buf.st_size;
+		if (strcmp(ent->d_name + idLength, ".meta") == 0) {
+			rec->hasMeta = 1;
+			rec->isComplete = stat_buf.st_size > 0;
+		}
+	}
+	closedir(dir);
+
+	//The look back above is only a shortcut. Merge any split records.
+	qsort(records, length, sizeof(StoredRecord), compare_records);
+
+	size_t merged = 0;
+
+	for (size_t i = 0; i < length; ++i) {
+		if (merged > 0 &&
+			strcmp(records[merged - 1].uniqueId, records[i].uniqueId) == 0) {
+			records[merged - 1].bytes += records[i].bytes;
+			records[merged - 1].hasMeta |= records[i].hasMeta;
+			records[merged - 1].isComplete |= records[i].isComplete;
+			continue;
+		}
+		records[merged++] = records[i];
+	}
+	*count = merged;
+
+	return records;
+}
+
+static void unlink_record(int dirFd, const char *uniqueId) {
+	const char *ext[] = {".meta", ".res", ".req"};
+	char file_name[128];
+
+	//Meta goes first so that a reader never sees a half deleted record
+	for (int i = 0; i < 3; ++i) {
+		snprintf(file_name, sizeof(file_name), "%s%s", uniqueId, ext[i]);
+		unlinkat(dirFd, file_name, 0);
+	}
+}
+
+static double elapsed_since(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/*
+ * Removes the oldest records until the folder is within the limits of
+ * the retention policy. Records still being written are never removed
+ * unless they are past the age limit, which also takes care of files left
+ * behind by a crash.
+ */
+int proxyServerEnforceRetention(ProxyServer *p, RetentionStats *stats) {
+	RetentionPolicy *policy = &p->retention;
+	RetentionStats result;
+	struct timeval start;
+
+	memset(&result, 0, sizeof(result));
+	gettimeofday(&start, NULL);
+
+	int dirFd = open(stringAsCString(p->persistenceFolder), O_RDONLY | O_DIRECTORY);
+	DIE(p, dirFd, "Failed to open persistence directory.");
+
+	size_t count = 0;
+	long long totalBytes = 0;
+	StoredRecord *records = list_records(dirFd, &count, &totalBytes);
+
+	if (records == NULL) {
+		close(dirFd);
+		DIE(p, -1, "Failed to get listing of persistence directory.");
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		totalBytes += records[i].bytes;
+	}
+
+	long remaining = count;
+	long cutoff = policy->maxAgeSeconds > 0 ?
+		start.tv_sec - policy->maxAgeSeconds : 0;
+
+	result.recordsScanned = count;
+	for (size_t i = 0; i < count; ++i) {
+		StoredRecord *rec = records + i;
+		int expired = rec->startSeconds < cutoff;
+		int overLimit =
+			(policy->maxBytes > 0 && totalBytes > policy->maxBytes) ||
+			(policy->maxRecords > 0 && remaining > policy->maxRecords);
+
+		if (!expired && !overLimit) {
+			//Everything after this is newer
+			break;
+		}
+		if (!expired && !rec->isComplete) {
+			continue;
+		}
+
+		unlink_record(dirFd, rec->uniqueId);
+		indexRecordRemoved(p, rec->uniqueId);
+		metaStoreRecordRemoved(p, rec->uniqueId);
+		if (p->onRecordRemoved != NULL) {
+			p->onRecordRemoved(p, rec->uniqueId);
+		}
+
+		totalBytes -= rec->bytes;
+		--remaining;
+		++result.recordsRemoved;
+		result.bytesRemoved += rec->bytes;
+
+		if (result.recordsRemoved % DELETE_BATCH == 0) {
+			usleep(1000);
+		}
+	}
+
+	result.bytesRetained = totalBytes;
+	result.elapsedSeconds = elapsed_since(&start);
+
+	free(records);
+	close(dirFd);
+
+	if (stats != NULL) {
+		*stats = result;
+	}
+
+	return 0;
+}
+
+static int has_limits(RetentionPolicy *policy) {
+	return policy->maxAgeSeconds > 0 || policy->maxBytes > 0 ||
+		policy->maxRecords > 0;
+}
+
+static void *compactor_loop(void *data) {
+	ProxyServer *p = data;
+	Compactor *c = p->compactor;
+	int interval = p->retention.intervalSeconds > 0 ?
+		p->retention.intervalSeconds : DEFAULT_INTERVAL;
+
+	pthread_mutex_lock(&c->lock);
+	while (c->stopRequested == 0) {
+		pthread_mutex_unlock(&c->lock);
+
+		RetentionStats stats;
+
+		if (proxyServerEnforceRetention(p, &stats) == 0) {
+			pthread_mutex_lock(&c->lock);
+			c->lastStats = stats;
+			pthread_mutex_unlock(&c->lock);
+		}
+
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += interval;
+
+		pthread_mutex_lock(&c->lock);
+		if (c->stopRequested == 0) {
+			pthread_cond_timedwait(&c->wakeUp, &c->lock, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/*
+ * Starts the background compactor if the retention policy has any limit.
+ */
+int compactorStart(ProxyServer *p) {
+	if (p->compactor != NULL || !has_limits(&p->retention)) {
+		return 0;
+	}
+
+	Compactor *c = calloc(1, sizeof(Compactor));
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->wakeUp, NULL);
+	p->compactor = c;
+
+	int status = pthread_create(&c->threadId, NULL, compactor_loop, p);
+
+	if (status != 0) {
+		p->compactor = NULL;
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->wakeUp);
+		free(c);
+		DIE(p, -1, "Failed to create compactor thread.");
+	}
+
+	return 0;
+}
+
+void compactorStop(ProxyServer *p) {
+	Compactor *c = p->compactor;
+
+	if (c == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	c->stopRequested = 1;
+	pthread_cond_signal(&c->wakeUp);
+	pthread_mutex_unlock(&c->lock);
+
+	pthread_join(c->threadId, NULL);
+
+	p->compactor = NULL;
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->wakeUp);
+	free(c);
+}
+
+/*
+ * Called by the proxy thread for every finished record. Never blocks.
+ * A busy proxy wakes the compactor before the interval is up.
+ */
+void compactorNotify(ProxyServer *p) {
+	Compactor *c = p->compactor;
+
+	if (c == NULL) {
+		return;
+	}
+	if (__sync_add_and_fetch(&c->newRecords, 1) % NOTIFY_EVERY == 0) {
+		pthread_cond_signal(&c->wakeUp);
+	}
+}
+
+int proxyServerGetRetentionStats(ProxyServer *p, RetentionStats *stats) {
+	Compactor *c = p->compactor;
+
+	if (c == NULL) {
+		memset(stats, 0, sizeof(RetentionStats));
+
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	*stats = c->lastStats;
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
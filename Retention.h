@@ -0,0 +1,6 @@
+/*
+ * Background enforcement of the capture retention policy.
+ */
+int compactorStart(ProxyServer *p);
+void compactorStop(ProxyServer *p);
+void compactorNotify(ProxyServer *p);
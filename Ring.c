@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "Ring.h"
+
+#define FRAGMENT_MAGIC 0x52465850 //"PXFR"
+#define HEADER_AREA 4096
+//Large writes are split so that one record can't wipe out the ring
+#define MAX_FRAGMENT_PAYLOAD (64 * 1024)
+
+#define ALIGN8(n) (((n) + 7) & ~((uint64_t) 7))
+
+typedef struct _RingIndexEntry {
+	uint64_t position; //Of the RING_BEGIN fragment
+	uint64_t sequence; //0 if the slot is free
+	uint32_t hash;
+} RingIndexEntry;
+
+/*
+ * Open addressing hash table from unique ID to where the record begins.
+ * Entries that fell off the tail are dropped when the table grows.
+ */
+typedef struct _RingIndex {
+	pthread_mutex_t lock;
+	RingIndexEntry *slots;
+	size_t capacity; //Power of 2
+	size_t length;
+	uint64_t position; //Where the last walk stopped
+	uint64_t sequence;
+} RingIndex;
+
+static uint32_t fragment_checksum(RingFragment *f) {
+	uint64_t h = 14695981039346656037UL;
+	uint64_t fields[4] = {f->kind, f->length, f->sequence, f->record};
+
+	for (int i = 0; i < 4; ++i) {
+		h ^= fields[i];
+		h *= 1099511628211UL;
+	}
+
+	return (uint32_t) (h ^ (h >> 32));
+}
+
+static uint32_t payload_checksum(RingFragment *f) {
+	return (uint32_t) crc32(0, (const Bytef*) f + sizeof(RingFragment),
+		f->length);
+}
+
+static int map_ring(Ring *r, int prot) {
+	r->map = mmap(NULL, r->mapLength, prot, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+
+		return -1;
+	}
+
+	r->header = (RingHeader*) r->map;
+	r->data = r->map + HEADER_AREA;
+
+	return 0;
+}
+
+/*
+ * Returns the fragment at a position or NULL if there is no valid
+ * fragment there. The payload is only checked if asked for. The writer
+ * skips it when dropping old fragments.
+ */
+static RingFragment *fragment_at(Ring *r, uint64_t position, int checkPayload) {
+	uint64_t offset = position % r->size;
+
+	if (r->size - offset < sizeof(RingFragment)) {
+		return NULL;
+	}
+
+	RingFragment *f = (RingFragment*) (r->data + offset);
+
+	if (f->magic != FRAGMENT_MAGIC || f->checksum != fragment_checksum(f) ||
+		f->length > r->size - offset - sizeof(RingFragment)) {
+		return NULL;
+	}
+	if (checkPayload && f->payloadChecksum != payload_checksum(f)) {
+		return NULL;
+	}
+
+	return f;
+}
+
+/*
+ * Position of the fragment that follows the one at position.
+ */
+static uint64_t next_position(Ring *r, uint64_t position, RingFragment *f) {
+	uint64_t offset = position % r->size;
+
+	if (f == NULL) {
+		//Implicit padding at the end of the data area
+		return position + r->size - offset;
+	}
+
+	return position + ALIGN8(sizeof(RingFragment) + f->length);
+}
+
+/*
+ * Walks valid fragments from the tail. The walk does not trust the head
+ * stored in the header since it may be stale after a crash. It stops at
+ * the first fragment that is not valid or out of sequence.
+ */
+int ringWalk(Ring *r, void *context,
+	int (*callback)(void *context, uint64_t position, RingFragment *fragment,
+		const char *payload)) {
+	uint64_t position = r->header->tail, sequence = 0;
+
+	ringWalkFrom(r, &position, &sequence, context, callback);
+
+	return 0;
+}
+
+/*
+ * Same as ringWalk() but carries on from where an earlier walk stopped.
+ * Position and sequence are updated to the end of the walk. Pass 0 as the
+ * sequence to start at the tail. If the position was overwritten in the
+ * meantime the walk starts over at the tail and the sequence check
+ * is skipped for the first fragment.
+ */
+void ringWalkFrom(Ring *r, uint64_t *start, uint64_t *lastSequence,
+	void *context,
+	int (*callback)(void *context, uint64_t position, RingFragment *fragment,
+		const char *payload)) {
+	uint64_t position = *start;
+	uint64_t sequence = *lastSequence;
+	int first = sequence == 0;
+
+	if (first || position < r->header->tail) {
+		position = r->header->tail;
+		first = 1;
+	}
+
+	uint64_t end = r->header->tail + r->size;
+
+	while (position < end) {
+		uint64_t offset = position % r->size;
+		RingFragment *f = fragment_at(r, position, 1);
+
+		if (f == NULL) {
+			if (r->size - offset < sizeof(RingFragment)) {
+				position = next_position(r, position, NULL);
+				continue;
+			}
+			break;
+		}
+		if (!first && f->sequence != sequence + 1) {
+			break;
+		}
+		first = 0;
+		sequence = f->sequence;
+
+		if (f->kind != RING_PAD && callback != NULL) {
+			if (callback(context, position, f,
+				(const char*) f + sizeof(RingFragment)) != 0) {
+				//Not consumed
+				sequence = f->sequence - 1;
+				break;
+			}
+		}
+
+		position = next_position(r, position, f);
+	}
+
+	*start = position;
+	*lastSequence = sequence;
+}
+
+/*
+ * A reader copies data out of the ring and then calls this to make sure
+ * the writer did not overwrite it in the meantime.
+ */
+int ringIsValid(Ring *r, uint64_t position) {
+	__sync_synchronize();
+
+	return position >= r->header->tail;
+}
+
+static RingIndex *new_index() {
+	RingIndex *ix = calloc(1, sizeof(RingIndex));
+
+	pthread_mutex_init(&ix->lock, NULL);
+
+	return ix;
+}
+
+static void delete_index(RingIndex *ix) {
+	pthread_mutex_destroy(&ix->lock);
+	free(ix->slots);
+	free(ix);
+}
+
+static uint32_t hash_id(const char *id, size_t length) {
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < length; ++i) {
+		h ^= (unsigned char) id[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static void index_put(RingIndex *ix, RingIndexEntry *e) {
+	size_t mask = ix->capacity - 1;
+	size_t slot = e->hash & mask;
+
+	while (ix->slots[slot].sequence != 0) {
+		slot = (slot + 1) & mask;
+	}
+	ix->slots[slot] = *e;
+	++ix->length;
+}
+
+/*
+ * Makes room for one more entry. Records that fell off the tail are
+ * dropped on the way, so the table stays about as big as the number of
+ * records in the ring.
+ */
+static void grow_index(RingIndex *ix, uint64_t tail) {
+	RingIndexEntry *old = ix->slots;
+	size_t oldCapacity = ix->capacity;
+	size_t live = 0;
+
+	for (size_t i = 0; i < oldCapacity; ++i) {
+		if (old[i].sequence != 0 && old[i].position >= tail) {
+			++live;
+		}
+	}
+
+	//Keep load factor at or below 50%
+	ix->capacity = 256;
+	while (ix->capacity < 4 * (live + 1)) {
+		ix->capacity <<= 1;
+	}
+	ix->slots = calloc(ix->capacity, sizeof(RingIndexEntry));
+	ix->length = 0;
+
+	for (size_t i = 0; i < oldCapacity; ++i) {
+		if (old[i].sequence != 0 && old[i].position >= tail) {
+			index_put(ix, old + i);
+		}
+	}
+	free(old);
+}
+
+static int index_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	Ring *r = context;
+	RingIndex *ix = r->index;
+
+	if (f->kind == RING_BEGIN) {
+		RingIndexEntry e;
+
+		e.position = position;
+		e.sequence = f->sequence;
+		e.hash = hash_id(payload, f->length);
+		if (2 * (ix->length + 1) > ix->capacity) {
+			grow_index(ix, r->header->tail);
+		}
+		index_put(ix, &e);
+	}
+
+	return 0;
+}
+
+/*
+ * Finds where a record begins. The index is first brought up to date
+ * with the fragments written since the last lookup. Returns -1 if the
+ * record is not in the ring. Walking on from the position with the
+ * sequence before the one returned visits the record's fragments.
+ */
+int ringFindRecord(Ring *r, const char *uniqueId, size_t length,
+	uint64_t *position, uint64_t *sequence) {
+	RingIndex *ix = r->index;
+	uint32_t hash = hash_id(uniqueId, length);
+	int status = -1;
+
+	pthread_mutex_lock(&ix->lock);
+
+	if (ix->sequence != 0 && !ringIsValid(r, ix->position)) {
+		//Fell behind by a whole ring. Start over.
+		memset(ix->slots, 0, ix->capacity * sizeof(RingIndexEntry));
+		ix->length = 0;
+		ix->sequence = 0;
+	}
+	ringWalkFrom(r, &ix->position, &ix->sequence, r, index_callback);
+
+	size_t mask = ix->capacity - 1;
+
+	for (size_t slot = hash & mask; ix->capacity > 0 &&
+		ix->slots[slot].sequence != 0; slot = (slot + 1) & mask) {
+		RingIndexEntry *e = ix->slots + slot;
+
+		if (e->hash != hash || !ringIsValid(r, e->position)) {
+			continue;
+		}
+
+		RingFragment *f = fragment_at(r, e->position, 0);
+
+		if (f != NULL && f->kind == RING_BEGIN && f->sequence == e->sequence &&
+			f->length == length &&
+			memcmp((const char*) f + sizeof(RingFragment), uniqueId,
+				length) == 0) {
+			*position = e->position;
+			*sequence = e->sequence;
+			status = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&ix->lock);
+
+	return status;
+}
+
+typedef struct _RecoverState {
+	uint64_t end;
+	uint64_t lastSequence;
+	uint64_t lastRecord;
+} RecoverState;
+
+static int recover_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	RecoverState *state = context;
+
+	state->end = position + ALIGN8(sizeof(RingFragment) + f->length);
+	state->lastSequence = f->sequence;
+	if (f->record > state->lastRecord) {
+		state->lastRecord = f->record;
+	}
+
+	return 0;
+}
+
+/*
+ * Finds where the writer left off. Anything after the last valid
+ * fragment is discarded.
+ */
+static void recover(Ring *r) {
+	RecoverState state;
+
+	state.end = r->header->tail;
+	state.lastSequence = 0;
+	state.lastRecord = 0;
+
+	ringWalk(r, &state, recover_callback);
+
+	r->header->head = state.end;
+	if (state.lastSequence >= r->header->nextSequence) {
+		r->header->nextSequence = state.lastSequence + 1;
+	}
+	if (state.lastRecord >= r->header->nextRecord) {
+		r->header->nextRecord = state.lastRecord + 1;
+	}
+}
+
+/*
+ * Opens the ring for writing. The file is created and preallocated if
+ * needed. An existing ring of a different size is started afresh.
+ */
+Ring *newRing(const char *fileName, uint64_t size) {
+	Ring *r = calloc(1, sizeof(Ring));
+	struct stat stat_buf;
+
+	r->index = new_index();
+	size = ALIGN8(size);
+	r->size = size;
+	r->writable = 1;
+	r->mapLength = HEADER_AREA + size;
+	r->fd = open(fileName, O_RDWR | O_CREAT, 0600);
+
+	if (r->fd < 0 || fstat(r->fd, &stat_buf) < 0) {
+		deleteRing(r);
+
+		return NULL;
+	}
+
+	int fresh = stat_buf.st_size != (off_t) r->mapLength;
+
+	if (fresh) {
+		if (ftruncate(r->fd, 0) < 0 ||
+			posix_fallocate(r->fd, 0, r->mapLength) != 0) {
+			deleteRing(r);
+
+			return NULL;
+		}
+	}
+
+	if (map_ring(r, PROT_READ | PROT_WRITE) < 0) {
+		deleteRing(r);
+
+		return NULL;
+	}
+
+	if (fresh || memcmp(r->header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 ||
+		r->header->size != size) {
+		memset(r->header, 0, sizeof(RingHeader));
+		r->header->size = size;
+		r->header->nextSequence = 1;
+		r->header->nextRecord = 1;
+		memcpy(r->header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+	} else {
+		recover(r);
+	}
+
+	return r;
+}
+
+/*
+ * Opens an existing ring for reading.
+ */
+Ring *openRing(const char *fileName) {
+	Ring *r = calloc(1, sizeof(Ring));
+	struct stat stat_buf;
+
+	r->index = new_index();
+	r->fd = open(fileName, O_RDONLY);
+	if (r->fd < 0 || fstat(r->fd, &stat_buf) < 0 ||
+		stat_buf.st_size <= HEADER_AREA) {
+		deleteRing(r);
+
+		return NULL;
+	}
+
+	r->mapLength = stat_buf.st_size;
+	if (map_ring(r, PROT_READ) < 0 ||
+		memcmp(r->header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 ||
+		r->header->size != r->mapLength - HEADER_AREA) {
+		deleteRing(r);
+
+		return NULL;
+	}
+	r->size = r->header->size;
+
+	return r;
+}
+
+void deleteRing(Ring *r) {
+	if (r->map != NULL) {
+		munmap(r->map, r->mapLength);
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
+	delete_index(r->index);
+
+	free(r);
+}
+
+/*
+ * Drops the oldest fragments until there is room for need bytes
+ * at the head.
+ */
+static void make_room(Ring *r, uint64_t need) {
+	RingHeader *h = r->header;
+
+	while (h->tail < h->head && h->tail + r->size < h->head + need) {
+		RingFragment *f = fragment_at(r, h->tail, 0);
+		uint64_t offset = h->tail % r->size;
+
+		if (f == NULL && r->size - offset >= sizeof(RingFragment)) {
+			//Should not happen. Forget everything.
+			h->tail = h->head;
+			break;
+		}
+		h->tail = next_position(r, h->tail, f);
+	}
+	if (h->tail > h->head) {
+		h->tail = h->head;
+	}
+}
+
+static void write_fragment(Ring *r, int kind, uint64_t record,
+	const char *data, size_t length) {
+	RingHeader *h = r->header;
+	uint64_t need = ALIGN8(sizeof(RingFragment) + length);
+	uint64_t offset = h->head % r->size;
+
+	if (r->size - offset < need) {
+		//Doesn't fit before the end. Pad out and start over at 0.
+		uint64_t remaining = r->size - offset;
+
+		if (remaining >= sizeof(RingFragment)) {
+			write_fragment(r, RING_PAD, 0, NULL,
+				remaining - sizeof(RingFragment));
+		} else {
+			make_room(r, remaining);
+			h->head += remaining;
+		}
+		offset = 0;
+	}
+
+	make_room(r, need);
+	//Readers must see the new tail before we overwrite anything
+	__sync_synchronize();
+
+	RingFragment *f = (RingFragment*) (r->data + offset);
+
+	f->magic = 0;
+	if (data != NULL) {
+		memcpy((char*) f + sizeof(RingFragment), data, length);
+	}
+	f->kind = kind;
+	f->reserved = 0;
+	f->length = length;
+	f->sequence = h->nextSequence++;
+	f->record = record;
+	f->checksum = fragment_checksum(f);
+	f->payloadChecksum = payload_checksum(f);
+	__sync_synchronize();
+	f->magic = FRAGMENT_MAGIC;
+
+	h->head += need;
+}
+
+/*
+ * Starts a new record and returns its number.
+ */
+uint64_t ringBeginRecord(Ring *r, const char *uniqueId, size_t length) {
+	uint64_t record = r->header->nextRecord++;
+
+	write_fragment(r, RING_BEGIN, record, uniqueId, length);
+
+	return record;
+}
+
+void ringAppend(Ring *r, int kind, uint64_t record, const char *data, size_t length) {
+	//Keep a fragment well within the ring
+	size_t maxPayload = r->size / 4 - sizeof(RingFragment);
+
+	if (maxPayload > MAX_FRAGMENT_PAYLOAD) {
+		maxPayload = MAX_FRAGMENT_PAYLOAD;
+	}
+
+	while (length > 0) {
+		size_t sz = length < maxPayload ? length : maxPayload;
+
+		write_fragment(r, kind, record, data, sz);
+		data += sz;
+		length -= sz;
+	}
+}
@@ -0,0 +1,72 @@
+/*
+ * Fixed size capture file used in flight recorder mode. The file is
+ * preallocated and memory mapped. Captured data is appended as fragments
+ * and the oldest fragments are overwritten when the ring is full.
+ *
+ * Every record starts with a RING_BEGIN fragment holding the unique ID,
+ * followed by any number of request and response fragments, and ends with
+ * a RING_META fragment. A record is usable only while both its begin and
+ * meta fragments are still in the ring.
+ *
+ * Positions are monotonic byte counts. Offset in the data area is
+ * position % size. Fragments never wrap around the end of the data area.
+ *
+ * Readers find records through an index of where each record begins. The
+ * index is built by the first lookup and catches up with the fragments
+ * written since on every lookup after that.
+ */
+#define RING_MAGIC "PXRING2"
+#define RING_FILE "capture.ring"
+
+#define RING_PAD 0
+#define RING_BEGIN 1
+#define RING_REQUEST 2
+#define RING_RESPONSE 3
+#define RING_META 4
+
+typedef struct _RingHeader {
+	char magic[8];
+	uint64_t size; //Size of the data area
+	uint64_t head; //Where the next fragment goes
+	uint64_t tail; //Oldest fragment still in the ring
+	uint64_t nextSequence;
+	uint64_t nextRecord;
+} RingHeader;
+
+typedef struct _RingFragment {
+	uint32_t magic;
+	uint16_t kind;
+	uint16_t reserved;
+	uint32_t length; //Payload length
+	uint32_t checksum; //Of the fragment header fields
+	uint32_t payloadChecksum; //CRC-32 of the payload
+	uint64_t sequence;
+	uint64_t record;
+} RingFragment;
+
+typedef struct _Ring {
+	int fd;
+	int writable;
+	char *map;
+	size_t mapLength;
+	RingHeader *header;
+	char *data;
+	uint64_t size;
+	struct _RingIndex *index;
+} Ring;
+
+Ring *newRing(const char *fileName, uint64_t size);
+Ring *openRing(const char *fileName);
+void deleteRing(Ring *r);
+uint64_t ringBeginRecord(Ring *r, const char *uniqueId, size_t length);
+void ringAppend(Ring *r, int kind, uint64_t record, const char *data, size_t length);
+int ringWalk(Ring *r, void *context,
+	int (*callback)(void *context, uint64_t position, RingFragment *fragment,
+		const char *payload));
+void ringWalkFrom(Ring *r, uint64_t *position, uint64_t *sequence,
+	void *context,
+	int (*callback)(void *context, uint64_t position, RingFragment *fragment,
+		const char *payload));
+int ringIsValid(Ring *r, uint64_t position);
+int ringFindRecord(Ring *r, const char *uniqueId, size_t length,
+	uint64_t *position, uint64_t *sequence);
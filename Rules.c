@@ -0,0 +1,945 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "Proxy.h"
+#include "Regex.h"
+#include "Rules.h"
+
+#define MAX_HOST 256
+#define MAX_HEADER_NAME 128
+#define DEFAULT_BLOCK_STATUS 403
+
+typedef enum _RuleAction {
+	ACTION_NO_CAPTURE,
+	ACTION_BLOCK,
+	ACTION_SET_HEADER,
+	ACTION_REMOVE_HEADER,
+	ACTION_MAP
+} RuleAction;
+
+typedef enum _HeaderTestKind {
+	TEST_PRESENT,
+	TEST_EQUALS,
+	TEST_REGEX
+} HeaderTestKind;
+
+typedef struct _HeaderTest {
+	char *name; //Lower case
+	char *value;
+	int kind;
+} HeaderTest;
+
+typedef struct _Rule {
+	int line;
+	//Conditions. NULL or 0 if not given.
+	char *host;
+	char *pathPrefix;
+	char *pathRegex;
+	unsigned methods; //Bit per entry of method_names
+	HeaderTest *tests;
+	size_t testCount;
+	size_t firstPredicate; //Tests are predicates from here on
+	//Action
+	int action;
+	int status;
+	char *name;
+	char *value;
+	char *mapHost;
+	char *mapPort;
+} Rule;
+
+typedef struct _KeyEntry {
+	size_t scope;
+	char *key; //NULL if the slot is empty
+	size_t length;
+	unsigned hash;
+	size_t value;
+} KeyEntry;
+
+//Open addressing table of byte strings within a scope
+typedef struct _KeyTable {
+	KeyEntry *entries;
+	size_t count;
+	size_t size;
+} KeyTable;
+
+typedef struct _TrieNode {
+	uint64_t *here; //Rules for exactly this name or prefix. May be NULL.
+	uint64_t *below; //Rules for names below this one. May be NULL.
+} TrieNode;
+
+//Edges are keyed by the parent node and a host label or path byte
+typedef struct _Trie {
+	TrieNode *nodes; //0 is the root
+	size_t nodeCount;
+	KeyTable edges;
+} Trie;
+
+typedef struct _HeaderGroup {
+	uint64_t *present; //Predicates that hold when the header is there
+	struct _RegexSet *regex; //Ids are predicates. NULL if none.
+} HeaderGroup;
+
+struct _RuleSet {
+	Rule *rules;
+	size_t count;
+	size_t words; //In a bitmap of rules
+	size_t predicateCount; //All header tests
+	size_t predicateWords;
+	uint64_t *anyHost;
+	Trie hosts; //Labels from the right
+	uint64_t *anyPath;
+	Trie paths;
+	struct _RegexSet *pathRegex;
+	uint64_t **methodRules; //Per entry of method_names
+	HeaderGroup *groups;
+	size_t groupCount;
+	KeyTable groupNames;
+	KeyTable groupValues; //Scope is the group
+	uint64_t **valuePredicates;
+	size_t valueCount;
+	//Scratch bitmaps for matching
+	uint64_t *candidates;
+	uint64_t *scratch;
+	uint64_t *satisfied;
+};
+
+//Anything else is matched by rules without a method condition only
+static const char *method_names[] = {
+	"GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT",
+	"TRACE", NULL
+};
+#define METHOD_CONNECT 7
+#define METHOD_COUNT 10
+
+static unsigned hash_key(size_t scope, const char *key, size_t length) {
+	unsigned hash = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(scope); ++i) {
+		hash = (hash ^ ((scope >> (i * 8)) & 0xff)) * 16777619u;
+	}
+	for (size_t i = 0; i < length; ++i) {
+		hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static long key_find(KeyTable *t, size_t scope, const char *key,
+	size_t length) {
+	if (t->size == 0) {
+		return -1;
+	}
+
+	unsigned hash = hash_key(scope, key, length);
+	size_t mask = t->size - 1;
+
+	for (size_t i = hash & mask; t->entries[i].key != NULL;
+		i = (i + 1) & mask) {
+		KeyEntry *e = t->entries + i;
+
+		if (e->hash == hash && e->scope == scope && e->length == length &&
+			memcmp(e->key, key, length) == 0) {
+			return (long) e->value;
+		}
+	}
+
+	return -1;
+}
+
+static void key_place(KeyTable *t, KeyEntry *entry) {
+	size_t mask = t->size - 1;
+	size_t i = entry->hash & mask;
+
+	while (t->entries[i].key != NULL) {
+		i = (i + 1) & mask;
+	}
+	t->entries[i] = *entry;
+}
+
+//The key must not be in the table yet
+static void key_add(KeyTable *t, size_t scope, const char *key,
+	size_t length, size_t value) {
+	//Keep the table at most half full
+	if ((t->count + 1) * 2 > t->size) {
+		KeyEntry *old = t->entries;
+		size_t oldSize = t->size;
+
+		t->size = t->size == 0 ? 64 : t->size * 2;
+		t->entries = calloc(t->size, sizeof(KeyEntry));
+		for (size_t i = 0; i < oldSize; ++i) {
+			if (old[i].key != NULL) {
+				key_place(t, old + i);
+			}
+		}
+		free(old);
+	}
+
+	KeyEntry entry;
+
+	entry.scope = scope;
+	entry.key = malloc(length + 1);
+	memcpy(entry.key, key, length);
+	entry.key[length] = '\0';
+	entry.length = length;
+	entry.hash = hash_key(scope, key, length);
+	entry.value = value;
+	key_place(t, &entry);
+	++t->count;
+}
+
+static void key_free(KeyTable *t) {
+	for (size_t i = 0; i < t->size; ++i) {
+		free(t->entries[i].key);
+	}
+	free(t->entries);
+}
+
+static uint64_t *new_bitmap(size_t words) {
+	return calloc(words > 0 ? words : 1, sizeof(uint64_t));
+}
+
+static void set_bit(uint64_t **bitmap, size_t words, size_t bit) {
+	if (*bitmap == NULL) {
+		*bitmap = new_bitmap(words);
+	}
+	(*bitmap)[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static void or_bits(uint64_t *to, const uint64_t *from, size_t words) {
+	if (from == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < words; ++i) {
+		to[i] |= from[i];
+	}
+}
+
+static size_t trie_child(Trie *t, size_t parent, const char *key,
+	size_t length, int create) {
+	long child = key_find(&t->edges, parent, key, length);
+
+	if (child >= 0) {
+		return (size_t) child;
+	}
+	if (!create) {
+		return 0;
+	}
+	t->nodes = realloc(t->nodes, (t->nodeCount + 1) * sizeof(TrieNode));
+	memset(t->nodes + t->nodeCount, 0, sizeof(TrieNode));
+	key_add(&t->edges, parent, key, length, t->nodeCount);
+
+	return t->nodeCount++;
+}
+
+static void trie_init(Trie *t) {
+	t->nodes = calloc(1, sizeof(TrieNode));
+	t->nodeCount = 1;
+}
+
+static void trie_free(Trie *t) {
+	for (size_t i = 0; i < t->nodeCount; ++i) {
+		free(t->nodes[i].here);
+		free(t->nodes[i].below);
+	}
+	free(t->nodes);
+	key_free(&t->edges);
+}
+
+static char *copy_lower(const char *s, size_t length) {
+	char *copy = malloc(length + 1);
+
+	for (size_t i = 0; i < length; ++i) {
+		copy[i] = tolower((unsigned char) s[i]);
+	}
+	copy[length] = '\0';
+
+	return copy;
+}
+
+static char *next_word(char **cursor) {
+	char *s = *cursor;
+
+	while (*s != '\0' && isspace((unsigned char) *s)) {
+		++s;
+	}
+	if (*s == '\0') {
+		*cursor = s;
+
+		return NULL;
+	}
+
+	char *word = s;
+
+	while (*s != '\0' && !isspace((unsigned char) *s)) {
+		++s;
+	}
+	if (*s != '\0') {
+		*s++ = '\0';
+	}
+	*cursor = s;
+
+	return word;
+}
+
+static char *trim(char *s) {
+	while (isspace((unsigned char) *s)) {
+		++s;
+	}
+
+	size_t length = strlen(s);
+
+	while (length > 0 && isspace((unsigned char) s[length - 1])) {
+		s[--length] = '\0';
+	}
+
+	return s;
+}
+
+static int method_index(const char *method, size_t length) {
+	for (int i = 0; method_names[i] != NULL; ++i) {
+		if (strlen(method_names[i]) == length &&
+			memcmp(method_names[i], method, length) == 0) {
+			return i;
+		}
+	}
+
+	return METHOD_COUNT - 1;
+}
+
+static const char *parse_methods(Rule *rule, char *list) {
+	char *save = NULL;
+
+	for (char *name = strtok_r(list, ",", &save); name != NULL;
+		name = strtok_r(NULL, ",", &save)) {
+		int index = method_index(name, strlen(name));
+
+		if (index == METHOD_COUNT - 1) {
+			return "unknown method";
+		}
+		rule->methods |= 1u << index;
+	}
+
+	return rule->methods == 0 ? "method needs a list of methods" : NULL;
+}
+
+static const char *parse_header_test(Rule *rule, const char *text) {
+	size_t nameLength = strcspn(text, "=~");
+
+	if (nameLength == 0) {
+		return "header needs a name";
+	}
+
+	HeaderTest *test;
+
+	rule->tests = realloc(rule->tests,
+		(rule->testCount + 1) * sizeof(HeaderTest));
+	test = rule->tests + rule->testCount++;
+	test->name = copy_lower(text, nameLength);
+	test->value = NULL;
+	test->kind = TEST_PRESENT;
+	if (text[nameLength] != '\0') {
+		test->kind = text[nameLength] == '=' ? TEST_EQUALS : TEST_REGEX;
+		test->value = strdup(text + nameLength + 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * Parses the action that ends a rule. The cursor is after the action
+ * name.
+ */
+static const char *parse_action(Rule *rule, const char *action,
+	char **cursor) {
+	if (strcmp(action, "nocapture") == 0) {
+		rule->action = ACTION_NO_CAPTURE;
+	} else if (strcmp(action, "block") == 0) {
+		char *status = next_word(cursor);
+
+		rule->action = ACTION_BLOCK;
+		rule->status = DEFAULT_BLOCK_STATUS;
+		if (status != NULL) {
+			rule->status = atoi(status);
+			if (rule->status < 200 || rule->status > 599) {
+				return "block takes a status from 200 to 599";
+			}
+		}
+	} else if (strcmp(action, "set-header") == 0) {
+		char *rest = trim(*cursor);
+		char *colon = strchr(rest, ':');
+
+		if (colon == NULL) {
+			return "set-header needs NAME: VALUE";
+		}
+		*colon = '\0';
+		rule->action = ACTION_SET_HEADER;
+		rule->name = strdup(trim(rest));
+		rule->value = strdup(trim(colon + 1));
+		*cursor = rest + strlen(rest);
+		if (rule->name[0] == '\0' || strchr(rule->name, ' ') != NULL) {
+			return "set-header needs NAME: VALUE";
+		}
+
+		return NULL;
+	} else if (strcmp(action, "remove-header") == 0) {
+		char *name = next_word(cursor);
+
+		if (name == NULL) {
+			return "remove-header needs a name";
+		}
+		rule->action = ACTION_REMOVE_HEADER;
+		rule->name = strdup(name);
+	} else if (strcmp(action, "map") == 0) {
+		char *target = next_word(cursor);
+
+		if (target == NULL) {
+			return "map needs HOST[:PORT]";
+		}
+
+		char *colon = strchr(target, ':');
+
+		rule->action = ACTION_MAP;
+		if (colon != NULL) {
+			*colon = '\0';
+			if (atoi(colon + 1) <= 0) {
+				return "map needs HOST[:PORT]";
+			}
+			rule->mapPort = strdup(colon + 1);
+		}
+		rule->mapHost = strdup(target);
+	} else {
+		return "unknown condition or action";
+	}
+
+	return next_word(cursor) == NULL ? NULL : "text after the action";
+}
+
+static const char *parse_rule(Rule *rule, char *line) {
+	char *cursor = line;
+	char *word;
+
+	while ((word = next_word(&cursor)) != NULL) {
+		int isCondition = strcmp(word, "host") == 0 ||
+			strcmp(word, "path") == 0 || strcmp(word, "method") == 0 ||
+			strcmp(word, "header") == 0;
+
+		if (!isCondition) {
+			return parse_action(rule, word, &cursor);
+		}
+
+		char *argument = next_word(&cursor);
+
+		if (argument == NULL) {
+			return "condition without a value";
+		}
+		if (strcmp(word, "host") == 0) {
+			if (rule->host != NULL) {
+				return "host given twice";
+			}
+
+			size_t length = strlen(argument);
+
+			//A trailing dot names the same host
+			if (length > 1 && argument[length - 1] == '.') {
+				--length;
+			}
+			rule->host = copy_lower(argument, length);
+		} else if (strcmp(word, "path") == 0) {
+			if (rule->pathPrefix != NULL || rule->pathRegex != NULL) {
+				return "path given twice";
+			}
+			if (argument[0] == '~') {
+				rule->pathRegex = strdup(argument + 1);
+			} else {
+				rule->pathPrefix = strdup(argument);
+			}
+		} else if (strcmp(word, "method") == 0) {
+			const char *error = parse_methods(rule, argument);
+
+			if (error != NULL) {
+				return error;
+			}
+		} else {
+			const char *error = parse_header_test(rule, argument);
+
+			if (error != NULL) {
+				return error;
+			}
+		}
+	}
+
+	return "rule without an action";
+}
+
+static void free_rule(Rule *rule) {
+	free(rule->host);
+	free(rule->pathPrefix);
+	free(rule->pathRegex);
+	for (size_t i = 0; i < rule->testCount; ++i) {
+		free(rule->tests[i].name);
+		free(rule->tests[i].value);
+	}
+	free(rule->tests);
+	free(rule->name);
+	free(rule->value);
+	free(rule->mapHost);
+	free(rule->mapPort);
+}
+
+static void add_host(struct _RuleSet *rs, size_t index, const char *host) {
+	int below = strncmp(host, "*.", 2) == 0;
+	const char *name = below ? host + 2 : host;
+	size_t end = strlen(name);
+	size_t node = 0;
+
+	while (end > 0) {
+		size_t start = end;
+
+		while (start > 0 && name[start - 1] != '.') {
+			--start;
+		}
+		node = trie_child(&rs->hosts, node, name + start, end - start, 1);
+		if (start == 0) {
+			break;
+		}
+		end = start - 1;
+	}
+
+	TrieNode *n = rs->hosts.nodes + node;
+
+	set_bit(below ? &n->below : &n->here, rs->words, index);
+}
+
+static void add_path_prefix(struct _RuleSet *rs, size_t index,
+	const char *prefix) {
+	size_t node = 0;
+
+	for (const char *s = prefix; *s != '\0'; ++s) {
+		node = trie_child(&rs->paths, node, s, 1, 1);
+	}
+	set_bit(&rs->paths.nodes[node].here, rs->words, index);
+}
+
+static size_t header_group(struct _RuleSet *rs, const char *name) {
+	long group = key_find(&rs->groupNames, 0, name, strlen(name));
+
+	if (group >= 0) {
+		return (size_t) group;
+	}
+	rs->groups = realloc(rs->groups,
+		(rs->groupCount + 1) * sizeof(HeaderGroup));
+	rs->groups[rs->groupCount].present = new_bitmap(rs->predicateWords);
+	rs->groups[rs->groupCount].regex = NULL;
+	key_add(&rs->groupNames, 0, name, strlen(name), rs->groupCount);
+
+	return rs->groupCount++;
+}
+
+static const char *add_header_test(struct _RuleSet *rs, HeaderTest *test,
+	size_t predicate) {
+	size_t group = header_group(rs, test->name);
+	HeaderGroup *g = rs->groups + group;
+
+	if (test->kind == TEST_PRESENT) {
+		set_bit(&g->present, rs->predicateWords, predicate);
+	} else if (test->kind == TEST_EQUALS) {
+		size_t length = strlen(test->value);
+		long value = key_find(&rs->groupValues, group, test->value, length);
+
+		if (value < 0) {
+			rs->valuePredicates = realloc(rs->valuePredicates,
+				(rs->valueCount + 1) * sizeof(uint64_t*));
+			rs->valuePredicates[rs->valueCount] =
+				new_bitmap(rs->predicateWords);
+			key_add(&rs->groupValues, group, test->value, length,
+				rs->valueCount);
+			value = rs->valueCount++;
+		}
+		set_bit(rs->valuePredicates + value, rs->predicateWords, predicate);
+	} else {
+		if (g->regex == NULL) {
+			g->regex = newRegexSet();
+		}
+		if (regexSetAdd(g->regex, test->value, predicate) < 0) {
+			return "bad header expression";
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Builds the lookup structures once all rules are parsed.
+ */
+static const char *compile_rule(struct _RuleSet *rs, size_t index) {
+	Rule *rule = rs->rules + index;
+
+	if (rule->host == NULL || strcmp(rule->host, "*") == 0) {
+		set_bit(&rs->anyHost, rs->words, index);
+	} else {
+		add_host(rs, index, rule->host);
+	}
+
+	if (rule->pathPrefix != NULL) {
+		add_path_prefix(rs, index, rule->pathPrefix);
+	} else if (rule->pathRegex != NULL) {
+		if (rs->pathRegex == NULL) {
+			rs->pathRegex = newRegexSet();
+		}
+		if (regexSetAdd(rs->pathRegex, rule->pathRegex, index) < 0) {
+			return "bad path expression";
+		}
+	} else {
+		set_bit(&rs->anyPath, rs->words, index);
+	}
+
+	for (int m = 0; m < METHOD_COUNT; ++m) {
+		if (rule->methods == 0 || (rule->methods & (1u << m))) {
+			set_bit(rs->methodRules + m, rs->words, index);
+		}
+	}
+
+	for (size_t i = 0; i < rule->testCount; ++i) {
+		const char *error = add_header_test(rs, rule->tests + i,
+			rule->firstPredicate + i);
+
+		if (error != NULL) {
+			return error;
+		}
+	}
+
+	return NULL;
+}
+
+static void match_host(struct _RuleSet *rs, Request *req, uint64_t *out) {
+	char name[MAX_HOST];
+	size_t length = req->host->length;
+
+	memcpy(out, rs->anyHost, rs->words * sizeof(uint64_t));
+	if (length >= MAX_HOST) {
+		return;
+	}
+	for (size_t i = 0; i < length; ++i) {
+		name[i] = tolower((unsigned char) req->host->buffer[i]);
+	}
+	if (length > 1 && name[length - 1] == '.') {
+		--length;
+	}
+
+	size_t node = 0;
+	size_t end = length;
+
+	while (end > 0) {
+		size_t start = end;
+
+		while (start > 0 && name[start - 1] != '.') {
+			--start;
+		}
+		node = trie_child(&rs->hosts, node, name + start, end - start, 0);
+		if (node == 0) {
+			return;
+		}
+		if (start == 0) {
+			or_bits(out, rs->hosts.nodes[node].here, rs->words);
+
+			return;
+		}
+		//There are labels left so *.name holds
+		or_bits(out, rs->hosts.nodes[node].below, rs->words);
+		end = start - 1;
+	}
+}
+
+static void match_path(struct _RuleSet *rs, Request *req, uint64_t *out) {
+	const char *path = req->path->buffer;
+	size_t length = req->path->length;
+
+	//The path is followed by the protocol version
+	while (length > 0 && path[length - 1] != ' ') {
+		--length;
+	}
+	length = length > 0 ? length - 1 : req->path->length;
+	//A tunnel has no path
+	if (method_index(req->method->buffer, req->method->length) ==
+		METHOD_CONNECT) {
+		length = 0;
+	}
+
+	memcpy(out, rs->anyPath, rs->words * sizeof(uint64_t));
+
+	size_t node = 0;
+
+	for (size_t i = 0; i < length; ++i) {
+		node = trie_child(&rs->paths, node, path + i, 1, 0);
+		if (node == 0) {
+			break;
+		}
+		or_bits(out, rs->paths.nodes[node].here, rs->words);
+	}
+	if (rs->pathRegex != NULL) {
+		regexSetMatch(rs->pathRegex, path, length, out);
+	}
+}
+
+static void match_headers(struct _RuleSet *rs, Request *req) {
+	char name[MAX_HEADER_NAME];
+
+	memset(rs->satisfied, 0, rs->predicateWords * sizeof(uint64_t));
+	for (size_t i = 0; i < req->headerNames->length; ++i) {
+		String *n = arrayGet(req->headerNames, i);
+		String *v = i < req->headerValues->length ?
+			arrayGet(req->headerValues, i) : NULL;
+
+		if (n->length >= MAX_HEADER_NAME) {
+			continue;
+		}
+		for (size_t j = 0; j < n->length; ++j) {
+			name[j] = tolower((unsigned char) n->buffer[j]);
+		}
+
+		long group = key_find(&rs->groupNames, 0, name, n->length);
+
+		if (group < 0) {
+			continue;
+		}
+
+		HeaderGroup *g = rs->groups + group;
+		//Empty values are never allocated
+		const char *value = v != NULL ? v->buffer : "";
+		size_t valueLength = v != NULL ? v->length : 0;
+		long entry = key_find(&rs->groupValues, group, value, valueLength);
+
+		or_bits(rs->satisfied, g->present, rs->predicateWords);
+		if (entry >= 0) {
+			or_bits(rs->satisfied, rs->valuePredicates[entry],
+				rs->predicateWords);
+		}
+		if (g->regex != NULL) {
+			regexSetMatch(g->regex, value, valueLength, rs->satisfied);
+		}
+	}
+}
+
+static int tests_hold(struct _RuleSet *rs, Rule *rule) {
+	for (size_t i = 0; i < rule->testCount; ++i) {
+		size_t k = rule->firstPredicate + i;
+
+		if (!(rs->satisfied[k / 64] & (1ULL << (k % 64)))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Reads and compiles a rule file. Returns NULL and describes the first
+ * problem in error if it can't be read or has a bad rule.
+ */
+struct _RuleSet *newRuleSet(const char *fileName, char *error,
+	size_t errorSize) {
+	FILE *file = fopen(fileName, "r");
+
+	if (file == NULL) {
+		snprintf(error, errorSize, "Can't open %s.", fileName);
+
+		return NULL;
+	}
+
+	struct _RuleSet *rs = calloc(1, sizeof(struct _RuleSet));
+	char *line = NULL;
+	size_t lineSize = 0;
+	const char *problem = NULL;
+	int lineNumber = 0;
+
+	while (problem == NULL && getline(&line, &lineSize, file) >= 0) {
+		char *text = trim(line);
+
+		++lineNumber;
+		if (text[0] == '\0' || text[0] == '#') {
+			continue;
+		}
+
+		rs->rules = realloc(rs->rules, (rs->count + 1) * sizeof(Rule));
+
+		Rule *rule = rs->rules + rs->count++;
+
+		memset(rule, 0, sizeof(Rule));
+		rule->line = lineNumber;
+		problem = parse_rule(rule, text);
+		rule->firstPredicate = rs->predicateCount;
+		rs->predicateCount += rule->testCount;
+	}
+	free(line);
+	fclose(file);
+
+	rs->words = (rs->count + 63) / 64;
+	rs->predicateWords = (rs->predicateCount + 63) / 64;
+	rs->anyHost = new_bitmap(rs->words);
+	rs->anyPath = new_bitmap(rs->words);
+	rs->methodRules = calloc(METHOD_COUNT, sizeof(uint64_t*));
+	for (int m = 0; m < METHOD_COUNT; ++m) {
+		rs->methodRules[m] = new_bitmap(rs->words);
+	}
+	rs->candidates = new_bitmap(rs->words);
+	rs->scratch = new_bitmap(rs->words);
+	rs->satisfied = new_bitmap(rs->predicateWords);
+	trie_init(&rs->hosts);
+	trie_init(&rs->paths);
+
+	for (size_t i = 0; problem == NULL && i < rs->count; ++i) {
+		problem = compile_rule(rs, i);
+		lineNumber = rs->rules[i].line;
+	}
+	if (problem != NULL) {
+		snprintf(error, errorSize, "%s line %d: %s.", fileName, lineNumber,
+			problem);
+		deleteRuleSet(rs);
+
+		return NULL;
+	}
+
+	return rs;
+}
+
+void deleteRuleSet(struct _RuleSet *rs) {
+	if (rs == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < rs->count; ++i) {
+		free_rule(rs->rules + i);
+	}
+	free(rs->rules);
+	free(rs->anyHost);
+	free(rs->anyPath);
+	trie_free(&rs->hosts);
+	trie_free(&rs->paths);
+	deleteRegexSet(rs->pathRegex);
+	if (rs->methodRules != NULL) {
+		for (int m = 0; m < METHOD_COUNT; ++m) {
+			free(rs->methodRules[m]);
+		}
+		free(rs->methodRules);
+	}
+	for (size_t i = 0; i < rs->groupCount; ++i) {
+		free(rs->groups[i].present);
+		deleteRegexSet(rs->groups[i].regex);
+	}
+	free(rs->groups);
+	key_free(&rs->groupNames);
+	key_free(&rs->groupValues);
+	for (size_t i = 0; i < rs->valueCount; ++i) {
+		free(rs->valuePredicates[i]);
+	}
+	free(rs->valuePredicates);
+	free(rs->candidates);
+	free(rs->scratch);
+	free(rs->satisfied);
+	free(rs);
+}
+
+size_t ruleSetCount(struct _RuleSet *rs) {
+	return rs->count;
+}
+
+/*
+ * Finds the rules that hold for a request and collects their actions in
+ * match. Returns the number of rules that matched.
+ */
+int ruleSetMatch(struct _RuleSet *rs, Request *req, RuleMatch *match) {
+	memset(match, 0, sizeof(RuleMatch));
+	if (rs->count == 0) {
+		return 0;
+	}
+
+	match_host(rs, req, rs->candidates);
+	match_path(rs, req, rs->scratch);
+
+	uint64_t *methods = rs->methodRules[method_index(req->method->buffer,
+		req->method->length)];
+	int any = 0;
+
+	for (size_t i = 0; i < rs->words; ++i) {
+		rs->candidates[i] &= rs->scratch[i] & methods[i];
+		any |= rs->candidates[i] != 0;
+	}
+	if (!any) {
+		return 0;
+	}
+	if (rs->predicateCount > 0) {
+		match_headers(rs, req);
+	}
+
+	int matched = 0;
+
+	for (size_t w = 0; w < rs->words; ++w) {
+		uint64_t bits = rs->candidates[w];
+
+		while (bits != 0) {
+			Rule *rule = rs->rules + w * 64 + __builtin_ctzll(bits);
+
+			bits &= bits - 1;
+			if (!tests_hold(rs, rule)) {
+				continue;
+			}
+			++matched;
+			if (rule->action == ACTION_NO_CAPTURE) {
+				match->noCapture = 1;
+			} else if (rule->action == ACTION_BLOCK) {
+				match->blockStatus = rule->status;
+
+				return matched;
+			} else if (rule->action == ACTION_MAP) {
+				if (match->mapHost == NULL) {
+					match->mapHost = rule->mapHost;
+					match->mapPort = rule->mapPort;
+				}
+			} else if (match->editCount < RULE_MAX_EDITS) {
+				HeaderEdit *edit = match->edits + match->editCount++;
+
+				edit->name = rule->name;
+				edit->value = rule->action == ACTION_SET_HEADER ?
+					rule->value : NULL;
+			}
+		}
+	}
+
+	return matched;
+}
+
+/*
+ * Compiles a rule file and swaps it in for the current rules. This may
+ * be called while the server runs. The old rules are deleted once the
+ * event loop can no longer be using them. On error the current rules are
+ * kept.
+ */
+int proxyServerLoadRules(ProxyServer *p, const char *fileName, char *error,
+	size_t errorSize) {
+	struct _RuleSet *rules = newRuleSet(fileName, error, errorSize);
+
+	if (rules == NULL) {
+		return -1;
+	}
+
+	struct _RuleSet *old = __atomic_exchange_n(&p->rules, rules,
+		__ATOMIC_SEQ_CST);
+
+	if (old != NULL) {
+		unsigned long epoch = __atomic_load_n(&p->loopEpoch,
+			__ATOMIC_SEQ_CST);
+
+		//While odd the loop is handling events and may hold the old rules
+		while ((epoch & 1) &&
+			__atomic_load_n(&p->loopEpoch, __ATOMIC_SEQ_CST) == epoch) {
+			usleep(1000);
+		}
+		deleteRuleSet(old);
+	}
+
+	return 0;
+}
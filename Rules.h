@@ -0,0 +1,63 @@
+/*
+ * Rules applied to each request once its header has been parsed. A rule
+ * file has one rule per line, conditions first and then one action.
+ * Blank lines and lines starting with # are skipped.
+ *
+ *	host *.ads.example.com block
+ *	host api.example.com path /v2/ method GET,HEAD map localhost:8080
+ *	path ~\.(png|jpg|gif)$ nocapture
+ *	header User-Agent~[Bb]ot header X-Debug block 429
+ *	method POST set-header X-Debug: on
+ *	host tracker.example.com remove-header Cookie
+ *
+ * All conditions of a rule must hold and a rule without any applies to
+ * every request.
+ *
+ *	host NAME	NAME exactly, *.NAME for names below it, * for all
+ *	path PREFIX	Path and query start with PREFIX
+ *	path ~REGEX	REGEX is found in the path and query. See Regex.h.
+ *	method LIST	One of a comma separated list of methods
+ *	header NAME	The header is present
+ *	header NAME=VALUE	Its value is exactly VALUE
+ *	header NAME~REGEX	REGEX is found in its value
+ *
+ * Host and header names are not case sensitive. Values can't hold spaces
+ * but an expression can match them with \s.
+ *
+ * Actions are nocapture, block [STATUS], set-header NAME: VALUE,
+ * remove-header NAME and map HOST[:PORT]. Every matching rule is applied
+ * in file order. The first map wins and a block ends the request. A map
+ * also rewrites the Host header.
+ *
+ * A rule file is compiled into a trie of host labels, a trie of path
+ * prefixes, one DFA for all path expressions and per header name tables
+ * of values and expressions. Each yields a bitmap of the rules it allows
+ * and the bitmaps are intersected, so the work per request only grows
+ * with the length of a bitmap as rules are added.
+ *
+ * A compiled rule set is only used from the event loop.
+ */
+#define RULE_MAX_EDITS 16
+
+typedef struct _HeaderEdit {
+	const char *name;
+	const char *value; //NULL removes the header
+} HeaderEdit;
+
+//Points into the rule set. Valid while the request header is handled.
+typedef struct _RuleMatch {
+	int noCapture;
+	int blockStatus; //0 if not blocked
+	const char *mapHost; //NULL if not mapped
+	const char *mapPort; //NULL keeps the port
+	HeaderEdit edits[RULE_MAX_EDITS];
+	int editCount;
+} RuleMatch;
+
+struct _RuleSet *newRuleSet(const char *fileName, char *error,
+	size_t errorSize);
+void deleteRuleSet(struct _RuleSet *rules);
+size_t ruleSetCount(struct _RuleSet *rules);
+int ruleSetMatch(struct _RuleSet *rules, Request *req, RuleMatch *match);
+int proxyServerLoadRules(ProxyServer *p, const char *fileName, char *error,
+	size_t errorSize);
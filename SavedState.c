@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include "Proxy.h"
+#include "SavedState.h"
+
+//Save at least this often while there are changes
+#define SAVE_INTERVAL 60
+
+/*
+ * Locks the lock file next to the saved file if no other process holds
+ * it. Returns -1 if the path does not fit, since a save to a truncated
+ * name would replace some other file.
+ */
+int savedStateOpen(SavedState *state, ProxyServer *p, const char *name,
+	const char *lockName, unsigned long saveEvery) {
+	char lock_name[sizeof(state->fileName)];
+	const char *folder = stringAsCString(p->persistenceFolder);
+	int nameLength = snprintf(state->fileName, sizeof(state->fileName),
+		"%s/%s", folder, name);
+	int lockLength = snprintf(lock_name, sizeof(lock_name), "%s/%s", folder,
+		lockName);
+
+	state->lockFd = -1;
+	state->saveEvery = saveEvery;
+	state->unsaved = 0;
+	state->saving = 0;
+	state->lastSave = time(NULL);
+	if (nameLength < 0 || nameLength >= (int) sizeof(state->fileName) ||
+		lockLength < 0 || lockLength >= (int) sizeof(lock_name)) {
+		return -1;
+	}
+
+	//The first process to take the lock saves the file
+	state->lockFd = open(lock_name, O_RDWR | O_CREAT, 0600);
+	if (state->lockFd >= 0 && flock(state->lockFd, LOCK_EX | LOCK_NB) < 0) {
+		close(state->lockFd);
+		state->lockFd = -1;
+	}
+
+	return 0;
+}
+
+void savedStateClose(SavedState *state) {
+	if (state->lockFd >= 0) {
+		close(state->lockFd);
+		state->lockFd = -1;
+	}
+}
+
+void savedStateChanged(SavedState *state) {
+	__atomic_fetch_add(&state->unsaved, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns 1 if this process saves the file and there are changes that
+ * have waited long enough, or any changes at all when force is set.
+ */
+int savedStateIsDue(SavedState *state, int force) {
+	unsigned long unsaved = __atomic_load_n(&state->unsaved, __ATOMIC_RELAXED);
+
+	if (state->lockFd < 0 || unsaved == 0) {
+		return 0;
+	}
+
+	return force || unsaved >= state->saveEvery ||
+		time(NULL) - state->lastSave >= SAVE_INTERVAL;
+}
+
+/*
+ * Opens the temporary file to save to. The caller keeps the state from
+ * changing until the save ends, so the changes counted now are the ones
+ * being saved.
+ */
+FILE *savedStateBeginSave(SavedState *state) {
+	char tmp_name[sizeof(state->fileName) + 4];
+
+	state->saving = __atomic_load_n(&state->unsaved, __ATOMIC_RELAXED);
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", state->fileName);
+
+	return fopen(tmp_name, "w");
+}
+
+/*
+ * Closes the temporary file and puts it in place if status and every
+ * write were good. Returns -1 and leaves the old file if not.
+ */
+int savedStateEndSave(SavedState *state, FILE *file, int status) {
+	char tmp_name[sizeof(state->fileName) + 4];
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", state->fileName);
+	if (fclose(file) != 0 || status != 0 ||
+		rename(tmp_name, state->fileName) < 0) {
+		unlink(tmp_name);
+
+		return -1;
+	}
+
+	__atomic_fetch_sub(&state->unsaved, state->saving, __ATOMIC_RELAXED);
+	state->lastSave = time(NULL);
+
+	return 0;
+}
+
+/*
+ * Opens the saved file and returns its size in size, so that counts read
+ * from it can be checked before anything is allocated for them. Returns
+ * NULL if there is no saved file.
+ */
+FILE *savedStateLoad(SavedState *state, size_t *size) {
+	FILE *file = fopen(state->fileName, "r");
+	struct stat st;
+
+	if (file != NULL && fstat(fileno(file), &st) < 0) {
+		fclose(file);
+
+		return NULL;
+	}
+	if (file != NULL) {
+		*size = st.st_size;
+	}
+
+	return file;
+}
+
+int savedWrite(FILE *file, const void *data, size_t length) {
+	return fwrite(data, 1, length, file) == length ? 0 : -1;
+}
+
+int savedRead(FILE *file, void *data, size_t length) {
+	return fread(data, 1, length, file) == length ? 0 : -1;
+}
+
+//FNV-1a, also used for the hash tables of the saved state owners
+uint64_t savedHash(const char *data, size_t length) {
+	uint64_t h = 14695981039346656037UL;
+
+	for (size_t i = 0; i < length; ++i) {
+		h ^= (unsigned char) data[i];
+		h *= 1099511628211UL;
+	}
+
+	return h;
+}
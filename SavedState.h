@@ -0,0 +1,31 @@
+/*
+ * A file in the persistence folder holding state that is slow to rebuild
+ * from the records, like the search index and the meta data columns. The
+ * first process to take the lock file saves it and the others only load
+ * it. Changes are counted so that a save waits until enough of them add
+ * up or enough time has passed.
+ *
+ * A save writes a temporary file that is renamed into place, so a crash
+ * never leaves a partial file behind. Loading a missing or damaged file
+ * is up to the owner, which rebuilds from the records.
+ */
+typedef struct _SavedState {
+	char fileName[512];
+	int lockFd; //Holds the lock file if this process saves the state
+	unsigned long saveEvery; //Changes that make a save due at once
+	unsigned long unsaved; //Changes since the last save. Atomic.
+	unsigned long saving; //Changes counted when the current save began
+	time_t lastSave;
+} SavedState;
+
+int savedStateOpen(SavedState *state, ProxyServer *p, const char *name,
+	const char *lockName, unsigned long saveEvery);
+void savedStateClose(SavedState *state);
+void savedStateChanged(SavedState *state);
+int savedStateIsDue(SavedState *state, int force);
+FILE *savedStateBeginSave(SavedState *state);
+int savedStateEndSave(SavedState *state, FILE *file, int status);
+FILE *savedStateLoad(SavedState *state, size_t *size);
+int savedWrite(FILE *file, const void *data, size_t length);
+int savedRead(FILE *file, void *data, size_t length);
+uint64_t savedHash(const char *data, size_t length);
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "Proxy.h"
+#include "Metrics.h"
+#include "Shaper.h"
+
+#define HOST_BUCKETS 256 //Power of 2
+//Idle hosts are swept out once there are this many
+#define HOST_SWEEP_MIN 1024
+
+typedef struct _HostShape {
+	TokenBucket buckets[2]; //Indexed by ShapeDirection
+	int requests; //Requests pointing here
+	struct _HostShape *next;
+	char name[];
+} HostShape;
+
+typedef struct _Shaper {
+	ProxyServer *proxy;
+	TokenBucket global[2];
+	HostShape *hosts[HOST_BUCKETS];
+	size_t hostCount;
+	size_t sweepAt; //Host count that starts the next sweep
+	uint64_t random;
+} Shaper;
+
+/*
+ * Reads a rate in bits per second and returns bytes per second. Returns
+ * -1 if it can't be parsed.
+ */
+static long long parse_rate(const char *text, char **end) {
+	double rate = strtod(text, end);
+
+	if (*end == text || rate <= 0) {
+		return -1;
+	}
+	if (**end == 'k' || **end == 'K') {
+		rate *= 1000;
+		++*end;
+	} else if (**end == 'm' || **end == 'M') {
+		rate *= 1000 * 1000;
+		++*end;
+	} else if (**end == 'g' || **end == 'G') {
+		rate *= 1000 * 1000 * 1000;
+		++*end;
+	}
+
+	return (long long) (rate / 8);
+}
+
+//Parses DOWN[/UP]. A single rate applies both ways.
+static int parse_rates(const char *text, long long rates[2]) {
+	char *end;
+
+	rates[SHAPE_DOWN] = parse_rate(text, &end);
+	if (rates[SHAPE_DOWN] < 0) {
+		return -1;
+	}
+	rates[SHAPE_UP] = rates[SHAPE_DOWN];
+	if (*end == '/') {
+		rates[SHAPE_UP] = parse_rate(end + 1, &end);
+		if (rates[SHAPE_UP] < 0) {
+			return -1;
+		}
+	}
+
+	return *end == '\0' ? 0 : -1;
+}
+
+int shapingPolicyParse(const char *spec, ShapingPolicy *policy) {
+	char copy[512];
+	char *save = NULL;
+
+	if (strlen(spec) >= sizeof(copy)) {
+		return -1;
+	}
+	strcpy(copy, spec);
+	memset(policy, 0, sizeof(ShapingPolicy));
+
+	for (char *item = strtok_r(copy, ",", &save); item != NULL;
+		item = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(item, '=');
+		int status = 0;
+
+		if (value == NULL) {
+			return -1;
+		}
+		*value++ = '\0';
+		if (strcmp(item, "conn") == 0) {
+			status = parse_rates(value, policy->connectionRate);
+		} else if (strcmp(item, "host") == 0) {
+			status = parse_rates(value, policy->hostRate);
+		} else if (strcmp(item, "global") == 0) {
+			status = parse_rates(value, policy->globalRate);
+		} else if (strcmp(item, "latency") == 0) {
+			status = sscanf(value, "%d", &policy->latencyMs) == 1 ? 0 : -1;
+		} else if (strcmp(item, "chunk") == 0) {
+			status = sscanf(value, "%d", &policy->chunkLatencyMs) == 1 ? 0 : -1;
+		} else if (strcmp(item, "stall") == 0) {
+			status = sscanf(value, "%lf:%d", &policy->stallPercent,
+				&policy->stallMs) == 2 ? 0 : -1;
+		} else {
+			status = -1;
+		}
+		if (status < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+Shaper *newShaper(ProxyServer *p) {
+	Shaper *shaper = calloc(1, sizeof(Shaper));
+
+	shaper->proxy = p;
+	shaper->sweepAt = HOST_SWEEP_MIN;
+	shaper->random = (uint64_t) (uintptr_t) shaper ^ 0x9E3779B97F4A7C15ULL;
+
+	return shaper;
+}
+
+void deleteShaper(Shaper *shaper) {
+	for (int i = 0; i < HOST_BUCKETS; ++i) {
+		HostShape *h = shaper->hosts[i];
+
+		while (h != NULL) {
+			HostShape *next = h->next;
+
+			free(h);
+			h = next;
+		}
+	}
+	metricsAdd(shaper->proxy, METRIC_SHAPING_HOSTS,
+		-(long long) shaper->hostCount);
+	free(shaper);
+}
+
+//Host names are not case sensitive
+static uint32_t hash_host(const char *name) {
+	uint32_t h = 2166136261U;
+
+	for (; *name != '\0'; ++name) {
+		h ^= (unsigned char) tolower((unsigned char) *name);
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+//A tenth of a second of traffic but at least one segment
+static double burst_size(long long rate) {
+	double burst = rate / 10.0;
+
+	return burst < SHAPE_QUANTUM ? SHAPE_QUANTUM : burst;
+}
+
+/*
+ * Returns 1 if a bucket that nobody draws from would be full by now, so
+ * it is no different from a new one.
+ */
+static int is_refilled(TokenBucket *b, long long rate, long long now) {
+	if (rate <= 0 || b->updated == 0) {
+		return 1;
+	}
+
+	return b->tokens + (now - b->updated) * (rate / 1000000.0) >=
+		burst_size(rate);
+}
+
+/*
+ * Frees the hosts no request points to whose buckets have refilled. The
+ * next sweep waits until the table has doubled so that sweeps stay rare.
+ */
+static void sweep_hosts(Shaper *shaper, long long now) {
+	ShapingPolicy *policy = &shaper->proxy->shaping;
+	size_t before = shaper->hostCount;
+
+	for (int i = 0; i < HOST_BUCKETS; ++i) {
+		HostShape **link = shaper->hosts + i;
+
+		while (*link != NULL) {
+			HostShape *h = *link;
+
+			if (h->requests == 0 && is_refilled(h->buckets + SHAPE_DOWN,
+				policy->hostRate[SHAPE_DOWN], now) &&
+				is_refilled(h->buckets + SHAPE_UP, policy->hostRate[SHAPE_UP],
+				now)) {
+				*link = h->next;
+				free(h);
+				--shaper->hostCount;
+			} else {
+				link = &h->next;
+			}
+		}
+	}
+	shaper->sweepAt = shaper->hostCount * 2 > HOST_SWEEP_MIN ?
+		shaper->hostCount * 2 : HOST_SWEEP_MIN;
+	metricsAdd(shaper->proxy, METRIC_SHAPING_HOSTS,
+		-(long long) (before - shaper->hostCount));
+}
+
+/*
+ * Finds the buckets for the host the request goes to. A host is kept
+ * while requests point to it and until its buckets have refilled.
+ */
+static HostShape *find_host(Shaper *shaper, const char *name, long long now) {
+	HostShape **slot = shaper->hosts + (hash_host(name) & (HOST_BUCKETS - 1));
+
+	for (HostShape *h = *slot; h != NULL; h = h->next) {
+		if (strcasecmp(h->name, name) == 0) {
+			return h;
+		}
+	}
+	if (shaper->hostCount >= shaper->sweepAt) {
+		sweep_hosts(shaper, now);
+	}
+
+	size_t length = strlen(name);
+	HostShape *h = calloc(1, sizeof(HostShape) + length + 1);
+
+	memcpy(h->name, name, length + 1);
+	h->next = *slot;
+	*slot = h;
+	++shaper->hostCount;
+	metricsAdd(shaper->proxy, METRIC_SHAPING_HOSTS, 1);
+
+	return h;
+}
+
+void shaperBeginRequest(ProxyServer *p, Request *req, long long now) {
+	Shaper *shaper = p->shaper;
+
+	//The previous request on the connection may have gone elsewhere
+	shaperEndRequest(p, req);
+	req->shapeResponseStarted = 0;
+	if (p->shaping.hostRate[SHAPE_DOWN] > 0 ||
+		p->shaping.hostRate[SHAPE_UP] > 0) {
+		req->shapeHost = find_host(shaper, stringAsCString(req->host), now);
+		++req->shapeHost->requests;
+	}
+}
+
+void shaperEndRequest(ProxyServer *p, Request *req) {
+	if (req->shapeHost != NULL) {
+		--req->shapeHost->requests;
+		req->shapeHost = NULL;
+	}
+}
+
+//xorshift64*. Only the event loop draws from it.
+static double next_random(Shaper *shaper) {
+	uint64_t x = shaper->random;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	shaper->random = x;
+
+	return (double) ((x * 2685821657736338717ULL) >> 11) / (1ULL << 53);
+}
+
+/*
+ * Adds latency and stalls before the data just placed in a request or
+ * response buffer is written.
+ */
+void shaperScheduleWrite(ProxyServer *p, Request *req, int direction,
+	long long now) {
+	ShapingPolicy *policy = &p->shaping;
+	long long delay = policy->chunkLatencyMs * 1000LL;
+
+	if (direction == SHAPE_DOWN && !req->shapeResponseStarted) {
+		req->shapeResponseStarted = 1;
+		delay += policy->latencyMs * 1000LL;
+	}
+	if (policy->stallPercent > 0 &&
+		next_random(p->shaper) * 100 < policy->stallPercent) {
+		delay += policy->stallMs * 1000LL;
+		metricsAdd(p, METRIC_SHAPING_STALLS, 1);
+	}
+	if (delay > 0) {
+		req->shapeDue[direction] = now + delay;
+	}
+}
+
+static void refill(TokenBucket *b, long long rate, long long now) {
+	double burst = burst_size(rate);
+
+	if (b->updated == 0) {
+		//Starts full
+		b->tokens = burst;
+	} else if (now > b->updated) {
+		b->tokens += (now - b->updated) * (rate / 1000000.0);
+		if (b->tokens > burst) {
+			b->tokens = burst;
+		}
+	}
+	b->updated = now;
+}
+
+/*
+ * Collects the buckets that meter a write. Returns how many there are.
+ */
+static int find_buckets(ProxyServer *p, Request *req, int direction,
+	TokenBucket **buckets, long long *rates) {
+	ShapingPolicy *policy = &p->shaping;
+	int count = 0;
+
+	if (policy->connectionRate[direction] > 0) {
+		buckets[count] = req->shapeBuckets + direction;
+		rates[count++] = policy->connectionRate[direction];
+	}
+	if (policy->hostRate[direction] > 0 && req->shapeHost != NULL) {
+		buckets[count] = req->shapeHost->buckets + direction;
+		rates[count++] = policy->hostRate[direction];
+	}
+	if (policy->globalRate[direction] > 0) {
+		buckets[count] = p->shaper->global + direction;
+		rates[count++] = policy->globalRate[direction];
+	}
+
+	return count;
+}
+
+/*
+ * Returns how many of the bytes waiting to be written may be written now.
+ * If a bucket is short the request pays for one segment up front, taking
+ * the buckets into debt, and is due when the debt is paid off. Requests
+ * sharing a bucket are then served in the order they ran short rather
+ * than the one that wakes up first taking every refill.
+ */
+size_t shaperAllow(ProxyServer *p, Request *req, int direction,
+	size_t wanted, long long now) {
+	if (req->shapeDue[direction] > now + SHAPE_SLACK_MICROS) {
+		return 0;
+	}
+	req->shapeDue[direction] = 0;
+	if (req->shapeReserved[direction] > 0) {
+		return wanted < req->shapeReserved[direction] ?
+			wanted : req->shapeReserved[direction];
+	}
+
+	TokenBucket *buckets[3];
+	long long rates[3];
+	int count = find_buckets(p, req, direction, buckets, rates);
+	double allowed = wanted;
+	size_t needed = wanted < SHAPE_QUANTUM ? wanted : SHAPE_QUANTUM;
+	int isShort = 0;
+
+	for (int i = 0; i < count; ++i) {
+		refill(buckets[i], rates[i], now);
+		if (buckets[i]->tokens < needed) {
+			isShort = 1;
+		} else if (buckets[i]->tokens < allowed) {
+			allowed = buckets[i]->tokens;
+		}
+	}
+	if (!isShort) {
+		return (size_t) allowed;
+	}
+
+	long long due = now;
+
+	for (int i = 0; i < count; ++i) {
+		buckets[i]->tokens -= needed;
+		if (buckets[i]->tokens < 0) {
+			long long paid = now + (long long)
+				(-buckets[i]->tokens * 1000000.0 / rates[i]) + 1;
+
+			if (paid > due) {
+				due = paid;
+			}
+		}
+	}
+	req->shapeReserved[direction] = needed;
+	req->shapeDue[direction] = due;
+	metricsAdd(p, METRIC_SHAPING_DELAYS, 1);
+
+	return 0;
+}
+
+void shaperConsume(ProxyServer *p, Request *req, int direction, size_t sent) {
+	size_t *reserved = req->shapeReserved + direction;
+
+	if (*reserved >= sent) {
+		*reserved -= sent;
+
+		return;
+	}
+	sent -= *reserved;
+	*reserved = 0;
+
+	TokenBucket *buckets[3];
+	long long rates[3];
+	int count = find_buckets(p, req, direction, buckets, rates);
+
+	for (int i = 0; i < count; ++i) {
+		buckets[i]->tokens -= sent;
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * Slows traffic down to emulate a constrained network. Writes to clients
+ * and servers are metered by token buckets for each connection, each
+ * host and the whole proxy, in each direction. Latency can be added
+ * before each response and before each write, and a write can stall as
+ * if a packet was lost and had to be sent again.
+ *
+ * Nothing sleeps. A write that may not happen yet sets a due time in its
+ * request. The event loop leaves the socket out of the select() write set
+ * until then and wakes up for the earliest due time.
+ *
+ * A policy is given as a comma separated list. Rates are in bits per
+ * second with an optional k, m or g suffix. The first rate is towards
+ * the client and the second, if any, towards the server.
+ *
+ *	conn=1.6m/768k	Each client connection
+ *	host=10m	All connections to one host
+ *	global=50m	The whole proxy
+ *	latency=300	Milliseconds added before each response
+ *	chunk=20	Milliseconds added before each write
+ *	stall=2:500	A 2% chance of a 500ms stall before each write
+ *
+ * The shaper is used from the event loop.
+ */
+
+//Smallest write worth waking up for. About one TCP segment.
+#define SHAPE_QUANTUM 1460
+/*
+ * Writes due this close together are let through on the same wake up,
+ * so many shaped connections don't wake the event loop for one write
+ * each. Bucket debt keeps the long term rates exact.
+ */
+#define SHAPE_SLACK_MICROS 2000
+
+int shapingPolicyParse(const char *spec, ShapingPolicy *policy);
+struct _Shaper *newShaper(ProxyServer *p);
+void deleteShaper(struct _Shaper *shaper);
+
+void shaperBeginRequest(ProxyServer *p, Request *req, long long now);
+void shaperEndRequest(ProxyServer *p, Request *req);
+void shaperScheduleWrite(ProxyServer *p, Request *req, int direction,
+	long long now);
+size_t shaperAllow(ProxyServer *p, Request *req, int direction,
+	size_t wanted, long long now);
+void shaperConsume(ProxyServer *p, Request *req, int direction, size_t sent);
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "Trace.h"
+
+#define TRACE_MAGIC "PXTRACE1"
+
+typedef struct _TraceRing {
+	uint64_t head; //Records written so far. Only the owner thread writes.
+	uint16_t thread;
+	struct _TraceRing *next;
+	TraceRecord records[TRACE_RING_RECORDS];
+} TraceRing;
+
+typedef struct _TraceEventInfo {
+	const char *name;
+	const char *a;
+	const char *b;
+} TraceEventInfo;
+
+static const TraceEventInfo event_info[TRACE_EVENT_COUNT] = {
+	{"CAPTURE_FAILED", NULL, NULL},
+	{"OPEN_FILES_FAILED", NULL, NULL},
+	{"DNS_FAILED", "status", "port"},
+	{"CONNECT_FAILED", "error", "client"},
+	{"CLIENT_REJECTED", NULL, NULL},
+	{"SERVER_START", "port", NULL},
+	{"SERVER_STOP", NULL, NULL},
+	{"CONTROL_COMMAND", "command", NULL},
+	{"CLIENT_ACCEPTED", "slot", NULL},
+	{"REQUEST_BEGIN", "start_sec", "start_usec"},
+	{"REQUEST_END", "request_bytes", "response_bytes"},
+	{"CONNECTION_REUSED", NULL, NULL},
+	{"CHANNEL_SHUTDOWN", "server", NULL},
+	{"CONNECT_START", "port", NULL},
+	{"CONNECT_PENDING", "client", NULL},
+	{"CONNECTED", "client", "immediate"},
+	{"SELECT", "events", NULL},
+	{"CLIENT_READ", "bytes", NULL},
+	{"CLIENT_WRITE", "bytes", "buffered"},
+	{"SERVER_READ", "bytes", NULL},
+	{"SERVER_WRITE", "bytes", "buffered"},
+	{"WOULD_BLOCK", NULL, NULL},
+	{"PEER_CLOSED", NULL, NULL},
+	{"READ_DEFERRED", NULL, NULL},
+	{"WRITE_SCHEDULED", "bytes", NULL},
+	{"WRITE_BUSY", NULL, NULL},
+	{"NOTHING_TO_WRITE", NULL, NULL}
+};
+
+int traceEnabled = 0;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *rings = NULL;
+static uint16_t ring_count = 0;
+static __thread TraceRing *thread_ring = NULL;
+
+static uint64_t now_ns(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Rings are only ever added so that traceDump() can walk the list
+ * while threads trace. A ring outlives its thread.
+ */
+static TraceRing *register_ring() {
+	TraceRing *ring = calloc(1, sizeof(TraceRing));
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&rings_lock);
+	ring->thread = ring_count++;
+	ring->next = rings;
+	__atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rings_lock);
+
+	thread_ring = ring;
+
+	return ring;
+}
+
+void traceWrite(int event, int fd, long long a, long long b) {
+	TraceRing *ring = thread_ring;
+
+	if (ring == NULL && (ring = register_ring()) == NULL) {
+		return;
+	}
+
+	uint64_t head = ring->head;
+	TraceRecord *rec = ring->records + (head & (TRACE_RING_RECORDS - 1));
+
+	rec->time = now_ns(CLOCK_MONOTONIC);
+	rec->event = event;
+	rec->thread = ring->thread;
+	rec->fd = fd;
+	rec->a = a;
+	rec->b = b;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the records of a ring that are not being overwritten.
+ */
+static size_t copy_ring(TraceRing *ring, TraceRecord *out) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TRACE_RING_RECORDS ? head - TRACE_RING_RECORDS : 0;
+
+	for (uint64_t i = first; i < head; ++i) {
+		out[i - first] = ring->records[i & (TRACE_RING_RECORDS - 1)];
+	}
+
+	//Drop the records the owner may have written over while copying
+	uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t safe = now > TRACE_RING_RECORDS ? now - TRACE_RING_RECORDS : 0;
+	size_t skip = safe > first ? safe - first : 0;
+
+	if (skip >= head - first) {
+		return 0;
+	}
+	memmove(out, out + skip, (head - first - skip) * sizeof(TraceRecord));
+
+	return head - first - skip;
+}
+
+/*
+ * Writes the newest records of every thread to a file. Threads may keep
+ * tracing while this runs. The file starts with the magic, the
+ * monotonic and real time clocks in nanoseconds and the number of rings.
+ * Each ring is its thread number, record count and records.
+ */
+int traceDump(const char *fileName) {
+	FILE *file = fopen(fileName, "wb");
+
+	if (file == NULL) {
+		return -1;
+	}
+
+	TraceRecord *copy = malloc(sizeof(TraceRecord) * TRACE_RING_RECORDS);
+	uint64_t clocks[2] = {now_ns(CLOCK_MONOTONIC), now_ns(CLOCK_REALTIME)};
+	uint32_t count = 0;
+	TraceRing *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+	for (TraceRing *ring = first; ring != NULL; ring = ring->next) {
+		++count;
+	}
+
+	int ok = copy != NULL && fwrite(TRACE_MAGIC, 8, 1, file) == 1 &&
+		fwrite(clocks, sizeof(clocks), 1, file) == 1 &&
+		fwrite(&count, sizeof(count), 1, file) == 1;
+
+	for (TraceRing *ring = first; ok && ring != NULL; ring = ring->next) {
+		uint32_t header[2] = {ring->thread, copy_ring(ring, copy)};
+
+		ok = fwrite(header, sizeof(header), 1, file) == 1 &&
+			fwrite(copy, sizeof(TraceRecord), header[1], file) == header[1];
+	}
+
+	free(copy);
+	if (fclose(file) != 0) {
+		ok = 0;
+	}
+
+	return ok ? 0 : -1;
+}
+
+/*
+ * Returns the name of an event and of its a and b values. A value name
+ * is NULL if the event does not use it.
+ */
+const char *traceEventName(int event, const char **aName, const char **bName) {
+	if (event < 0 || event >= TRACE_EVENT_COUNT) {
+		*aName = "a";
+		*bName = "b";
+
+		return "UNKNOWN";
+	}
+
+	*aName = event_info[event].a;
+	*bName = event_info[event].b;
+
+	return event_info[event].name;
+}
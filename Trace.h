@@ -0,0 +1,80 @@
+/*
+ * Low overhead binary tracing. An event is a fixed size record written
+ * to a ring owned by the calling thread so tracing takes no locks and
+ * does no formatting. The newest records of every thread are written to
+ * a file with traceDump() and rendered offline by pixie-trace.
+ *
+ * Events above TRACE_LEVEL are removed at compile time together with the
+ * code that computes their arguments. Build with TRACE_LEVEL=1 to keep
+ * only errors. The rest are written only when tracing is enabled.
+ */
+#define TRACE_LEVEL_OFF 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_DEBUG
+#endif
+
+//Records kept per thread. Must be a power of two.
+#define TRACE_RING_RECORDS (64 * 1024)
+
+typedef enum _TraceEventId {
+	//Errors
+	TRACE_CAPTURE_FAILED,
+	TRACE_OPEN_FILES_FAILED,
+	TRACE_DNS_FAILED,
+	TRACE_CONNECT_FAILED,
+	TRACE_CLIENT_REJECTED,
+	//Life cycle
+	TRACE_SERVER_START,
+	TRACE_SERVER_STOP,
+	TRACE_CONTROL_COMMAND,
+	TRACE_CLIENT_ACCEPTED,
+	TRACE_REQUEST_BEGIN,
+	TRACE_REQUEST_END,
+	TRACE_CONNECTION_REUSED,
+	TRACE_CHANNEL_SHUTDOWN,
+	TRACE_CONNECT_START,
+	TRACE_CONNECT_PENDING,
+	TRACE_CONNECTED,
+	//I/O
+	TRACE_SELECT,
+	TRACE_CLIENT_READ,
+	TRACE_CLIENT_WRITE,
+	TRACE_SERVER_READ,
+	TRACE_SERVER_WRITE,
+	TRACE_WOULD_BLOCK,
+	TRACE_PEER_CLOSED,
+	TRACE_READ_DEFERRED, //Waiting for a write to the other side
+	TRACE_WRITE_SCHEDULED,
+	TRACE_WRITE_BUSY, //A write was already scheduled
+	TRACE_NOTHING_TO_WRITE,
+	TRACE_EVENT_COUNT
+} TraceEventId;
+
+typedef struct _TraceRecord {
+	uint64_t time; //CLOCK_MONOTONIC nanoseconds
+	uint16_t event;
+	uint16_t thread;
+	int32_t fd;
+	int64_t a; //Meaning depends on the event
+	int64_t b;
+} TraceRecord;
+
+extern int traceEnabled;
+
+#define TRACE(level, event, fd, a, b) do { \
+	if ((level) <= TRACE_LEVEL && traceEnabled) { \
+		traceWrite((event), (fd), (a), (b)); \
+	} \
+} while (0)
+
+#define TRACE_ERROR(event, fd, a, b) TRACE(TRACE_LEVEL_ERROR, event, fd, a, b)
+#define TRACE_INFO(event, fd, a, b) TRACE(TRACE_LEVEL_INFO, event, fd, a, b)
+#define TRACE_DEBUG(event, fd, a, b) TRACE(TRACE_LEVEL_DEBUG, event, fd, a, b)
+
+void traceWrite(int event, int fd, long long a, long long b);
+int traceDump(const char *fileName);
+const char *traceEventName(int event, const char **aName, const char **bName);
@@ -0,0 +1,361 @@
+/*
+ * Checks of stored body decoding. Bodies are framed and compressed here
+ * with zlib, saved as records in a temporary folder and must decode back
+ * to the original bytes, whole, up to a limit and a page at a time
+ * through the body cache. Cut off bodies decode as far as they go and
+ * damaged ones are refused.
+ *
+ * bodycheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../Proxy.h"
+#include "../Persistence.h"
+#include "../BodyCodec.h"
+#include "check.h"
+
+//Large enough for paging to decode past the first MIN_DECODE
+#define PAYLOAD_SIZE (1536 * 1024)
+#define PAGE_SIZE (64 * 1024)
+//Decodes to more than an inner coding may take
+#define BOMB_SIZE (96 * 1024 * 1024)
+
+static int records = 0;
+
+//Decoding errors are expected here
+static void ignore_error(const char *message) {
+}
+
+static void make_payload(Buffer *out, size_t length) {
+	static const char words[][8] = {"pixie ", "proxy ", "ring ", "body ",
+		"chunk ", "gzip ", "\r\n", "0\r\n"};
+	uint64_t x = 88172645463325252ULL;
+
+	while (out->length < length) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+
+		const char *word = words[x % 8];
+		size_t room = length - out->length;
+		size_t n = strlen(word);
+
+		bufferAppendBytes(out, word, n < room ? n : room);
+	}
+}
+
+//windowBits as for deflateInit2(): 16 + MAX_WBITS for gzip, negative for raw
+static void compress_body(const char *data, size_t length, int windowBits,
+	Buffer *out) {
+	z_stream stream;
+	char chunk[16384];
+	int status;
+
+	memset(&stream, 0, sizeof(stream));
+	deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8,
+		Z_DEFAULT_STRATEGY);
+	stream.next_in = (Bytef*) data;
+	stream.avail_in = length;
+	do {
+		stream.next_out = (Bytef*) chunk;
+		stream.avail_out = sizeof(chunk);
+		status = deflate(&stream, Z_FINISH);
+		bufferAppendBytes(out, chunk, sizeof(chunk) - stream.avail_out);
+	} while (status == Z_OK);
+	deflateEnd(&stream);
+}
+
+/*
+ * Frames data in chunks of varying size with upper and lower case hex
+ * sizes, an extension and a trailer.
+ */
+static void chunk_body(const char *data, size_t length, Buffer *out) {
+	char line[64];
+	size_t size = 1;
+
+	for (size_t pos = 0; pos < length; pos += size, size = size * 3 + 7) {
+		if (size > length - pos) {
+			size = length - pos;
+		}
+		snprintf(line, sizeof(line), size % 2 ? "%zX\r\n" : "%zx;ext=1\r\n",
+			size);
+		bufferAppendBytes(out, line, strlen(line));
+		bufferAppendBytes(out, data + pos, size);
+		bufferAppendBytes(out, "\r\n", 2);
+	}
+	bufferAppendBytes(out, "0\r\nX-Trailer: done\r\n\r\n", 22);
+}
+
+static void save_record(ProxyServer *p, const char *suffix, const char *header,
+	const char *body, size_t length, char *uniqueId) {
+	char fileName[512];
+
+	sprintf(uniqueId, "check-%d", records++);
+	snprintf(fileName, sizeof(fileName), "%s/%s.%s",
+		stringAsCString(p->persistenceFolder), uniqueId, suffix);
+
+	FILE *file = fopen(fileName, "wb");
+
+	fwrite(header, 1, strlen(header), file);
+	fwrite(body, 1, length, file);
+	fclose(file);
+}
+
+/*
+ * Saves a response with the given framing headers and decodes it with
+ * the limit. Returns the decoder status.
+ */
+static int decode_response(ProxyServer *p, const char *headers,
+	const char *body, size_t length, size_t limit, Buffer *out) {
+	char header[512], uniqueId[32];
+	ResponseRecord *rec = newResponseRecord();
+	int status;
+
+	snprintf(header, sizeof(header),
+		"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n%s\r\n", headers);
+	save_record(p, "res", header, body, length, uniqueId);
+	out->length = 0;
+	status = proxyServerLoadResponse(p, uniqueId, rec);
+	CHECK(status == 0);
+	if (status == 0) {
+		status = responseRecordDecodeBody(rec, limit, out);
+	}
+	proxyServerResetRecords(p, NULL, rec);
+	deleteResponseRecord(rec);
+
+	return status;
+}
+
+static int same(Buffer *a, const char *data, size_t length) {
+	return a->length == length && memcmp(a->buffer, data, length) == 0;
+}
+
+static void check_codings(ProxyServer *p, Buffer *payload) {
+	Buffer *gzip = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *zlib = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *raw = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *twice = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *chunked = newBufferWithCapacity(PAYLOAD_SIZE * 2);
+	Buffer *chunkedGzip = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *out = newBufferWithCapacity(PAYLOAD_SIZE);
+	const char *data = payload->buffer;
+	size_t length = payload->length;
+
+	compress_body(data, length, 16 + MAX_WBITS, gzip);
+	compress_body(data, length, MAX_WBITS, zlib);
+	compress_body(data, length, -MAX_WBITS, raw);
+	compress_body(gzip->buffer, gzip->length, 16 + MAX_WBITS, twice);
+	chunk_body(data, length, chunked);
+	chunk_body(gzip->buffer, gzip->length, chunkedGzip);
+
+	CHECK(decode_response(p, "", data, length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	CHECK(decode_response(p, "Transfer-Encoding: chunked\r\n",
+		chunked->buffer, chunked->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	CHECK(decode_response(p, "Content-Encoding: gzip\r\n",
+		gzip->buffer, gzip->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	CHECK(decode_response(p, "Content-Encoding: gzip\r\n"
+		"Transfer-Encoding: chunked\r\n",
+		chunkedGzip->buffer, chunkedGzip->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	CHECK(decode_response(p, "Transfer-Encoding: gzip, chunked\r\n",
+		chunkedGzip->buffer, chunkedGzip->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	CHECK(decode_response(p, "Content-Encoding: deflate\r\n",
+		zlib->buffer, zlib->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	//Raw deflate sent as deflate
+	CHECK(decode_response(p, "Content-Encoding: deflate\r\n",
+		raw->buffer, raw->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	CHECK(decode_response(p, "Content-Encoding: gzip, GZIP\r\n",
+		twice->buffer, twice->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+	CHECK(decode_response(p, "Content-Encoding: identity, x-gzip;q=1\r\n",
+		gzip->buffer, gzip->length, SIZE_MAX, out) == 0);
+	CHECK(same(out, data, length));
+
+	//Limits stop the last step only
+	CHECK(decode_response(p, "Content-Encoding: gzip\r\n"
+		"Transfer-Encoding: chunked\r\n",
+		chunkedGzip->buffer, chunkedGzip->length, 1000, out) == 1);
+	CHECK(same(out, data, 1000));
+	CHECK(decode_response(p, "Transfer-Encoding: chunked\r\n",
+		chunked->buffer, chunked->length, 12345, out) == 1);
+	CHECK(same(out, data, 12345));
+	CHECK(decode_response(p, "", data, length, 0, out) == 1);
+	CHECK(out->length == 0);
+
+	//Cut off bodies decode up to where they end
+	CHECK(decode_response(p, "Transfer-Encoding: chunked\r\n",
+		chunked->buffer, chunked->length / 2, SIZE_MAX, out) == 0);
+	CHECK(out->length > 0 && out->length < length);
+	CHECK(memcmp(out->buffer, data, out->length) == 0);
+	CHECK(decode_response(p, "Content-Encoding: gzip\r\n",
+		gzip->buffer, gzip->length / 2, SIZE_MAX, out) == 0);
+	CHECK(out->length > 0 && out->length < length);
+	CHECK(memcmp(out->buffer, data, out->length) == 0);
+
+	//Damaged bodies and unknown codings are refused
+	gzip->buffer[gzip->length / 2] ^= 0x55;
+	gzip->buffer[gzip->length / 2 + 1] ^= 0x55;
+	CHECK(decode_response(p, "Content-Encoding: gzip\r\n",
+		gzip->buffer, gzip->length, SIZE_MAX, out) < 0);
+	CHECK(decode_response(p, "Transfer-Encoding: chunked\r\n",
+		"zz\r\nhello\r\n0\r\n\r\n", 16, SIZE_MAX, out) < 0);
+	CHECK(decode_response(p, "Content-Encoding: compress\r\n",
+		data, 100, SIZE_MAX, out) < 0);
+	CHECK(decode_response(p, "Content-Encoding: gzip\r\n",
+		data, 100, SIZE_MAX, out) < 0);
+
+	deleteBuffer(gzip);
+	deleteBuffer(zlib);
+	deleteBuffer(raw);
+	deleteBuffer(twice);
+	deleteBuffer(chunked);
+	deleteBuffer(chunkedGzip);
+	deleteBuffer(out);
+}
+
+/*
+ * An outer gzip layer that inflates far past its own size is refused,
+ * even though the inner layer would stop at the limit. The inner stream
+ * is followed by zeros, which inflate ignores.
+ */
+static void check_bomb(ProxyServer *p) {
+	char *inner = calloc(1, BOMB_SIZE);
+	Buffer *hello = newBufferWithCapacity(64);
+	Buffer *outer = newBufferWithCapacity(BOMB_SIZE / 512);
+	Buffer *out = newBufferWithCapacity(PAYLOAD_SIZE);
+
+	compress_body("hello", 5, 16 + MAX_WBITS, hello);
+	memcpy(inner, hello->buffer, hello->length);
+	compress_body(inner, BOMB_SIZE, 16 + MAX_WBITS, outer);
+	CHECK(decode_response(p, "Content-Encoding: gzip, gzip\r\n",
+		outer->buffer, outer->length, 1000, out) < 0);
+	//The same within the bound decodes
+	outer->length = 0;
+	compress_body(inner, BOMB_SIZE / 4, 16 + MAX_WBITS, outer);
+	CHECK(decode_response(p, "Content-Encoding: gzip, gzip\r\n",
+		outer->buffer, outer->length, 1000, out) == 0);
+	CHECK(same(out, "hello", 5));
+
+	free(inner);
+	deleteBuffer(hello);
+	deleteBuffer(outer);
+	deleteBuffer(out);
+}
+
+static void check_request(ProxyServer *p, Buffer *payload) {
+	Buffer *gzip = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *chunked = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *out = newBufferWithCapacity(PAYLOAD_SIZE);
+	RequestRecord *rec = newRequestRecord();
+	char uniqueId[32];
+
+	compress_body(payload->buffer, 100000, 16 + MAX_WBITS, gzip);
+	chunk_body(gzip->buffer, gzip->length, chunked);
+	save_record(p, "req", "POST /upload HTTP/1.1\r\nHost: example.com\r\n"
+		"Content-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n",
+		chunked->buffer, chunked->length, uniqueId);
+
+	CHECK(proxyServerLoadRequest(p, uniqueId, rec) == 0);
+	CHECK(requestRecordDecodeBody(rec, SIZE_MAX, out) == 0);
+	CHECK(same(out, payload->buffer, 100000));
+	proxyServerResetRecords(p, rec, NULL);
+	deleteRequestRecord(rec);
+	deleteBuffer(gzip);
+	deleteBuffer(chunked);
+	deleteBuffer(out);
+}
+
+//Pages through a body the way a viewer would
+static void check_paging(ProxyServer *p, Buffer *payload) {
+	Buffer *gzip = newBufferWithCapacity(PAYLOAD_SIZE);
+	Buffer *out = newBufferWithCapacity(PAYLOAD_SIZE);
+	BodyCacheStats before, after;
+	char uniqueId[32];
+
+	compress_body(payload->buffer, payload->length, 16 + MAX_WBITS, gzip);
+	save_record(p, "res", "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n\r\n",
+		gzip->buffer, gzip->length, uniqueId);
+	proxyServerGetBodyCacheStats(p, &before);
+
+	for (size_t offset = 0; offset < payload->length; offset += PAGE_SIZE) {
+		long n = proxyServerGetResponseBody(p, uniqueId, offset, PAGE_SIZE,
+			out);
+
+		CHECK(n > 0 && (size_t) n <= PAGE_SIZE);
+		if (n <= 0) {
+			break;
+		}
+	}
+	CHECK(same(out, payload->buffer, payload->length));
+	CHECK(proxyServerGetResponseBody(p, uniqueId, payload->length, PAGE_SIZE,
+		out) == 0);
+
+	//Served from the cache now that it is complete
+	out->length = 0;
+	CHECK(proxyServerGetResponseBody(p, uniqueId, 0, SIZE_MAX, out) ==
+		(long) payload->length);
+	CHECK(same(out, payload->buffer, payload->length));
+	proxyServerGetBodyCacheStats(p, &after);
+	//Re-decoding doubles each time so only a few pages miss
+	CHECK(after.misses - before.misses <= 4);
+	CHECK(after.hits > before.hits);
+	CHECK(proxyServerGetResponseBody(p, "check-missing", 0, 10, out) < 0);
+
+	deleteBuffer(gzip);
+	deleteBuffer(out);
+}
+
+static int is_text(const char *contentType) {
+	Slice slice = {contentType, strlen(contentType)};
+
+	return bodyIsText(&slice);
+}
+
+static void check_text_types() {
+	CHECK(is_text("text/html; charset=utf-8"));
+	CHECK(is_text("application/JSON"));
+	CHECK(is_text("application/vnd.api+json"));
+	CHECK(is_text("image/svg+xml"));
+	CHECK(is_text("application/x-www-form-urlencoded"));
+	CHECK(!is_text("image/png"));
+	CHECK(!is_text("application/octet-stream"));
+	CHECK(!is_text("text"));
+	CHECK(!is_text(""));
+}
+
+int main(int argc, char **argv) {
+	char folder[64];
+	ProxyServer *p = newProxyServer(0);
+	Buffer *payload = newBufferWithCapacity(PAYLOAD_SIZE);
+
+	check_folder("bodycheck", folder);
+	p->onError = ignore_error;
+	stringAppendCString(p->persistenceFolder, folder);
+	make_payload(payload, PAYLOAD_SIZE);
+
+	check_codings(p, payload);
+	check_bomb(p);
+	check_request(p, payload);
+	check_paging(p, payload);
+	check_text_types();
+
+	deleteBuffer(payload);
+	deleteProxyServer(p);
+	remove_check_folder(folder);
+
+	return check_summary("bodycheck");
+}
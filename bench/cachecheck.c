@@ -0,0 +1,313 @@
+/*
+ * Checks of the response cache. A proxy with the cache enabled runs in
+ * the background in front of an origin stub that counts the requests it
+ * gets. Fresh responses must be served without the origin, stale ones
+ * revalidated, variants kept apart, uncacheable responses passed on and
+ * unsafe methods must drop what is stored. A small memory budget makes
+ * entries spill to disk and come back.
+ *
+ * cachecheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../Proxy.h"
+#include "../ResponseCache.h"
+#include "check.h"
+#include "checkhttp.h"
+
+#define MAX_MESSAGE (256 * 1024)
+//Larger than the memory budget allows to keep, smaller than its share
+#define LARGE_BODY (100 * 1024)
+#define ROUTES 8
+
+static const char *routes[ROUTES] = {"/fresh", "/nostore", "/etag", "/vary",
+	"/private", "/large", "/cookie", "/changed"};
+static int origin_counts[ROUTES];
+static int not_modified; //304s sent by the origin
+static int originPort;
+
+//Returns the value of a request header or "" if absent
+static void header_value(const char *data, const char *name, char *out,
+	size_t size) {
+	const char *line = strcasestr(data, name);
+
+	out[0] = '\0';
+	if (line != NULL) {
+		line += strlen(name);
+		snprintf(out, size, "%.*s", (int) strcspn(line, "\r"), line);
+	}
+}
+
+static void respond(int fd, const char *request) {
+	static char body[LARGE_BODY];
+	char path[256], response[1024], etag[64], language[64];
+	int route = -1;
+
+	sscanf(request, "%*s %255s", path);
+	//The query string only makes a different URL
+	path[strcspn(path, "?")] = '\0';
+	for (int i = 0; i < ROUTES; ++i) {
+		if (strcmp(path, routes[i]) == 0) {
+			route = i;
+		}
+	}
+	if (strncmp(request, "GET ", 4) != 0 || route < 0) {
+		http_write_all(fd, "HTTP/1.1 204 No Content\r\n\r\n", 28);
+
+		return;
+	}
+
+	int count = __sync_add_and_fetch(origin_counts + route, 1);
+	const char *headers = "";
+	size_t bodyLength;
+
+	header_value(request, "\r\nIf-None-Match: ", etag, sizeof(etag));
+	header_value(request, "\r\nAccept-Language: ", language, sizeof(language));
+	if (strcmp(routes[route], "/etag") == 0 && strcmp(etag, "\"v1\"") == 0) {
+		__sync_add_and_fetch(&not_modified, 1);
+		snprintf(response, sizeof(response), "HTTP/1.1 304 Not Modified\r\n"
+			"ETag: \"v1\"\r\nCache-Control: max-age=0\r\n\r\n");
+		http_write_all(fd, response, strlen(response));
+
+		return;
+	}
+
+	switch (route) {
+	case 0:
+		headers = "Cache-Control: max-age=60\r\n";
+		break;
+	case 1:
+		headers = "Cache-Control: no-store\r\n";
+		break;
+	case 2:
+		headers = "Cache-Control: max-age=0\r\nETag: \"v1\"\r\n";
+		break;
+	case 3:
+		headers = "Cache-Control: max-age=60\r\nVary: Accept-Language\r\n";
+		break;
+	case 4:
+		headers = "Cache-Control: private, max-age=60\r\n";
+		break;
+	case 5:
+		headers = "Cache-Control: max-age=60\r\n";
+		break;
+	case 6:
+		headers = "Cache-Control: max-age=60\r\nSet-Cookie: id=1\r\n";
+		break;
+	case 7:
+		//A new version each time, so revalidation gets a 200
+		headers = count % 2 ? "Cache-Control: max-age=0\r\nETag: \"odd\"\r\n" :
+			"Cache-Control: max-age=0\r\nETag: \"even\"\r\n";
+		break;
+	}
+	bodyLength = snprintf(body, sizeof(body), "%s-%d-%s", routes[route] + 1,
+		count, language);
+	if (route == 5) {
+		memset(body + bodyLength, 'x', LARGE_BODY - bodyLength);
+		bodyLength = LARGE_BODY;
+	}
+	snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\n%s"
+		"Content-Type: text/plain\r\nContent-Length: %zu\r\n\r\n",
+		headers, bodyLength);
+	http_write_all(fd, response, strlen(response));
+	http_write_all(fd, body, bodyLength);
+}
+
+static void *serve_connection(void *data) {
+	int fd = (int) (intptr_t) data;
+	char *request = malloc(MAX_MESSAGE);
+
+	while (http_read_message(fd, request, MAX_MESSAGE, 0) > 0) {
+		respond(fd, request);
+	}
+	free(request);
+	close(fd);
+
+	return NULL;
+}
+
+static void *origin_loop(void *data) {
+	int listenFd = (int) (intptr_t) data;
+
+	for (;;) {
+		int fd = accept(listenFd, NULL, NULL);
+		pthread_t thread;
+
+		if (fd < 0) {
+			continue;
+		}
+		pthread_create(&thread, NULL, serve_connection, (void*) (intptr_t) fd);
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static int listen_on_loopback(int *port) {
+	struct sockaddr_in addr;
+	socklen_t length = sizeof(addr);
+	int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+		listen(fd, 16) < 0 ||
+		getsockname(fd, (struct sockaddr*) &addr, &length) < 0) {
+		perror("origin");
+		exit(1);
+	}
+	*port = ntohs(addr.sin_port);
+
+	return fd;
+}
+
+//Sends a request for the origin through the proxy
+static int fetch(int proxyPort, const char *method, const char *path,
+	const char *headers, char *body, size_t size) {
+	char request[1024];
+
+	snprintf(request, sizeof(request), "%s http://127.0.0.1:%d%s HTTP/1.1\r\n"
+		"Host: 127.0.0.1:%d\r\n%s\r\n", method, originPort, path, originPort,
+		headers);
+
+	return http_fetch(proxyPort, request, body, size);
+}
+
+static int count_of(const char *route) {
+	for (int i = 0; i < ROUTES; ++i) {
+		if (strcmp(route, routes[i]) == 0) {
+			return __sync_fetch_and_add(origin_counts + i, 0);
+		}
+	}
+
+	return -1;
+}
+
+static void check_caching(ProxyServer *p, int port) {
+	char body[MAX_MESSAGE];
+	ResponseCacheStats stats;
+
+	CHECK(fetch(port, "GET", "/fresh", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "fresh-1-") == 0);
+	CHECK(fetch(port, "GET", "/fresh", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "fresh-1-") == 0);
+	CHECK(count_of("/fresh") == 1);
+	//The client can ask for a fresher copy
+	CHECK(fetch(port, "GET", "/fresh", "Cache-Control: no-cache\r\n",
+		body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "fresh-2-") == 0);
+	CHECK(fetch(port, "GET", "/fresh", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "fresh-2-") == 0);
+
+	//Not stored
+	for (int i = 0; i < 2; ++i) {
+		fetch(port, "GET", "/nostore", "", body, sizeof(body));
+		fetch(port, "GET", "/private", "", body, sizeof(body));
+		fetch(port, "GET", "/cookie", "", body, sizeof(body));
+	}
+	CHECK(count_of("/nostore") == 2);
+	CHECK(count_of("/private") == 2);
+	CHECK(count_of("/cookie") == 2);
+
+	//Stale with a validator. The 304 is answered with the stored body.
+	CHECK(fetch(port, "GET", "/etag", "", body, sizeof(body)) == 200);
+	CHECK(fetch(port, "GET", "/etag", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "etag-1-") == 0);
+	CHECK(fetch(port, "GET", "/etag", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "etag-1-") == 0);
+	CHECK(count_of("/etag") == 3);
+	CHECK(__sync_fetch_and_add(&not_modified, 0) == 2);
+	//A client's own validator goes to the origin as it is
+	CHECK(fetch(port, "GET", "/etag", "If-None-Match: \"v1\"\r\n",
+		body, sizeof(body)) == 304);
+
+	//Revalidation that gets a new version serves and stores it
+	CHECK(fetch(port, "GET", "/changed", "", body, sizeof(body)) == 200);
+	CHECK(fetch(port, "GET", "/changed", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "changed-2-") == 0);
+
+	//Variants by Accept-Language
+	CHECK(fetch(port, "GET", "/vary", "Accept-Language: en\r\n",
+		body, sizeof(body)) == 200);
+	CHECK(fetch(port, "GET", "/vary", "Accept-Language: fr\r\n",
+		body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "vary-2-fr") == 0);
+	CHECK(fetch(port, "GET", "/vary", "Accept-Language: en\r\n",
+		body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "vary-1-en") == 0);
+	CHECK(count_of("/vary") == 2);
+
+	//Unsafe methods drop the stored response
+	CHECK(fetch(port, "POST", "/fresh", "Content-Length: 0\r\n",
+		body, sizeof(body)) == 204);
+	CHECK(fetch(port, "GET", "/fresh", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "fresh-3-") == 0);
+
+	proxyServerGetResponseCacheStats(p, &stats);
+	CHECK(stats.hits == 3);
+	CHECK(stats.revalidated == 2);
+	CHECK(stats.entries > 0 && stats.bytes > 0);
+}
+
+//Entries pushed out of memory are served from disk
+static void check_spill(ProxyServer *p, int port) {
+	char body[MAX_MESSAGE];
+	ResponseCacheStats stats;
+
+	CHECK(fetch(port, "GET", "/large", "", body, sizeof(body)) == 200);
+	CHECK(strlen(body) == LARGE_BODY);
+	//Pushes the first one out of memory
+	for (int i = 0; i < 12; ++i) {
+		char path[64];
+
+		snprintf(path, sizeof(path), "/large?%d", i);
+		CHECK(fetch(port, "GET", path, "", body, sizeof(body)) == 200);
+	}
+	proxyServerGetResponseCacheStats(p, &stats);
+	CHECK(stats.spilledEntries > 0);
+	CHECK(stats.bytes <= (unsigned long long) p->responseCacheSize);
+	CHECK(fetch(port, "GET", "/large", "", body, sizeof(body)) == 200);
+	CHECK(strlen(body) == LARGE_BODY && strncmp(body, "large-1-", 8) == 0);
+	CHECK(count_of("/large") == 13);
+}
+
+int main(int argc, char **argv) {
+	char folder[64];
+	pthread_t origin;
+	int listenFd = listen_on_loopback(&originPort);
+	ProxyServer *p = newProxyServer(0);
+
+	//The proxy keeps its folder in $HOME/.pixie
+	check_folder("cachecheck", folder);
+	setenv("HOME", folder, 1);
+	p->responseCacheEnabled = 1;
+	p->responseCacheSize = 1024 * 1024;
+	p->responseCacheSpillSize = 16 * 1024 * 1024;
+	pthread_create(&origin, NULL, origin_loop, (void*) (intptr_t) listenFd);
+	pthread_detach(origin);
+
+	int port = start_check_proxy(p);
+
+	CHECK(port > 0);
+	if (port > 0) {
+		check_caching(p, port);
+		check_spill(p, port);
+		proxyServerStop(p);
+	}
+	deleteProxyServer(p);
+	remove_check_folder(folder);
+
+	return check_summary("cachecheck");
+}
@@ -0,0 +1,65 @@
+/*
+ * Shared by the check programs. CHECK() counts a check and prints it
+ * with its file and line if it fails. A check program ends by returning
+ * check_summary(), which is 1 if anything failed.
+ *
+ * Included once by each check program, so the helpers are static.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define CHECK(condition) \
+	check_condition(condition, #condition, __FILE__, __LINE__)
+
+static int check_count = 0;
+static int check_failures = 0;
+
+static void check_condition(int condition, const char *text,
+	const char *file, int line) {
+	++check_count;
+	if (!condition) {
+		++check_failures;
+		fprintf(stderr, "%s:%d: %s\n", file, line, text);
+	}
+}
+
+/*
+ * Creates an empty folder for the check under /tmp. The name is returned
+ * in folder, which must hold at least 64 bytes. Exits if it can't.
+ */
+static void check_folder(const char *name, char *folder) {
+	snprintf(folder, 64, "/tmp/pixie-%s-XXXXXX", name);
+	if (mkdtemp(folder) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+}
+
+//Deletes the folder made by check_folder() and everything in it
+static void remove_check_folder(const char *folder) {
+	DIR *dir = opendir(folder);
+	struct dirent *entry;
+	char fileName[512];
+
+	while (dir != NULL && (entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+			snprintf(fileName, sizeof(fileName), "%s/%s", folder, entry->d_name);
+			if (unlink(fileName) < 0) {
+				remove_check_folder(fileName);
+			}
+		}
+	}
+	if (dir != NULL) {
+		closedir(dir);
+	}
+	rmdir(folder);
+}
+
+static int check_summary(const char *name) {
+	printf("%s: %d checks, %d failed\n", name, check_count, check_failures);
+
+	return check_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Shared by the check programs that send requests through a proxy
+ * running in the background. Included after check.h.
+ */
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int http_write_all(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t n = write(fd, data, length);
+
+		if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads one message into data, which holds size bytes. The body is
+ * framed by Content-Length. A response without one is read until the
+ * connection closes. Returns the length or -1 if the connection ended
+ * first.
+ */
+static long http_read_message(int fd, char *data, size_t size,
+	int isResponse) {
+	long length = 0, headerLength = -1, bodyLength = 0;
+
+	while (headerLength < 0 || bodyLength == LONG_MAX ||
+		length < headerLength + bodyLength) {
+		ssize_t n = read(fd, data + length, size - 1 - length);
+
+		if (n <= 0) {
+			return bodyLength == LONG_MAX ? length : -1;
+		}
+		length += n;
+		data[length] = '\0';
+
+		char *end = headerLength < 0 ? strstr(data, "\r\n\r\n") : NULL;
+
+		if (end != NULL) {
+			char *value = strcasestr(data, "\r\nContent-Length:");
+
+			headerLength = end + 4 - data;
+			bodyLength = value != NULL && value < end ? atol(value + 17) :
+				isResponse ? LONG_MAX : 0;
+			if (isResponse && (strncmp(data + 9, "204", 3) == 0 ||
+				strncmp(data + 9, "304", 3) == 0)) {
+				bodyLength = 0;
+			}
+		}
+	}
+
+	return length;
+}
+
+/*
+ * Starts the proxy on a free port in the background. Returns the port or
+ * -1 if it did not start.
+ */
+static int start_check_proxy(ProxyServer *p) {
+	struct sockaddr_in addr;
+	socklen_t length = sizeof(addr);
+	struct timespec pause = {0, 10 * 1000000};
+
+	p->port = 0;
+	if (proxyServerStartInBackground(p) < 0) {
+		return -1;
+	}
+	for (int i = 0; i < 500 && p->runStatus != RUNNING; ++i) {
+		nanosleep(&pause, NULL);
+	}
+	if (p->runStatus != RUNNING ||
+		getsockname(p->serverSocket, (struct sockaddr*) &addr, &length) < 0) {
+		return -1;
+	}
+
+	return ntohs(addr.sin_port);
+}
+
+/*
+ * Sends a request to the proxy on a new connection and copies the text of
+ * the response body to body. Returns the status code or -1.
+ */
+static int http_fetch(int proxyPort, const char *request, char *body,
+	size_t size) {
+	struct sockaddr_in addr;
+	size_t capacity = 4 * 1024 * 1024;
+	char *response = malloc(capacity);
+	int fd = socket(PF_INET, SOCK_STREAM, 0), status = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(proxyPort);
+	body[0] = '\0';
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 &&
+		http_write_all(fd, request, strlen(request)) == 0 &&
+		http_read_message(fd, response, capacity, 1) > 0) {
+		char *start = strstr(response, "\r\n\r\n") + 4;
+
+		status = atoi(response + 9);
+		snprintf(body, size, "%s", start);
+	}
+	close(fd);
+	free(response);
+
+	return status;
+}
@@ -0,0 +1,425 @@
+/*
+ * HTTP load generator for benchmarks. Each thread keeps one connection
+ * to the proxy and sends GET requests for the target URL through it.
+ *
+ * driver -x proxyHost:port -u host:port/path [-c connections]
+ *	[-d seconds] [-r rate] [-k] [-P pixiePid]
+ *
+ * Without -r every connection sends its next request as soon as the
+ * previous response is complete (closed loop). With -r the requests per
+ * second are spread over the connections on a fixed schedule and latency
+ * is measured from when a request was due, so a stalled proxy is not
+ * hidden by the driver slowing down (open loop).
+ *
+ * -k closes the connection after every response. -P reports the CPU
+ * time used by the proxy process per request.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../Proxy.h"
+#include "../Metrics.h"
+
+#define READ_SIZE (64 * 1024)
+
+typedef struct _Driver {
+	struct sockaddr_in proxy;
+	char request[1024];
+	size_t requestLength;
+	double interval; //Seconds between requests of a connection. 0 is closed loop.
+	long long end; //Monotonic microseconds
+	int closeEach;
+} Driver;
+
+typedef struct _Worker {
+	pthread_t thread;
+	Driver *driver;
+	long long offset; //Start of the open loop schedule
+	long long requests;
+	long long errors;
+	long long bytes;
+	HistogramSnapshot latency;
+} Worker;
+
+static long long now_micros() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int connect_proxy(Driver *d) {
+	int fd = socket(PF_INET, SOCK_STREAM, 0);
+	int on = 1;
+
+	if (fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (connect(fd, (struct sockaddr*) &d->proxy, sizeof(d->proxy)) < 0) {
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t n = write(fd, data, length);
+
+		if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads one response and returns the number of body bytes or -1. Only
+ * what the origin stub sends is understood: Content-Length or chunked
+ * bodies with no trailer.
+ */
+static long long read_response(int fd, char *buffer, int *keepAlive) {
+	size_t length = 0;
+	char *end = NULL;
+
+	buffer[0] = '\0';
+	while ((end = strstr(buffer, "\r\n\r\n")) == NULL) {
+		ssize_t n = read(fd, buffer + length, READ_SIZE - 1 - length);
+
+		if (n <= 0) {
+			return -1;
+		}
+		length += n;
+		buffer[length] = '\0';
+	}
+
+	int status = 0;
+
+	if (sscanf(buffer, "HTTP/%*s %d", &status) != 1 || status != 200) {
+		return -1;
+	}
+	*keepAlive = strcasestr(buffer, "\r\nConnection: close") == NULL;
+
+	size_t headerLength = end + 4 - buffer;
+	size_t have = length - headerLength;
+	const char *contentLength = strcasestr(buffer, "\r\nContent-Length:");
+	long long bodyLength = contentLength != NULL && contentLength < end ?
+		atoll(contentLength + 17) : -1;
+
+	memmove(buffer, buffer + headerLength, have);
+	if (bodyLength >= 0) {
+		while ((long long) have < bodyLength) {
+			ssize_t n = read(fd, buffer, READ_SIZE);
+
+			if (n <= 0) {
+				return -1;
+			}
+			have += n;
+		}
+
+		return bodyLength;
+	}
+
+	//Chunked. Scan chunk size lines, skipping over the data.
+	long long total = 0;
+	size_t pos = 0;
+
+	while (1) {
+		char *line = NULL;
+
+		while (pos + 2 > have || (line = memchr(buffer + pos, '\n', have - pos))
+			== NULL) {
+			if (pos > 0) {
+				memmove(buffer, buffer + pos, have - pos);
+				have -= pos;
+				pos = 0;
+			}
+			if (have == READ_SIZE) {
+				return -1;
+			}
+
+			ssize_t n = read(fd, buffer + have, READ_SIZE - have);
+
+			if (n <= 0) {
+				return -1;
+			}
+			have += n;
+		}
+
+		long long size = strtoll(buffer + pos, NULL, 16);
+
+		pos = line + 1 - buffer;
+		if (size == 0) {
+			//Final CRLF after the last chunk
+			while (have - pos < 2) {
+				ssize_t n = read(fd, buffer + have, READ_SIZE - have);
+
+				if (n <= 0) {
+					return -1;
+				}
+				have += n;
+			}
+
+			return total;
+		}
+		total += size;
+
+		//Data and its CRLF
+		long long skip = size + 2;
+
+		while ((long long) (have - pos) < skip) {
+			skip -= have - pos;
+			pos = have = 0;
+
+			ssize_t n = read(fd, buffer, READ_SIZE);
+
+			if (n <= 0) {
+				return -1;
+			}
+			have = n;
+		}
+		pos += skip;
+	}
+}
+
+static void *run_worker(void *data) {
+	Worker *w = data;
+	Driver *d = w->driver;
+	char *buffer = malloc(READ_SIZE + 1);
+	int fd = -1;
+	long long due = w->offset;
+
+	while (1) {
+		long long start = now_micros();
+
+		if (d->interval > 0) {
+			if (due > start) {
+				usleep(due - start);
+			}
+			start = due;
+			due += (long long) (d->interval * 1000000);
+		}
+		//Requests still due at the end are not sent
+		if (start >= d->end || now_micros() >= d->end) {
+			break;
+		}
+
+		if (fd < 0 && (fd = connect_proxy(d)) < 0) {
+			++w->errors;
+			usleep(1000);
+			continue;
+		}
+
+		int keepAlive = 0;
+		long long bytes = write_all(fd, d->request, d->requestLength) < 0 ?
+			-1 : read_response(fd, buffer, &keepAlive);
+
+		if (bytes < 0) {
+			++w->errors;
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		histogramAdd(&w->latency, now_micros() - start);
+		++w->requests;
+		w->bytes += bytes;
+		if (!keepAlive || d->closeEach) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(buffer);
+
+	return NULL;
+}
+
+/*
+ * User plus system time of a process in microseconds, or -1.
+ */
+static long long process_cpu(int pid) {
+	char path[64];
+	char stat[1024];
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL) {
+		return -1;
+	}
+
+	size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+
+	fclose(file);
+	stat[length] = '\0';
+
+	//Fields after the command name, which may contain spaces
+	char *s = strrchr(stat, ')');
+	unsigned long utime, stime;
+
+	if (s == NULL || sscanf(s + 2,
+		"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2) {
+		return -1;
+	}
+
+	return (long long) (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static int parse_address(const char *address, struct sockaddr_in *addr) {
+	char host[256];
+	int port = 0;
+
+	if (sscanf(address, "%255[^:]:%d", host, &port) != 2) {
+		return -1;
+	}
+
+	struct hostent *h = gethostbyname(host);
+
+	if (h == NULL) {
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	memcpy(&addr->sin_addr, h->h_addr_list[0], h->h_length);
+	addr->sin_port = htons(port);
+
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s -x proxyHost:port -u host:port/path "
+		"[-c connections] [-d seconds] [-r rate] [-k] [-P pid]\n", name);
+}
+
+int main(int argc, char **argv) {
+	Driver d;
+	const char *proxy = NULL, *url = NULL;
+	int connections = 16, seconds = 10, pid = -1;
+	double rate = 0;
+	int c;
+
+	memset(&d, 0, sizeof(d));
+	while ((c = getopt(argc, argv, "x:u:c:d:r:kP:")) != -1) {
+		if (c == 'x') {
+			proxy = optarg;
+		} else if (c == 'u') {
+			url = optarg;
+		} else if (c == 'c') {
+			connections = atoi(optarg);
+		} else if (c == 'd') {
+			seconds = atoi(optarg);
+		} else if (c == 'r') {
+			rate = atof(optarg);
+		} else if (c == 'k') {
+			d.closeEach = 1;
+		} else if (c == 'P') {
+			pid = atoi(optarg);
+		} else {
+			usage(argv[0]);
+
+			return 2;
+		}
+	}
+	if (proxy == NULL || url == NULL || connections < 1 ||
+		parse_address(proxy, &d.proxy) < 0) {
+		usage(argv[0]);
+
+		return 2;
+	}
+
+	const char *path = strchr(url, '/');
+	int hostLength = path != NULL ? path - url : (int) strlen(url);
+
+	d.requestLength = snprintf(d.request, sizeof(d.request),
+		"GET http://%s HTTP/1.1\r\nHost: %.*s\r\n"
+		"User-Agent: pixie-bench\r\n%s\r\n", url, hostLength, url,
+		d.closeEach ? "Connection: close\r\n" : "");
+	if (rate > 0) {
+		d.interval = connections / rate;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	Worker *workers = calloc(connections, sizeof(Worker));
+	long long cpuStart = pid > 0 ? process_cpu(pid) : -1;
+	long long start = now_micros();
+
+	d.end = start + seconds * 1000000LL;
+	for (int i = 0; i < connections; ++i) {
+		workers[i].driver = &d;
+		//Stagger the open loop schedules across the interval
+		workers[i].offset = start + (long long)
+			(d.interval * 1000000 * i / connections);
+		pthread_create(&workers[i].thread, NULL, run_worker, workers + i);
+	}
+
+	HistogramSnapshot latency;
+	long long requests = 0, errors = 0, bytes = 0;
+
+	memset(&latency, 0, sizeof(latency));
+	for (int i = 0; i < connections; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		requests += workers[i].requests;
+		errors += workers[i].errors;
+		bytes += workers[i].bytes;
+		latency.count += workers[i].latency.count;
+		latency.sum += workers[i].latency.sum;
+		for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+			latency.buckets[b] += workers[i].latency.buckets[b];
+		}
+	}
+
+	double elapsed = (now_micros() - start) / 1e6;
+	long long cpuEnd = pid > 0 ? process_cpu(pid) : -1;
+
+	printf("connections  %d (%s loop%s)\n", connections,
+		rate > 0 ? "open" : "closed", d.closeEach ? ", close each" : "");
+	printf("requests     %lld in %.2fs, %lld errors\n", requests, elapsed,
+		errors);
+	printf("throughput   %.1f req/s, %.2f MB/s\n", requests / elapsed,
+		bytes / elapsed / (1024 * 1024));
+	if (latency.count > 0) {
+		printf("latency us   mean %llu p50 %lld p90 %lld p99 %lld "
+			"p99.9 %lld max %lld\n",
+			latency.sum / latency.count,
+			histogramQuantile(&latency, 0.5),
+			histogramQuantile(&latency, 0.9),
+			histogramQuantile(&latency, 0.99),
+			histogramQuantile(&latency, 0.999),
+			histogramQuantile(&latency, 1.0));
+	}
+	if (cpuStart >= 0 && cpuEnd >= 0 && requests > 0) {
+		printf("proxy cpu    %.1f us/request, %.0f%% of a core\n",
+			(double) (cpuEnd - cpuStart) / requests,
+			(cpuEnd - cpuStart) / elapsed / 1e4);
+	}
+
+	free(workers);
+
+	return errors > 0 && requests == 0 ? 1 : 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * Checks of the search index. Records are written to a persistence
+ * folder and indexed by the indexer thread. Searches must find exactly
+ * the records that hold every query token. The saved index must come
+ * back after a restart and a damaged one must be rebuilt.
+ *
+ * indexcheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../Proxy.h"
+#include "../Persistence.h"
+#include "../Index.h"
+#include "check.h"
+
+#define RECORDS 300
+//How long to wait for the indexer to catch up
+#define WAIT_MS 10000
+
+static int records = 0;
+
+static void ignore_error(const char *message) {
+}
+
+static void write_file(ProxyServer *p, const char *uniqueId,
+	const char *suffix, const char *data) {
+	char fileName[512];
+
+	snprintf(fileName, sizeof(fileName), "%s/%s.%s",
+		stringAsCString(p->persistenceFolder), uniqueId, suffix);
+
+	FILE *file = fopen(fileName, "wb");
+
+	fwrite(data, 1, strlen(data), file);
+	fclose(file);
+}
+
+/*
+ * Saves a whole record. The meta file goes last, as the proxy does, so
+ * the record is complete when the feed sees it.
+ */
+static void save_record(ProxyServer *p, const char *contentType,
+	const char *encoding, const char *body) {
+	char uniqueId[32], data[1024];
+	int i = records++;
+
+	snprintf(uniqueId, sizeof(uniqueId), "check-%d", i);
+	snprintf(data, sizeof(data), "GET /items/item%d?color=%s HTTP/1.1\r\n"
+		"Host: host%d.example\r\n\r\n", i, i % 2 ? "red" : "blue", i % 10);
+	write_file(p, uniqueId, "req", data);
+	snprintf(data, sizeof(data), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+		"%s\r\n%s", contentType, encoding, body);
+	write_file(p, uniqueId, "res", data);
+	snprintf(data, sizeof(data), "protocol-line\nGET /items/item%d HTTP/1.1\n"
+		"host\nhost%d.example\nport\n80\npath\n/items/item%d\n"
+		"response-status-code\n200\nresponse-status-message\nOK\n",
+		i, i % 10, i);
+	write_file(p, uniqueId, "meta", data);
+}
+
+static void save_records(ProxyServer *p, int count) {
+	char body[256];
+
+	for (int i = 0; i < count; ++i) {
+		snprintf(body, sizeof(body), "{\"common\": \"Shared\", \"word\": \"w%d\"}",
+			records % 7);
+		save_record(p, "application/json", "", body);
+	}
+}
+
+static int wait_for_documents(ProxyServer *p, unsigned long documents) {
+	IndexStats stats;
+	struct timespec pause = {0, 10 * 1000000};
+
+	for (int waited = 0; waited < WAIT_MS; waited += 10) {
+		proxyServerGetIndexStats(p, &stats);
+		if (stats.documents + stats.removed >= documents) {
+			return stats.documents + stats.removed == documents;
+		}
+		nanosleep(&pause, NULL);
+	}
+
+	return 0;
+}
+
+typedef struct _Found {
+	int ids[RECORDS + 16];
+	int count;
+} Found;
+
+static void found_callback(void *context, const char *uniqueId) {
+	Found *f = context;
+
+	if (f->count < RECORDS + 16) {
+		f->ids[f->count++] = atoi(uniqueId + strlen("check-"));
+	}
+}
+
+static int search(ProxyServer *p, const char *query, Found *f) {
+	f->count = 0;
+
+	int found = proxyServerSearch(p, query, f, found_callback);
+
+	return found == f->count ? found : -1;
+}
+
+//Records come back oldest first
+static int in_order(Found *f) {
+	for (int i = 1; i < f->count; ++i) {
+		if (f->ids[i] <= f->ids[i - 1]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void check_search(ProxyServer *p) {
+	Found *f = calloc(1, sizeof(Found));
+
+	CHECK(search(p, "shared", f) == RECORDS);
+	CHECK(in_order(f));
+	CHECK(search(p, "SHARED Common", f) == RECORDS);
+	CHECK(search(p, "w3", f) == RECORDS / 7 + (RECORDS % 7 > 3));
+	CHECK(in_order(f));
+	for (int i = 0; i < f->count; ++i) {
+		CHECK(f->ids[i] % 7 == 3);
+	}
+	//Host, path, query string and header values are indexed too
+	CHECK(search(p, "host4", f) == RECORDS / 10);
+	CHECK(search(p, "item42", f) == 1 && f->ids[0] == 42);
+	CHECK(search(p, "item42 w0", f) == 1);
+	CHECK(search(p, "item42 w1", f) == 0);
+	CHECK(search(p, "red w2 host5", f) > 0);
+	for (int i = 0; i < f->count; ++i) {
+		CHECK(f->ids[i] % 2 == 1 && f->ids[i] % 7 == 2 && f->ids[i] % 10 == 5);
+	}
+	CHECK(search(p, "json", f) == RECORDS);
+	CHECK(search(p, "missing", f) == 0);
+	CHECK(search(p, "shared missing", f) == 0);
+	//Single characters are not tokens
+	CHECK(search(p, "a", f) == 0);
+	CHECK(search(p, "", f) == 0);
+
+	free(f);
+}
+
+//Encoded and binary bodies are left out
+static void check_bodies(ProxyServer *p) {
+	Found *f = calloc(1, sizeof(Found));
+	int first = records;
+
+	save_record(p, "text/plain", "Content-Encoding: gzip\r\n", "zipped");
+	save_record(p, "image/png", "", "picture");
+	save_record(p, "text/html; charset=utf-8", "", "<p>visible</p>");
+	CHECK(wait_for_documents(p, records));
+
+	CHECK(search(p, "zipped", f) == 0);
+	CHECK(search(p, "picture", f) == 0);
+	CHECK(search(p, "visible", f) == 1 && f->ids[0] == first + 2);
+	CHECK(search(p, "gzip", f) == 1 && f->ids[0] == first);
+
+	free(f);
+}
+
+static void check_removed(ProxyServer *p) {
+	Found *f = calloc(1, sizeof(Found));
+	IndexStats stats;
+
+	indexRecordRemoved(p, "check-42");
+	indexRecordRemoved(p, "check-42");
+	indexRecordRemoved(p, "check-none");
+	CHECK(search(p, "item42", f) == 0);
+	CHECK(search(p, "shared", f) == RECORDS - 1);
+	proxyServerGetIndexStats(p, &stats);
+	CHECK(stats.removed == 1);
+	CHECK(stats.documents == (unsigned long) records - 1);
+
+	free(f);
+}
+
+static void restart(ProxyServer *p) {
+	proxyServerStopIndex(p);
+	CHECK(proxyServerStartIndex(p) == 0);
+}
+
+/*
+ * The saved index comes back without the records being read again. It
+ * still holds records whose files are gone.
+ */
+static void check_reload(ProxyServer *p) {
+	Found *f = calloc(1, sizeof(Found));
+	char fileName[512];
+	IndexStats stats;
+
+	restart(p);
+	snprintf(fileName, sizeof(fileName), "%s/check-7.res",
+		stringAsCString(p->persistenceFolder));
+	unlink(fileName);
+	restart(p);
+	proxyServerGetIndexStats(p, &stats);
+	CHECK(stats.documents == (unsigned long) records - 1);
+	CHECK(stats.removed == 1);
+	CHECK(search(p, "shared", f) == RECORDS - 1);
+	CHECK(search(p, "item42", f) == 0);
+	CHECK(search(p, "item7 w0", f) == 1);
+
+	//New records join the loaded index
+	save_records(p, 1);
+	CHECK(wait_for_documents(p, records));
+	CHECK(search(p, "shared", f) == RECORDS);
+	CHECK(f->count > 0 && f->ids[f->count - 1] == records - 1);
+
+	free(f);
+}
+
+/*
+ * A posting that points past the last document makes the saved index
+ * be rebuilt instead of loaded.
+ */
+static void check_bad_postings(ProxyServer *p) {
+	Found *f = calloc(1, sizeof(Found));
+	char fileName[512];
+	int before = search(p, "w3", f);
+
+	proxyServerStopIndex(p);
+	snprintf(fileName, sizeof(fileName), "%s/%s",
+		stringAsCString(p->persistenceFolder), INDEX_FILE);
+
+	FILE *file = fopen(fileName, "r+b");
+	static char data[1024 * 1024];
+	size_t length = fread(data, 1, sizeof(data), file);
+	//Length, text, count, last document and posting length of the term
+	char *term = memmem(data, length, "\2\0\0\0w3", 6);
+
+	CHECK(term != NULL);
+	if (term != NULL) {
+		uint32_t postingLength;
+
+		memcpy(&postingLength, term + 14, sizeof(uint32_t));
+		//The last delta jumps 127 documents ahead
+		term[18 + postingLength - 1] = 0x7f;
+		fseek(file, 0, SEEK_SET);
+		fwrite(data, 1, length, file);
+	}
+	fclose(file);
+
+	CHECK(proxyServerStartIndex(p) == 0);
+	CHECK(wait_for_documents(p, records));
+	CHECK(search(p, "w3", f) == before);
+	for (int i = 0; i < f->count; ++i) {
+		CHECK(f->ids[i] % 7 == 3);
+	}
+
+	free(f);
+}
+
+//A damaged index is rebuilt from the records
+static void check_damaged(ProxyServer *p) {
+	Found *f = calloc(1, sizeof(Found));
+	char fileName[512];
+
+	proxyServerStopIndex(p);
+	snprintf(fileName, sizeof(fileName), "%s/%s",
+		stringAsCString(p->persistenceFolder), INDEX_FILE);
+	CHECK(truncate(fileName, 100) == 0);
+	CHECK(proxyServerStartIndex(p) == 0);
+	CHECK(wait_for_documents(p, records));
+	//The record removed earlier is back and the one without a response
+	//can only be found by its request
+	CHECK(search(p, "item42", f) == 1);
+	CHECK(search(p, "item7", f) == 1);
+	CHECK(search(p, "item7 w0", f) == 0);
+	CHECK(search(p, "shared", f) == RECORDS);
+
+	free(f);
+}
+
+int main(int argc, char **argv) {
+	char folder[64];
+	ProxyServer *p = newProxyServer(0);
+
+	check_folder("indexcheck", folder);
+	p->onError = ignore_error;
+	stringAppendCString(p->persistenceFolder, folder);
+
+	CHECK(proxyServerSearch(p, "shared", NULL, NULL) < 0);
+	save_records(p, RECORDS - 1);
+	CHECK(proxyServerStartIndex(p) == 0);
+	CHECK(wait_for_documents(p, RECORDS - 1));
+	//Records written while the indexer runs are picked up
+	save_records(p, 1);
+	CHECK(wait_for_documents(p, RECORDS));
+
+	check_search(p);
+	check_bodies(p);
+	check_removed(p);
+	check_reload(p);
+	check_bad_postings(p);
+	check_damaged(p);
+
+	proxyServerStopIndex(p);
+	deleteProxyServer(p);
+	remove_check_folder(folder);
+
+	return check_summary("indexcheck");
+}
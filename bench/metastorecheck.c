@@ -0,0 +1,426 @@
+/*
+ * Checks of the meta data column store. Meta files with known values are
+ * written to a persistence folder and queries are compared with the same
+ * filters applied to the values directly. The saved columns must come
+ * back after a restart and damaged columns must be rebuilt.
+ *
+ * metastorecheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../Proxy.h"
+#include "../Persistence.h"
+#include "../HistoryFeed.h"
+#include "../MetaStore.h"
+#include "check.h"
+
+//More than one block of rows so that zone maps skip some
+#define RECORDS 3000
+#define BASE_SECONDS 1700000000LL
+#define WAIT_MS 10000
+//The row count follows the magic and the feed cursor
+#define ROWS_OFFSET (7 + sizeof(HistoryCursor))
+//Bytes per row of the host column and the ones after it
+#define HOST_TAIL_BYTES 24
+
+typedef struct _Row {
+	char host[32];
+	const char *method;
+	int status;
+	long long start; //Microseconds
+	long long duration;
+	unsigned long long requestSize;
+	unsigned long long responseSize;
+	int removed;
+} Row;
+
+static Row rows[RECORDS + 1];
+static int records = 0;
+
+static void ignore_error(const char *message) {
+}
+
+static void make_row(int i, Row *r) {
+	static const char *methods[] = {"GET", "POST", "PUT", "DELETE"};
+	static const int statuses[] = {200, 201, 301, 404, 500, 503};
+
+	snprintf(r->host, sizeof(r->host), "host%d.example", i % 5);
+	r->method = methods[i % 7 % 4];
+	r->status = statuses[i % 11 % 6];
+	r->start = (BASE_SECONDS + i) * 1000000 + i % 1000;
+	r->duration = (i * 37 % 5000) * 1000LL + i % 3;
+	r->requestSize = i * 3;
+	r->responseSize = i * 101 % 100000;
+	r->removed = 0;
+}
+
+/*
+ * Writes the meta file of the next record the way the proxy does.
+ */
+static void save_record(ProxyServer *p) {
+	char fileName[512];
+	int i = records++;
+	Row *r = rows + i;
+
+	make_row(i, r);
+	snprintf(fileName, sizeof(fileName), "%s/check-%d.meta",
+		stringAsCString(p->persistenceFolder), i);
+
+	FILE *file = fopen(fileName, "w");
+	long long end = r->start + r->duration;
+
+	fprintf(file, "protocol-line\n%s /items/%d HTTP/1.1\nhost\n%s\nport\n80\n"
+		"path\n/items/%d\nrequest-start-seconds\n%lld\n"
+		"request-start-microseconds\n%lld\nresponse-end-seconds\n%lld\n"
+		"response-end-microseconds\n%lld\nresponse-status-code\n%d\n"
+		"response-status-message\nOK\nrequest-bytes\n%llu\n"
+		"response-bytes\n%llu\n", r->method, i, r->host, i, r->start / 1000000,
+		r->start % 1000000, end / 1000000, end % 1000000, r->status,
+		r->requestSize, r->responseSize);
+	fclose(file);
+}
+
+typedef struct _Result {
+	int ids[RECORDS + 1];
+	long count;
+	int wrong; //Rows whose values did not match what was written
+} Result;
+
+static void result_callback(void *context, QueryRow *row) {
+	Result *result = context;
+	int i = atoi(row->uniqueId + strlen("check-"));
+	Row *r = rows + i;
+
+	if (result->count > RECORDS || i < 0 || i >= records) {
+		++result->wrong;
+
+		return;
+	}
+	result->wrong += strcmp(row->host, r->host) != 0 ||
+		strcmp(row->method, r->method) != 0 || row->status != r->status ||
+		row->startTime != r->start || row->duration != r->duration ||
+		row->requestSize != r->requestSize ||
+		row->responseSize != r->responseSize;
+	result->ids[result->count++] = i;
+}
+
+static long query(ProxyServer *p, const char *text, Result *result) {
+	result->count = 0;
+	result->wrong = 0;
+
+	long found = proxyServerQuery(p, text, result, result_callback);
+
+	return found == result->count && result->wrong == 0 ? found : -2;
+}
+
+static long live_rows() {
+	long count = 0;
+
+	for (int i = 0; i < records; ++i) {
+		count += !rows[i].removed;
+	}
+
+	return count;
+}
+
+static int wait_for_rows(ProxyServer *p, long expected) {
+	Result *result = calloc(1, sizeof(Result));
+	struct timespec pause = {0, 10 * 1000000};
+	long found = -1;
+
+	for (int waited = 0; waited < WAIT_MS && found != expected; waited += 10) {
+		found = query(p, "limit 100000", result);
+		if (found != expected) {
+			nanosleep(&pause, NULL);
+		}
+	}
+	free(result);
+
+	return found == expected;
+}
+
+typedef struct _Filter {
+	const char *query;
+	int (*matches)(Row *r);
+} Filter;
+
+static int server_errors(Row *r) {
+	return r->status >= 500;
+}
+
+static int not_success(Row *r) {
+	return r->status < 200 || r->status > 299;
+}
+
+static int host3_post(Row *r) {
+	return strcmp(r->host, "host3.example") == 0 &&
+		strcmp(r->method, "POST") == 0;
+}
+
+static int slow(Row *r) {
+	return r->duration > 2000000;
+}
+
+static int neither(Row *r) {
+	return !(r->status == 404 || strcmp(r->method, "GET") == 0);
+}
+
+static int sizes(Row *r) {
+	return r->requestSize >= 3 * 1024 && r->responseSize < 50 * 1024;
+}
+
+static int window(Row *r) {
+	return r->start >= (BASE_SECONDS + 1500) * 1000000 &&
+		r->start < (BASE_SECONDS + 2600) * 1000000;
+}
+
+static int ends(Row *r) {
+	return r->start + r->duration <= (BASE_SECONDS + 100) * 1000000;
+}
+
+static int mixed(Row *r) {
+	return (r->status == 301 || r->duration < 10000) &&
+		strcmp(r->host, "host0.example") != 0;
+}
+
+static int nothing(Row *r) {
+	return 0;
+}
+
+static const Filter filters[] = {
+	{"status >= 500", server_errors},
+	{"status = 5xx", server_errors},
+	{"status > 4xx", server_errors},
+	{"status != 2xx", not_success},
+	{"host = host3.example and method = post", host3_post},
+	{"duration > 2s", slow},
+	{"duration > 2000", slow},
+	{"duration > 2000000us", slow},
+	{"not (status = 404 or method = GET)", neither},
+	{"reqsize >= 3k and ressize < 50k", sizes},
+	{"start >= 1700001500 and start < 1700002600", window},
+	{"end <= 1700000100", ends},
+	{"(status = 301 or duration < 10ms) and not host = host0.example", mixed},
+	{"host = nowhere.example", nothing},
+	{"method = PATCH or status = 999", nothing},
+};
+
+static void check_filters(ProxyServer *p) {
+	Result *result = calloc(1, sizeof(Result));
+
+	for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); ++f) {
+		long expected = 0;
+		int mismatches = 0;
+
+		for (int i = 0; i < records; ++i) {
+			expected += !rows[i].removed && filters[f].matches(rows + i);
+		}
+		if (query(p, filters[f].query, result) != expected) {
+			fprintf(stderr, "%s: %ld found, %ld expected\n", filters[f].query,
+				result->count, expected);
+			CHECK(0);
+			continue;
+		}
+		for (long i = 0; i < result->count; ++i) {
+			Row *r = rows + result->ids[i];
+
+			mismatches += r->removed || !filters[f].matches(r);
+		}
+		CHECK(mismatches == 0);
+	}
+
+	free(result);
+}
+
+static void check_order(ProxyServer *p) {
+	Result *result = calloc(1, sizeof(Result));
+	int sorted = 1;
+
+	CHECK(query(p, "status >= 500 order by duration desc limit 20", result) ==
+		20);
+	for (long i = 1; i < result->count; ++i) {
+		sorted &= rows[result->ids[i]].duration <=
+			rows[result->ids[i - 1]].duration;
+	}
+	CHECK(sorted);
+
+	long long longest = 0;
+
+	for (int i = 0; i < records; ++i) {
+		if (!rows[i].removed && rows[i].status >= 500 &&
+			rows[i].duration > longest) {
+			longest = rows[i].duration;
+		}
+	}
+	CHECK(result->count > 0 && rows[result->ids[0]].duration == longest);
+
+	//Host names sort by name, not by the order they were first seen
+	CHECK(query(p, "order by host asc", result) > 0);
+	for (long i = 1; i < result->count; ++i) {
+		sorted &= strcmp(rows[result->ids[i]].host,
+			rows[result->ids[i - 1]].host) >= 0;
+	}
+	CHECK(sorted);
+	CHECK(query(p, "order by ressize limit 1", result) == 1);
+	CHECK(rows[result->ids[0]].responseSize == 0);
+	CHECK(query(p, "status = 200 limit 7", result) == 7);
+	CHECK(query(p, "limit 0", result) == 0);
+
+	free(result);
+}
+
+static void check_syntax(ProxyServer *p) {
+	static const char *invalid[] = {"status >", "colour = red", "(status = 200",
+		"status = abc", "host > x", "status = 200 limit", "limit -1",
+		"order by", "order by colour", "status = 200 status = 201",
+		"start >= 25:99", "duration > 5parsecs", "not", "status = 200 and"};
+
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+		CHECK(proxyServerQuery(p, invalid[i], NULL, NULL) == -1);
+	}
+}
+
+static void check_removed(ProxyServer *p) {
+	Result *result = calloc(1, sizeof(Result));
+
+	for (int i = 0; i < records; i += 3) {
+		char uniqueId[32];
+
+		snprintf(uniqueId, sizeof(uniqueId), "check-%d", i);
+		metaStoreRecordRemoved(p, uniqueId);
+		rows[i].removed = 1;
+	}
+	metaStoreRecordRemoved(p, "check-none");
+	CHECK(query(p, "limit 100000", result) == live_rows());
+	check_filters(p);
+
+	free(result);
+}
+
+static void restart(ProxyServer *p) {
+	proxyServerStopMetaStore(p);
+	CHECK(proxyServerStartMetaStore(p) == 0);
+	proxyServerWaitMetaStore(p);
+}
+
+/*
+ * The saved columns come back without reading the meta files again, so
+ * removed rows stay removed.
+ */
+static void check_reload(ProxyServer *p) {
+	restart(p);
+	check_filters(p);
+
+	save_record(p);
+	CHECK(wait_for_rows(p, live_rows()));
+	check_filters(p);
+}
+
+//Damaged columns are rebuilt from the meta files
+static void check_damaged(ProxyServer *p) {
+	char fileName[512];
+
+	proxyServerStopMetaStore(p);
+	snprintf(fileName, sizeof(fileName), "%s/%s",
+		stringAsCString(p->persistenceFolder), META_STORE_FILE);
+	CHECK(truncate(fileName, 1000) == 0);
+	for (int i = 0; i < records; ++i) {
+		rows[i].removed = 0;
+	}
+	CHECK(proxyServerStartMetaStore(p) == 0);
+	proxyServerWaitMetaStore(p);
+	CHECK(wait_for_rows(p, live_rows()));
+	check_filters(p);
+}
+
+static void overwrite(const char *fileName, long offset, const void *data,
+	size_t length) {
+	FILE *file = fopen(fileName, "r+b");
+
+	CHECK(file != NULL);
+	if (file != NULL) {
+		CHECK(fseek(file, offset, SEEK_SET) == 0);
+		CHECK(fwrite(data, 1, length, file) == length);
+		fclose(file);
+	}
+}
+
+/*
+ * A row count that does not fit the file and a host ID beyond the host
+ * table are damage too.
+ */
+static void check_bad_rows(ProxyServer *p) {
+	char fileName[512];
+	uint64_t rows = 0;
+	uint32_t host = UINT32_MAX;
+	struct stat st;
+
+	snprintf(fileName, sizeof(fileName), "%s/%s",
+		stringAsCString(p->persistenceFolder), META_STORE_FILE);
+	for (int damage = 0; damage < 2; ++damage) {
+		FILE *file;
+
+		proxyServerStopMetaStore(p);
+		file = fopen(fileName, "rb");
+		CHECK(file != NULL && stat(fileName, &st) == 0);
+		if (file == NULL) {
+			return;
+		}
+		CHECK(fseek(file, ROWS_OFFSET, SEEK_SET) == 0 &&
+			fread(&rows, sizeof(rows), 1, file) == 1);
+		fclose(file);
+		CHECK(rows == (uint64_t) records);
+		if (damage == 0) {
+			--rows;
+			overwrite(fileName, ROWS_OFFSET, &rows, sizeof(rows));
+		} else {
+			overwrite(fileName, st.st_size - rows * HOST_TAIL_BYTES, &host,
+				sizeof(host));
+		}
+		CHECK(proxyServerStartMetaStore(p) == 0);
+		proxyServerWaitMetaStore(p);
+		CHECK(wait_for_rows(p, live_rows()));
+		check_filters(p);
+	}
+}
+
+int main(int argc, char **argv) {
+	char folder[64];
+	ProxyServer *p = newProxyServer(0);
+
+	check_folder("metastorecheck", folder);
+	p->onError = ignore_error;
+	stringAppendCString(p->persistenceFolder, folder);
+
+	CHECK(proxyServerQuery(p, "status = 200", NULL, NULL) < 0);
+	for (int i = 0; i < RECORDS; ++i) {
+		save_record(p);
+	}
+	CHECK(proxyServerStartMetaStore(p) == 0);
+	proxyServerWaitMetaStore(p);
+	CHECK(wait_for_rows(p, records));
+
+	check_filters(p);
+	check_order(p);
+	check_syntax(p);
+	check_removed(p);
+	check_reload(p);
+	check_damaged(p);
+	check_bad_rows(p);
+
+	proxyServerStopMetaStore(p);
+	deleteProxyServer(p);
+	remove_check_folder(folder);
+
+	return check_summary("metastorecheck");
+}
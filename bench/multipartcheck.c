@@ -0,0 +1,280 @@
+/*
+ * Checks of form parameter parsing. Requests with query strings, URL
+ * encoded and multipart form bodies are saved as records in a temporary
+ * folder, loaded and read back through the parameter API. Multipart
+ * bodies include boundary look-alikes, a large binary upload, a preamble
+ * and bodies cut off at every byte.
+ *
+ * multipartcheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../Proxy.h"
+#include "../Persistence.h"
+#include "check.h"
+
+#define UPLOAD_SIZE (1024 * 1024)
+#define BOUNDARY "----pixieBoundary7MA4YWxkTrZu0gW"
+
+static void ignore_error(const char *message) {
+}
+
+static int slice_is(Slice *s, const char *data, size_t length) {
+	return s->length == length &&
+		(length == 0 || memcmp(s->buffer, data, length) == 0);
+}
+
+static int parameter_is(RequestRecord *rec, size_t index, const char *name,
+	const char *value) {
+	Slice n, v;
+
+	return requestRecordParameterAt(rec, index, &n, &v) == 0 &&
+		slice_is(&n, name, strlen(name)) && slice_is(&v, value, strlen(value));
+}
+
+static int part_is(RequestRecord *rec, size_t index, const char *fileName,
+	const char *contentType) {
+	Slice f, t;
+
+	return requestRecordPartAt(rec, index, &f, &t) == 0 &&
+		slice_is(&f, fileName, strlen(fileName)) &&
+		slice_is(&t, contentType, strlen(contentType));
+}
+
+/*
+ * Saves a request and loads it into rec. The record must be reset by
+ * the caller.
+ */
+static int load_request(ProxyServer *p, const char *header, const char *body,
+	size_t length, RequestRecord *rec) {
+	char fileName[512];
+
+	snprintf(fileName, sizeof(fileName), "%s/check.req",
+		stringAsCString(p->persistenceFolder));
+
+	FILE *file = fopen(fileName, "wb");
+
+	fwrite(header, 1, strlen(header), file);
+	fwrite(body, 1, length, file);
+	fclose(file);
+
+	return proxyServerLoadRequest(p, "check", rec);
+}
+
+static void check_url_encoded(ProxyServer *p, RequestRecord *rec) {
+	const char *body = "a+b=c%20d&bad=%zz%4&empty=&=novalue&last=%41%42";
+
+	CHECK(load_request(p, "POST /form?q=one%2Ftwo&flag HTTP/1.1\r\n"
+		"Host: example.com\r\n"
+		"Content-Type: application/x-www-form-urlencoded\r\n\r\n",
+		body, strlen(body), rec) == 0);
+	CHECK(requestRecordParameterCount(rec) == 7);
+	CHECK(requestRecordQueryParameterCount(rec) == 2);
+	CHECK(parameter_is(rec, 0, "q", "one/two"));
+	CHECK(parameter_is(rec, 1, "flag", ""));
+	CHECK(parameter_is(rec, 2, "a b", "c d"));
+	//Bad escapes are kept as they are
+	CHECK(parameter_is(rec, 3, "bad", "%zz%4"));
+	CHECK(parameter_is(rec, 4, "empty", ""));
+	CHECK(parameter_is(rec, 5, "", "novalue"));
+	CHECK(parameter_is(rec, 6, "last", "AB"));
+	//Decoding twice must not decode again
+	CHECK(parameter_is(rec, 2, "a b", "c d"));
+	CHECK(requestRecordParameterAt(rec, 7, &(Slice) {0}, &(Slice) {0}) < 0);
+	CHECK(!part_is(rec, 2, "", ""));
+	proxyServerResetRecords(p, rec, NULL);
+}
+
+static void append(Buffer *b, const char *text) {
+	bufferAppendBytes(b, text, strlen(text));
+}
+
+/*
+ * A form with a text field, a field whose value looks like the boundary,
+ * a large binary upload and a field with no name.
+ */
+static void make_form(Buffer *body, Buffer *upload) {
+	uint64_t x = 2463534242ULL;
+
+	while (upload->length < UPLOAD_SIZE) {
+		char ch;
+
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		ch = (char) x;
+		bufferAppendBytes(upload, &ch, 1);
+	}
+	//Near misses of the delimiter inside the upload
+	memcpy(upload->buffer + 1000, "\r\n--" BOUNDARY, 4 + strlen(BOUNDARY) - 1);
+	memcpy(upload->buffer + 5000, "--" BOUNDARY "\r\n", strlen(BOUNDARY) + 4);
+
+	append(body, "This is the preamble.\r\n");
+	append(body, "--" BOUNDARY "\r\n");
+	append(body, "Content-Disposition: form-data; name=\"title\"\r\n\r\n");
+	append(body, "Hello\r\nworld");
+	append(body, "\r\n--" BOUNDARY "\r\n");
+	append(body, "Content-Disposition: form-data; name=\"a;b\"\r\n\r\n");
+	append(body, "--" BOUNDARY "x");
+	append(body, "\r\n--" BOUNDARY "\r\n");
+	append(body, "content-disposition: form-data; name=\"file\"; "
+		"filename=\"photo 1.jpg\"\r\n");
+	append(body, "Content-Type:  image/jpeg\r\n\r\n");
+	bufferAppendBytes(body, upload->buffer, upload->length);
+	append(body, "\r\n--" BOUNDARY "\r\n");
+	append(body, "Content-Disposition: form-data\r\n\r\n");
+	append(body, "anonymous");
+	append(body, "\r\n--" BOUNDARY "--\r\n");
+	append(body, "This is the epilogue.\r\n");
+}
+
+static void check_multipart(ProxyServer *p, RequestRecord *rec, Buffer *body,
+	Buffer *upload) {
+	Slice name, value;
+
+	CHECK(load_request(p, "POST /upload?id=7 HTTP/1.1\r\n"
+		"Host: example.com\r\n"
+		"Content-Type: multipart/form-data; charset=utf-8; "
+		"boundary=\"" BOUNDARY "\"\r\n\r\n",
+		body->buffer, body->length, rec) == 0);
+	CHECK(requestRecordParameterCount(rec) == 5);
+	CHECK(requestRecordQueryParameterCount(rec) == 1);
+	CHECK(parameter_is(rec, 0, "id", "7"));
+	CHECK(requestRecordPartAt(rec, 0, &name, &value) < 0);
+	CHECK(parameter_is(rec, 1, "title", "Hello\r\nworld"));
+	CHECK(part_is(rec, 1, "", ""));
+	CHECK(parameter_is(rec, 2, "a;b", "--" BOUNDARY "x"));
+	CHECK(requestRecordParameterAt(rec, 3, &name, &value) == 0);
+	CHECK(slice_is(&name, "file", 4));
+	CHECK(slice_is(&value, upload->buffer, upload->length));
+	CHECK(part_is(rec, 3, "photo 1.jpg", "image/jpeg"));
+	CHECK(parameter_is(rec, 4, "", "anonymous"));
+	CHECK(requestRecordPartAt(rec, 5, &name, &value) < 0);
+	proxyServerResetRecords(p, rec, NULL);
+
+	//Unquoted boundary ending the header value
+	CHECK(load_request(p, "POST /upload HTTP/1.1\r\nHost: example.com\r\n"
+		"Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n\r\n",
+		body->buffer, body->length, rec) == 0);
+	CHECK(requestRecordParameterCount(rec) == 4);
+	CHECK(requestRecordQueryParameterCount(rec) == 0);
+	CHECK(part_is(rec, 2, "photo 1.jpg", "image/jpeg"));
+	proxyServerResetRecords(p, rec, NULL);
+}
+
+/*
+ * Every cut of the body parses without reading past the end. Parts that
+ * were complete keep their values and the last part is shorter.
+ */
+static void check_cut_off(ProxyServer *p, RequestRecord *rec) {
+	Buffer *body = newBufferWithCapacity(1024);
+	size_t lastCount = 0;
+	int shrank = 0, wrong = 0;
+
+	append(body, "--" BOUNDARY "\r\n");
+	append(body, "Content-Disposition: form-data; name=\"one\"\r\n\r\n");
+	append(body, "first value");
+	append(body, "\r\n--" BOUNDARY "\r\n");
+	append(body, "Content-Disposition: form-data; name=\"two\"; "
+		"filename=\"b.txt\"\r\nContent-Type: text/plain\r\n\r\n");
+	append(body, "second value");
+	append(body, "\r\n--" BOUNDARY "--\r\n");
+
+	for (size_t length = 0; length <= body->length; ++length) {
+		Slice name, value;
+
+		if (load_request(p, "POST / HTTP/1.1\r\nHost: example.com\r\n"
+			"Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n\r\n",
+			body->buffer, length, rec) < 0) {
+			++wrong;
+			continue;
+		}
+
+		size_t count = requestRecordParameterCount(rec);
+
+		shrank += count < lastCount;
+		lastCount = count;
+		for (size_t i = 0; i < count; ++i) {
+			if (requestRecordParameterAt(rec, i, &name, &value) < 0 ||
+				value.buffer + value.length > rec->bodyBuffer.buffer + length) {
+				++wrong;
+			}
+		}
+		if (count == 2 && (!parameter_is(rec, 0, "one", "first value") ||
+			!part_is(rec, 1, "b.txt", "text/plain"))) {
+			++wrong;
+		}
+		if (length == body->length && (count != 2 ||
+			!parameter_is(rec, 1, "two", "second value"))) {
+			++wrong;
+		}
+		proxyServerResetRecords(p, rec, NULL);
+	}
+	CHECK(wrong == 0);
+	CHECK(shrank == 0);
+	CHECK(lastCount == 2);
+	deleteBuffer(body);
+}
+
+static void check_refused(ProxyServer *p, RequestRecord *rec, Buffer *body) {
+	char header[512];
+
+	//No boundary, an empty one and one longer than RFC 2046 allows
+	CHECK(load_request(p, "POST / HTTP/1.1\r\nHost: example.com\r\n"
+		"Content-Type: multipart/form-data\r\n\r\n",
+		body->buffer, body->length, rec) == 0);
+	CHECK(requestRecordParameterCount(rec) == 0);
+	proxyServerResetRecords(p, rec, NULL);
+
+	CHECK(load_request(p, "POST / HTTP/1.1\r\nHost: example.com\r\n"
+		"Content-Type: multipart/form-data; boundary=\"\"\r\n\r\n",
+		body->buffer, body->length, rec) == 0);
+	CHECK(requestRecordParameterCount(rec) == 0);
+	proxyServerResetRecords(p, rec, NULL);
+
+	snprintf(header, sizeof(header), "POST / HTTP/1.1\r\nHost: example.com\r\n"
+		"Content-Type: multipart/form-data; boundary=%071d\r\n\r\n", 0);
+	CHECK(load_request(p, header, body->buffer, body->length, rec) == 0);
+	CHECK(requestRecordParameterCount(rec) == 0);
+	proxyServerResetRecords(p, rec, NULL);
+
+	//A boundary that never appears
+	CHECK(load_request(p, "POST / HTTP/1.1\r\nHost: example.com\r\n"
+		"Content-Type: multipart/form-data; boundary=elsewhere\r\n\r\n",
+		body->buffer, body->length, rec) == 0);
+	CHECK(requestRecordParameterCount(rec) == 0);
+	proxyServerResetRecords(p, rec, NULL);
+}
+
+int main(int argc, char **argv) {
+	char folder[64];
+	ProxyServer *p = newProxyServer(0);
+	RequestRecord *rec = newRequestRecord();
+	Buffer *body = newBufferWithCapacity(UPLOAD_SIZE + 1024);
+	Buffer *upload = newBufferWithCapacity(UPLOAD_SIZE);
+
+	check_folder("multipartcheck", folder);
+	p->onError = ignore_error;
+	stringAppendCString(p->persistenceFolder, folder);
+	make_form(body, upload);
+
+	check_url_encoded(p, rec);
+	check_multipart(p, rec, body, upload);
+	check_cut_off(p, rec);
+	check_refused(p, rec, body);
+
+	deleteBuffer(upload);
+	deleteBuffer(body);
+	deleteRequestRecord(rec);
+	deleteProxyServer(p);
+	remove_check_folder(folder);
+
+	return check_summary("multipartcheck");
+}
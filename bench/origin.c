@@ -0,0 +1,246 @@
+/*
+ * HTTP origin stub for benchmarks. A pool of threads accepts connections
+ * and serves every request with a generated body. Connections are kept
+ * alive unless the client asks to close.
+ *
+ * origin [-p port] [-t threads] [-s size] [-l latencyMs] [-c]
+ *
+ * -s, -l and -c (chunked) set the defaults. A request can override them
+ * with size, delay and chunked query parameters:
+ *
+ * GET /?size=65536&delay=5&chunked=1
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_HEADER (16 * 1024)
+#define MAX_BODY (64 * 1024 * 1024)
+#define CHUNK_SIZE (16 * 1024)
+
+static int listenFd;
+static long defaultSize = 1024;
+static long defaultDelay = 0;
+static int defaultChunked = 0;
+static char *body;
+
+static int write_all(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t n = write(fd, data, length);
+
+		if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+static long query_value(const char *path, const char *name, long fallback) {
+	const char *query = strchr(path, '?');
+	size_t length = strlen(name);
+
+	for (const char *s = query; s != NULL; s = strchr(s + 1, '&')) {
+		if (strncmp(s + 1, name, length) == 0 && s[1 + length] == '=') {
+			return atol(s + 2 + length);
+		}
+	}
+
+	return fallback;
+}
+
+static int send_response(int fd, const char *path, int keepAlive) {
+	char header[256];
+	long size = query_value(path, "size", defaultSize);
+	long delay = query_value(path, "delay", defaultDelay);
+	int chunked = query_value(path, "chunked", defaultChunked);
+
+	if (size < 0 || size > MAX_BODY) {
+		size = MAX_BODY;
+	}
+	if (delay > 0) {
+		usleep(delay * 1000);
+	}
+
+	int length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Connection: %s\r\n", keepAlive ? "keep-alive" : "close");
+
+	if (chunked) {
+		length += snprintf(header + length, sizeof(header) - length,
+			"Transfer-Encoding: chunked\r\n\r\n");
+	} else {
+		length += snprintf(header + length, sizeof(header) - length,
+			"Content-Length: %ld\r\n\r\n", size);
+	}
+	if (write_all(fd, header, length) < 0) {
+		return -1;
+	}
+	if (!chunked) {
+		return write_all(fd, body, size);
+	}
+
+	for (long sent = 0; sent < size; sent += CHUNK_SIZE) {
+		long n = size - sent < CHUNK_SIZE ? size - sent : CHUNK_SIZE;
+
+		length = snprintf(header, sizeof(header), "%lx\r\n", n);
+		if (write_all(fd, header, length) < 0 || write_all(fd, body, n) < 0 ||
+			write_all(fd, "\r\n", 2) < 0) {
+			return -1;
+		}
+	}
+
+	return write_all(fd, "0\r\n\r\n", 5);
+}
+
+/*
+ * Serves requests on a connection until either side closes it.
+ */
+static void serve(int fd) {
+	char *request = malloc(MAX_HEADER + 1);
+	size_t length = 0;
+
+	while (1) {
+		char *end = NULL;
+
+		request[length] = '\0';
+		while ((end = strstr(request, "\r\n\r\n")) == NULL) {
+			if (length == MAX_HEADER) {
+				free(request);
+
+				return;
+			}
+
+			ssize_t n = read(fd, request + length, MAX_HEADER - length);
+
+			if (n <= 0) {
+				free(request);
+
+				return;
+			}
+			length += n;
+			request[length] = '\0';
+		}
+
+		//Request bodies are read and dropped
+		size_t headerLength = end + 4 - request;
+		const char *contentLength = strcasestr(request, "\r\nContent-Length:");
+		long bodyLength = contentLength != NULL && contentLength < end ?
+			atol(contentLength + 17) : 0;
+		int keepAlive = strcasestr(request, "\r\nConnection: close") == NULL;
+		char path[2048] = "/";
+
+		sscanf(request, "%*s %2047s", path);
+		while ((long) (length - headerLength) < bodyLength) {
+			char discard[16 * 1024];
+			long want = bodyLength - (length - headerLength);
+			ssize_t n = read(fd, discard,
+				want < (long) sizeof(discard) ? want : (long) sizeof(discard));
+
+			if (n <= 0) {
+				free(request);
+
+				return;
+			}
+			bodyLength -= n;
+		}
+		if (bodyLength > (long) (length - headerLength)) {
+			bodyLength = length - headerLength;
+		}
+
+		if (send_response(fd, path, keepAlive) < 0 || !keepAlive) {
+			break;
+		}
+
+		//Keep what was pipelined after this request
+		size_t used = headerLength + bodyLength;
+
+		memmove(request, request + used, length - used);
+		length -= used;
+	}
+
+	free(request);
+}
+
+static void *worker(void *data) {
+	while (1) {
+		int fd = accept(listenFd, NULL, NULL);
+
+		if (fd < 0) {
+			continue;
+		}
+
+		int on = 1;
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int port = 9000;
+	int threads = 64;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:t:s:l:c")) != -1) {
+		if (c == 'p') {
+			port = atoi(optarg);
+		} else if (c == 't') {
+			threads = atoi(optarg);
+		} else if (c == 's') {
+			defaultSize = atol(optarg);
+		} else if (c == 'l') {
+			defaultDelay = atol(optarg);
+		} else if (c == 'c') {
+			defaultChunked = 1;
+		} else {
+			return 2;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	body = malloc(MAX_BODY);
+	memset(body, 'x', MAX_BODY);
+
+	listenFd = socket(PF_INET, SOCK_STREAM, 0);
+
+	int reuse = 1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+		listen(listenFd, 1024) < 0) {
+		perror("Failed to listen");
+
+		return 1;
+	}
+
+	for (int i = 1; i < threads; ++i) {
+		pthread_t id;
+
+		pthread_create(&id, NULL, worker, NULL);
+		pthread_detach(id);
+	}
+	worker(NULL);
+
+	return 0;
+}
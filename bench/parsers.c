@@ -0,0 +1,595 @@
+/*
+ * Microbenchmarks of the message parsers over the corpus in bench/corpus.
+ *
+ * parsers [-d corpusFolder] [-n rounds]
+ *
+ * The streaming parsers are fed every corpus message in one read and
+ * then split in two at every possible read boundary. A split parse must
+ * give the same result as a single read. The loaders are run over
+ * records written from the corpus to a temporary folder.
+ *
+ * Each row reports the time per byte and per message and the heap
+ * allocations and reallocations per message. Allocations are counted by
+ * wrapping malloc at link time so those made inside libc, such as by
+ * fopen(), are not seen.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+//The parsers are static so Proxy.c is compiled in here
+#include "../Proxy.c"
+
+#define MAX_MESSAGES 256
+
+typedef struct _Corpus {
+	char *data;
+	size_t count;
+	const char *messages[MAX_MESSAGES];
+	size_t lengths[MAX_MESSAGES];
+} Corpus;
+
+typedef struct _Result {
+	unsigned long long messages;
+	unsigned long long bytes;
+	unsigned long long nanos;
+	unsigned long long allocs;
+	unsigned long long reallocs;
+} Result;
+
+static unsigned long long alloc_count = 0;
+static unsigned long long realloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	++alloc_count;
+
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+	++alloc_count;
+
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		++alloc_count;
+	} else {
+		++realloc_count;
+	}
+
+	return __real_realloc(ptr, size);
+}
+
+static unsigned long long now_nanos() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void begin(Result *r) {
+	memset(r, 0, sizeof(Result));
+	r->allocs = alloc_count;
+	r->reallocs = realloc_count;
+	r->nanos = now_nanos();
+}
+
+static void end(Result *r) {
+	r->nanos = now_nanos() - r->nanos;
+	r->allocs = alloc_count - r->allocs;
+	r->reallocs = realloc_count - r->reallocs;
+}
+
+static void report(const char *name, Result *r) {
+	double messages = r->messages > 0 ? r->messages : 1;
+
+	printf("%-32s %9llu %6.2f %9.1f %8.2f %8.2f\n", name, r->messages,
+		r->bytes > 0 ? (double) r->nanos / r->bytes : 0.0,
+		r->nanos / messages, r->allocs / messages, r->reallocs / messages);
+}
+
+static char *read_file(const char *folder, const char *name, size_t *length) {
+	char fileName[512];
+
+	snprintf(fileName, sizeof(fileName), "%s/%s", folder, name);
+
+	FILE *file = fopen(fileName, "rb");
+
+	if (file == NULL) {
+		perror(fileName);
+
+		return NULL;
+	}
+
+	Buffer *b = newBufferWithCapacity(4096);
+	char chunk[4096];
+	size_t n;
+
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		bufferAppendBytes(b, chunk, n);
+	}
+	fclose(file);
+
+	char *data = malloc(b->length + 1);
+
+	memcpy(data, b->buffer, b->length);
+	data[b->length] = '\0';
+	*length = b->length;
+	deleteBuffer(b);
+
+	return data;
+}
+
+/*
+ * Message heads are kept with plain line ends and end with an empty line.
+ * They are converted to CRLF as sent on the wire.
+ */
+static int load_heads(const char *folder, const char *name, Corpus *c) {
+	size_t length;
+	char *text = read_file(folder, name, &length);
+
+	if (text == NULL) {
+		return -1;
+	}
+
+	c->data = malloc(length * 2 + 1);
+	c->count = 0;
+
+	char *out = c->data;
+	char *line = text;
+	const char *start = out;
+
+	while (*line != '\0' && c->count < MAX_MESSAGES) {
+		char *eol = strchr(line, '\n');
+		size_t lineLength = eol != NULL ? (size_t) (eol - line) : strlen(line);
+
+		memcpy(out, line, lineLength);
+		out += lineLength;
+		*out++ = '\r';
+		*out++ = '\n';
+		if (lineLength == 0) {
+			c->messages[c->count] = start;
+			c->lengths[c->count] = out - start;
+			++c->count;
+			start = out;
+		}
+		if (eol == NULL) {
+			break;
+		}
+		line = eol + 1;
+	}
+	free(text);
+
+	return 0;
+}
+
+//One line per message
+static int load_lines(const char *folder, const char *name, Corpus *c) {
+	size_t length;
+
+	c->data = read_file(folder, name, &length);
+	c->count = 0;
+	if (c->data == NULL) {
+		return -1;
+	}
+
+	for (char *line = c->data; *line != '\0' && c->count < MAX_MESSAGES;) {
+		char *eol = strchr(line, '\n');
+
+		c->messages[c->count] = line;
+		c->lengths[c->count] = eol != NULL ? (size_t) (eol - line) :
+			strlen(line);
+		++c->count;
+		if (eol == NULL) {
+			break;
+		}
+		line = eol + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The request is never connected. A server descriptor is set so that the
+ * parser schedules the write instead of connecting.
+ */
+static void reset_request(Request *req) {
+	req->requestState = REQ_STATE_NONE;
+	req->clientFd = 0;
+	req->serverFd = 0;
+	req->clientIOFlag = RW_STATE_NONE;
+	req->serverIOFlag = RW_STATE_NONE;
+}
+
+static void feed_request(ProxyServer *p, Request *req, const char *data,
+	size_t length) {
+	req->requestBuffer->length = 0;
+	bufferAppendBytes(req->requestBuffer, data, length);
+	read_request_header(p, req);
+}
+
+static void parse_request(ProxyServer *p, Request *req, const char *data,
+	size_t length, size_t split) {
+	reset_request(req);
+	if (split > 0) {
+		feed_request(p, req, data, split);
+	}
+	feed_request(p, req, data + split, length - split);
+}
+
+static void feed_response(ProxyServer *p, Request *req, const char *data,
+	size_t length) {
+	req->responseBuffer->length = 0;
+	bufferAppendBytes(req->responseBuffer, data, length);
+	if (req->responseHeaderParseState != RES_HEADER_STATE_DONE) {
+		parse_response_header(p, req);
+	}
+}
+
+static void parse_response(ProxyServer *p, Request *req, const char *data,
+	size_t length, size_t split) {
+	req->responseHeaderParseState = RES_HEADER_STATE_PROTOCOL;
+	req->responseStatusCode->length = 0;
+	req->responseStatusMessage->length = 0;
+	if (split > 0) {
+		feed_response(p, req, data, split);
+	}
+	feed_response(p, req, data + split, length - split);
+}
+
+static int same_bytes(Buffer *b, const char *data, size_t length) {
+	return b->length == length && memcmp(b->buffer, data, length) == 0;
+}
+
+static int same_string(String *a, String *b) {
+	return a->length == b->length &&
+		memcmp(a->buffer, b->buffer, a->length) == 0;
+}
+
+static int bench_requests(ProxyServer *p, Corpus *c, int rounds) {
+	Request *req = p->requests;
+	Buffer *expected = newBufferWithCapacity(4096);
+	int mismatches = 0;
+	Result r;
+
+	//A single read is cheap so it gets more rounds
+	begin(&r);
+	for (int round = 0; round < rounds * 100; ++round) {
+		for (size_t m = 0; m < c->count; ++m) {
+			parse_request(p, req, c->messages[m], c->lengths[m], 0);
+			r.bytes += c->lengths[m];
+		}
+	}
+	r.messages = (unsigned long long) rounds * 100 * c->count;
+	end(&r);
+	report("read_request_header 1 read", &r);
+
+	begin(&r);
+	for (size_t m = 0; m < c->count; ++m) {
+		//What is sent to the server must not depend on the reads
+		parse_request(p, req, c->messages[m], c->lengths[m], 0);
+		expected->length = 0;
+		bufferAppendBytes(expected, req->requestBuffer->buffer,
+			req->requestBuffer->length);
+
+		for (int round = 0; round < rounds; ++round) {
+			for (size_t split = 1; split < c->lengths[m]; ++split) {
+				parse_request(p, req, c->messages[m], c->lengths[m], split);
+				if (round == 0 && !same_bytes(req->requestBuffer,
+					expected->buffer, expected->length)) {
+					fprintf(stderr, "Request %zu differs when split at %zu.\n",
+						m, split);
+					++mismatches;
+				}
+			}
+		}
+		r.messages += (unsigned long long) rounds * (c->lengths[m] - 1);
+		r.bytes += (unsigned long long) rounds * (c->lengths[m] - 1) *
+			c->lengths[m];
+	}
+	end(&r);
+	report("read_request_header 2 reads", &r);
+	deleteBuffer(expected);
+
+	return mismatches;
+}
+
+static int bench_responses(ProxyServer *p, Corpus *c, int rounds) {
+	Request *req = p->requests;
+	String *code = newString();
+	String *message = newString();
+	int mismatches = 0;
+	Result r;
+
+	//A single read is cheap so it gets more rounds
+	begin(&r);
+	for (int round = 0; round < rounds * 100; ++round) {
+		for (size_t m = 0; m < c->count; ++m) {
+			parse_response(p, req, c->messages[m], c->lengths[m], 0);
+			r.bytes += c->lengths[m];
+		}
+	}
+	r.messages = (unsigned long long) rounds * 100 * c->count;
+	end(&r);
+	report("parse_response_header 1 read", &r);
+
+	begin(&r);
+	for (size_t m = 0; m < c->count; ++m) {
+		parse_response(p, req, c->messages[m], c->lengths[m], 0);
+		code->length = 0;
+		stringAppendBuffer(code, req->responseStatusCode->buffer,
+			req->responseStatusCode->length);
+		message->length = 0;
+		stringAppendBuffer(message, req->responseStatusMessage->buffer,
+			req->responseStatusMessage->length);
+
+		for (int round = 0; round < rounds; ++round) {
+			for (size_t split = 1; split < c->lengths[m]; ++split) {
+				parse_response(p, req, c->messages[m], c->lengths[m], split);
+				if (round == 0 && (!same_string(code, req->responseStatusCode) ||
+					!same_string(message, req->responseStatusMessage))) {
+					fprintf(stderr, "Response %zu differs when split at %zu.\n",
+						m, split);
+					++mismatches;
+				}
+			}
+		}
+		r.messages += (unsigned long long) rounds * (c->lengths[m] - 1);
+		r.bytes += (unsigned long long) rounds * (c->lengths[m] - 1) *
+			c->lengths[m];
+	}
+	end(&r);
+	report("parse_response_header 2 reads", &r);
+	deleteString(code);
+	deleteString(message);
+
+	return mismatches;
+}
+
+static int write_record_file(const char *folder, int id, const char *suffix,
+	const char *data, size_t length) {
+	char fileName[512];
+
+	snprintf(fileName, sizeof(fileName), "%s/bench-%d.%s", folder, id, suffix);
+
+	FILE *file = fopen(fileName, "wb");
+
+	if (file == NULL) {
+		return -1;
+	}
+	fwrite(data, 1, length, file);
+
+	return fclose(file);
+}
+
+/*
+ * Saves a record per corpus request the way the proxy would: the
+ * rewritten request, a response from the corpus with a short body and
+ * the meta data. Returns the number of records.
+ */
+static int write_records(ProxyServer *p, Corpus *requests, Corpus *responses,
+	Buffer *metas[]) {
+	const char *folder = stringAsCString(p->persistenceFolder);
+	Request *req = p->requests;
+	const char *body = "<html><body>Hello</body></html>";
+
+	for (size_t m = 0; m < requests->count; ++m) {
+		size_t r = m % responses->count;
+
+		parse_request(p, req, requests->messages[m], requests->lengths[m], 0);
+		req->requestBytes = req->requestBuffer->length;
+		parse_response(p, req, responses->messages[r], responses->lengths[r], 0);
+		req->responseBytes = responses->lengths[r] + strlen(body);
+		gettimeofday(&req->requestStartTime, NULL);
+		req->responseEndTime = req->requestStartTime;
+		req->timings.start = 1;
+		req->timings.headerComplete = 40;
+		req->timings.requestSent = 380;
+		req->timings.firstByte = 2150;
+		req->timings.responseComplete = 2400;
+
+		metas[m] = newBufferWithCapacity(512);
+		format_meta(req, metas[m]);
+
+		Buffer *res = newBufferWithCapacity(1024);
+
+		bufferAppendBytes(res, responses->messages[r], responses->lengths[r]);
+		bufferAppendBytes(res, body, strlen(body));
+		if (write_record_file(folder, m, "req", req->requestBuffer->buffer,
+			req->requestBuffer->length) < 0 ||
+			write_record_file(folder, m, "res", res->buffer, res->length) < 0 ||
+			write_record_file(folder, m, "meta", metas[m]->buffer,
+			metas[m]->length) < 0) {
+			deleteBuffer(res);
+
+			return -1;
+		}
+		deleteBuffer(res);
+	}
+
+	return requests->count;
+}
+
+static void bench_loaders(ProxyServer *p, int count, Buffer *metas[],
+	int rounds) {
+	RequestRecord *reqRec = newRequestRecord();
+	ResponseRecord *resRec = newResponseRecord();
+	char id[32];
+	Result r;
+
+	begin(&r);
+	for (int round = 0; round < rounds; ++round) {
+		for (int m = 0; m < count; ++m) {
+			snprintf(id, sizeof(id), "bench-%d", m);
+			proxyServerLoadRequest(p, id, reqRec);
+			r.bytes += reqRec->map.length;
+		}
+	}
+	r.messages = (unsigned long long) rounds * count;
+	end(&r);
+	report("proxyServerLoadRequest", &r);
+
+	begin(&r);
+	for (int round = 0; round < rounds; ++round) {
+		for (int m = 0; m < count; ++m) {
+			snprintf(id, sizeof(id), "bench-%d", m);
+			proxyServerLoadResponse(p, id, resRec);
+			r.bytes += resRec->map.length;
+		}
+	}
+	r.messages = (unsigned long long) rounds * count;
+	end(&r);
+	report("proxyServerLoadResponse", &r);
+
+	begin(&r);
+	for (int round = 0; round < rounds; ++round) {
+		for (int m = 0; m < count; ++m) {
+			snprintf(id, sizeof(id), "bench-%d", m);
+			proxyServerLoadMeta(p, id, reqRec, resRec);
+			r.bytes += metas[m]->length;
+		}
+	}
+	r.messages = (unsigned long long) rounds * count;
+	end(&r);
+	report("proxyServerLoadMeta", &r);
+
+	begin(&r);
+	for (int round = 0; round < rounds; ++round) {
+		for (int m = 0; m < count; ++m) {
+			proxyServerLoadMetaBuffer(p, metas[m]->buffer, metas[m]->length,
+				reqRec, resRec);
+			r.bytes += metas[m]->length;
+		}
+	}
+	r.messages = (unsigned long long) rounds * count;
+	end(&r);
+	report("proxyServerLoadMetaBuffer", &r);
+
+	proxyServerResetRecords(p, reqRec, resRec);
+	deleteRequestRecord(reqRec);
+	deleteResponseRecord(resRec);
+}
+
+/*
+ * Query strings and form bodies are parsed on first access to the
+ * parameters.
+ */
+static void bench_params(Corpus *c, int rounds) {
+	RequestRecord *rec = newRequestRecord();
+	Result r;
+
+	begin(&r);
+	for (int round = 0; round < rounds; ++round) {
+		for (size_t m = 0; m < c->count; ++m) {
+			rec->queryString->length = 0;
+			stringAppendBuffer(rec->queryString, c->messages[m], c->lengths[m]);
+			rec->parameters.length = 0;
+			rec->parameters.isParsed = 0;
+			requestRecordParameterCount(rec);
+			r.bytes += c->lengths[m];
+		}
+	}
+	r.messages = (unsigned long long) rounds * c->count;
+	end(&r);
+	report("parse_url_params", &r);
+
+	deleteRequestRecord(rec);
+}
+
+static void remove_records(const char *folder, int count) {
+	static const char *suffixes[] = {"req", "res", "meta"};
+	char fileName[512];
+
+	for (int m = 0; m < count; ++m) {
+		for (int s = 0; s < 3; ++s) {
+			snprintf(fileName, sizeof(fileName), "%s/bench-%d.%s", folder, m,
+				suffixes[s]);
+			unlink(fileName);
+		}
+	}
+	rmdir(folder);
+}
+
+static void print_error(const char *msg) {
+	fprintf(stderr, "%s\n", msg);
+}
+
+int main(int argc, char **argv) {
+	const char *corpusFolder = "bench/corpus";
+	int rounds = 20;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:n:")) != -1) {
+		if (c == 'd') {
+			corpusFolder = optarg;
+		} else if (c == 'n') {
+			rounds = atoi(optarg);
+		} else {
+			fprintf(stderr, "Usage: %s [-d corpusFolder] [-n rounds]\n", argv[0]);
+
+			return 2;
+		}
+	}
+
+	Corpus requests, responses, params;
+
+	if (load_heads(corpusFolder, "requests.http", &requests) < 0 ||
+		load_heads(corpusFolder, "responses.http", &responses) < 0 ||
+		load_lines(corpusFolder, "params.txt", &params) < 0) {
+		return 1;
+	}
+
+	char folder[] = "/tmp/pixie-parsers-XXXXXX";
+
+	if (mkdtemp(folder) == NULL) {
+		perror("mkdtemp");
+
+		return 1;
+	}
+
+	ProxyServer *p = newProxyServer(0);
+	Buffer *metas[MAX_MESSAGES];
+
+	p->onError = print_error;
+	stringAppendCString(p->persistenceFolder, folder);
+
+	//Warm up so that buffers and spare strings have grown
+	parse_request(p, p->requests, requests.messages[0], requests.lengths[0], 0);
+
+	printf("%zu requests, %zu responses, %zu parameter strings, %d rounds\n\n",
+		requests.count, responses.count, params.count, rounds);
+	printf("%-32s %9s %6s %9s %8s %8s\n", "parser", "messages", "ns/B",
+		"ns/msg", "allocs", "reallocs");
+
+	int mismatches = bench_requests(p, &requests, rounds) +
+		bench_responses(p, &responses, rounds);
+	int count = write_records(p, &requests, &responses, metas);
+
+	if (count < 0) {
+		fprintf(stderr, "Failed to write records in %s.\n", folder);
+	} else {
+		bench_loaders(p, count, metas, rounds * 50);
+		for (int m = 0; m < count; ++m) {
+			deleteBuffer(metas[m]);
+		}
+	}
+	bench_params(&params, rounds * 500);
+
+	remove_records(folder, count < 0 ? (int) requests.count : count);
+	deleteProxyServer(p);
+	free(requests.data);
+	free(responses.data);
+	free(params.data);
+
+	return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Checks of the regex set. Random patterns over a small alphabet are
+ * matched against random texts and compared with POSIX extended regular
+ * expressions from libc. A pattern whose DFA has far more than
+ * MAX_DFA_STATES states makes the cache drop and rebuild while matching.
+ * Invalid patterns must be refused without spoiling the set.
+ *
+ * regexcheck [-n patterns]
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <regex.h>
+
+#include "../Regex.h"
+#include "check.h"
+
+#define TEXTS_PER_PATTERN 200
+#define MAX_TEXT 16
+
+static uint64_t random_state = 88172645463325252ULL;
+
+static unsigned next_random(unsigned range) {
+	uint64_t x = random_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	random_state = x;
+
+	return (unsigned) (x % range);
+}
+
+static int matches(struct _RegexSet *set, const char *text, size_t length,
+	size_t id) {
+	uint64_t matched[4] = {0, 0, 0, 0};
+
+	regexSetMatch(set, text, length, matched);
+
+	return (matched[id / 64] >> (id % 64)) & 1;
+}
+
+//Appends a random expression that POSIX and the regex set read alike
+static void random_expression(char *out, size_t *length, int depth) {
+	static const char *atoms[] = {"a", "b", "c", ".", "[ab]", "[^a]",
+		"[b-d]", "\\.", "x"};
+	int branches = depth < 2 && next_random(4) == 0 ? 2 : 1;
+
+	for (int b = 0; b < branches; ++b) {
+		int count = 1 + next_random(3);
+
+		if (b > 0) {
+			out[(*length)++] = '|';
+		}
+		for (int i = 0; i < count; ++i) {
+			if (depth < 2 && next_random(5) == 0) {
+				out[(*length)++] = '(';
+				random_expression(out, length, depth + 1);
+				out[(*length)++] = ')';
+			} else {
+				const char *atom = atoms[next_random(9)];
+
+				memcpy(out + *length, atom, strlen(atom));
+				*length += strlen(atom);
+			}
+
+			unsigned repeat = next_random(8);
+
+			if (repeat < 3) {
+				out[(*length)++] = "*+?"[repeat];
+			}
+		}
+	}
+	out[*length] = '\0';
+}
+
+static void random_pattern(char *pattern) {
+	char body[512];
+	size_t length = 0;
+
+	random_expression(body, &length, 0);
+	//Grouped so that an anchor applies to every branch in both
+	switch (next_random(4)) {
+	case 0:
+		sprintf(pattern, "%s", body);
+		break;
+	case 1:
+		sprintf(pattern, "^(%s)", body);
+		break;
+	case 2:
+		sprintf(pattern, "(%s)$", body);
+		break;
+	default:
+		sprintf(pattern, "^(%s)$", body);
+	}
+}
+
+static void random_text(char *text, size_t length) {
+	static const char alphabet[] = "abcd.x";
+
+	for (size_t i = 0; i < length; ++i) {
+		text[i] = alphabet[next_random(sizeof(alphabet) - 1)];
+	}
+	text[length] = '\0';
+}
+
+/*
+ * Each random pattern joins a set with the patterns before it, so the
+ * set is matched with many patterns at once as well.
+ */
+static void check_against_posix(int patternCount) {
+	struct _RegexSet *set = newRegexSet();
+	regex_t *posix = calloc(patternCount, sizeof(regex_t));
+	char text[MAX_TEXT + 1];
+	int added = 0, mismatches = 0;
+
+	for (int i = 0; i < patternCount; ++i) {
+		char pattern[1024];
+
+		random_pattern(pattern);
+		if (regcomp(posix + added, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+			continue;
+		}
+		if (regexSetAdd(set, pattern, added) < 0) {
+			fprintf(stderr, "Refused %s\n", pattern);
+			++mismatches;
+			regfree(posix + added);
+			continue;
+		}
+		//The set is rebuilt on every add so only check the last few
+		if (added % 8 == 7 || i == patternCount - 1) {
+			for (int t = 0; t < TEXTS_PER_PATTERN; ++t) {
+				size_t length = next_random(MAX_TEXT + 1);
+				uint64_t matched[4] = {0, 0, 0, 0};
+
+				random_text(text, length);
+				regexSetMatch(set, text, length, matched);
+				for (int p = added > 7 ? added - 7 : 0; p <= added; ++p) {
+					int expected = regexec(posix + p, text, 0, NULL, 0) == 0;
+
+					if (((matched[p / 64] >> (p % 64)) & 1) != expected) {
+						if (mismatches < 10) {
+							fprintf(stderr, "Pattern %d on \"%s\": %d\n",
+								p, text, !expected);
+						}
+						++mismatches;
+					}
+				}
+			}
+		}
+		if (++added == 256) {
+			break;
+		}
+	}
+	CHECK(added > patternCount / 2);
+	CHECK(mismatches == 0);
+
+	for (int i = 0; i < added; ++i) {
+		regfree(posix + i);
+	}
+	free(posix);
+	deleteRegexSet(set);
+}
+
+/*
+ * An a 13 bytes from the end needs 2^13 DFA states, so matching long
+ * texts drops the cache many times.
+ */
+static void check_state_cache() {
+	struct _RegexSet *set = newRegexSet();
+	regex_t posix;
+	const char *pattern = "a[ab][ab][ab][ab][ab][ab][ab][ab][ab][ab][ab][ab]$";
+	char text[4097];
+	int mismatches = 0;
+
+	CHECK(regexSetAdd(set, pattern, 0) == 0);
+	CHECK(regexSetAdd(set, "^b+$", 1) == 0);
+	regcomp(&posix, pattern, REG_EXTENDED | REG_NOSUB);
+	for (int round = 0; round < 200; ++round) {
+		size_t length = 13 + next_random(sizeof(text) - 13);
+
+		for (size_t i = 0; i < length; ++i) {
+			text[i] = next_random(2) ? 'a' : 'b';
+		}
+		text[length] = '\0';
+		mismatches += matches(set, text, length, 0) != (text[length - 13] == 'a');
+		mismatches += matches(set, text, length, 0) !=
+			(regexec(&posix, text, 0, NULL, 0) == 0);
+		mismatches += matches(set, text, length, 1) !=
+			(strspn(text, "b") == length);
+	}
+	CHECK(mismatches == 0);
+	regfree(&posix);
+	deleteRegexSet(set);
+}
+
+static void check_syntax() {
+	struct _RegexSet *set = newRegexSet();
+	static const char *invalid[] = {"(", "a)", "(a|b", "*a", "a|*", "+",
+		"[abc", "[", "a^b", "a$b", "\\", "a\\", "(?)", "a|?"};
+	char deep[200];
+
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+		CHECK(regexSetAdd(set, invalid[i], 0) < 0);
+	}
+	//Groups nested deeper than the parser allows
+	memset(deep, '(', 65);
+	deep[65] = 'a';
+	memset(deep + 66, ')', 65);
+	deep[131] = '\0';
+	CHECK(regexSetAdd(set, deep, 0) < 0);
+	memset(deep, '(', 64);
+	deep[64] = 'a';
+	memset(deep + 65, ')', 64);
+	deep[129] = '\0';
+	CHECK(regexSetAdd(set, deep, 1) == 0);
+
+	//A refused pattern leaves nothing behind
+	CHECK(regexSetAdd(set, "^/api/v[0-9]+/users/\\d+$", 2) == 0);
+	CHECK(regexSetAdd(set, "\\.(css|js)$", 3) == 0);
+	CHECK(regexSetAdd(set, "cost\\$", 4) == 0);
+	CHECK(regexSetAdd(set, "^\\w+\\s\\W\\D\\S$", 5) == 0);
+	CHECK(regexSetAdd(set, "[]a]", 6) == 0);
+	CHECK(regexSetAdd(set, "^[^]a]$", 7) == 0);
+	CHECK(regexSetAdd(set, "a.b", 100) == 0);
+	CHECK(regexSetAdd(set, "^$", 101) == 0);
+	CHECK(regexSetAdd(set, "[\\x-\\z]", 102) == 0);
+
+	CHECK(matches(set, "a", 1, 1));
+	CHECK(!matches(set, "b", 1, 1));
+	CHECK(matches(set, "/api/v12/users/42", 17, 2));
+	CHECK(!matches(set, "/api/v12/users/42/", 18, 2));
+	CHECK(!matches(set, "x/api/v1/users/4", 16, 2));
+	CHECK(matches(set, "/site.css", 9, 3));
+	CHECK(!matches(set, "/site.css?v=1", 13, 3));
+	CHECK(!matches(set, "/sitexcss", 9, 3));
+	CHECK(matches(set, "the cost$ is", 12, 4));
+	CHECK(!matches(set, "the cost is", 11, 4));
+	CHECK(matches(set, "go_1 -xy", 8, 5));
+	CHECK(!matches(set, "go_1 -1y", 8, 5));
+	CHECK(matches(set, "x]", 2, 6));
+	CHECK(matches(set, "z", 1, 7));
+	CHECK(!matches(set, "]", 1, 7));
+	CHECK(matches(set, "\xff", 1, 7));
+	//Any byte, NUL included, and ids past the first word
+	CHECK(matches(set, "a\0b", 3, 100));
+	CHECK(!matches(set, "a\0\0b", 4, 100));
+	CHECK(matches(set, "", 0, 101));
+	CHECK(!matches(set, "a", 1, 101));
+	CHECK(matches(set, "y", 1, 102));
+	CHECK(!matches(set, "w", 1, 102));
+
+	uint64_t matched[2] = {0, 0};
+
+	regexSetMatch(set, "a\0b", 3, matched);
+	CHECK(matched[0] == ((1ULL << 1) | (1ULL << 6)));
+	CHECK(matched[1] == 1ULL << (100 - 64));
+	deleteRegexSet(set);
+
+	//An empty set matches nothing
+	set = newRegexSet();
+	CHECK(!matches(set, "a", 1, 0));
+	deleteRegexSet(set);
+}
+
+int main(int argc, char **argv) {
+	int patternCount = 2000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		if (opt == 'n') {
+			patternCount = atoi(optarg);
+		} else {
+			fprintf(stderr, "Usage: regexcheck [-n patterns]\n");
+
+			return 2;
+		}
+	}
+
+	check_syntax();
+	check_state_cache();
+	for (int i = 0; i < patternCount / 256 + 1; ++i) {
+		check_against_posix(patternCount < 256 ? patternCount : 256);
+	}
+
+	return check_summary("regexcheck");
+}
@@ -0,0 +1,247 @@
+/*
+ * Checks of replay mode. Records are written to the persistence folder
+ * and a proxy in replay mode answers requests from them without a
+ * server. Records with the same key come back in capture order and the
+ * last one repeats. Query string and body matching pick the right record
+ * and requests that match nothing get a 404.
+ *
+ * replaycheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "../Proxy.h"
+#include "../Replay.h"
+#include "check.h"
+#include "checkhttp.h"
+
+#define LARGE_BODY (1024 * 1024)
+#define ORIGIN "example.test:8080"
+
+static int records = 0;
+
+static void ignore_error(const char *message) {
+}
+
+static void write_file(const char *folder, const char *uniqueId,
+	const char *suffix, const char *data, size_t length, const char *body,
+	size_t bodyLength) {
+	char fileName[512];
+
+	snprintf(fileName, sizeof(fileName), "%s/%s.%s", folder, uniqueId,
+		suffix);
+
+	FILE *file = fopen(fileName, "wb");
+
+	fwrite(data, 1, length, file);
+	fwrite(body, 1, bodyLength, file);
+	fclose(file);
+}
+
+/*
+ * Saves a captured exchange. Records start a second apart in the order
+ * they are saved. The response takes durationMs.
+ */
+static void save_record(const char *folder, const char *method,
+	const char *path, const char *requestBody, const char *responseHeader,
+	const char *responseBody, size_t responseLength, long durationMs) {
+	char uniqueId[32], data[2048];
+	long long start = 1700000000LL + records;
+	long long end = start * 1000000 + durationMs * 1000;
+	int length;
+
+	snprintf(uniqueId, sizeof(uniqueId), "check-%d", records++);
+	length = snprintf(data, sizeof(data), "%s http://" ORIGIN "%s HTTP/1.1\r\n"
+		"Host: " ORIGIN "\r\nContent-Length: %zu\r\n\r\n%s", method, path,
+		strlen(requestBody), requestBody);
+	write_file(folder, uniqueId, "req", data, length, "", 0);
+	length = snprintf(data, sizeof(data), "HTTP/1.1 200 OK\r\n%s\r\n",
+		responseHeader);
+	write_file(folder, uniqueId, "res", data, length, responseBody,
+		responseLength);
+	length = snprintf(data, sizeof(data), "protocol-line\n%s http://" ORIGIN
+		"%s HTTP/1.1\nprotocol\nHTTP/1.1\nhost\nexample.test\nport\n8080\n"
+		"path\n%s\nrequest-start-seconds\n%lld\nrequest-start-microseconds\n0\n"
+		"response-end-seconds\n%lld\nresponse-end-microseconds\n%lld\n"
+		"response-status-code\n200\nresponse-status-message\nOK\n",
+		method, path, path, start, end / 1000000, end % 1000000);
+	write_file(folder, uniqueId, "meta", data, length, "", 0);
+}
+
+static void save_text(const char *folder, const char *method,
+	const char *path, const char *requestBody, const char *text) {
+	char header[64];
+
+	snprintf(header, sizeof(header), "Content-Length: %zu\r\n", strlen(text));
+	save_record(folder, method, path, requestBody, header, text, strlen(text),
+		0);
+}
+
+static void save_records(const char *folder) {
+	char *large = malloc(LARGE_BODY);
+	char header[64];
+
+	save_text(folder, "GET", "/items?page=1", "", "first");
+	save_text(folder, "GET", "/items?page=2", "", "second");
+	save_text(folder, "GET", "/items?page=1", "", "third");
+	save_text(folder, "POST", "/submit", "a=1", "posted-1");
+	save_text(folder, "POST", "/submit", "a=2", "posted-2");
+
+	//Sent from the capture file
+	for (int i = 0; i < LARGE_BODY; ++i) {
+		large[i] = 'a' + i % 26;
+	}
+	snprintf(header, sizeof(header), "Content-Length: %d\r\n", LARGE_BODY);
+	save_record(folder, "GET", "/large", "", header, large, LARGE_BODY, 0);
+	//Without a length the body ends when the connection closes
+	save_record(folder, "GET", "/stream", "", "", "until closed", 12, 0);
+	save_text(folder, "GET", "/slow", "", "slow");
+	save_record(folder, "GET", "/slow", "", "Content-Length: 4\r\n", "late", 4,
+		300);
+	free(large);
+}
+
+static int get(int port, const char *method, const char *path,
+	const char *requestBody, char *body, size_t size) {
+	char request[1024];
+
+	snprintf(request, sizeof(request), "%s http://" ORIGIN "%s HTTP/1.1\r\n"
+		"Host: " ORIGIN "\r\nContent-Length: %zu\r\n\r\n%s", method, path,
+		strlen(requestBody), requestBody);
+
+	return http_fetch(port, request, body, size);
+}
+
+static long long millis_since(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) * 1000LL +
+		(now.tv_usec - start->tv_usec) / 1000;
+}
+
+//Matching on method, host, port and path only
+static void check_path_match(ProxyServer *p, int port) {
+	static char body[LARGE_BODY + 1];
+	ReplayStats stats;
+	struct timeval start;
+	int wrong = 0;
+
+	CHECK(get(port, "GET", "/items?page=9", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "first") == 0);
+	CHECK(get(port, "GET", "/items", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "second") == 0);
+	CHECK(get(port, "GET", "/items", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "third") == 0);
+	CHECK(get(port, "GET", "/items", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "third") == 0);
+
+	CHECK(get(port, "POST", "/submit", "a=9", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "posted-1") == 0);
+	CHECK(get(port, "GET", "/submit", "", body, sizeof(body)) == 404);
+	CHECK(get(port, "GET", "/missing", "", body, sizeof(body)) == 404);
+	CHECK(strstr(body, "/missing") != NULL);
+
+	CHECK(get(port, "GET", "/large", "", body, sizeof(body)) == 200);
+	CHECK(strlen(body) == LARGE_BODY);
+	for (int i = 0; i < LARGE_BODY; ++i) {
+		wrong += body[i] != 'a' + i % 26;
+	}
+	CHECK(wrong == 0);
+	CHECK(get(port, "GET", "/stream", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "until closed") == 0);
+
+	//A time scale of 0 sends at once
+	gettimeofday(&start, NULL);
+	CHECK(get(port, "GET", "/slow", "", body, sizeof(body)) == 200);
+	CHECK(get(port, "GET", "/slow", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "late") == 0);
+	CHECK(millis_since(&start) < 250);
+
+	proxyServerGetReplayStats(p, &stats);
+	CHECK(stats.records == (unsigned long) records);
+	CHECK(stats.served == 9);
+	CHECK(stats.missed == 2);
+}
+
+//Matching on the query string and body too, with the captured timing
+static void check_full_match(ProxyServer *p, int port) {
+	char body[256];
+	struct timeval start;
+
+	CHECK(get(port, "GET", "/items?page=2", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "second") == 0);
+	CHECK(get(port, "GET", "/items?page=1", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "first") == 0);
+	CHECK(get(port, "GET", "/items?page=1", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "third") == 0);
+	CHECK(get(port, "GET", "/items?page=3", "", body, sizeof(body)) == 404);
+	CHECK(get(port, "GET", "/items", "", body, sizeof(body)) == 404);
+
+	CHECK(get(port, "POST", "/submit", "a=2", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "posted-2") == 0);
+	CHECK(get(port, "POST", "/submit", "a=1", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "posted-1") == 0);
+	CHECK(get(port, "POST", "/submit", "a=3", body, sizeof(body)) == 404);
+
+	gettimeofday(&start, NULL);
+	CHECK(get(port, "GET", "/slow", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "slow") == 0);
+	CHECK(millis_since(&start) < 250);
+	gettimeofday(&start, NULL);
+	CHECK(get(port, "GET", "/slow", "", body, sizeof(body)) == 200);
+	CHECK(strcmp(body, "late") == 0);
+	CHECK(millis_since(&start) >= 290);
+}
+
+static int start_replay(ProxyServer *p, int match, double timeScale) {
+	p->onError = ignore_error;
+	p->replayEnabled = 1;
+	p->replayMatch = match;
+	p->replayTimeScale = timeScale;
+
+	return start_check_proxy(p);
+}
+
+int main(int argc, char **argv) {
+	char folder[64], pixieFolder[128];
+
+	//The proxy keeps its folder in $HOME/.pixie
+	check_folder("replaycheck", folder);
+	setenv("HOME", folder, 1);
+	snprintf(pixieFolder, sizeof(pixieFolder), "%s/.pixie", folder);
+	mkdir(pixieFolder, 0700);
+	save_records(pixieFolder);
+
+	ProxyServer *p = newProxyServer(0);
+	int port = start_replay(p, REPLAY_MATCH_PATH, 0);
+
+	CHECK(port > 0);
+	if (port > 0) {
+		check_path_match(p, port);
+		proxyServerStop(p);
+	}
+	deleteProxyServer(p);
+
+	p = newProxyServer(0);
+	port = start_replay(p, REPLAY_MATCH_QUERY | REPLAY_MATCH_BODY, 1);
+	CHECK(port > 0);
+	if (port > 0) {
+		check_full_match(p, port);
+		proxyServerStop(p);
+	}
+	deleteProxyServer(p);
+	remove_check_folder(folder);
+
+	return check_summary("replaycheck");
+}
@@ -0,0 +1,666 @@
+/*
+ * Replays captured traffic against a server for load testing. Requests
+ * are read from the capture folder through the persistence API and sent
+ * to the target oldest first.
+ *
+ * replayer -t host:port [-f folder] [-s scale] [-c connections]
+ *	[-o host] [-v]
+ *
+ * By default requests are sent at their captured times relative to the
+ * first one. -s multiplies the gaps, so 0.5 replays twice as fast and 0
+ * sends as fast as the connections allow. Each connection has its own
+ * thread and takes the next request in order. Latency is measured from
+ * when a request was due, so a slow target is not hidden by requests
+ * starting late.
+ *
+ * The status and body size of every response are compared with the
+ * capture. Bodies are compared after chunked framing is removed. -o only
+ * replays requests captured for one host. -v prints every mismatch
+ * instead of the first few.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../Proxy.h"
+#include "../Persistence.h"
+#include "../Metrics.h"
+
+#define READ_SIZE (64 * 1024)
+#define LOAD_BATCH 64
+#define REPORT_LIMIT 10
+#define LATE_MICROS 10000
+
+typedef struct _Job {
+	char *uniqueId;
+	long long start; //Microseconds since the epoch. Offset once loaded.
+	char *request;
+	size_t requestLength;
+	int isHead;
+	int status; //0 if the response was not captured
+	long long size; //Body payload bytes
+} Job;
+
+typedef struct _JobBatch {
+	Job *jobs;
+	size_t count;
+} JobBatch;
+
+typedef struct _Replayer {
+	ProxyServer *p;
+	struct sockaddr_in target;
+	const char *host; //Only replay this host if set
+	Job *jobs;
+	size_t count;
+	size_t capacity;
+	size_t next; //Next job to send. Taken atomically.
+	double scale;
+	long long start; //Monotonic microseconds
+	int verbose;
+	int reported;
+	pthread_mutex_t lock; //Serializes mismatch output
+} Replayer;
+
+typedef struct _Worker {
+	pthread_t thread;
+	Replayer *replayer;
+	long long requests;
+	long long errors;
+	long long statusMismatches;
+	long long sizeMismatches;
+	long long late;
+	long long bytes;
+	HistogramSnapshot latency;
+} Worker;
+
+enum {
+	CHUNK_SIZE,
+	CHUNK_EXTENSION,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER,
+	CHUNK_TRAILER_LINE,
+	CHUNK_DONE
+};
+
+typedef struct _Chunks {
+	int state;
+	long long size; //Of the current chunk, then what is left of it
+	long long total;
+} Chunks;
+
+static long long now_micros() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Scans chunked data and adds up the payload. Returns the bytes used,
+ * which is less than length once the last chunk and the trailer are seen.
+ */
+static size_t scan_chunks(Chunks *c, const char *data, size_t length) {
+	size_t i = 0;
+
+	while (i < length && c->state != CHUNK_DONE) {
+		char ch = data[i];
+
+		if (c->state == CHUNK_DATA) {
+			size_t n = length - i;
+
+			if ((long long) n > c->size) {
+				n = c->size;
+			}
+			c->size -= n;
+			i += n;
+			if (c->size == 0) {
+				c->state = CHUNK_DATA_END;
+			}
+			continue;
+		}
+
+		++i;
+		switch (c->state) {
+		case CHUNK_SIZE:
+			if (isxdigit((unsigned char) ch)) {
+				c->size = c->size * 16 + (isdigit((unsigned char) ch) ?
+					ch - '0' : tolower((unsigned char) ch) - 'a' + 10);
+				break;
+			}
+			c->state = CHUNK_EXTENSION;
+			//Fall through
+		case CHUNK_EXTENSION:
+			if (ch == '\n') {
+				c->total += c->size;
+				c->state = c->size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+			}
+			break;
+		case CHUNK_DATA_END:
+			if (ch == '\n') {
+				c->state = CHUNK_SIZE;
+				c->size = 0;
+			}
+			break;
+		case CHUNK_TRAILER:
+			if (ch == '\n') {
+				c->state = CHUNK_DONE;
+			} else if (ch != '\r') {
+				c->state = CHUNK_TRAILER_LINE;
+			}
+			break;
+		case CHUNK_TRAILER_LINE:
+			if (ch == '\n') {
+				c->state = CHUNK_TRAILER;
+			}
+			break;
+		}
+	}
+
+	return i;
+}
+
+//A Transfer-Encoding value. chunked is always the last coding.
+static int is_chunked(const char *value, size_t length) {
+	while (length > 0 && (value[length - 1] == ' ' ||
+		value[length - 1] == '\t' || value[length - 1] == '\r')) {
+		--length;
+	}
+
+	return length >= 7 && strncasecmp(value + length - 7, "chunked", 7) == 0;
+}
+
+/*
+ * Value of a field in a NUL terminated header, or NULL. The value runs to
+ * the next CRLF.
+ */
+static const char *find_header(const char *header, const char *name) {
+	size_t length = strlen(name);
+
+	for (const char *line = strstr(header, "\r\n"); line != NULL;
+		line = strstr(line + 2, "\r\n")) {
+		if (strncasecmp(line + 2, name, length) == 0 &&
+			line[2 + length] == ':') {
+			const char *value = line + 3 + length;
+
+			while (*value == ' ' || *value == '\t') {
+				++value;
+			}
+
+			return value;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads one response and returns the payload length of its body, or -1.
+ * Interim 1xx responses are skipped.
+ */
+static long long read_response(int fd, char *buffer, int isHead, int *status,
+	int *keepAlive) {
+	size_t length = 0;
+	char *end = NULL;
+
+	while (1) {
+		buffer[length] = '\0';
+		while ((end = strstr(buffer, "\r\n\r\n")) == NULL) {
+			if (length == READ_SIZE) {
+				//Header too large
+				return -1;
+			}
+
+			ssize_t n = read(fd, buffer + length, READ_SIZE - length);
+
+			if (n <= 0) {
+				return -1;
+			}
+			length += n;
+			buffer[length] = '\0';
+		}
+		if (sscanf(buffer, "HTTP/%*s %d", status) != 1) {
+			return -1;
+		}
+		if (*status >= 200) {
+			break;
+		}
+
+		size_t headerLength = end + 4 - buffer;
+
+		length -= headerLength;
+		memmove(buffer, buffer + headerLength, length);
+	}
+
+	size_t headerLength = end + 4 - buffer;
+	size_t have = length - headerLength;
+
+	//End the header after its last CRLF
+	end[2] = '\0';
+
+	const char *connection = find_header(buffer, "Connection");
+	const char *encoding = find_header(buffer, "Transfer-Encoding");
+	const char *contentLength = find_header(buffer, "Content-Length");
+	int chunked = encoding != NULL &&
+		is_chunked(encoding, strstr(encoding, "\r\n") - encoding);
+	long long bodyLength = contentLength != NULL ? atoll(contentLength) : -1;
+
+	if (strncmp(buffer, "HTTP/1.0", 8) == 0) {
+		*keepAlive = connection != NULL &&
+			strncasecmp(connection, "keep-alive", 10) == 0;
+	} else {
+		*keepAlive = connection == NULL ||
+			strncasecmp(connection, "close", 5) != 0;
+	}
+
+	memmove(buffer, buffer + headerLength, have);
+	if (isHead || *status == 204 || *status == 304) {
+		return 0;
+	}
+	if (chunked) {
+		Chunks c;
+
+		memset(&c, 0, sizeof(c));
+		scan_chunks(&c, buffer, have);
+		while (c.state != CHUNK_DONE) {
+			ssize_t n = read(fd, buffer, READ_SIZE);
+
+			if (n <= 0) {
+				return -1;
+			}
+			scan_chunks(&c, buffer, n);
+		}
+
+		return c.total;
+	}
+	if (bodyLength >= 0) {
+		while ((long long) have < bodyLength) {
+			ssize_t n = read(fd, buffer, READ_SIZE);
+
+			if (n <= 0) {
+				return -1;
+			}
+			have += n;
+		}
+
+		return bodyLength;
+	}
+
+	//Body ends when the server closes
+	ssize_t n;
+
+	*keepAlive = 0;
+	while ((n = read(fd, buffer, READ_SIZE)) > 0) {
+		have += n;
+	}
+
+	return n < 0 ? -1 : (long long) have;
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t n = write(fd, data, length);
+
+		if (n <= 0) {
+			return -1;
+		}
+		data += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+static int connect_target(Replayer *r) {
+	int fd = socket(PF_INET, SOCK_STREAM, 0);
+	int on = 1;
+
+	if (fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (connect(fd, (struct sockaddr*) &r->target, sizeof(r->target)) < 0) {
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static void report_mismatch(Replayer *r, Job *job, int status,
+	long long size) {
+	pthread_mutex_lock(&r->lock);
+	if (r->verbose || r->reported < REPORT_LIMIT) {
+		printf("%s: status %d expected %d, body %lld bytes expected %lld\n",
+			job->uniqueId, status, job->status, size, job->size);
+		if (!r->verbose && ++r->reported == REPORT_LIMIT) {
+			printf("Further mismatches are not shown. Use -v to see all.\n");
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void *run_worker(void *data) {
+	Worker *w = data;
+	Replayer *r = w->replayer;
+	char *buffer = malloc(READ_SIZE + 1);
+	int fd = -1;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) <
+		r->count) {
+		Job *job = r->jobs + i;
+		long long now = now_micros();
+		long long due = now;
+
+		if (r->scale > 0) {
+			due = r->start + (long long) (job->start * r->scale);
+			if (due > now) {
+				usleep(due - now);
+			} else if (now - due > LATE_MICROS) {
+				++w->late;
+			}
+		}
+
+		//One reconnect in case the server closed an idle connection
+		long long size = -1;
+		int status = 0;
+		int keepAlive = 0;
+
+		for (int attempt = 0; attempt < 2 && size < 0; ++attempt) {
+			if (fd < 0 && (fd = connect_target(r)) < 0) {
+				break;
+			}
+			if (write_all(fd, job->request, job->requestLength) == 0) {
+				size = read_response(fd, buffer, job->isHead, &status,
+					&keepAlive);
+			}
+			if (size < 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		if (size < 0) {
+			++w->errors;
+			continue;
+		}
+
+		histogramAdd(&w->latency, now_micros() - due);
+		++w->requests;
+		w->bytes += size;
+		if (job->status != 0 && status != job->status) {
+			++w->statusMismatches;
+			report_mismatch(r, job, status, size);
+		} else if (job->status != 0 && size != job->size) {
+			++w->sizeMismatches;
+			report_mismatch(r, job, status, size);
+		}
+		if (!keepAlive) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(buffer);
+
+	return NULL;
+}
+
+static void load_job(Job *job, RequestRecord *req, ResponseRecord *res,
+	int hasResponse) {
+	job->requestLength = req->headerBuffer.length + req->bodyBuffer.length;
+	job->request = malloc(job->requestLength);
+	memcpy(job->request, req->headerBuffer.buffer, req->headerBuffer.length);
+	memcpy(job->request + req->headerBuffer.length, req->bodyBuffer.buffer,
+		req->bodyBuffer.length);
+	job->isHead = strcmp(stringAsCString(req->method), "HEAD") == 0;
+
+	if (!hasResponse || res->statusCode->length == 0) {
+		return;
+	}
+
+	Slice encoding;
+
+	job->status = atoi(stringAsCString(res->statusCode));
+	job->size = res->bodyBuffer.length;
+	if (responseRecordFindHeader(res, "Transfer-Encoding", &encoding) == 0 &&
+		is_chunked(encoding.buffer, encoding.length)) {
+		Chunks c;
+
+		memset(&c, 0, sizeof(c));
+		scan_chunks(&c, res->bodyBuffer.buffer, res->bodyBuffer.length);
+		job->size = c.total;
+	}
+}
+
+//Runs concurrently. Loads the records of a batch.
+static void *prepare_batch(void *contextData, HistoryEntry *entries,
+	size_t count) {
+	Replayer *r = contextData;
+	JobBatch *batch = calloc(1, sizeof(JobBatch));
+	RequestRecord *req = newRequestRecord();
+	ResponseRecord *res = newResponseRecord();
+
+	batch->jobs = calloc(count, sizeof(Job));
+	for (size_t i = 0; i < count; ++i) {
+		RequestRecord *meta = entries[i].request;
+
+		if (r->host != NULL &&
+			strcmp(stringAsCString(meta->host), r->host) != 0) {
+			continue;
+		}
+		//Tunnels can't be replayed
+		if (strcmp(stringAsCString(meta->method), "CONNECT") == 0) {
+			continue;
+		}
+		if (proxyServerLoadRequest(r->p, entries[i].uniqueId, req) != 0 ||
+			req->headerBuffer.length == 0) {
+			continue;
+		}
+
+		int hasResponse = proxyServerLoadResponse(r->p, entries[i].uniqueId,
+			res) == 0;
+		Job *job = batch->jobs + batch->count++;
+
+		job->uniqueId = strdup(entries[i].uniqueId);
+		job->start = (long long) meta->requestStartTime.tv_sec * 1000000 +
+			meta->requestStartTime.tv_usec;
+		load_job(job, req, res, hasResponse);
+		proxyServerResetRecords(r->p, req, res);
+	}
+
+	deleteRequestRecord(req);
+	deleteResponseRecord(res);
+
+	return batch;
+}
+
+//Called in order. Adds the jobs of a batch to the schedule.
+static void deliver_batch(void *contextData, void *prepared) {
+	Replayer *r = contextData;
+	JobBatch *batch = prepared;
+
+	if (r->count + batch->count > r->capacity) {
+		r->capacity = (r->count + batch->count) * 2;
+		r->jobs = realloc(r->jobs, r->capacity * sizeof(Job));
+	}
+	memcpy(r->jobs + r->count, batch->jobs, batch->count * sizeof(Job));
+	r->count += batch->count;
+
+	free(batch->jobs);
+	free(batch);
+}
+
+static int parse_address(const char *address, struct sockaddr_in *addr) {
+	char host[256];
+	int port = 0;
+
+	if (sscanf(address, "%255[^:]:%d", host, &port) != 2) {
+		return -1;
+	}
+
+	struct hostent *h = gethostbyname(host);
+
+	if (h == NULL) {
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	memcpy(&addr->sin_addr, h->h_addr_list[0], h->h_length);
+	addr->sin_port = htons(port);
+
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s -t host:port [-f folder] [-s scale] "
+		"[-c connections] [-o host] [-v]\n", name);
+}
+
+int main(int argc, char **argv) {
+	Replayer r;
+	const char *target = NULL, *folder = NULL;
+	int connections = 16;
+	int c;
+
+	memset(&r, 0, sizeof(r));
+	r.scale = 1;
+	while ((c = getopt(argc, argv, "t:f:s:c:o:v")) != -1) {
+		if (c == 't') {
+			target = optarg;
+		} else if (c == 'f') {
+			folder = optarg;
+		} else if (c == 's') {
+			r.scale = atof(optarg);
+		} else if (c == 'c') {
+			connections = atoi(optarg);
+		} else if (c == 'o') {
+			r.host = optarg;
+		} else if (c == 'v') {
+			r.verbose = 1;
+		} else {
+			usage(argv[0]);
+
+			return 2;
+		}
+	}
+	if (target == NULL || connections < 1 ||
+		parse_address(target, &r.target) < 0) {
+		usage(argv[0]);
+
+		return 2;
+	}
+
+	r.p = newProxyServer(0);
+	if (folder != NULL) {
+		stringAppendCString(r.p->persistenceFolder, folder);
+	} else {
+		const char *home = getenv("HOME");
+
+		if (home != NULL) {
+			stringAppendCString(r.p->persistenceFolder, home);
+		}
+		stringAppendCString(r.p->persistenceFolder, "/.pixie");
+	}
+
+	long long loadStart = now_micros();
+
+	if (proxyServerLoadHistoryPipelined(r.p, 0, LOAD_BATCH, &r,
+		prepare_batch, deliver_batch) < 0) {
+		fprintf(stderr, "Failed to load records from %s\n",
+			stringAsCString(r.p->persistenceFolder));
+
+		return 1;
+	}
+	//Start times become offsets from the first request
+	for (size_t i = r.count; i > 0; --i) {
+		r.jobs[i - 1].start -= r.jobs[0].start;
+	}
+	printf("records      %zu loaded in %.2fs\n", r.count,
+		(now_micros() - loadStart) / 1e6);
+
+	signal(SIGPIPE, SIG_IGN);
+	pthread_mutex_init(&r.lock, NULL);
+
+	Worker *workers = calloc(connections, sizeof(Worker));
+
+	r.start = now_micros();
+	for (int i = 0; i < connections; ++i) {
+		workers[i].replayer = &r;
+		pthread_create(&workers[i].thread, NULL, run_worker, workers + i);
+	}
+
+	HistogramSnapshot latency;
+	long long requests = 0, errors = 0, bytes = 0, late = 0;
+	long long statusMismatches = 0, sizeMismatches = 0;
+
+	memset(&latency, 0, sizeof(latency));
+	for (int i = 0; i < connections; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		requests += workers[i].requests;
+		errors += workers[i].errors;
+		bytes += workers[i].bytes;
+		late += workers[i].late;
+		statusMismatches += workers[i].statusMismatches;
+		sizeMismatches += workers[i].sizeMismatches;
+		latency.count += workers[i].latency.count;
+		latency.sum += workers[i].latency.sum;
+		for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+			latency.buckets[b] += workers[i].latency.buckets[b];
+		}
+	}
+
+	double elapsed = (now_micros() - r.start) / 1e6;
+
+	printf("connections  %d (%s)\n", connections, r.scale > 0 ?
+		"captured schedule" : "as fast as possible");
+	if (r.scale > 0) {
+		printf("schedule     scale %.2f, %lld requests started over %dms "
+			"late\n", r.scale, late, LATE_MICROS / 1000);
+	}
+	printf("requests     %lld in %.2fs, %lld errors\n", requests, elapsed,
+		errors);
+	printf("throughput   %.1f req/s, %.2f MB/s\n", requests / elapsed,
+		bytes / elapsed / (1024 * 1024));
+	if (latency.count > 0) {
+		printf("latency us   mean %llu p50 %lld p90 %lld p99 %lld "
+			"p99.9 %lld max %lld\n",
+			latency.sum / latency.count,
+			histogramQuantile(&latency, 0.5),
+			histogramQuantile(&latency, 0.9),
+			histogramQuantile(&latency, 0.99),
+			histogramQuantile(&latency, 0.999),
+			histogramQuantile(&latency, 1.0));
+	}
+	printf("mismatches   %lld status, %lld body size\n", statusMismatches,
+		sizeMismatches);
+
+	for (size_t i = 0; i < r.count; ++i) {
+		free(r.jobs[i].uniqueId);
+		free(r.jobs[i].request);
+	}
+	free(r.jobs);
+	free(workers);
+	pthread_mutex_destroy(&r.lock);
+	deleteProxyServer(r.p);
+
+	return errors > 0 && requests == 0 ? 1 : 0;
+}
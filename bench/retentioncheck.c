@@ -0,0 +1,133 @@
+/*
+ * Checks of the retention policy. Records of known sizes are written to
+ * a temporary folder next to files that are not records, and the oldest
+ * records must be removed until the whole folder fits the limits.
+ *
+ * retentioncheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../Proxy.h"
+#include "../Persistence.h"
+#include "check.h"
+
+#define RECORDS 10
+#define RECORD_BYTES 1000
+#define BASE_SECONDS 1700000000L
+
+static void ignore_error(const char *message) {
+}
+
+static void write_file(const char *folder, const char *name, size_t length) {
+	char fileName[512];
+	char *data = malloc(length);
+
+	memset(data, 'x', length);
+	snprintf(fileName, sizeof(fileName), "%s/%s", folder, name);
+
+	FILE *file = fopen(fileName, "w");
+
+	fwrite(data, 1, length, file);
+	fclose(file);
+	free(data);
+}
+
+//Saves a finished record of RECORD_BYTES that started i seconds in
+static void save_record(const char *folder, int i) {
+	char name[64];
+
+	snprintf(name, sizeof(name), "%ld-000000-%d.req", BASE_SECONDS + i, i);
+	write_file(folder, name, 300);
+	snprintf(name, sizeof(name), "%ld-000000-%d.res", BASE_SECONDS + i, i);
+	write_file(folder, name, 600);
+	snprintf(name, sizeof(name), "%ld-000000-%d.meta", BASE_SECONDS + i, i);
+	write_file(folder, name, 100);
+}
+
+static int record_exists(const char *folder, int i) {
+	char fileName[512];
+
+	snprintf(fileName, sizeof(fileName), "%s/%ld-000000-%d.meta", folder,
+		BASE_SECONDS + i, i);
+
+	return access(fileName, F_OK) == 0;
+}
+
+/*
+ * The index and other files count toward the size limit. The spill
+ * folder of the response cache does not.
+ */
+static void check_size_limit(ProxyServer *p, const char *folder) {
+	char spill[512];
+	RetentionStats stats;
+
+	for (int i = 0; i < RECORDS; ++i) {
+		save_record(folder, i);
+	}
+	write_file(folder, "capture.index", 4000);
+	write_file(folder, "capture.columns", 1000);
+	snprintf(spill, sizeof(spill), "%s/cache", folder);
+	mkdir(spill, 0700);
+	write_file(spill, "1.cache", 100000);
+
+	//15000 bytes in all
+	p->retention.maxBytes = 12000;
+	CHECK(proxyServerEnforceRetention(p, &stats) == 0);
+	CHECK(stats.recordsScanned == RECORDS);
+	CHECK(stats.recordsRemoved == 3);
+	CHECK(stats.bytesRemoved == 3 * RECORD_BYTES);
+	CHECK(stats.bytesRetained == 12000);
+	CHECK(!record_exists(folder, 0) && !record_exists(folder, 2));
+	CHECK(record_exists(folder, 3) && record_exists(folder, RECORDS - 1));
+
+	//Already within the limit
+	CHECK(proxyServerEnforceRetention(p, &stats) == 0);
+	CHECK(stats.recordsRemoved == 0);
+	CHECK(stats.bytesRetained == 12000);
+
+	//Larger files that are not records leave no record behind
+	write_file(folder, "capture.index", 20000);
+	CHECK(proxyServerEnforceRetention(p, &stats) == 0);
+	CHECK(stats.recordsRemoved == RECORDS - 3);
+	CHECK(!record_exists(folder, RECORDS - 1));
+	CHECK(stats.bytesRetained == 21000);
+}
+
+static void check_record_limit(ProxyServer *p, const char *folder) {
+	RetentionStats stats;
+
+	for (int i = 0; i < RECORDS; ++i) {
+		save_record(folder, i);
+	}
+	p->retention.maxBytes = 0;
+	p->retention.maxRecords = 4;
+	CHECK(proxyServerEnforceRetention(p, &stats) == 0);
+	CHECK(stats.recordsRemoved == RECORDS - 4);
+	CHECK(!record_exists(folder, RECORDS - 5));
+	CHECK(record_exists(folder, RECORDS - 4));
+}
+
+int main(int argc, char **argv) {
+	char folder[64];
+	ProxyServer *p = newProxyServer(0);
+
+	check_folder("retentioncheck", folder);
+	p->onError = ignore_error;
+	stringAppendCString(p->persistenceFolder, folder);
+
+	check_size_limit(p, folder);
+	check_record_limit(p, folder);
+
+	deleteProxyServer(p);
+	remove_check_folder(folder);
+
+	return check_summary("retentioncheck");
+}
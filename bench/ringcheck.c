@@ -0,0 +1,319 @@
+/*
+ * Checks of the flight recorder ring. Records are written through many
+ * wraparounds and looked up through the index of the writer and of a
+ * reader that maps the same file. Reopening must recover where the
+ * writer left off, and a walk must stop at a fragment whose payload no
+ * longer matches its checksum. A snapshot must not add to the files of
+ * an earlier one.
+ *
+ * ringcheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../Proxy.h"
+#include "../Persistence.h"
+#include "../Ring.h"
+#include "check.h"
+
+#define RING_SIZE (64 * 1024)
+#define RECORDS 5000
+
+typedef struct _Collected {
+	uint64_t record;
+	char body[RING_SIZE];
+	size_t length;
+	int complete;
+} Collected;
+
+//Gathers the response of the first record the walk comes to
+static int collect_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	Collected *c = context;
+
+	if (c->record == 0) {
+		c->record = f->record;
+	}
+	if (f->record != c->record) {
+		return 0;
+	}
+	if (f->kind == RING_RESPONSE && c->length + f->length <= RING_SIZE) {
+		memcpy(c->body + c->length, payload, f->length);
+		c->length += f->length;
+	} else if (f->kind == RING_META) {
+		c->complete = 1;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static size_t body_length(int i) {
+	//Every 97th record is split into several fragments
+	return i % 97 == 0 ? RING_SIZE / 3 : 100 + i % 400;
+}
+
+static void write_record(Ring *r, int i) {
+	static char body[RING_SIZE];
+	char id[32];
+	int length = snprintf(id, sizeof(id), "id%d", i);
+	uint64_t record = ringBeginRecord(r, id, length);
+
+	memset(body, 'a' + i % 26, body_length(i));
+	ringAppend(r, RING_REQUEST, record, "GET", 3);
+	ringAppend(r, RING_RESPONSE, record, body, body_length(i));
+	ringAppend(r, RING_META, record, "m", 1);
+}
+
+/*
+ * Returns 1 if the record was found with the right body, 0 if it is not
+ * in the ring and -1 if it was found but came back wrong.
+ */
+static int find_record(Ring *r, int i) {
+	char id[32];
+	int length = snprintf(id, sizeof(id), "id%d", i);
+	uint64_t position, sequence;
+	Collected *c;
+
+	if (ringFindRecord(r, id, length, &position, &sequence) < 0) {
+		return 0;
+	}
+	c = calloc(1, sizeof(Collected));
+	--sequence;
+	ringWalkFrom(r, &position, &sequence, c, collect_callback);
+
+	int good = c->complete && c->length == body_length(i) &&
+		c->body[0] == 'a' + i % 26 && c->body[c->length - 1] == c->body[0];
+
+	free(c);
+
+	return good ? 1 : -1;
+}
+
+static void check_wraparound(const char *fileName) {
+	Ring *writer = newRing(fileName, RING_SIZE);
+	Ring *reader = openRing(fileName);
+	int bad = 0, found = 0;
+
+	CHECK(writer != NULL && reader != NULL);
+	if (writer == NULL || reader == NULL) {
+		return;
+	}
+	for (int i = 0; i < RECORDS; ++i) {
+		write_record(writer, i);
+		if (i % 7 != 0) {
+			continue;
+		}
+		//The newest record is always there, old ones fall off
+		CHECK(find_record(writer, i) == 1);
+		CHECK(find_record(reader, i) == 1);
+		for (int j = i - 1; j >= 0 && j > i - 400; j -= 13) {
+			int status = find_record(j % 2 ? reader : writer, j);
+
+			bad += status < 0;
+			found += status > 0;
+		}
+	}
+	CHECK(bad == 0);
+	CHECK(found > 0);
+	CHECK(find_record(reader, 0) == 0);
+	CHECK(ringFindRecord(reader, "nope", 4, &(uint64_t) {0},
+		&(uint64_t) {0}) < 0);
+	CHECK(writer->header->head - writer->header->tail <= RING_SIZE);
+
+	deleteRing(reader);
+	deleteRing(writer);
+}
+
+static int count_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	++*(int*) context;
+
+	return 0;
+}
+
+static void check_recovery(const char *fileName) {
+	Ring *r = newRing(fileName, RING_SIZE);
+	uint64_t head = r->header->head;
+	uint64_t nextSequence = r->header->nextSequence;
+	int before = 0, after = 0;
+
+	ringWalk(r, &before, count_callback);
+	//Lose the head as if the writer died before updating it
+	r->header->head = r->header->tail;
+	deleteRing(r);
+
+	r = newRing(fileName, RING_SIZE);
+	CHECK(r->header->head == head);
+	CHECK(r->header->nextSequence >= nextSequence);
+	ringWalk(r, &after, count_callback);
+	CHECK(after == before);
+	CHECK(find_record(r, RECORDS - 1) == 1);
+	write_record(r, RECORDS);
+	CHECK(find_record(r, RECORDS) == 1);
+	CHECK(find_record(r, RECORDS - 1) == 1);
+	deleteRing(r);
+
+	//A different size starts afresh
+	r = newRing(fileName, RING_SIZE * 2);
+	CHECK(r->header->head == 0 && r->header->tail == 0);
+	CHECK(find_record(r, RECORDS) == 0);
+	deleteRing(r);
+}
+
+typedef struct _Corruption {
+	uint64_t record; //Record whose response gets a flipped byte
+	uint64_t position;
+	RingFragment *fragment;
+	int fragments; //Valid fragments seen
+} Corruption;
+
+static int corrupt_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	Corruption *c = context;
+
+	if (c->fragment == NULL && f->record == c->record &&
+		f->kind == RING_RESPONSE) {
+		c->position = position;
+		c->fragment = f;
+	}
+
+	return 0;
+}
+
+static int stop_callback(void *context, uint64_t position,
+	RingFragment *f, const char *payload) {
+	Corruption *c = context;
+
+	++c->fragments;
+	if (position >= c->position) {
+		c->fragment = f;
+	}
+
+	return 0;
+}
+
+static void check_corruption(const char *fileName) {
+	Ring *r = newRing(fileName, RING_SIZE);
+	Corruption c;
+	int total = 0;
+
+	for (int i = 0; i < 40; ++i) {
+		write_record(r, i);
+	}
+	ringWalk(r, &total, count_callback);
+
+	char id[32];
+	int length = snprintf(id, sizeof(id), "id%d", 30);
+	uint64_t position, sequence;
+
+	memset(&c, 0, sizeof(c));
+	CHECK(ringFindRecord(r, id, length, &position, &sequence) == 0);
+	c.record = ((RingFragment*) (r->data + position % r->size))->record;
+	ringWalk(r, &c, corrupt_callback);
+	CHECK(c.fragment != NULL);
+	if (c.fragment == NULL) {
+		deleteRing(r);
+
+		return;
+	}
+	((char*) c.fragment + sizeof(RingFragment))[c.fragment->length / 2] ^= 1;
+
+	//A new reader indexes up to the damage and no further
+	Ring *reader = openRing(fileName);
+
+	CHECK(find_record(reader, 29) == 1);
+	CHECK(find_record(reader, 30) == -1);
+	CHECK(find_record(reader, 31) == 0);
+	CHECK(find_record(reader, 39) == 0);
+	deleteRing(reader);
+
+	c.fragment = NULL;
+	ringWalk(r, &c, stop_callback);
+	CHECK(c.fragment == NULL);
+	CHECK(c.fragments > 0 && c.fragments < total);
+	deleteRing(r);
+}
+
+static void ignore_error(const char *message) {
+}
+
+//Size of a file in a snapshot folder or -1 if it is missing
+static long long file_size(const char *folder, const char *name) {
+	char fileName[512];
+	struct stat st;
+
+	snprintf(fileName, sizeof(fileName), "%s/%s", folder, name);
+
+	return stat(fileName, &st) == 0 ? st.st_size : -1;
+}
+
+static int snapshot_is_whole(const char *folder) {
+	int whole = 1;
+
+	for (int i = 1; i <= 20; ++i) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "id%d.res", i);
+		whole &= file_size(folder, name) == (long long) body_length(i);
+		snprintf(name, sizeof(name), "id%d.req", i);
+		whole &= file_size(folder, name) == 3;
+		snprintf(name, sizeof(name), "id%d.meta", i);
+		whole &= file_size(folder, name) == 1;
+	}
+
+	return whole;
+}
+
+static void check_snapshot(const char *folder, const char *fileName) {
+	Ring *writer = newRing(fileName, RING_SIZE);
+	ProxyServer *p = newProxyServer(0);
+	char snapshot[512], empty[512];
+
+	for (int i = 1; i <= 20; ++i) {
+		write_record(writer, i);
+	}
+	p->onError = ignore_error;
+	stringAppendCString(p->persistenceFolder, folder);
+	snprintf(snapshot, sizeof(snapshot), "%s/snapshot", folder);
+	snprintf(empty, sizeof(empty), "%s/empty", folder);
+
+	CHECK(proxyServerSnapshotRing(p, snapshot) == 0);
+	CHECK(snapshot_is_whole(snapshot));
+	//A second snapshot into the same folder is refused
+	CHECK(proxyServerSnapshotRing(p, snapshot) < 0);
+	CHECK(snapshot_is_whole(snapshot));
+	//An empty folder that is already there is fine
+	CHECK(mkdir(empty, 0700) == 0);
+	CHECK(proxyServerSnapshotRing(p, empty) == 0);
+	CHECK(snapshot_is_whole(empty));
+
+	deleteProxyServer(p);
+	deleteRing(writer);
+}
+
+int main(int argc, char **argv) {
+	char folder[64], fileName[512];
+
+	check_folder("ringcheck", folder);
+	snprintf(fileName, sizeof(fileName), "%s/%s", folder, RING_FILE);
+
+	CHECK(openRing(fileName) == NULL);
+	check_wraparound(fileName);
+	check_recovery(fileName);
+	unlink(fileName);
+	check_corruption(fileName);
+	unlink(fileName);
+	check_snapshot(folder, fileName);
+	remove_check_folder(folder);
+
+	return check_summary("ringcheck");
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+#Runs the load test through Pixie with capture on and off, in closed and
+#open loop. Run from the Pixie folder with make bench. Settings can be
+#overridden from the environment, e.g.
+#
+#SIZE=65536 CONNECTIONS=64 RATE=5000 make bench
+
+ORIGIN_PORT=${ORIGIN_PORT:-9000}
+PROXY_PORT=${PROXY_PORT:-9090}
+SIZE=${SIZE:-4096}
+LATENCY=${LATENCY:-0}
+CONNECTIONS=${CONNECTIONS:-32}
+DURATION=${DURATION:-10}
+RATE=${RATE:-2000}
+
+WORK=$(mktemp -d)
+ORIGIN_PID=
+PIXIE_PID=
+
+stop() {
+	[ -n "$PIXIE_PID" ] && kill $PIXIE_PID 2>/dev/null
+	[ -n "$ORIGIN_PID" ] && kill $ORIGIN_PID 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap stop EXIT INT TERM
+
+bench/origin -p $ORIGIN_PORT -s $SIZE -l $LATENCY &
+ORIGIN_PID=$!
+
+#Pixie reads commands from stdin. Hold a fifo open to keep it running
+#and send quit at the end so that it shuts down cleanly.
+run() {
+	label=$1
+	shift
+	mkfifo "$WORK/control"
+	HOME="$WORK" ./pixie -p $PROXY_PORT $PIXIE_FLAGS "$@" \
+		< "$WORK/control" > "$WORK/pixie.log" 2>&1 &
+	PIXIE_PID=$!
+	exec 3> "$WORK/control"
+	sleep 1
+
+	echo "== $label, closed loop"
+	bench/driver -x 127.0.0.1:$PROXY_PORT -u 127.0.0.1:$ORIGIN_PORT/ \
+		-c $CONNECTIONS -d $DURATION -P $PIXIE_PID
+	echo "== $label, open loop at $RATE req/s"
+	bench/driver -x 127.0.0.1:$PROXY_PORT -u 127.0.0.1:$ORIGIN_PORT/ \
+		-c $CONNECTIONS -d $DURATION -r $RATE -P $PIXIE_PID
+
+	echo quit >&3
+	exec 3>&-
+	wait $PIXIE_PID
+	PIXIE_PID=
+	rm -rf "$WORK/control" "$WORK/.pixie"
+}
+
+run "capture on"
+run "capture off" -n
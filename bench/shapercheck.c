@@ -0,0 +1,315 @@
+/*
+ * Checks of traffic shaping. Policies are parsed and token buckets are
+ * driven on a made up clock, writing as fast as the shaper allows, so
+ * the rates can be checked exactly without waiting. Hosts share their
+ * buckets and latency and stalls hold writes back.
+ *
+ * shapercheck
+ *
+ * Prints each failed check and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../Proxy.h"
+#include "../Metrics.h"
+#include "../Shaper.h"
+#include "check.h"
+
+#define SECOND 1000000LL
+#define START (1000 * SECOND)
+
+static void check_parse() {
+	ShapingPolicy policy;
+	char tooLong[600];
+
+	CHECK(shapingPolicyParse("conn=1.6m/768k", &policy) == 0);
+	CHECK(policy.connectionRate[SHAPE_DOWN] == 200000);
+	CHECK(policy.connectionRate[SHAPE_UP] == 96000);
+	CHECK(policy.hostRate[SHAPE_DOWN] == 0 && policy.globalRate[SHAPE_UP] == 0);
+	CHECK(shapingPolicyParse("host=10M,global=1g,latency=300,chunk=20,"
+		"stall=2.5:500", &policy) == 0);
+	CHECK(policy.hostRate[SHAPE_DOWN] == 1250000);
+	CHECK(policy.hostRate[SHAPE_UP] == 1250000);
+	CHECK(policy.globalRate[SHAPE_DOWN] == 125000000);
+	CHECK(policy.latencyMs == 300 && policy.chunkLatencyMs == 20);
+	CHECK(policy.stallPercent == 2.5 && policy.stallMs == 500);
+	CHECK(shapingPolicyParse("", &policy) == 0);
+	CHECK(policy.connectionRate[SHAPE_DOWN] == 0 && policy.latencyMs == 0);
+
+	static const char *invalid[] = {"conn", "conn=", "conn=0", "conn=-1m",
+		"conn=1x", "conn=1m/", "conn=1m/2m/3m", "speed=1m", "latency=abc",
+		"stall=2", "conn=1m,,latency"};
+
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+		CHECK(shapingPolicyParse(invalid[i], &policy) == -1);
+	}
+	memset(tooLong, 'a', sizeof(tooLong) - 1);
+	tooLong[sizeof(tooLong) - 1] = '\0';
+	CHECK(shapingPolicyParse(tooLong, &policy) == -1);
+}
+
+static ProxyServer *new_shaped_proxy(const char *spec) {
+	ProxyServer *p = newProxyServer(0);
+
+	CHECK(shapingPolicyParse(spec, &p->shaping) == 0);
+	p->shaper = newShaper(p);
+
+	return p;
+}
+
+static void delete_shaped_proxy(ProxyServer *p) {
+	deleteShaper(p->shaper);
+	p->shaper = NULL;
+	deleteProxyServer(p);
+}
+
+static Request *new_shaped_request(ProxyServer *p, const char *host) {
+	Request *req = calloc(1, sizeof(Request));
+
+	req->host = newStringWithCString(host);
+	shaperBeginRequest(p, req, START);
+
+	return req;
+}
+
+static void delete_shaped_request(ProxyServer *p, Request *req) {
+	shaperEndRequest(p, req);
+	deleteString(req->host);
+	free(req);
+}
+
+/*
+ * Writes as much as the shaper allows through each request in turn until
+ * the clock reaches end. Returns the bytes written by all of them.
+ */
+static long long write_until(ProxyServer *p, Request **reqs, int count,
+	int direction, long long *now, long long end) {
+	long long total = 0;
+
+	while (*now < end) {
+		long long next = end;
+
+		for (int i = 0; i < count; ++i) {
+			size_t n = shaperAllow(p, reqs[i], direction, 64 * 1024, *now);
+
+			if (n > 0) {
+				shaperConsume(p, reqs[i], direction, n);
+				total += n;
+				next = *now;
+			} else if (reqs[i]->shapeDue[direction] > 0 &&
+				reqs[i]->shapeDue[direction] < next) {
+				next = reqs[i]->shapeDue[direction];
+			}
+		}
+		//Nothing was due, so the writers would sleep until the next one is
+		*now = next > *now ? next : *now + 1;
+	}
+
+	return total;
+}
+
+static int near(long long value, long long expected, long long slack) {
+	return value >= expected - slack && value <= expected + slack;
+}
+
+static void check_connection_rate() {
+	ProxyServer *p = new_shaped_proxy("conn=800k/80k");
+	Request *req = new_shaped_request(p, "example.test");
+	long long now = START;
+	long long down = write_until(p, &req, 1, SHAPE_DOWN, &now,
+		START + 10 * SECOND);
+
+	//Ten seconds at 100000 bytes a second plus the first burst
+	CHECK(near(down, 10 * 100000 + 10000, SHAPE_QUANTUM));
+
+	now = START;
+	long long up = write_until(p, &req, 1, SHAPE_UP, &now, START + 10 * SECOND);
+
+	//The burst is at least one segment
+	CHECK(near(up, 10 * 10000 + SHAPE_QUANTUM, SHAPE_QUANTUM));
+
+	delete_shaped_request(p, req);
+	delete_shaped_proxy(p);
+}
+
+//Connections to one host share its rate and other hosts get their own
+static void check_host_rate() {
+	ProxyServer *p = new_shaped_proxy("host=800k");
+	Request *reqs[3] = {new_shaped_request(p, "example.test"),
+		new_shaped_request(p, "EXAMPLE.test"),
+		new_shaped_request(p, "other.test")};
+	long long now = START;
+
+	CHECK(reqs[0]->shapeHost != NULL);
+	CHECK(reqs[0]->shapeHost == reqs[1]->shapeHost);
+	CHECK(reqs[0]->shapeHost != reqs[2]->shapeHost);
+
+	long long shared = write_until(p, reqs, 2, SHAPE_DOWN, &now,
+		START + 10 * SECOND);
+
+	CHECK(near(shared, 10 * 100000 + 10000, 2 * SHAPE_QUANTUM));
+	now = START;
+	CHECK(near(write_until(p, reqs + 2, 1, SHAPE_DOWN, &now,
+		START + 10 * SECOND), 10 * 100000 + 10000, SHAPE_QUANTUM));
+
+	for (int i = 0; i < 3; ++i) {
+		delete_shaped_request(p, reqs[i]);
+	}
+	delete_shaped_proxy(p);
+}
+
+//The slowest bucket sets the pace
+static void check_global_rate() {
+	ProxyServer *p = new_shaped_proxy("conn=8m,global=800k");
+	Request *reqs[4];
+	long long now = START;
+
+	for (int i = 0; i < 4; ++i) {
+		char host[32];
+
+		snprintf(host, sizeof(host), "host%d.test", i);
+		reqs[i] = new_shaped_request(p, host);
+	}
+	CHECK(near(write_until(p, reqs, 4, SHAPE_DOWN, &now, START + 10 * SECOND),
+		10 * 100000 + 10000, 4 * SHAPE_QUANTUM));
+
+	for (int i = 0; i < 4; ++i) {
+		delete_shaped_request(p, reqs[i]);
+	}
+	delete_shaped_proxy(p);
+}
+
+static void check_latency() {
+	ProxyServer *p = new_shaped_proxy("latency=300,chunk=20");
+	Request *req = new_shaped_request(p, "example.test");
+	long long now = START;
+
+	//The first write of the response waits for both
+	shaperScheduleWrite(p, req, SHAPE_DOWN, now);
+	CHECK(req->shapeDue[SHAPE_DOWN] == now + 320000);
+	CHECK(shaperAllow(p, req, SHAPE_DOWN, 100, now) == 0);
+	CHECK(shaperAllow(p, req, SHAPE_DOWN, 100, now + 300000) == 0);
+	//Writes due within the slack go at once
+	CHECK(shaperAllow(p, req, SHAPE_DOWN, 100,
+		now + 320000 - SHAPE_SLACK_MICROS) == 100);
+	now += 320000;
+	shaperScheduleWrite(p, req, SHAPE_DOWN, now);
+	CHECK(req->shapeDue[SHAPE_DOWN] == now + 20000);
+	shaperScheduleWrite(p, req, SHAPE_UP, now);
+	CHECK(req->shapeDue[SHAPE_UP] == now + 20000);
+	delete_shaped_request(p, req);
+
+	//Each request waits for its own response
+	req = new_shaped_request(p, "example.test");
+	shaperScheduleWrite(p, req, SHAPE_DOWN, now);
+	CHECK(req->shapeDue[SHAPE_DOWN] == now + 320000);
+	delete_shaped_request(p, req);
+	delete_shaped_proxy(p);
+}
+
+static void check_stalls() {
+	ProxyServer *p = new_shaped_proxy("stall=100:500");
+	Request *req = new_shaped_request(p, "example.test");
+	int stalled = 0;
+
+	for (int i = 0; i < 10; ++i) {
+		req->shapeDue[SHAPE_UP] = 0;
+		shaperScheduleWrite(p, req, SHAPE_UP, START);
+		stalled += req->shapeDue[SHAPE_UP] == START + 500000;
+	}
+	CHECK(stalled == 10);
+	delete_shaped_request(p, req);
+	delete_shaped_proxy(p);
+
+	p = new_shaped_proxy("stall=25:500");
+	req = new_shaped_request(p, "example.test");
+	stalled = 0;
+	for (int i = 0; i < 10000; ++i) {
+		req->shapeDue[SHAPE_UP] = 0;
+		shaperScheduleWrite(p, req, SHAPE_UP, START);
+		stalled += req->shapeDue[SHAPE_UP] != 0;
+	}
+	CHECK(stalled > 2200 && stalled < 2800);
+	delete_shaped_request(p, req);
+	delete_shaped_proxy(p);
+}
+
+static long long shaped_hosts(ProxyServer *p) {
+	MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+	long long hosts = -1;
+
+	if (proxyServerGetMetrics(p, snapshot) == 0) {
+		hosts = snapshot->values[METRIC_SHAPING_HOSTS];
+	}
+	free(snapshot);
+
+	return hosts;
+}
+
+//Writes until the request's buckets run short, as the proxy would
+static void drain(ProxyServer *p, Request *req, long long now) {
+	size_t n = shaperAllow(p, req, SHAPE_DOWN, 64 * 1024, now);
+
+	shaperConsume(p, req, SHAPE_DOWN, n);
+	CHECK(shaperAllow(p, req, SHAPE_DOWN, 1000, now) == 0);
+}
+
+/*
+ * Hosts nobody connects to are dropped once their buckets have refilled.
+ * Hosts in use or still in debt keep their buckets.
+ */
+static void check_host_eviction() {
+	ProxyServer *p = new_shaped_proxy("host=800k");
+	Request *kept = new_shaped_request(p, "kept.test");
+	Request *drained = new_shaped_request(p, "drained.test");
+	void *keptHost = kept->shapeHost;
+	char host[32];
+
+	drain(p, kept, START);
+	drain(p, drained, START);
+	delete_shaped_request(p, drained);
+	for (int i = 0; i < 5000; ++i) {
+		snprintf(host, sizeof(host), "host%d.test", i);
+		delete_shaped_request(p, new_shaped_request(p, host));
+	}
+	CHECK(shaped_hosts(p) > 2 && shaped_hosts(p) <= 1024);
+	CHECK(kept->shapeHost == keptHost);
+	//Still in debt rather than starting over with a full bucket
+	drained = new_shaped_request(p, "drained.test");
+	CHECK(shaperAllow(p, drained, SHAPE_DOWN, 1000, START) == 0);
+	delete_shaped_request(p, drained);
+
+	//A second later only the host in use is left from before
+	for (int i = 0; i < 1024; ++i) {
+		Request *req = calloc(1, sizeof(Request));
+
+		snprintf(host, sizeof(host), "later%d.test", i);
+		req->host = newStringWithCString(host);
+		shaperBeginRequest(p, req, START + SECOND);
+		delete_shaped_request(p, req);
+	}
+	CHECK(shaped_hosts(p) < 1024);
+	CHECK(kept->shapeHost == keptHost);
+	delete_shaped_request(p, kept);
+	deleteShaper(p->shaper);
+	p->shaper = NULL;
+	CHECK(shaped_hosts(p) == 0);
+	deleteProxyServer(p);
+}
+
+int main(int argc, char **argv) {
+	check_parse();
+	check_connection_rate();
+	check_host_rate();
+	check_global_rate();
+	check_latency();
+	check_stalls();
+	check_host_eviction();
+
+	return check_summary("shapercheck");
+}
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+#
+# Generates HeaderNames.h and HeaderNames.c. Run "make header-names" after
+# changing the list. IDs are only used in memory so the list can be
+# changed freely.
+#
+# The hash lower cases a name by setting bit 0x20 of every byte. Lookups
+# confirm a hit with strncasecmp() so bytes that collide this way are fine.
+
+NAMES = [
+	"Accept",
+	"Accept-Charset",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Accept-Ranges",
+	"Access-Control-Allow-Credentials",
+	"Access-Control-Allow-Headers",
+	"Access-Control-Allow-Methods",
+	"Access-Control-Allow-Origin",
+	"Access-Control-Expose-Headers",
+	"Access-Control-Max-Age",
+	"Access-Control-Request-Headers",
+	"Access-Control-Request-Method",
+	"Age",
+	"Allow",
+	"Authorization",
+	"Cache-Control",
+	"Connection",
+	"Content-Disposition",
+	"Content-Encoding",
+	"Content-Language",
+	"Content-Length",
+	"Content-Location",
+	"Content-Range",
+	"Content-Security-Policy",
+	"Content-Type",
+	"Cookie",
+	"Date",
+	"DNT",
+	"ETag",
+	"Expect",
+	"Expires",
+	"Forwarded",
+	"From",
+	"Host",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Keep-Alive",
+	"Last-Modified",
+	"Link",
+	"Location",
+	"Max-Forwards",
+	"Origin",
+	"Pragma",
+	"Proxy-Authenticate",
+	"Proxy-Authorization",
+	"Proxy-Connection",
+	"Range",
+	"Referer",
+	"Referrer-Policy",
+	"Retry-After",
+	"Server",
+	"Set-Cookie",
+	"Strict-Transport-Security",
+	"TE",
+	"Trailer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"Upgrade-Insecure-Requests",
+	"User-Agent",
+	"Vary",
+	"Via",
+	"Warning",
+	"WWW-Authenticate",
+	"X-Content-Type-Options",
+	"X-Forwarded-For",
+	"X-Forwarded-Host",
+	"X-Forwarded-Proto",
+	"X-Frame-Options",
+	"X-Powered-By",
+	"X-Request-Id",
+	"X-Requested-With",
+	"X-XSS-Protection",
+]
+
+TABLE_SIZE = 512
+
+
+def name_hash(name, seed):
+	h = seed
+	for ch in name.encode():
+		h = ((h ^ (ch | 0x20)) * 16777619) & 0xffffffff
+	#Low bits of the product only depend on low bits of the seed
+	return h ^ (h >> 16)
+
+
+def find_seed():
+	for seed in range(1, 1 << 24):
+		slots = set()
+		for name in NAMES:
+			slot = name_hash(name, seed) % TABLE_SIZE
+			if slot in slots:
+				break
+			slots.add(slot)
+		else:
+			return seed
+	raise Exception("No seed found. Make TABLE_SIZE larger.")
+
+
+def enum_name(name):
+	return "HEADER_" + name.upper().replace("-", "_")
+
+
+def main():
+	seed = find_seed()
+	slots = [0] * TABLE_SIZE
+	for i, name in enumerate(NAMES):
+		slots[name_hash(name, seed) % TABLE_SIZE] = i + 1
+
+	with open("HeaderNames.h", "w") as f:
+		f.write("/*\n")
+		f.write(" * Generated by genheadernames.py. Do not edit.\n")
+		f.write(" *\n")
+		f.write(" * Well known header names have a small ID. Names are looked up\n")
+		f.write(" * ignoring case with a perfect hash. Other names are\n")
+		f.write(" * HEADER_UNKNOWN and have to be compared by text.\n")
+		f.write(" */\n")
+		f.write("typedef enum _HeaderNameId {\n")
+		f.write("\tHEADER_UNKNOWN = 0,\n")
+		for name in NAMES:
+			f.write("\t%s,\n" % enum_name(name))
+		f.write("\tHEADER_NAME_COUNT\n")
+		f.write("} HeaderNameId;\n\n")
+		f.write("int headerNameLookup(const char *name, size_t length);\n")
+		f.write("const char *headerNameString(int id);\n")
+
+	with open("HeaderNames.c", "w") as f:
+		f.write("/*\n")
+		f.write(" * Generated by genheadernames.py. Do not edit.\n")
+		f.write(" */\n")
+		f.write("#include <stdint.h>\n")
+		f.write("#include <string.h>\n")
+		f.write("#include <strings.h>\n\n")
+		f.write("#include \"HeaderNames.h\"\n\n")
+		f.write("#define HASH_SEED %du\n" % seed)
+		f.write("#define TABLE_SIZE %d\n\n" % TABLE_SIZE)
+		f.write("static const char *names[HEADER_NAME_COUNT] = {\n")
+		f.write("\tNULL,\n")
+		for name in NAMES:
+			f.write("\t\"%s\",\n" % name)
+		f.write("};\n\n")
+		f.write("static const unsigned char lengths[HEADER_NAME_COUNT] = {\n\t0,")
+		for i, name in enumerate(NAMES):
+			f.write("\n\t" if i % 16 == 15 else " ")
+			f.write("%d," % len(name))
+		f.write("\n};\n\n")
+		f.write("//ID by hash slot\n")
+		f.write("static const unsigned char slots[TABLE_SIZE] = {")
+		for i, id in enumerate(slots):
+			f.write("\n\t" if i % 16 == 0 else " ")
+			f.write("%d," % id)
+		f.write("\n};\n\n")
+		f.write("""/*
+ * Returns the ID of a header name or HEADER_UNKNOWN.
+ */
+int headerNameLookup(const char *name, size_t length) {
+	uint32_t h = HASH_SEED;
+
+	for (size_t i = 0; i < length; ++i) {
+		h = (h ^ ((unsigned char) name[i] | 0x20)) * 16777619u;
+	}
+	h ^= h >> 16;
+
+	int id = slots[h % TABLE_SIZE];
+
+	if (id != HEADER_UNKNOWN && lengths[id] == length &&
+		strncasecmp(names[id], name, length) == 0) {
+		return id;
+	}
+
+	return HEADER_UNKNOWN;
+}
+
+const char *headerNameString(int id) {
+	return id > HEADER_UNKNOWN && id < HEADER_NAME_COUNT ? names[id] : NULL;
+}
+""")
+
+
+main()
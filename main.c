@@ -1,7 +1,23 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include "Proxy.h"
+#include "Persistence.h"
+#include "HistoryFeed.h"
+#include "Index.h"
+#include "MetaStore.h"
+#include "BodyCodec.h"
+#include "ResponseCache.h"
+#include "Replay.h"
+#include "Rules.h"
+#include "Shaper.h"
+#include "Har.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Alloc.h"
 
 static void print_request_start(ProxyServer *p, Request *req) {
 	printf("New request with ID: %s\n",
@@ -9,36 +25,428 @@ static void print_request_start(ProxyServer *p, Request *req) {
 }
 static void print_request_end(ProxyServer *p, Request *req) {
 }
+static void print_search_result(void *contextData, const char *uniqueId) {
+	printf("%s\n", uniqueId);
+}
+static void print_query_row(void *contextData, QueryRow *row) {
+	char when[32];
+	time_t seconds = row->startTime / 1000000;
+	struct tm tm;
+
+	localtime_r(&seconds, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s %s %s %s %d %.1fms %llu %llu\n", row->uniqueId, when,
+		row->method, row->host, row->status, row->duration / 1000.0,
+		row->requestSize, row->responseSize);
+}
+static void print_record(void *contextData, const char *uniqueId,
+	RequestRecord *req, ResponseRecord *res) {
+	printf("%s %s %s %s %s\n", uniqueId,
+		stringAsCString(req->method), stringAsCString(req->host),
+		stringAsCString(req->path), stringAsCString(res->statusCode));
+	fflush(stdout);
+}
+
+/*
+ * Prints records as they are captured by a proxy running elsewhere.
+ */
+static void follow(ProxyServer *p) {
+	const char *home = getenv("HOME");
+
+	if (home != NULL) {
+		stringAppendCString(p->persistenceFolder, home);
+	}
+	stringAppendCString(p->persistenceFolder, "/.pixie");
+
+	HistoryFeed *feed = newHistoryFeed(p, NULL);
+
+	while (1) {
+		historyFeedWait(feed, -1, NULL, print_record);
+	}
+
+	deleteHistoryFeed(feed);
+}
+
+/*
+ * Runs a query over what has been captured so far and exits.
+ */
+static void query(ProxyServer *p, const char *expression) {
+	const char *home = getenv("HOME");
+
+	if (home != NULL) {
+		stringAppendCString(p->persistenceFolder, home);
+	}
+	stringAppendCString(p->persistenceFolder, "/.pixie");
+
+	if (proxyServerStartMetaStore(p) < 0) {
+		exit(1);
+	}
+	proxyServerWaitMetaStore(p);
+
+	long count = proxyServerQuery(p, expression, NULL, print_query_row);
+
+	if (count >= 0) {
+		printf("Found %ld records.\n", count);
+	}
+
+	deleteProxyServer(p);
+	exit(count < 0 ? 1 : 0);
+}
+
+static void dump_trace(ProxyServer *p) {
+	char fileName[512];
+
+	snprintf(fileName, sizeof(fileName), "%s/pixie.trace",
+		stringAsCString(p->persistenceFolder));
+	if (traceDump(fileName) == 0) {
+		printf("Saved trace in %s. Read it with pixie-trace.\n", fileName);
+	}
+}
+
+/*
+ * Prints where heap traffic came from. At shutdown nothing is printed
+ * unless allocation accounting was built in.
+ */
+static void print_allocations(ProxyServer *p, int always) {
+	MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+	Buffer *report = newBufferWithCapacity(16 * 1024);
+
+	proxyServerGetMetrics(p, snapshot);
+	if (allocFormatReport(report, snapshot->values[METRIC_REQUESTS]) == 0 ||
+		always) {
+		fwrite(report->buffer, 1, report->length, stdout);
+	}
+	deleteBuffer(report);
+	free(snapshot);
+}
+
+/*
+ * Accepts seconds since the epoch or local time as YYYY-MM-DDTHH:MM[:SS].
+ * Returns microseconds since the epoch.
+ */
+static long long parse_time(const char *text) {
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(text, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+		&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) >= 5) {
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_isdst = -1;
+
+		return (long long) mktime(&tm) * 1000000;
+	}
+
+	return atoll(text) * 1000000;
+}
+
+/*
+ * Writes what has been captured so far as a HAR file and exits.
+ */
+static void export_har(ProxyServer *p, const char *fileName,
+	const HarFilter *filter) {
+	const char *home = getenv("HOME");
+
+	if (home != NULL) {
+		stringAppendCString(p->persistenceFolder, home);
+	}
+	stringAppendCString(p->persistenceFolder, "/.pixie");
+
+	FILE *out = strcmp(fileName, "-") == 0 ? stdout : fopen(fileName, "w");
+
+	if (out == NULL) {
+		perror(fileName);
+		exit(1);
+	}
+
+	long count = proxyServerExportHar(p, out, filter, 0);
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	if (count >= 0) {
+		fprintf(stderr, "Exported %ld records.\n", count);
+	}
+
+	deleteProxyServer(p);
+	exit(count < 0 ? 1 : 0);
+}
 
 int main(int argc, char **argv) {
 	int port = 8080;
+	RetentionPolicy retention;
 	
 	int c;
 
-	while ((c = getopt(argc, argv, "vp:")) != -1) {
+	memset(&retention, 0, sizeof(retention));
+
+	int ringMegabytes = 0;
+	DurabilityMode durability = DURABILITY_NONE;
+	int commitInterval = 0;
+	int followMode = 0;
+	int indexEnabled = 0;
+	int metaStoreEnabled = 0;
+	const char *queryExpression = NULL;
+	int metricsPort = 0;
+	const char *metricsAddress = NULL;
+	int captureEnabled = 1;
+	long long cacheMegabytes = 0;
+	long long spillMegabytes = 0;
+	const char *replaySpec = NULL;
+	const char *rulesFile = NULL;
+	const char *shapingSpec = NULL;
+	const char *harFile = NULL;
+	HarFilter harFilter;
+
+	memset(&harFilter, 0, sizeof(harFilter));
+
+	while ((c = getopt(argc, argv, "vnFXMp:A:B:N:R:D:I:q:E:s:e:o:m:C:r:u:t:")) != -1) {
 		if (c == 'v') {
 			proxySetTrace(1);
+		} else if (c == 'n') {
+			captureEnabled = 0;
+		} else if (c == 'F') {
+			followMode = 1;
+		} else if (c == 'X') {
+			indexEnabled = 1;
+		} else if (c == 'M') {
+			metaStoreEnabled = 1;
+		} else if (c == 'q') {
+			queryExpression = optarg;
+		} else if (c == 'm') {
+			//[address:]port. Loopback if no address is given.
+			char *colon = strrchr(optarg, ':');
+
+			if (colon != NULL) {
+				*colon = '\0';
+				metricsAddress = optarg;
+				optarg = colon + 1;
+			}
+			sscanf(optarg, "%d", &metricsPort);
+		} else if (c == 'E') {
+			harFile = optarg;
+		} else if (c == 's') {
+			harFilter.startTime = parse_time(optarg);
+		} else if (c == 'e') {
+			harFilter.endTime = parse_time(optarg);
+		} else if (c == 'o') {
+			harFilter.host = optarg;
 		} else if (c == 'p') {
 			if (optarg != NULL) {
 				sscanf(optarg, "%d", &port);
 			}
+		} else if (c == 'A') {
+			sscanf(optarg, "%ld", &retention.maxAgeSeconds);
+		} else if (c == 'B') {
+			long long mb = 0;
+
+			sscanf(optarg, "%lld", &mb);
+			retention.maxBytes = mb * 1024 * 1024;
+		} else if (c == 'N') {
+			sscanf(optarg, "%ld", &retention.maxRecords);
+		} else if (c == 'R') {
+			sscanf(optarg, "%d", &ringMegabytes);
+		} else if (c == 'D') {
+			if (strcmp(optarg, "group") == 0) {
+				durability = DURABILITY_GROUP;
+			} else if (strcmp(optarg, "record") == 0) {
+				durability = DURABILITY_RECORD;
+			}
+		} else if (c == 'I') {
+			sscanf(optarg, "%d", &commitInterval);
+		} else if (c == 'C') {
+			//Memory and optional disk spill in MB. Ex: 64 or 64:1024.
+			sscanf(optarg, "%lld:%lld", &cacheMegabytes, &spillMegabytes);
+		} else if (c == 'r') {
+			//Time scale and what else must match. Ex: 1 or 0:query:body.
+			replaySpec = optarg;
+		} else if (c == 'u') {
+			rulesFile = optarg;
+		} else if (c == 't') {
+			//Network to emulate. Ex: conn=1.6m/768k,latency=300.
+			shapingSpec = optarg;
 		}
 	}
 
 	ProxyServer *p = newProxyServer(port);
 
-	p->persistenceEnabled = 1;
+	if (followMode) {
+		follow(p);
+	}
+	if (queryExpression != NULL) {
+		query(p, queryExpression);
+	}
+	if (harFile != NULL) {
+		export_har(p, harFile, &harFilter);
+	}
+
+	p->retention = retention;
+	if (ringMegabytes > 0) {
+		p->captureMode = CAPTURE_RING;
+		p->ringSize = (unsigned long long) ringMegabytes * 1024 * 1024;
+	}
+	p->durability = durability;
+	p->commitIntervalMs = commitInterval;
+	p->indexEnabled = indexEnabled;
+	p->metaStoreEnabled = metaStoreEnabled;
+	p->metricsPort = metricsPort;
+	p->metricsAddress = metricsAddress;
+	if (cacheMegabytes > 0) {
+		p->responseCacheEnabled = 1;
+		p->responseCacheSize = cacheMegabytes * 1024 * 1024;
+		p->responseCacheSpillSize = spillMegabytes * 1024 * 1024;
+	}
+
+	if (replaySpec != NULL) {
+		p->replayEnabled = 1;
+		sscanf(replaySpec, "%lf", &p->replayTimeScale);
+		if (strstr(replaySpec, ":query") != NULL) {
+			p->replayMatch |= REPLAY_MATCH_QUERY;
+		}
+		if (strstr(replaySpec, ":body") != NULL) {
+			p->replayMatch |= REPLAY_MATCH_BODY;
+		}
+		//Don't mix replayed traffic with the records it came from
+		captureEnabled = 0;
+	}
+
+	if (rulesFile != NULL) {
+		char error[512];
+
+		if (proxyServerLoadRules(p, rulesFile, error, sizeof(error)) < 0) {
+			fprintf(stderr, "%s\n", error);
+			exit(1);
+		}
+	}
+
+	if (shapingSpec != NULL) {
+		if (shapingPolicyParse(shapingSpec, &p->shaping) < 0) {
+			fprintf(stderr, "Bad shaping policy: %s\n", shapingSpec);
+			exit(1);
+		}
+		p->shapingEnabled = 1;
+	}
+
+	p->persistenceEnabled = captureEnabled;
 	p->onBeginRequest = print_request_start;
 	p->onEndRequest = print_request_end;
 
 	proxyServerStartInBackground(p);
 	
-	char buff[128];
+	char buff[512];
 	while (1) {
 		printf("Enter quit to stop server.\n");
-		fgets(buff, sizeof(buff), stdin);
+		if (fgets(buff, sizeof(buff), stdin) == NULL) {
+			strcpy(buff, "quit");
+		}
+
+		if (strncmp(buff, "snapshot", 8) == 0) {
+			char folder[512];
+
+			snprintf(folder, sizeof(folder), "%s/snapshot-%lu",
+				stringAsCString(p->persistenceFolder),
+				(unsigned long) time(NULL));
+			if (proxyServerSnapshotRing(p, folder) == 0) {
+				printf("Saved snapshot in %s\n", folder);
+			}
+			continue;
+		}
+		if (strncmp(buff, "trace", 5) == 0) {
+			dump_trace(p);
+			continue;
+		}
+		if (strncmp(buff, "metrics", 7) == 0) {
+			Buffer *text = newBufferWithCapacity(16 * 1024);
+
+			proxyServerFormatMetrics(p, text);
+			fwrite(text->buffer, 1, text->length, stdout);
+			deleteBuffer(text);
+			continue;
+		}
+		if (strncmp(buff, "cache", 5) == 0) {
+			ResponseCacheStats stats;
+
+			if (proxyServerGetResponseCacheStats(p, &stats) == 0) {
+				printf("Hits %lu, revalidated %lu, misses %lu, stored %lu. "
+					"%lu entries in %llu bytes, %lu spilled in %llu bytes.\n",
+					stats.hits, stats.revalidated, stats.misses, stats.stored,
+					stats.entries, stats.bytes, stats.spilledEntries,
+					stats.spilledBytes);
+			} else {
+				printf("The response cache is off. Start with -C.\n");
+			}
+			continue;
+		}
+		if (strncmp(buff, "replay", 6) == 0) {
+			ReplayStats stats;
+
+			if (proxyServerGetReplayStats(p, &stats) == 0) {
+				printf("%lu records under %lu keys. Served %lu, missed %lu.\n",
+					stats.records, stats.keys, stats.served, stats.missed);
+			} else {
+				printf("Replay mode is off. Start with -r.\n");
+			}
+			continue;
+		}
+		if (strncmp(buff, "rules", 5) == 0) {
+			char error[512];
+
+			if (rulesFile == NULL) {
+				printf("No rule file. Start with -u.\n");
+			} else if (proxyServerLoadRules(p, rulesFile, error,
+				sizeof(error)) < 0) {
+				printf("%s Keeping the current rules.\n", error);
+			} else {
+				printf("Loaded %zu rules from %s.\n",
+					ruleSetCount(p->rules), rulesFile);
+			}
+			continue;
+		}
+		if (strncmp(buff, "allocs", 6) == 0) {
+			print_allocations(p, 1);
+			continue;
+		}
+		if (strncmp(buff, "search ", 7) == 0) {
+			int count = proxyServerSearch(p, buff + 7, NULL,
+				print_search_result);
 
+			if (count >= 0) {
+				printf("Found %d records.\n", count);
+			}
+			continue;
+		}
+		if (strncmp(buff, "query ", 6) == 0) {
+			long count = proxyServerQuery(p, buff + 6, NULL, print_query_row);
+
+			if (count >= 0) {
+				printf("Found %ld records.\n", count);
+			}
+			continue;
+		}
+		if (strncmp(buff, "body ", 5) == 0) {
+			Buffer *body = newBufferWithCapacity(4096);
+
+			buff[strcspn(buff, "\r\n")] = '\0';
+			if (proxyServerGetResponseBody(p, buff + 5, 0, SIZE_MAX, body) >= 0) {
+				fwrite(body->buffer, 1, body->length, stdout);
+				printf("\n");
+			}
+			deleteBuffer(body);
+			continue;
+		}
 		if (strncmp(buff, "quit", 4) == 0) {
+			CommitStats stats;
+
+			if (proxyServerGetCommitStats(p, &stats) == 0 && stats.records > 0) {
+				printf("Committed %lu records in %lu batches. "
+					"Average latency %.1f ms, max %.1f ms.\n",
+					stats.records, stats.batches,
+					stats.totalLatencyMs / stats.records, stats.maxLatencyMs);
+			}
+			if (traceEnabled) {
+				dump_trace(p);
+			}
+			print_allocations(p, 0);
 			printf("Stopping server...\n");
 			proxyServerStop(p);
 			break;
@@ -0,0 +1,144 @@
+/*
+ * Renders a trace file written by traceDump() as text, one event per
+ * line in time order.
+ *
+ * pixie-trace [-r] trace-file
+ *
+ * Times are relative to the first event. With -r they are wall clock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "Trace.h"
+
+static int compare_records(const void *a, const void *b) {
+	const TraceRecord *x = a, *y = b;
+
+	if (x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static TraceRecord *read_trace(FILE *file, size_t *count, uint64_t *clocks) {
+	char magic[8];
+	uint32_t rings;
+	TraceRecord *records = NULL;
+	size_t length = 0;
+
+	if (fread(magic, 8, 1, file) != 1 || memcmp(magic, "PXTRACE1", 8) != 0 ||
+		fread(clocks, sizeof(uint64_t), 2, file) != 2 ||
+		fread(&rings, sizeof(rings), 1, file) != 1) {
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < rings; ++i) {
+		uint32_t header[2];
+
+		if (fread(header, sizeof(header), 1, file) != 1) {
+			free(records);
+
+			return NULL;
+		}
+
+		TraceRecord *grown = realloc(records,
+			(length + header[1] + 1) * sizeof(TraceRecord));
+
+		if (grown == NULL) {
+			free(records);
+
+			return NULL;
+		}
+		records = grown;
+		if (fread(records + length, sizeof(TraceRecord), header[1], file) !=
+			header[1]) {
+			free(records);
+
+			return NULL;
+		}
+		length += header[1];
+	}
+
+	*count = length;
+
+	return records != NULL ? records : malloc(sizeof(TraceRecord));
+}
+
+static void print_value(const char *name, int64_t value) {
+	if (name != NULL) {
+		printf(" %s=%lld", name, (long long) value);
+	}
+}
+
+int main(int argc, char **argv) {
+	int wallClock = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "r")) != -1) {
+		if (c == 'r') {
+			wallClock = 1;
+		} else {
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [-r] trace-file\n", argv[0]);
+
+		return 2;
+	}
+
+	FILE *file = fopen(argv[optind], "rb");
+
+	if (file == NULL) {
+		perror(argv[optind]);
+
+		return 1;
+	}
+
+	size_t count = 0;
+	uint64_t clocks[2];
+	TraceRecord *records = read_trace(file, &count, clocks);
+
+	fclose(file);
+	if (records == NULL) {
+		fprintf(stderr, "%s is not a valid trace file.\n", argv[optind]);
+
+		return 1;
+	}
+
+	qsort(records, count, sizeof(TraceRecord), compare_records);
+
+	for (size_t i = 0; i < count; ++i) {
+		TraceRecord *rec = records + i;
+		const char *aName, *bName;
+		const char *name = traceEventName(rec->event, &aName, &bName);
+
+		if (wallClock) {
+			//Monotonic times are converted using the clocks at dump time
+			uint64_t real = clocks[1] - (clocks[0] - rec->time);
+			time_t seconds = real / 1000000000;
+			struct tm tm;
+			char when[32];
+
+			localtime_r(&seconds, &tm);
+			strftime(when, sizeof(when), "%H:%M:%S", &tm);
+			printf("%s.%06lu", when,
+				(unsigned long) (real % 1000000000 / 1000));
+		} else {
+			printf("%12.6f", (rec->time - records[0].time) / 1e9);
+		}
+		printf(" [%u] %-18s fd=%d", rec->thread, name, rec->fd);
+		print_value(aName, rec->a);
+		print_value(bName, rec->b);
+		printf("\n");
+	}
+
+	free(records);
+
+	return 0;
+}
@@ -160,27 +160,31 @@ static NSString *bufferToString(Buffer *buffer) {
 
     //Show the request
     [self.rawReqTextCtrl setBuffer: &(self->requestRecord->map)];
+    requestRecordFillArrays(self->requestRecord);
     [self.requestParamCtrl setNames:self->requestRecord->parameterNames
                              values:self->requestRecord->parameterValues];
     //Show the response
     BOOL isText = FALSE;
-    String *type = responseRecordGetHeader(self->responseRecord, "Content-Type");
-    if (type != NULL) {
+    Slice type;
+    if (responseRecordFindHeader(self->responseRecord, "Content-Type", &type) == 0) {
         char *textTypes[] = {"text/", "application/json", "application/xml", "application/javascript"};
         size_t len = sizeof(textTypes)/sizeof(char*);
         //Does content type start with "text"?
         for (size_t i = 0; i < len; ++i) {
-            isText = stringStartsWithCString(type, textTypes[i]);
+            size_t prefixLength = strlen(textTypes[i]);
+            isText = type.length >= prefixLength &&
+                strncmp(type.buffer, textTypes[i], prefixLength) == 0;
             if (isText) {
                 break;
             }
         }
     }
     BOOL isCompressed = FALSE;
-    String *encoding = responseRecordGetHeader(self->responseRecord,
-                                           "Content-Encoding");
-    if (encoding != NULL) {
-        isCompressed = stringEqualsCString(encoding, "gzip");
+    Slice encoding;
+    if (responseRecordFindHeader(self->responseRecord,
+                                 "Content-Encoding", &encoding) == 0) {
+        isCompressed = encoding.length == 4 &&
+            strncmp(encoding.buffer, "gzip", 4) == 0;
     }
     
     if (isText && !isCompressed) {